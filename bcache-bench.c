@@ -0,0 +1,422 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache-bench: micro benchmarks of the hot paths of the tools, run by
+ * make bench. Each one is repeated until it took the benchmark time, and
+ * reported as time and allocations per call.
+ *
+ * Scans run against a synthetic device tree in a temporary directory that
+ * BCACHE_ROOT points the tools at: sysfs directories for the disks and a
+ * partition of each, plain files holding super blocks as their /dev nodes,
+ * and every fourth disk the cache of an active cache set which the three
+ * following ones are attached to. The inventory is disabled, so every
+ * list_bdevs() is a full scan.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+#include "list.h"
+#include "show.h"
+
+/*
+ * Allocations are counted by wrapping the allocator of glibc, which its
+ * own functions like opendir() and scandir() go through as well.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long nr_allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+/* Devices in the synthetic tree, and seconds each benchmark takes */
+#define BENCH_DEVICES		256
+#define BENCH_TIME		0.5
+
+/* Cache sets of one cache and this many attached backing devices */
+#define BENCH_SET_SIZE		4
+
+static double bench_time = BENCH_TIME;
+static const char *bench_filter;
+static char bench_root[PATH_MAX];
+
+/* Results go here, tree() writes to the real stdout */
+static FILE *report;
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_run(const char *name, void (*fn)(void *), void *arg)
+{
+	uint64_t n = 1, i, t, allocs, target = bench_time * 1e9;
+
+	if (bench_filter && !strstr(name, bench_filter))
+		return;
+
+	/* Like go test -bench: grow n until one round takes long enough */
+	for (;;) {
+		allocs = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED);
+		t = now_ns();
+		for (i = 0; i < n; i++)
+			fn(arg);
+		t = now_ns() - t;
+		allocs = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED) -
+			allocs;
+
+		if (t >= target || n >= 1ULL << 32)
+			break;
+		n = t ? n * target / t * 6 / 5 + 1 : n * 100;
+		if (n > 1ULL << 32)
+			n = 1ULL << 32;
+	}
+
+	fprintf(report, "%-24s %10" PRIu64 " %14.1f ns/op %10.1f allocs/op\n",
+		name, n, (double) t / n, (double) allocs / n);
+	fflush(report);
+}
+
+struct crc_arg {
+	const void		*data;
+	size_t			len;
+};
+
+static void bench_crc64(void *arg)
+{
+	struct crc_arg *a = arg;
+
+	sink += crc64(a->data, a->len);
+}
+
+static void bench_csum_set(void *arg)
+{
+	sink += csum_set((struct cache_sb_disk *) arg);
+}
+
+static void bench_to_cache_sb(void *arg)
+{
+	struct cache_sb sb;
+
+	to_cache_sb(&sb, arg);
+	sink += sb.nbuckets;
+}
+
+static void bench_to_cache_sb_disk(void *arg)
+{
+	struct cache_sb_disk sb_disk;
+
+	to_cache_sb_disk(&sb_disk, arg);
+	sink += sb_disk.nbuckets;
+}
+
+static void bench_list_bdevs(void *arg)
+{
+	struct list_head head;
+	struct dev *dev;
+
+	INIT_LIST_HEAD(&head);
+	if (list_bdevs(&head))
+		exit(1);
+	list_for_each_entry(dev, &head, dev_list)
+		sink++;
+	free_dev(&head);
+}
+
+static void bench_tree(void *arg)
+{
+	if (tree(*(enum out_format *) arg))
+		exit(1);
+	fflush(stdout);
+}
+
+/* The super block of disk i of the synthetic tree */
+static void fixture_sb(struct cache_sb *sb, unsigned int i)
+{
+	unsigned int set = i / BENCH_SET_SIZE;
+
+	memset(sb, 0, sizeof(*sb));
+	memcpy(sb->magic, bcache_magic, 16);
+	sb->offset = SB_SECTOR;
+	sb->block_size = 8;
+	memcpy(sb->uuid, &i, sizeof(i));
+	sb->uuid[15] = 1;
+	memcpy(sb->set_uuid, &set, sizeof(set));
+	sb->set_uuid[15] = 2;
+	snprintf((char *) sb->label, SB_LABEL_SIZE, "bench%u", i);
+
+	if (i % BENCH_SET_SIZE == 0) {
+		sb->version = BCACHE_SB_VERSION_CDEV_WITH_UUID;
+		sb->bucket_size = 1024;
+		sb->nbuckets = 1 << 16;
+		sb->first_bucket = 1;
+		sb->nr_in_set = 1;
+		SET_CACHE_SYNC(sb, true);
+	} else {
+		sb->version = BCACHE_SB_VERSION_BDEV;
+		sb->data_offset = BDEV_DATA_START_DEFAULT;
+		SET_BDEV_CACHE_MODE(sb, CACHE_MODE_WRITEBACK);
+		SET_BDEV_STATE(sb, BDEV_STATE_CLEAN);
+	}
+}
+
+/* Paths are relative to the root, the fixture is built from inside it */
+static int fixture_write(const char *path, const void *data, size_t len)
+{
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0 || (len && write(fd, data, len) != (ssize_t) len)) {
+		fprintf(stderr, "Can't write %s: %m\n", path);
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int fixture_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Can't create %s: %m\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int fixture_symlink(const char *target, const char *path)
+{
+	if (symlink(target, path)) {
+		fprintf(stderr, "Can't create %s: %m\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Disk i, with its partition and, for a backing device, its sysfs */
+static int fixture_disk(unsigned int i, const void *dev, size_t len,
+			const char *cset)
+{
+	char path[NAME_MAX], target[NAME_MAX];
+
+	snprintf(path, sizeof(path), "dev/bd%u", i);
+	if (fixture_write(path, dev, len))
+		return -1;
+	snprintf(path, sizeof(path), "dev/bd%up1", i);
+	if (fixture_write(path, NULL, 0))
+		return -1;
+
+	snprintf(path, sizeof(path), "sys/block/bd%u", i);
+	if (fixture_mkdir(path))
+		return -1;
+	snprintf(path, sizeof(path), "sys/block/bd%u/bd%up1", i, i);
+	if (fixture_mkdir(path))
+		return -1;
+
+	if (i % BENCH_SET_SIZE == 0) {
+		snprintf(path, sizeof(path), "sys/fs/bcache/%s", cset);
+		return fixture_mkdir(path);
+	}
+
+	snprintf(path, sizeof(path), "sys/block/bd%u/bcache", i);
+	if (fixture_mkdir(path))
+		return -1;
+	snprintf(path, sizeof(path), "sys/block/bd%u/bcache/state", i);
+	if (fixture_write(path, "clean\n", 6))
+		return -1;
+	snprintf(path, sizeof(path), "sys/block/bd%u/bcache/running", i);
+	if (fixture_write(path, "1\n", 2))
+		return -1;
+
+	snprintf(target, sizeof(target),
+		 "../../../devices/virtual/block/bcache%u", i);
+	snprintf(path, sizeof(path), "sys/block/bd%u/bcache/dev", i);
+	if (fixture_symlink(target, path))
+		return -1;
+	snprintf(target, sizeof(target), "../../../fs/bcache/%s", cset);
+	snprintf(path, sizeof(path), "sys/block/bd%u/bcache/cache", i);
+	return fixture_symlink(target, path);
+}
+
+static int fixture_create(unsigned int nr)
+{
+	static char dev[2 * SB_START] __attribute__((aligned(4096)));
+	struct cache_sb_disk *sb_disk = (void *) (dev + SB_START);
+	struct cache_sb sb;
+	unsigned int i;
+	char cset[40];
+	int cwd, ret = -1;
+
+	snprintf(bench_root, sizeof(bench_root), "%s/bcache-bench.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(bench_root)) {
+		fprintf(stderr, "Can't create %s: %m\n", bench_root);
+		*bench_root = '\0';
+		return -1;
+	}
+
+	cwd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (cwd < 0 || chdir(bench_root)) {
+		fprintf(stderr, "Can't change to %s: %m\n", bench_root);
+		goto out;
+	}
+
+	if (fixture_mkdir("sys") || fixture_mkdir("sys/block") ||
+	    fixture_mkdir("sys/fs") || fixture_mkdir("sys/fs/bcache") ||
+	    fixture_mkdir("dev"))
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		fixture_sb(&sb, i);
+		memset(dev, 0, sizeof(dev));
+		to_cache_sb_disk(sb_disk, &sb);
+		sb_disk->csum = cpu_to_le64(csum_set(sb_disk));
+		uuid_unparse(sb.set_uuid, cset);
+
+		if (fixture_disk(i, dev, sizeof(dev), cset))
+			goto out;
+	}
+	ret = 0;
+out:
+	if (cwd >= 0) {
+		if (fchdir(cwd))
+			ret = -1;
+		close(cwd);
+	}
+	return ret;
+}
+
+static int fixture_unlink(const char *path, const struct stat *st, int flag,
+			  struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void fixture_remove(void)
+{
+	if (*bench_root)
+		nftw(bench_root, fixture_unlink, 16, FTW_DEPTH|FTW_PHYS);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-bench [-n devices] [-t seconds] [filter]\n"
+		"	-n	devices in the synthetic tree, default %u\n"
+		"	-t	time each benchmark takes, default %.1fs\n"
+		"	filter	only run benchmarks with this in their name\n",
+		BENCH_DEVICES, BENCH_TIME);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[1 << 20];
+	struct crc_arg crc_64 = { buf, 64 }, crc_4k = { buf, 4096 };
+	struct crc_arg crc_1m = { buf, sizeof(buf) };
+	enum out_format text = OUT_TEXT, json = OUT_JSON;
+	unsigned int nr = BENCH_DEVICES;
+	struct cache_sb_disk sb_disk;
+	struct cache_sb sb;
+	char name[64], *end;
+	int o, fd;
+
+	while ((o = getopt(argc, argv, "n:t:h")) != -1) {
+		switch (o) {
+		case 'n':
+			nr = strtoul(optarg, &end, 10);
+			if (*end || !nr)
+				usage();
+			break;
+		case 't':
+			bench_time = strtod(optarg, &end);
+			if (*end || bench_time <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind > 1)
+		usage();
+	bench_filter = argv[optind];
+
+	/* stdout is /dev/null for what the benchmarks print */
+	fd = dup(STDOUT_FILENO);
+	report = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!report || !freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "Can't redirect stdout: %m\n");
+		return 1;
+	}
+
+	if (fixture_create(nr)) {
+		fixture_remove();
+		return 1;
+	}
+	setenv("BCACHE_ROOT", bench_root, 1);
+	setenv("BCACHE_INVENTORY", "", 1);
+
+	memset(buf, 0x5a, sizeof(buf));
+	bench_run("crc64/64", bench_crc64, &crc_64);
+	bench_run("crc64/4k", bench_crc64, &crc_4k);
+	bench_run("crc64/1m", bench_crc64, &crc_1m);
+
+	fixture_sb(&sb, 0);
+	memset(&sb_disk, 0, sizeof(sb_disk));
+	to_cache_sb_disk(&sb_disk, &sb);
+	bench_run("csum_set", bench_csum_set, &sb_disk);
+	bench_run("to_cache_sb", bench_to_cache_sb, &sb_disk);
+	bench_run("to_cache_sb_disk", bench_to_cache_sb_disk, &sb);
+
+	snprintf(name, sizeof(name), "list_bdevs/%u", nr);
+	bench_run(name, bench_list_bdevs, NULL);
+	snprintf(name, sizeof(name), "tree/%u", nr);
+	bench_run(name, bench_tree, &text);
+	snprintf(name, sizeof(name), "tree-json/%u", nr);
+	bench_run(name, bench_tree, &json);
+
+	fixture_remove();
+	return 0;
+}
@@ -4,34 +4,251 @@
  * GPLv2
  */
 
+/*
+ * Registers any number of devices through one open register file, so
+ * that boot scripts can hand over every device in one exec. The kernel's
+ * register_async is used when it has one: each write then only queues
+ * the device and the registrations run in parallel; with -w bcache-register
+ * waits for them all to be done before it exits.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
-int main(int argc, char *argv[])
+#include "bcache.h"
+#include "watch.h"
+
+static bool quiet;
+
+/* Every device handed over, for -w */
+static char **devs;
+static unsigned int nr_devs, size_devs;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: bcache-register [-a] [-q] [-w seconds] [device]...\n"
+            "	-a	register every device with a bcache super block\n"
+            "	-q	don't complain about devices already registered\n"
+            "	-w	wait this long for the registrations to be done\n"
+            "	(a device of - reads devices from stdin, one per line)\n");
+    exit(1);
+}
+
+static int open_register(void)
 {
     int fd;
 
-    if (argc != 2)
-    {
-        fprintf(stderr, "bcache-register takes exactly one argument\n");
-        return 1;
-    }
+    fd = open("/sys/fs/bcache/register_async", O_WRONLY|O_CLOEXEC);
+    if (fd >= 0)
+        return fd;
 
-    fd = open("/sys/fs/bcache/register", O_WRONLY);
+    fd = open("/sys/fs/bcache/register", O_WRONLY|O_CLOEXEC);
     if (fd < 0)
     {
         perror("Error opening /sys/fs/bcache/register");
         fprintf(stderr, "The bcache kernel module must be loaded\n");
-        return 1;
     }
+    return fd;
+}
+
+/* The kernel has a bcache directory for every registered device */
+static bool registered(const char *dev)
+{
+    char path[PATH_MAX], real[PATH_MAX];
+    const char *name;
+
+    if (!realpath(dev, real))
+        return false;
+    name = strrchr(real, '/');
+    name = name ? name + 1 : real;
+
+    if (snprintf(path, sizeof(path), "/sys/class/block/%s/bcache",
+                 name) >= (int) sizeof(path))
+        return false;
+    return !access(path, F_OK);
+}
+
+static int remember(const char *dev)
+{
+    char **d;
 
-    if (dprintf(fd, "%s\n", argv[1]) < 0)
+    if (nr_devs == size_devs)
+    {
+        size_devs = size_devs ? size_devs * 2 : 64;
+        d = realloc(devs, size_devs * sizeof(*d));
+        if (!d)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        devs = d;
+    }
+    devs[nr_devs] = strdup(dev);
+    if (!devs[nr_devs])
     {
-        fprintf(stderr, "Error registering %s with bcache: %m\n", argv[1]);
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    nr_devs++;
+    return 0;
+}
+
+static int register_one(int fd, const char *dev)
+{
+    if (remember(dev))
         return 1;
+
+    if (registered(dev))
+    {
+        if (!quiet)
+            fprintf(stderr, "%s is already registered\n", dev);
+        return quiet ? 0 : 1;
     }
 
+    if (dprintf(fd, "%s\n", dev) < 0)
+    {
+        /* Raced with another registration of the same device */
+        if (quiet && (errno == EBUSY || errno == EEXIST))
+            return 0;
+        fprintf(stderr, "Error registering %s with bcache: %m\n", dev);
+        return 1;
+    }
     return 0;
 }
 
+static int register_stdin(int fd)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int ret = 0;
+
+    while ((len = getline(&line, &size, stdin)) > 0)
+    {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len)
+            ret |= register_one(fd, line);
+    }
+
+    free(line);
+    return ret;
+}
+
+static bool has_bcache_sb(const char *dev)
+{
+    char magic[16];
+    int fd;
+    bool ret;
+
+    fd = open(dev, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    /* The magic is at the same offset in all super block versions */
+    ret = pread(fd, magic, sizeof(magic),
+                SB_START + offsetof(struct cache_sb_disk, magic)) ==
+        sizeof(magic) && !memcmp(magic, bcache_magic, 16);
+    close(fd);
+    return ret;
+}
+
+/* Every block device in /proc/partitions that carries a super block */
+static int register_all(int fd)
+{
+    char line[256], name[NAME_MAX + 1], dev[NAME_MAX + 6];
+    unsigned int major, minor;
+    unsigned long long blocks;
+    FILE *f;
+    int ret = 0;
+
+    f = fopen("/proc/partitions", "re");
+    if (!f)
+    {
+        perror("Error opening /proc/partitions");
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, " %u %u %llu %255s", &major, &minor, &blocks,
+                   name) != 4)
+            continue;
+        snprintf(dev, sizeof(dev), "/dev/%s", name);
+        if (!registered(dev) && has_bcache_sb(dev))
+            ret |= register_one(fd, dev);
+    }
+
+    fclose(f);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    bool all = false;
+    int fd, i, o, ret = 0, wait_ms = -1;
+    char *e;
+
+    while ((o = getopt(argc, argv, "aqw:h")) != -1)
+    {
+        switch (o)
+        {
+        case 'w':
+            wait_ms = strtoul(optarg, &e, 10) * 1000;
+            if (*e || wait_ms < 0)
+                usage();
+            break;
+        case 'a':
+            all = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (!all && optind == argc)
+        usage();
+
+    fd = open_register();
+    if (fd < 0)
+        return 1;
+
+    if (all)
+        ret |= register_all(fd);
+
+    for (i = optind; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-"))
+            ret |= register_stdin(fd);
+        else
+            ret |= register_one(fd, argv[i]);
+    }
+
+    close(fd);
+
+    if (wait_ms >= 0 && !watch_registered(devs, nr_devs, wait_ms))
+    {
+        for (i = 0; i < (int) nr_devs; i++)
+            if (!dev_registered(devs[i]))
+                fprintf(stderr, "%s is not registered yet\n", devs[i]);
+        ret = 1;
+    }
+    return ret;
+}
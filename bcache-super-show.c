@@ -11,6 +11,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <linux/fs.h>
 #include <stdbool.h>
@@ -27,10 +28,104 @@
 #include "bcache.h"
 #include "lib.h"
 #include "bitwise.h"
+#include "out.h"
 
 static void usage()
 {
-	fprintf(stderr, "Usage: bcache-super-show [-f] <device>\n");
+	fprintf(stderr, "Usage: bcache-super-show [-f] [-j] [-o format] <device>\n");
+}
+
+/*
+ * The same checks and keys as the text output, written once they all
+ * passed; the names in brackets get keys of their own.
+ */
+static int super_show_out(struct cache_sb *sb, struct cache_sb_disk *sb_disk,
+			  bool force_csum, enum out_format format)
+{
+	uint64_t expected_csum = csum_set(sb_disk), first_sector = 0;
+	const char *name;
+	char uuid[40];
+	char label[SB_LABEL_SIZE + 1];
+	struct out o;
+
+	if (memcmp(sb->magic, bcache_magic, 16)) {
+		fprintf(stderr, "Invalid superblock (bad magic)\n");
+		return 2;
+	}
+	if (sb->offset != SB_SECTOR) {
+		fprintf(stderr, "Invalid superblock (bad sector)\n");
+		return 2;
+	}
+	if (sb_csum(sb_disk) != expected_csum && !force_csum) {
+		fprintf(stderr, "Corrupt superblock (bad csum)\n");
+		return 2;
+	}
+	if (SB_IS_BDEV(sb)) {
+		if (sb->version == BCACHE_SB_VERSION_BDEV) {
+			first_sector = BDEV_DATA_START_DEFAULT;
+		} else {
+			if (sb->keys == 1 || sb->d[0]) {
+				fprintf(stderr,
+					"Possible experimental format detected, bailing\n");
+				return 3;
+			}
+			first_sector = sb->data_offset;
+		}
+	}
+
+	out_init(&o, stdout, format);
+	out_begin_object(&o, NULL);
+	out_str(&o, "sb.magic", "ok");
+	out_u64(&o, "sb.first_sector", sb->offset);
+	out_hex(&o, "sb.csum", sb_csum(sb_disk));
+	if (sb_csum(sb_disk) != expected_csum)
+		out_hex(&o, "sb.csum_expected", expected_csum);
+	out_u64(&o, "sb.version", sb->version);
+	name = sb_type_name(sb->version);
+	out_str(&o, "sb.version_name", name ? name : "unknown");
+	if (!name) {
+		out_end_object(&o);
+		return out_finish(&o) ? 1 : 0;
+	}
+
+	strncpy(label, (char *) sb->label, SB_LABEL_SIZE);
+	label[SB_LABEL_SIZE] = '\0';
+	out_str(&o, "dev.label", label);
+	uuid_unparse(sb->uuid, uuid);
+	out_str(&o, "dev.uuid", uuid);
+	out_u64(&o, "dev.sectors_per_block", sb->block_size);
+	out_u64(&o, "dev.sectors_per_bucket", sb->bucket_size);
+
+	if (!SB_IS_BDEV(sb)) {
+		out_u64(&o, "dev.cache.first_sector",
+			sb->bucket_size * sb->first_bucket);
+		out_u64(&o, "dev.cache.cache_sectors",
+			sb->bucket_size * (sb->nbuckets - sb->first_bucket));
+		out_u64(&o, "dev.cache.total_sectors",
+			sb->bucket_size * sb->nbuckets);
+		out_bool(&o, "dev.cache.ordered", CACHE_SYNC(sb));
+		out_bool(&o, "dev.cache.discard", CACHE_DISCARD(sb));
+		out_u64(&o, "dev.cache.pos", sb->nr_this_dev);
+		out_u64(&o, "dev.cache.replacement", CACHE_REPLACEMENT(sb));
+		name = cache_replacement_name(CACHE_REPLACEMENT(sb));
+		if (name)
+			out_str(&o, "dev.cache.replacement_name", name);
+	} else {
+		out_u64(&o, "dev.data.first_sector", first_sector);
+		out_u64(&o, "dev.data.cache_mode", BDEV_CACHE_MODE(sb));
+		name = cache_mode_name(BDEV_CACHE_MODE(sb));
+		if (name)
+			out_str(&o, "dev.data.cache_mode_name", name);
+		out_u64(&o, "dev.data.cache_state", BDEV_STATE(sb));
+		name = bdev_state_name(BDEV_STATE(sb));
+		if (name)
+			out_str(&o, "dev.data.cache_state_name", name);
+	}
+
+	uuid_unparse(sb->set_uuid, uuid);
+	out_str(&o, "cset.uuid", uuid);
+	out_end_object(&o);
+	return out_finish(&o) ? 1 : 0;
 }
 
 int main(int argc, char **argv)
@@ -38,17 +133,36 @@ int main(int argc, char **argv)
 	bool force_csum = false;
 	int o;
 	extern char *optarg;
-	struct cache_sb_disk sb_disk;
+	struct cache_sb_disk *sb_disk;
 	struct cache_sb sb;
 	char uuid[40];
 	uint64_t expected_csum;
+	enum out_format format = OUT_TEXT;
+
+	static const struct option long_options[] = {
+		{"output", required_argument, 0, 'o'},
+		{"json", no_argument, 0, 'j'},
+		{0, 0, 0, 0}
+	};
 
-	while ((o = getopt(argc, argv, "f")) != EOF)
+	while ((o = getopt_long(argc, argv, "fo:j", long_options,
+				NULL)) != EOF)
 		switch (o) {
 			case 'f':
 				force_csum = 1;
 				break;
 
+			case 'o':
+				if (out_format_parse(optarg, &format)) {
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'j':
+				format = OUT_JSON;
+				break;
+
 			default:
 				usage();
 				exit(1);
@@ -68,12 +182,15 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
-	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk)) {
+	sb_disk = sb_read(fd);
+	if (!sb_disk) {
 		fprintf(stderr, "Couldn't read\n");
 		exit(2);
 	}
 
-	to_cache_sb(&sb, &sb_disk);
+	to_cache_sb(&sb, sb_disk);
+	if (format != OUT_TEXT)
+		return super_show_out(&sb, sb_disk, force_csum, format);
 
 	printf("sb.magic\t\t");
 	if (!memcmp(sb.magic, bcache_magic, 16)) {
@@ -93,9 +210,9 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
-	printf("sb.csum\t\t\t%llx", le64_to_cpu(sb_disk.csum));
-	expected_csum = csum_set(&sb_disk);
-	if (le64_to_cpu(sb_disk.csum) == expected_csum) {
+	printf("sb.csum\t\t\t%" PRIx64, sb_csum(sb_disk));
+	expected_csum = csum_set(sb_disk);
+	if (sb_csum(sb_disk) == expected_csum) {
 		printf(" [match]\n");
 	} else {
 		printf(" [expected %" PRIX64 "]\n", expected_csum);
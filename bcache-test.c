@@ -8,10 +8,14 @@
 #define _XOPEN_SOURCE 500
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <linux/aio_abi.h>
 #include <linux/fs.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,6 +23,7 @@
 #include <sys/ioctl.h>
 #include <sys/klog.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -28,58 +33,37 @@
 #include <openssl/rc4.h>
 #include <openssl/md4.h>
 
-static const unsigned char bcache_magic[] = {
-	0xc6, 0x85, 0x73, 0xf6, 0x4e, 0x1a, 0x45, 0xca,
-	0x82, 0x65, 0xf5, 0x7f, 0x48, 0xba, 0x6d, 0x81 };
+#include "bcache.h"
+#include "trace.h"
+#include "workload.h"
 
 unsigned char zero[4096];
 
 bool klog = false;
 
-#define Pread(fd, buf, size, offset) do {				\
-	int _read = 0, _r;						\
-	while (_read < size) {						\
-		_r = pread(fd, buf, (size) - _read, (offset) + _read);	\
-		if (_r <= 0)						\
-			goto err;					\
-		_read += _r;						\
-	}								\
-} while (0)
-
-#define Pwrite(fd, buf, size, offset) do {				\
-	int _write = 0, _r;						\
-	while (_write < size) {						\
-		_r = pwrite(fd, buf, (size) - _write, offset + _write);	\
-		if (_r < 0)						\
-			goto err;					\
-		_write += _r;						\
-	}								\
-} while (0)
-
-/* Marsaglia polar method
- */
-double normal()
-{
-	double x, y, s;
-	static double n = 0 / (double) 0;
+#define MAX_PAGES_PER_IO	16
+#define MAX_QUEUE_DEPTH		1024
+#define MAX_WORKERS		256
+#define REPLAY_MAX_PAGES	256
+#define REPLAY_QUEUE_DEPTH	32
+#define REPLAY_LATE_NS		1000000
 
-	if (n == n) {
-		x = n;
-		n = 0 / (double) 0;
-		return x;
-	}
+/* Test parameters, set up by main() and read only afterwards */
+static bool randsize, verbose, csum, rtest, wtest;
+static int fd1, fd2 = -1;
+static unsigned long nr_pages, benchmark;
+static unsigned int queue_depth = 1, nr_workers = 1;
+static unsigned int max_pages = MAX_PAGES_PER_IO;
 
-	do {
-		x = random() / (double) (RAND_MAX / 2) - 1;
-		y = random() / (double) (RAND_MAX / 2) - 1;
+/* Trace replay (-t), at the original timing unless replay_fast */
+static const char *trace_file;
+static bool replay_fast;
+static uint64_t replay_start;
 
-		s = x * x + y * y;
-	} while (s >= 1);
+static struct workload wl;
 
-	s = sqrt(-2 * log(s) / s);
-	n =	y * s;
-	return  x * s;
-}
+/* Compare every read against fd2 instead of checksumming */
+#define compare_mode	(!csum && !benchmark)
 
 long getblocks(int fd)
 {
@@ -98,6 +82,15 @@ long getblocks(int fd)
 	return ret;
 }
 
+/*
+ * Page tracking
+ *
+ * By default every page of the device gets a struct pagestuff with full
+ * MD4 digests, 40 bytes per 4k page. In compact mode (-m) a page takes
+ * 16 bytes, a crc64 digest and saturating counters, and is allocated in
+ * chunks on first touch, so memory follows the working set rather than
+ * the size of the device.
+ */
 struct pagestuff {
 	unsigned char csum[16];
 	unsigned char oldcsum[16];
@@ -105,6 +98,162 @@ struct pagestuff {
 	int writecount;
 };
 
+struct page_compact {
+	uint64_t	csum;
+	uint32_t	oldcsum;	/* low half of the previous csum */
+	uint16_t	readcount;
+	uint16_t	writecount;
+};
+
+#define CHUNK_BITS		12
+#define CHUNK_PAGES		(1UL << CHUNK_BITS)
+
+static bool compact;
+static struct pagestuff *pages;
+static struct page_compact **chunks;
+static unsigned long nr_chunks_allocated;
+
+static struct page_compact *compact_page(unsigned long page)
+{
+	struct page_compact **slot = &chunks[page >> CHUNK_BITS];
+	struct page_compact *c = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	struct page_compact *new;
+
+	if (!c) {
+		/* Chunks can straddle two workers' slices */
+		new = calloc(CHUNK_PAGES, sizeof(*new));
+		if (!new) {
+			printf("Could not allocate page tracking\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (__atomic_compare_exchange_n(slot, &c, new, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			c = new;
+			__atomic_fetch_add(&nr_chunks_allocated, 1,
+					   __ATOMIC_RELAXED);
+		} else {
+			free(new);
+		}
+	}
+
+	return &c[page & (CHUNK_PAGES - 1)];
+}
+
+static inline void sat_inc(uint16_t *v)
+{
+	if (*v != UINT16_MAX)
+		(*v)++;
+}
+
+/* A write of data to page is being submitted */
+static void page_written(unsigned long page, const unsigned char *data)
+{
+	if (compact) {
+		struct page_compact *p = compact_page(page);
+
+		p->oldcsum = p->csum;
+		p->csum = crc64(data, 4096);
+	} else {
+		struct pagestuff *p = &pages[page];
+
+		memcpy(&p->oldcsum[0], &p->csum[0], 16);
+		MD4(data, 4096, &p->csum[0]);
+	}
+}
+
+/*
+ * Checks data read from page against the last write, pages never seen
+ * before take the digest of whatever they contain. Returns 0 if good, 1 if
+ * bad and 2 if the data is what the previous write put there.
+ */
+static int page_verify(unsigned long page, const unsigned char *data)
+{
+	unsigned char c[16];
+
+	if (compact) {
+		struct page_compact *p = compact_page(page);
+		uint64_t sum = crc64(data, 4096);
+
+		if (!p->readcount && !p->writecount) {
+			p->oldcsum = p->csum;
+			p->csum = sum;
+		} else if (p->csum != sum) {
+			return (uint32_t) sum == p->oldcsum ? 2 : 1;
+		}
+	} else {
+		struct pagestuff *p = &pages[page];
+
+		MD4(data, 4096, &c[0]);
+
+		if (!p->readcount && !p->writecount) {
+			memcpy(&p->oldcsum[0], &p->csum[0], 16);
+			memcpy(&p->csum[0], c, 16);
+		} else if (memcmp(&p->csum[0], c, 16)) {
+			return !memcmp(&p->oldcsum[0], c, 16) ? 2 : 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Counts an I/O to page, true the first time page is touched */
+static bool page_touch(unsigned long page, bool writing)
+{
+	bool first;
+
+	if (compact) {
+		struct page_compact *p = compact_page(page);
+
+		first = !p->readcount && !p->writecount;
+		sat_inc(writing ? &p->writecount : &p->readcount);
+	} else {
+		struct pagestuff *p = &pages[page];
+
+		first = !p->readcount && !p->writecount;
+		writing ? p->writecount++ : p->readcount++;
+	}
+
+	return first;
+}
+
+static void page_counts(unsigned long page, unsigned int *readcount,
+			unsigned int *writecount)
+{
+	if (compact) {
+		struct page_compact *p = compact_page(page);
+
+		*readcount = p->readcount;
+		*writecount = p->writecount;
+	} else {
+		*readcount = pages[page].readcount;
+		*writecount = pages[page].writecount;
+	}
+}
+
+static int page_tracking_init(void)
+{
+	if (compact)
+		chunks = calloc(howmany(nr_pages, CHUNK_PAGES),
+				sizeof(*chunks));
+	else
+		pages = calloc(nr_pages, sizeof(*pages));
+
+	return compact ? !chunks : !pages;
+}
+
+/* Bytes used for page tracking */
+static unsigned long page_tracking_size(void)
+{
+	if (!compact)
+		return nr_pages * sizeof(*pages);
+
+	return howmany(nr_pages, CHUNK_PAGES) * sizeof(*chunks) +
+		__atomic_load_n(&nr_chunks_allocated, __ATOMIC_RELAXED) *
+		CHUNK_PAGES * sizeof(struct page_compact);
+}
+
 void flushlog(void)
 {
 	char logbuf[1 << 21];
@@ -143,37 +292,894 @@ void flushlog(void)
 	}
 }
 
-void aio_loop(int nr)
+/*
+ * Latency histograms
+ *
+ * Log-linear buckets in the style of HdrHistogram: every power of two
+ * range of nanoseconds is split into HIST_SUB linear sub-buckets, which
+ * bounds the error of any percentile to 1/HIST_SUB (about 3%) at a fixed
+ * size. Each worker records into its own histograms, and the reporting
+ * thread merges snapshots of them, so recording costs a few instructions
+ * and no shared cache lines.
+ */
+#define HIST_SUB_BITS		5
+#define HIST_SUB		(1U << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40	/* ~18 minutes in ns */
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+	OP_READ,
+	OP_WRITE,
+	NR_OPS,
+};
+
+static const char * const op_names[NR_OPS] = { "read", "write" };
+
+struct histogram {
+	uint64_t		count;
+	uint64_t		bytes;
+	uint64_t		max;
+	uint64_t		buckets[HIST_BUCKETS];
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < HIST_SUB)
+		return v;
+	if (v >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
+
+/* Highest value that falls into bucket @idx */
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	shift = idx / HIST_SUB - 1;
+	return ((uint64_t) (idx - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+/* Only called by the owning worker, the reporter may read concurrently */
+static inline void hist_record(struct histogram *h, uint64_t ns,
+			       unsigned int bytes)
+{
+	unsigned int idx = hist_index(ns);
+
+	__atomic_store_n(&h->buckets[idx], h->buckets[idx] + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&h->bytes, h->bytes + bytes, __ATOMIC_RELAXED);
+	if (ns > h->max)
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(struct histogram *dst, struct histogram *src)
+{
+	unsigned int i;
+	uint64_t max;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i],
+						   __ATOMIC_RELAXED);
+	dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+/* dst = a - b, where b is an earlier snapshot of a */
+static void hist_delta(struct histogram *dst, struct histogram *a,
+		       struct histogram *b)
 {
+	unsigned int i;
 
+	dst->max = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] = a->buckets[i] - b->buckets[i];
+		if (dst->buckets[i])
+			dst->max = hist_value(i);
+	}
+	if (dst->max > a->max)
+		dst->max = a->max;
+	dst->bytes = a->bytes - b->bytes;
+	dst->count = a->count - b->count;
+}
+
+static uint64_t hist_percentile(struct histogram *h, double q)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	want = ceil(h->count * q / 100);
+	if (!want)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want)
+			return MIN(hist_value(i), h->max);
+	}
+	return h->max;
+}
+
+/*
+ * Async engine
+ *
+ * Each worker thread owns a disjoint slice of pages[] and keeps up to
+ * queue_depth I/Os in flight in its own aio context, so page tracking
+ * needs no locking. I/Os of one worker never overlap each other while
+ * in flight, otherwise a read could race with a write of the same page
+ * and the verification would be meaningless.
+ */
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+struct aio_req {
+	struct iocb		iocb[2];	/* fd1, and fd2 in compare mode */
+	void			*buf[2];
+	unsigned long		page;
+	unsigned int		npages;
+	bool			writing;
+	bool			busy;
+	int			pending;
+	long			res;
+	uint64_t		start_ns;
+};
+
+struct worker {
+	pthread_t		thread;
+	unsigned int		id;
+
+	/* pages[first] .. pages[first + nr - 1] belong to this worker */
+	unsigned long		first;
+	unsigned long		nr;
+	unsigned long		quota;	/* 0: run forever */
+
+	aio_context_t		ctx;
+	struct aio_req		*reqs;
+	unsigned int		inflight;
+	RC4_KEY			writedata;
+	unsigned short		seed[3];
+	struct workload_gen	gen;
+	bool			finished;
+
+	/* Replay: what's left of the current trace event in this slice */
+	struct trace		trace;
+	unsigned long		ev_page;
+	unsigned long		ev_end;
+	bool			ev_writing;
+	uint64_t		ev_due;		/* ns from the start */
+	unsigned long		discards;
+	unsigned long		late;
+	uint64_t		max_lag;
+
+	/* Progress, read by the main thread */
+	unsigned long		loops;
+	unsigned long		done;		/* sectors */
+	unsigned long		unique;		/* sectors */
+	unsigned long		last_offset;	/* bytes */
+	unsigned int		last_nbytes;
+	struct histogram	hist[NR_OPS];
+};
+
+static struct worker *workers;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void __attribute__((noreturn)) io_error(long res)
+{
+	pthread_mutex_lock(&report_lock);
+	errno = res < 0 ? -res : EIO;
+	perror("IO error");
+	flushlog();
+	exit(EXIT_FAILURE);
+}
+
+static void __attribute__((noreturn)) bad_read(struct worker *w,
+					       unsigned long page,
+					       bool matches_previous)
+{
+	unsigned int readcount, writecount;
+
+	page_counts(page, &readcount, &writecount);
+
+	pthread_mutex_lock(&report_lock);
+	printf("Bad read! loop %li offset %li readcount %u writecount %u\n",
+	       w->loops, (page * 4096) >> 9, readcount, writecount);
+
+	if (matches_previous)
+		printf("Matches previous csum\n");
+
+	flushlog();
+	exit(EXIT_FAILURE);
+}
+
+static bool overlaps_inflight(struct worker *w, unsigned long page,
+			      unsigned int npages)
+{
+	unsigned int i;
+
+	for (i = 0; i < queue_depth; i++) {
+		struct aio_req *r = &w->reqs[i];
+
+		if (r->busy &&
+		    page < r->page + r->npages &&
+		    r->page < page + npages)
+			return true;
+	}
+	return false;
+}
+
+/* Pick the next I/O inside this worker's slice, false if it would overlap */
+static bool next_io(struct worker *w, struct aio_req *r)
+{
+	if (wl.read_pct >= 0)
+		r->writing = workload_next_write(&w->gen);
+	else
+		r->writing = (wtest && (w->loops & 1)) || !rtest;
+
+	r->npages = randsize ? erand48(w->seed) * MAX_PAGES_PER_IO + 1 : 1;
+	if (r->npages > w->nr)
+		r->npages = w->nr;
+
+	r->page = w->first + workload_next(&w->gen, r->npages);
+
+	return !overlaps_inflight(w, r->page, r->npages);
+}
+
+static void prep_iocb(struct iocb *iocb, struct aio_req *r, int fd,
+		      void *buf)
+{
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data		= (uint64_t) (uintptr_t) r;
+	iocb->aio_lio_opcode	= r->writing ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	iocb->aio_fildes	= fd;
+	iocb->aio_buf		= (uint64_t) (uintptr_t) buf;
+	iocb->aio_nbytes	= r->npages * 4096;
+	iocb->aio_offset	= r->page * 4096;
+}
+
+static void submit_io(struct worker *w, struct aio_req *r)
+{
+	struct iocb *iocbs[2];
+	unsigned int j;
+	int nr = 0, ret;
+
+	if (r->writing) {
+		for (j = 0; j < r->npages; j++) {
+			unsigned char *data = r->buf[0] + j * 4096;
+
+			RC4(&w->writedata, 4096, zero, data);
+			if (csum)
+				page_written(r->page + j, data);
+		}
+	}
+
+	prep_iocb(&r->iocb[0], r, fd1, r->buf[0]);
+	iocbs[nr++] = &r->iocb[0];
+	if (compare_mode) {
+		/* Writes put the same data on both devices */
+		prep_iocb(&r->iocb[1], r, fd2, r->buf[r->writing ? 0 : 1]);
+		iocbs[nr++] = &r->iocb[1];
+	}
+
+	r->busy = true;
+	r->pending = nr;
+	r->res = 0;
+
+	if (verbose) {
+		pthread_mutex_lock(&report_lock);
+		printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
+		       w->loops, (r->page * 4096) >> 9, (r->npages * 4096) >> 9,
+		       w->done >> 11, w->unique >> 11);
+		pthread_mutex_unlock(&report_lock);
+	}
+
+	r->start_ns = now_ns();
+	ret = io_submit(w->ctx, nr, iocbs);
+	if (ret != nr)
+		io_error(ret < 0 ? -errno : -EAGAIN);
+
+	w->inflight++;
+	w->loops++;
+	__atomic_store_n(&w->last_offset, r->page * 4096, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->last_nbytes, r->npages * 4096, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->done, (r->npages * 4096) >> 9,
+			   __ATOMIC_RELAXED);
+}
+
+static void complete_io(struct worker *w, struct aio_req *r)
+{
+	unsigned int j;
+
+	if (r->res)
+		io_error(r->res);
+
+	hist_record(&w->hist[r->writing ? OP_WRITE : OP_READ],
+		    now_ns() - r->start_ns, r->npages * 4096);
+
+	for (j = 0; j < r->npages; j++) {
+		unsigned char *data = r->buf[0] + j * 4096;
+		int ret;
+
+		if (!r->writing) {
+			if (csum) {
+				ret = page_verify(r->page + j, data);
+				if (ret)
+					bad_read(w, r->page + j, ret == 2);
+			} else if (compare_mode &&
+				   memcmp(data, r->buf[1] + j * 4096, 4096))
+				bad_read(w, r->page + j, false);
+		}
+
+		if (page_touch(r->page + j, r->writing))
+			__atomic_fetch_add(&w->unique, 8, __ATOMIC_RELAXED);
+	}
+
+	r->busy = false;
+	w->inflight--;
+}
+
+static void reap_io(struct worker *w, unsigned int min_nr,
+		    struct timespec *timeout)
+{
+	struct io_event events[MAX_QUEUE_DEPTH * 2];
+	int i, nr;
+
+	nr = io_getevents(w->ctx, min_nr, queue_depth * 2, events, timeout);
+	if (nr < 0) {
+		if (errno == EINTR)
+			return;
+		io_error(-errno);
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct aio_req *r = (void *) (uintptr_t) events[i].data;
+		struct iocb *iocb = (void *) (uintptr_t) events[i].obj;
+
+		if ((long) events[i].res != (long) iocb->aio_nbytes)
+			r->res = (long) events[i].res < 0 ?
+				(long) events[i].res : -EIO;
+		if (!--r->pending)
+			complete_io(w, r);
+	}
+}
+
+static struct aio_req *free_req(struct worker *w)
+{
+	unsigned int i;
+
+	for (i = 0; i < queue_depth; i++)
+		if (!w->reqs[i].busy)
+			return &w->reqs[i];
+	return NULL;
+}
+
+static void *aio_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!w->quota || w->loops < w->quota) {
+		struct aio_req *r = free_req(w);
+
+		if (!r) {
+			reap_io(w, 1, NULL);
+			continue;
+		}
+
+		if (!next_io(w, r)) {
+			/* Wait for the overlapping I/O rather than spin */
+			if (w->inflight)
+				reap_io(w, 1, NULL);
+			continue;
+		}
+
+		submit_io(w, r);
+
+		/* Pick up whatever has completed without blocking */
+		if (w->inflight)
+			reap_io(w, w->inflight == queue_depth ? 1 : 0, NULL);
+	}
+
+	while (w->inflight)
+		reap_io(w, 1, NULL);
+
+	__atomic_store_n(&w->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * Trace replay
+ *
+ * Every worker reads the whole trace and replays the part of each event
+ * that falls into its slice, so the slices stay private as for generated
+ * I/O. Events are submitted when the trace issued them and complete when
+ * the device gets to them, so the trace's concurrency comes back by
+ * itself, up to queue_depth in flight per worker. An I/O that overlaps
+ * one in flight waits for it, or verification would race with it.
+ */
+
+/* Moves on to the next event with something in this slice */
+static bool replay_next(struct worker *w)
+{
+	struct trace_event ev;
+	unsigned long page, end;
+	int ret;
+
+	while (w->ev_page >= w->ev_end) {
+		ret = trace_next(&w->trace, &ev);
+		if (ret < 0)
+			exit(EXIT_FAILURE);
+		if (!ret)
+			return false;
+
+		/* aio can't discard */
+		if (ev.op == TRACE_DISCARD) {
+			w->discards++;
+			continue;
+		}
+
+		page = ev.sector / 8;
+		end = howmany(ev.sector + ev.sectors, 8);
+		/* A trace of a bigger device wraps around */
+		if (page >= nr_pages) {
+			end -= page - page % nr_pages;
+			page %= nr_pages;
+		}
+		end = MIN(end, nr_pages);
+
+		w->ev_page = MAX(page, w->first);
+		w->ev_end = MIN(end, w->first + w->nr);
+		w->ev_writing = ev.op == TRACE_WRITE;
+		w->ev_due = ev.time;
+	}
+	return true;
+}
+
+/* Until @ns from now, picking up completions in the meantime */
+static void replay_wait(struct worker *w, uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec		= ns / 1000000000,
+		.tv_nsec	= ns % 1000000000,
+	};
+
+	if (w->inflight)
+		reap_io(w, 1, &ts);
+	else
+		nanosleep(&ts, NULL);
+}
+
+static void *replay_worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t due, now;
+
+	while ((!w->quota || w->loops < w->quota) && replay_next(w)) {
+		struct aio_req *r = free_req(w);
+		unsigned int npages = MIN(w->ev_end - w->ev_page, max_pages);
+
+		if (!r || overlaps_inflight(w, w->ev_page, npages)) {
+			reap_io(w, 1, NULL);
+			continue;
+		}
+
+		if (!replay_fast) {
+			due = replay_start + w->ev_due;
+			now = now_ns();
+			if (now < due) {
+				replay_wait(w, due - now);
+				continue;
+			}
+
+			/* Behind the trace: the device can't keep up */
+			if (now - due > REPLAY_LATE_NS)
+				__atomic_store_n(&w->late, w->late + 1,
+						 __ATOMIC_RELAXED);
+			if (now - due > w->max_lag)
+				__atomic_store_n(&w->max_lag, now - due,
+						 __ATOMIC_RELAXED);
+		}
+
+		r->page = w->ev_page;
+		r->npages = npages;
+		r->writing = w->ev_writing;
+		w->ev_page += npages;
+		submit_io(w, r);
+
+		if (w->inflight)
+			reap_io(w, w->inflight == queue_depth ? 1 : 0, NULL);
+	}
+
+	while (w->inflight)
+		reap_io(w, 1, NULL);
+
+	__atomic_store_n(&w->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void setup_worker(struct worker *w, unsigned int id)
+{
+	unsigned char key[16];
+	unsigned short gen_seed[3];
+	unsigned long per_worker = nr_pages / nr_workers;
+	unsigned int i, j;
+
+	w->id = id;
+	w->first = id * per_worker;
+	w->nr = id == nr_workers - 1 ? nr_pages - w->first : per_worker;
+
+	if (benchmark)
+		w->quota = benchmark / nr_workers +
+			(id < benchmark % nr_workers ? 1 : 0);
+
+	memcpy(key, bcache_magic, 16);
+	key[0] ^= id;
+	key[1] ^= id >> 8;
+	RC4_set_key(&w->writedata, 16, key);
+
+	w->seed[0] = random();
+	w->seed[1] = random();
+	w->seed[2] = id;
+
+	gen_seed[0] = random();
+	gen_seed[1] = random();
+	gen_seed[2] = id;
+	if (workload_gen_init(&w->gen, &wl, w->nr, nr_pages, gen_seed))
+		exit(EXIT_FAILURE);
+
+	if (trace_file) {
+		trace_init(&w->trace);
+		if (trace_open(&w->trace, trace_file))
+			exit(EXIT_FAILURE);
+	}
+
+	if (io_setup(queue_depth * 2, &w->ctx)) {
+		perror("Error setting up aio context");
+		exit(EXIT_FAILURE);
+	}
+
+	w->reqs = calloc(queue_depth, sizeof(*w->reqs));
+	if (!w->reqs) {
+		printf("Could not allocate buffers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < queue_depth; i++)
+		for (j = 0; j < (compare_mode ? 2 : 1); j++)
+			if (posix_memalign(&w->reqs[i].buf[j], 4096,
+					   4096 * max_pages)) {
+				printf("Could not allocate buffers\n");
+				exit(EXIT_FAILURE);
+			}
+}
+
+static void print_progress(void)
+{
+	unsigned long loops = 0, done = 0, unique = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		loops += __atomic_load_n(&workers[i].loops, __ATOMIC_RELAXED);
+		done += __atomic_load_n(&workers[i].done, __ATOMIC_RELAXED);
+		unique += __atomic_load_n(&workers[i].unique, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&report_lock);
+	printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
+	       loops,
+	       __atomic_load_n(&workers[0].last_offset, __ATOMIC_RELAXED) >> 9,
+	       __atomic_load_n(&workers[0].last_nbytes, __ATOMIC_RELAXED) >> 9,
+	       done >> 11, unique >> 11);
+	pthread_mutex_unlock(&report_lock);
+}
+
+/*
+ * Reporting
+ *
+ * Every interval the reporting thread merges the cumulative histograms
+ * of all workers, and subtracts the previous merge to get the interval.
+ */
+static bool json;
+static unsigned int report_interval = 1;
+
+static struct histogram report_prev[NR_OPS], report_cur[NR_OPS];
+static struct histogram report_delta[NR_OPS];
+
+static void print_latency(double us)
+{
+	if (us >= 1000)
+		printf("%.2fms", us / 1000);
+	else
+		printf("%.0fus", us);
+}
+
+static void print_ops(const char *type, double elapsed, double seconds,
+		      struct histogram *h)
+{
+	static const double pct[] = { 50, 99, 99.9 };
+	static const char * const pct_names[] = { "p50", "p99", "p99.9" };
+	unsigned int op, i;
+
+	pthread_mutex_lock(&report_lock);
+	if (json)
+		printf("{\"type\":\"%s\",\"time\":%.3f,\"seconds\":%.3f",
+		       type, elapsed, seconds);
+	else
+		printf("[%7.1fs]%s", elapsed,
+		       strcmp(type, "summary") ? "" : " total");
+
+	for (op = 0; op < NR_OPS; op++) {
+		if (!h[op].count && !json)
+			continue;
+
+		if (json) {
+			printf(",\"%s\":{\"ios\":%" PRIu64 ",\"iops\":%.1f,"
+			       "\"mbps\":%.2f",
+			       op_names[op], h[op].count,
+			       h[op].count / seconds,
+			       h[op].bytes / seconds / (1 << 20));
+			for (i = 0; i < 3; i++)
+				printf(",\"%s_us\":%.1f", pct_names[i],
+				       hist_percentile(&h[op], pct[i]) / 1000.0);
+			printf(",\"max_us\":%.1f}", h[op].max / 1000.0);
+			continue;
+		}
+
+		printf(" %s %.0f iops %.1f MB/s", op_names[op],
+		       h[op].count / seconds,
+		       h[op].bytes / seconds / (1 << 20));
+		for (i = 0; i < 3; i++) {
+			printf(" %s ", pct_names[i]);
+			print_latency(hist_percentile(&h[op], pct[i]) / 1000.0);
+		}
+		printf(" max ");
+		print_latency(h[op].max / 1000.0);
+	}
+
+	printf(json ? "}\n" : "\n");
+	fflush(stdout);
+	pthread_mutex_unlock(&report_lock);
+}
+
+static void report(const char *type, double elapsed, double seconds)
+{
+	unsigned int i, op;
+
+	memset(report_cur, 0, sizeof(report_cur));
+	for (i = 0; i < nr_workers; i++)
+		for (op = 0; op < NR_OPS; op++)
+			hist_merge(&report_cur[op], &workers[i].hist[op]);
+
+	if (!strcmp(type, "summary")) {
+		print_ops(type, elapsed, seconds, report_cur);
+		return;
+	}
+
+	for (op = 0; op < NR_OPS; op++)
+		hist_delta(&report_delta[op], &report_cur[op],
+			   &report_prev[op]);
+	memcpy(report_prev, report_cur, sizeof(report_prev));
+
+	print_ops(type, elapsed, seconds, report_delta);
+}
+
+static void print_replay(void)
+{
+	unsigned long late = 0, discards = 0;
+	uint64_t max_lag = 0, lag;
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		late += __atomic_load_n(&workers[i].late, __ATOMIC_RELAXED);
+		discards += workers[i].discards;
+		lag = __atomic_load_n(&workers[i].max_lag, __ATOMIC_RELAXED);
+		if (lag > max_lag)
+			max_lag = lag;
+	}
+
+	/* Every worker reads all of the trace */
+	if (json) {
+		printf("{\"type\":\"replay\",\"events\":%" PRIu64
+		       ",\"skipped\":%" PRIu64 ",\"discards\":%lu",
+		       workers[0].trace.nr, workers[0].trace.skipped,
+		       discards / nr_workers);
+		if (!replay_fast)
+			printf(",\"late\":%lu,\"max_lag_us\":%.1f",
+			       late, max_lag / 1000.0);
+		printf("}\n");
+		return;
+	}
+
+	printf("Replayed %" PRIu64 " events", workers[0].trace.nr);
+	if (workers[0].trace.skipped)
+		printf(", %" PRIu64 " lines skipped",
+		       workers[0].trace.skipped);
+	if (discards)
+		printf(", %lu discards left out", discards / nr_workers);
+	printf("\n");
+	if (!replay_fast) {
+		printf("%lu I/Os more than 1ms behind the trace, at most ",
+		       late);
+		print_latency(max_lag / 1000.0);
+		printf("\n");
+	}
+}
+
+static bool workers_running(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++)
+		if (!__atomic_load_n(&workers[i].finished, __ATOMIC_ACQUIRE))
+			return true;
+	return false;
+}
+
+void aio_loop(void)
+{
+	uint64_t start = now_ns(), last_report = start, now;
+	unsigned int i;
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers) {
+		printf("Could not allocate buffers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		setup_worker(&workers[i], i);
+
+	replay_start = now_ns();
+	for (i = 0; i < nr_workers; i++)
+		if (pthread_create(&workers[i].thread, NULL,
+				   trace_file ? replay_worker : aio_worker,
+				   &workers[i])) {
+			perror("Error creating worker thread");
+			exit(EXIT_FAILURE);
+		}
+
+	while (workers_running()) {
+		struct timespec tick = { 0, 100 * 1000 * 1000 };
+
+		nanosleep(&tick, NULL);
+		flushlog();
+
+		now = now_ns();
+		if (now - last_report >= report_interval * 1000000000ULL) {
+			report("interval", (now - start) / 1e9,
+			       (now - last_report) / 1e9);
+			if (!json)
+				print_progress();
+			last_report = now;
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		io_destroy(workers[i].ctx);
+		workload_gen_exit(&workers[i].gen);
+	}
+
+	now = now_ns();
+	report("summary", (now - start) / 1e9, (now - start) / 1e9);
+	if (trace_file)
+		print_replay();
+	for (i = 0; i < nr_workers; i++)
+		trace_close(&workers[i].trace);
+	if (!json) {
+		print_progress();
+		printf("Page tracking used %lu mb\n",
+		       page_tracking_size() >> 20);
+	}
 }
 
 void usage()
 {
+	fprintf(stderr,
+		"Usage: bcache-test [options] device [compare-device]\n"
+		"	-d	use O_DIRECT\n"
+		"	-n	random walk instead of uniform random offsets (-p walk)\n"
+		"	-p P	offset distribution: uniform, walk, zipf[:theta],\n"
+		"		hotspot[:hot%%[:access%%]] or seq[:streams]\n"
+		"	-W N	working set: N%% of the device, Nx the cache size\n"
+		"		or a size (default the whole device)\n"
+		"	-C N	cache size for -W Nx\n"
+		"	-M N	N%% of I/Os are reads, the rest writes\n"
+		"	-s	random I/O sizes from 4k to 64k\n"
+		"	-c	verify reads against checksums of written data\n"
+		"	-m	compact page tracking, for large devices\n"
+		"	-r	read test (default)\n"
+		"	-w	write test, alternating with reads when -r is given\n"
+		"	-v	verbose, print every I/O\n"
+		"	-l	save the kernel log to log.N\n"
+		"	-b N	stop after N I/Os (no verification)\n"
+		"	-q N	I/Os in flight per worker (default 1)\n"
+		"	-j N	number of worker threads (default 1)\n"
+		"	-i N	report interval in seconds (default 1)\n"
+		"	-J	report as JSON lines\n"
+		"	-t F	replay a blkparse or CSV (time,op,sector,sectors)\n"
+		"		trace from F, - for stdin, at its original timing\n"
+		"		(default -q %u)\n"
+		"	-f	replay as fast as possible\n",
+		REPLAY_QUEUE_DEPTH);
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
-	bool walk = false, randsize = false, verbose = false, csum = false, rtest = false, wtest = false;
-	int fd1, fd2 = 0, direct = 0, nbytes = 4096, j, o;
-	unsigned long size, i, offset = 0, done = 0, unique = 0, benchmark = 0;
-	void *buf1 = NULL, *buf2 = NULL;
-	struct pagestuff *pages, *p;
-	unsigned char c[16];
-	time_t last_printed = 0;
+	int direct = 0, o;
+	bool queue_depth_set = false;
+	unsigned long size;
 	extern char *optarg;
 
-	RC4_KEY writedata;
-	RC4_set_key(&writedata, 16, bcache_magic);
+	workload_init(&wl);
 
-	while ((o = getopt(argc, argv, "dnwvscwlb:")) != EOF)
+	while ((o = getopt(argc, argv, "dnrwvscmlb:q:j:i:Jp:W:C:M:t:f")) != EOF)
 		switch (o) {
 		case 'd':
 			direct = O_DIRECT;
 			break;
 		case 'n':
-			walk = true;
+			wl.dist = WL_WALK;
+			break;
+		case 'p':
+			if (workload_parse(&wl, optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'W':
+			if (workload_parse_ws(&wl, optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case 'C':
+			if (workload_parse_size(optarg, &wl.cache_pages))
+				exit(EXIT_FAILURE);
+			break;
+		case 'M':
+			wl.read_pct = atoi(optarg);
+			if (wl.read_pct < 0 || wl.read_pct > 100) {
+				printf("Read percentage must be between 0 and 100\n");
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'v':
 			verbose = true;
@@ -184,6 +1190,9 @@ int main(int argc, char **argv)
 		case 'c':
 			csum = true;
 			break;
+		case 'm':
+			compact = true;
+			break;
 		case 'w':
 			wtest = true;
 			break;
@@ -196,6 +1205,39 @@ int main(int argc, char **argv)
 		case 'b':
 			benchmark = atol(optarg);
 			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+				printf("Queue depth must be between 1 and %i\n",
+				       MAX_QUEUE_DEPTH);
+				exit(EXIT_FAILURE);
+			}
+			queue_depth_set = true;
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			if (nr_workers < 1 || nr_workers > MAX_WORKERS) {
+				printf("Number of workers must be between 1 and %i\n",
+				       MAX_WORKERS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'i':
+			report_interval = atoi(optarg);
+			if (report_interval < 1) {
+				printf("Report interval must be at least 1s\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'J':
+			json = true;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'f':
+			replay_fast = true;
+			break;
 		default:
 			usage();
 		}
@@ -203,118 +1245,72 @@ int main(int argc, char **argv)
 	argv += optind;
 	argc -= optind;
 
+	if (wl.read_pct >= 0) {
+		rtest = wl.read_pct > 0;
+		wtest = wl.read_pct < 100;
+	}
+
 	if (!rtest && !wtest)
 		rtest = true;
 
+	if (trace_file) {
+		/* Reads and writes are up to the trace */
+		wtest = true;
+		max_pages = REPLAY_MAX_PAGES;
+		if (!queue_depth_set)
+			queue_depth = REPLAY_QUEUE_DEPTH;
+		if (!strcmp(trace_file, "-") && nr_workers > 1) {
+			printf("Every worker reads the trace, -j needs a file\n");
+			exit(EXIT_FAILURE);
+		}
+	} else if (replay_fast) {
+		printf("-f is for replaying a trace with -t\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (wl.ws_cache && !wl.cache_pages) {
+		printf("Working set relative to the cache needs -C\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (argc < 1) {
 		printf("Please enter a device to test\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if (!csum && !benchmark && argc < 2) {
+	if (compare_mode && argc < 2) {
 		printf("Please enter a device to compare against\n");
 		exit(EXIT_FAILURE);
 	}
 
 	fd1 = open(argv[0], (wtest ? O_RDWR : O_RDONLY)|direct);
-	if (!csum && !benchmark)
+	if (compare_mode)
 		fd2 = open(argv[1], (wtest ? O_RDWR : O_RDONLY)|direct);
 
-	if (fd1 == -1 || fd2 == -1) {
+	if (fd1 == -1 || (compare_mode && fd2 == -1)) {
 		perror("Error opening device");
 		exit(EXIT_FAILURE);
 	}
 
 	size = getblocks(fd1);
-	if (!csum && !benchmark)
+	if (compare_mode)
 		size = MIN(size, getblocks(fd2));
 
-	size = size / 8 - 16;
-	pages = calloc(size + 16, sizeof(*pages));
-	printf("size %li\n", size);
-
-	if (posix_memalign(&buf1, 4096, 4096 * 16) ||
-	    posix_memalign(&buf2, 4096, 4096 * 16)) {
-		printf("Could not allocate buffers\n");
+	nr_pages = size / 8;
+	if (nr_pages < nr_workers * MAX_PAGES_PER_IO) {
+		printf("Device too small for %u workers\n", nr_workers);
 		exit(EXIT_FAILURE);
 	}
-	//setvbuf(stdout, NULL, _IONBF, 0);
-
-	for (i = 0; !benchmark || i < benchmark; i++) {
-		bool writing = (wtest && (i & 1)) || !rtest;
-		nbytes = randsize ? drand48() * 16 + 1 : 1;
-		nbytes <<= 12;
-
-		offset >>= 12;
-		offset += walk ? normal() * 20 : random();
-		offset %= size;
-		offset <<= 12;
-
-		if (!(i % 200))
-			flushlog();
-
-		if (!verbose) {
-			time_t now = time(NULL);
-			if (now - last_printed >= 2) {
-				last_printed = now;
-				goto print;
-			}
-		} else
-print:			printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
-			       i, offset >> 9, nbytes >> 9, done >> 11, unique >> 11);
-
-		done += nbytes >> 9;
-
-		if (!writing)
-			Pread(fd1, buf1, nbytes, offset);
-		if (!writing && !csum && !benchmark)
-			Pread(fd2, buf2, nbytes, offset);
 
-		for (j = 0; j < nbytes; j += 4096) {
-			p = &pages[(offset + j) / 4096];
-
-			if (writing)
-				RC4(&writedata, 4096, zero, buf1 + j);
-
-			if (csum) {
-				MD4(buf1 + j, 4096, &c[0]);
-
-				if (writing ||
-				    (!p->readcount && !p->writecount)) {
-					memcpy(&p->oldcsum[0], &p->csum[0], 16);
-					memcpy(&p->csum[0], c, 16);
-				} else if (memcmp(&p->csum[0], c, 16))
-					goto bad;
-			} else if (!writing && !benchmark &&
-				   memcmp(buf1 + j,
-					  buf2 + j,
-					  4096))
-				goto bad;
-
-			if (!p->writecount && !p->readcount)
-				unique += 8;
-
-			writing ? p->writecount++ : p->readcount++;
-		}
-		if (writing)
-			Pwrite(fd1, buf1, nbytes, offset);
-		if (writing && !csum && !benchmark)
-			Pwrite(fd2, buf2, nbytes, offset);
+	if (page_tracking_init()) {
+		printf("Could not allocate page tracking\n");
+		exit(EXIT_FAILURE);
 	}
-	printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
-	       i, offset >> 9, nbytes >> 9, done >> 11, unique >> 11);
-	exit(EXIT_SUCCESS);
-err:
-	perror("IO error");
-	flushlog();
-	exit(EXIT_FAILURE);
-bad:
-	printf("Bad read! loop %li offset %li readcount %i writecount %i\n",
-	       i, (offset + j) >> 9, p->readcount, p->writecount);
-
-	if (!memcmp(&p->oldcsum[0], c, 16))
-		printf("Matches previous csum\n");
+	if (!json && trace_file)
+		printf("size %li, replaying %s\n", nr_pages, trace_file);
+	else if (!json)
+		printf("size %li, workload %s\n", nr_pages, workload_name(&wl));
 
-	flushlog();
-	exit(EXIT_FAILURE);
+	aio_loop();
+	exit(EXIT_SUCCESS);
 }
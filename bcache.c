@@ -20,6 +20,18 @@
 
 #include "features.h"
 #include "show.h"
+#include "out.h"
+#include "stats.h"
+#include "export.h"
+#include "inspect.h"
+#include "flush.h"
+#include "simulate.h"
+#include "cset.h"
+#include "watch.h"
+#include "load.h"
+#include "check.h"
+#include "sbarchive.h"
+#include "profile.h"
 
 #define BCACHE_TOOLS_VERSION	"1.1"
 
@@ -72,16 +84,28 @@ bool bad_dev(char **devname)
 int main_usage(void)
 {
 	fprintf(stderr,
-		"Usage:bcache [SUBCMD]\n"
+		"Usage:bcache [--profile] [SUBCMD]\n"
 		"	show		show all bcache devices in this host\n"
 		"	tree		show active bcache devices in this host\n"
+		"	status		show statistics of the registered cache sets\n"
+		"	export		export statistics as Prometheus metrics\n"
+		"	check		check the super blocks and cache sets of all devices\n"
+		"	inspect		read the journal and btree of a cache device\n"
+		"	flush-offline	write dirty data of an unregistered cache back\n"
+		"	simulate	replay a block trace against cache set models\n"
 		"	make		make regular device to bcache device\n"
-		"	register	register device to kernel\n"
+		"	register	register devices to kernel\n"
+		"	load		set up the devices of /etc/bcache/bcache.conf\n"
 		"	unregister	unregister device from kernel\n"
 		"	attach		attach backend device(data device) to cache device\n"
 		"	detach		detach backend device(data device) from cache device\n"
 		"	set-cachemode	set cachemode for backend device\n"
-		"	set-label	set label for backend device\n");
+		"	set-label	set label for backend device\n"
+		"	sb-backup	save the super blocks of all devices to a file\n"
+		"	sb-restore	write super blocks back from such a file\n"
+		"	--profile	count and time the I/O calls at exit, as does\n"
+		"			BCACHE_PROFILE=1 for all the tools; a blkid\n"
+		"			probe or a discard counts as one call\n");
 	return EXIT_FAILURE;
 }
 
@@ -92,6 +116,27 @@ int show_usage(void)
 		"	show overall information about all devices\n"
 		"	-d	--device {devname}	show the detail infomation about this device\n"
 		"	-m	--more			show overall information about all devices with detail info\n"
+		"	-o	--output {text|json|tsv0}	output format, text by default\n"
+		"	-j	--json			same as --output=json\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+int status_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	status [option]\n"
+		"	show statistics of the registered cache sets\n"
+		"	-f	--five-minute		print the last five minutes of stats\n"
+		"	-H	--hour			print the last hour of stats\n"
+		"	-d	--day			print the last day of stats\n"
+		"	-t	--total			print total stats (default)\n"
+		"	-a	--all			print all stats\n"
+		"	-s	--sub-status		print subdevice status\n"
+		"	-r	--reset-stats		reset stats after printing them\n"
+		"	-g	--gc			invoke GC before printing status\n"
+		"	-w	--watch {seconds}	print rates every interval until interrupted\n"
+		"	-c	--count {n}		stop watching after n reports\n"
 		"	-h	--help			show help information\n");
 	return EXIT_FAILURE;
 }
@@ -99,14 +144,17 @@ int show_usage(void)
 int tree_usage(void)
 {
 	fprintf(stderr,
-		"Usage: tree	show active bcache devices in this host\n");
+		"Usage: tree [option]	show active bcache devices in this host\n"
+		"	-o	--output {text|json|tsv0}	output format, text by default\n"
+		"	-j	--json			same as --output=json\n");
 	return EXIT_FAILURE;
 }
 
 int register_usage(void)
 {
 	fprintf(stderr,
-		"Usage:register devicename		register device as bcache device to kernel\n");
+		"Usage:register [-w seconds] devicename...	register devices as bcache devices to kernel\n"
+		"	-w	--wait {seconds}	wait this long for the registrations to be done\n");
 	return EXIT_FAILURE;
 }
 
@@ -114,25 +162,25 @@ int unregister_usage(void)
 {
 	fprintf(stderr,
 		"Usage:unregister devicename		unregister device from kernel\n");
-	return EXIT_FAILURE;
+	return cset_usage();
 }
 
 int attach_usage(void)
 {
 	fprintf(stderr, "Usage:attach cset_uuid|cachedevice datadevice\n");
-	return EXIT_FAILURE;
+	return cset_usage();
 }
 
 int detach_usage(void)
 {
 	fprintf(stderr, "Usage:detach devicename\n");
-	return EXIT_FAILURE;
+	return cset_usage();
 }
 
 int setcachemode_usage(void)
 {
 	fprintf(stderr, "Usage:set-cachemode devicename modetype\n");
-	return EXIT_FAILURE;
+	return cset_usage();
 }
 
 int setlabel_usage(void)
@@ -149,75 +197,6 @@ int version_usagee(void)
 	return EXIT_FAILURE;
 }
 
-void replace_line(char **dest, const char *from, const char *to)
-{
-	assert(strlen(from) == strlen(to));
-	char sub[4096] = "";
-	char new[4096] = "";
-
-	strcpy(sub, *dest);
-	while (1) {
-		char *tmp = strpbrk(sub, from);
-
-		if (tmp != NULL) {
-			strcpy(new, tmp);
-			strcpy(sub, tmp + strlen(from));
-		} else
-			break;
-	}
-	if (strlen(new) > 0) {
-		strncpy(new, to, strlen(to));
-		sprintf(*dest + strlen(*dest) - strlen(new), new, strlen(new));
-	}
-}
-
-int tree(void)
-{
-	char *out;
-	const char *begin = ".\n";
-	const char *middle = "├─";
-	const char *tail = "└─";
-	struct list_head head;
-	struct dev *devs, *tmp, *n, *m;
-
-	INIT_LIST_HEAD(&head);
-	int ret;
-
-	out = (char *)malloc(4096);
-	if (out == NULL) {
-		fprintf(stderr, "Error: fail to allocate memory buffer\n");
-		return 1;
-	}
-
-	ret = list_bdevs(&head);
-	if (ret != 0) {
-		free(out);
-		fprintf(stderr, "Failed to list devices\n");
-		return ret;
-	}
-	sprintf(out, "%s", begin);
-	list_for_each_entry_safe(devs, n, &head, dev_list) {
-		if ((devs->version == BCACHE_SB_VERSION_CDEV
-		     || devs->version == BCACHE_SB_VERSION_CDEV_WITH_UUID)
-		    && strcmp(devs->state, BCACHE_BASIC_STATE_ACTIVE) == 0) {
-			sprintf(out + strlen(out), "%s\n", devs->name);
-			list_for_each_entry_safe(tmp, m, &head, dev_list) {
-				if (strcmp(devs->cset, tmp->attachuuid) ==
-				    0) {
-					replace_line(&out, tail, middle);
-					sprintf(out + strlen(out), "%s%s %s\n",
-						tail, tmp->name, tmp->bname);
-				}
-			}
-		}
-	}
-	if (strlen(out) > strlen(begin))
-		printf("%s", out);
-	free_dev(&head);
-	free(out);
-	return 0;
-}
-
 int attach_both(char *cdev, char *backdev)
 {
 	struct bdev bd;
@@ -254,6 +233,28 @@ int attach_both(char *cdev, char *backdev)
 	return attach_backdev(buf, backdev);
 }
 
+/* register_async returns before the registrations are done */
+static int wait_registered(char **devnames, int nr, int timeout_ms)
+{
+	int i;
+
+	if (watch_registered(devnames, nr, timeout_ms))
+		return 0;
+	for (i = 0; i < nr; i++)
+		if (!dev_registered(devnames[i]))
+			fprintf(stderr, "%s is not registered yet\n",
+				devnames[i]);
+	return 1;
+}
+
+/* An option other than -h selects the cache set wide form (cset.c) */
+static bool is_cset_form(int argc, char **argv)
+{
+	if (argc < 2 || argv[1][0] != '-')
+		return false;
+	return strcmp(argv[1], "-h") != 0;
+}
+
 bool has_permission(void)
 {
 	uid_t euid = geteuid();
@@ -272,6 +273,11 @@ int main(int argc, char **argv)
 		"Only root or users who has root priviledges can run this command\n");
 		return 1;
 	}
+	if (argc > 1 && strcmp(argv[1], "--profile") == 0) {
+		profile_enable();
+		argc--;
+		argv++;
+	}
 	if (argc < 2) {
 		main_usage();
 		return 1;
@@ -287,19 +293,29 @@ int main(int argc, char **argv)
 		int more = 0;
 		int device = 0;
 		int help = 0;
+		enum out_format format = OUT_TEXT;
 
 		static struct option long_options[] = {
 			{"more", no_argument, 0, 'm'},
 			{"help", no_argument, 0, 'h'},
 			{"device", required_argument, 0, 'd'},
+			{"output", required_argument, 0, 'o'},
+			{"json", no_argument, 0, 'j'},
 			{0, 0, 0, 0}
 		};
 		int option_index = 0;
 
 		while ((o =
-			getopt_long(argc, argv, "hmd:", long_options,
+			getopt_long(argc, argv, "hmd:o:j", long_options,
 				    &option_index)) != EOF) {
 			switch (o) {
+			case 'o':
+				if (out_format_parse(optarg, &format))
+					return show_usage();
+				break;
+			case 'j':
+				format = OUT_JSON;
+				break;
 			case 'd':
 				devname = optarg;
 				device = 1;
@@ -318,31 +334,168 @@ int main(int argc, char **argv)
 		if (help || argc != 0) {
 			return show_usage();
 		} else if (more) {
-			return show_bdevs_detail();
+			return show_bdevs_detail(format);
 		} else if (device) {
 			if (bad_dev(&devname)) {
 				fprintf(stderr,
 					"Error:Wrong device name found\n");
 				return 1;
 			}
-			return detail_single(devname);
+			return detail_single(devname, format);
 		} else {
-			return show_bdevs();
+			return show_bdevs(format);
 		}
+	} else if (strcmp(subcmd, "status") == 0) {
+		struct status_opts so = { 0 };
+		char *end;
+		int o;
+
+		static struct option long_options[] = {
+			{"five-minute", no_argument, 0, 'f'},
+			{"hour", no_argument, 0, 'H'},
+			{"day", no_argument, 0, 'd'},
+			{"total", no_argument, 0, 't'},
+			{"all", no_argument, 0, 'a'},
+			{"sub-status", no_argument, 0, 's'},
+			{"reset-stats", no_argument, 0, 'r'},
+			{"gc", no_argument, 0, 'g'},
+			{"watch", required_argument, 0, 'w'},
+			{"count", required_argument, 0, 'c'},
+			{"help", no_argument, 0, 'h'},
+			{0, 0, 0, 0}
+		};
+
+		while ((o = getopt_long(argc, argv, "fHdtasrgw:c:h",
+					long_options, NULL)) != EOF) {
+			switch (o) {
+			case 'f':
+				so.intervals |= 1U << STATS_FIVE_MINUTE;
+				break;
+			case 'H':
+				so.intervals |= 1U << STATS_HOUR;
+				break;
+			case 'd':
+				so.intervals |= 1U << STATS_DAY;
+				break;
+			case 't':
+				so.intervals |= 1U << STATS_TOTAL;
+				break;
+			case 'a':
+				so.intervals = (1U << NR_STATS_INTERVALS) - 1;
+				break;
+			case 's':
+				so.sub_status = true;
+				break;
+			case 'r':
+				so.reset_stats = true;
+				break;
+			case 'g':
+				so.gc = true;
+				break;
+			case 'w':
+				so.watch = strtod(optarg, &end);
+				if (*end || !(so.watch > 0)) {
+					fprintf(stderr,
+						"Bad watch interval %s\n",
+						optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				so.count = strtoul(optarg, &end, 10);
+				if (*end || !so.count) {
+					fprintf(stderr, "Bad count %s\n",
+						optarg);
+					return 1;
+				}
+				break;
+			case 'h':
+			default:
+				return status_usage();
+			}
+		}
+		if (argc != optind)
+			return status_usage();
+		if (so.watch && so.reset_stats) {
+			fprintf(stderr,
+				"Resetting stats would break the rates of --watch\n");
+			return 1;
+		}
+		if (so.count && !so.watch)
+			return status_usage();
+		if (!so.intervals)
+			so.intervals = 1U << STATS_TOTAL;
+		return show_status(&so);
+	} else if (strcmp(subcmd, "export") == 0) {
+		return bcache_export(argc, argv);
+	} else if (strcmp(subcmd, "inspect") == 0) {
+		return bcache_inspect(argc, argv);
+	} else if (strcmp(subcmd, "flush-offline") == 0) {
+		return bcache_flush(argc, argv);
+	} else if (strcmp(subcmd, "simulate") == 0) {
+		return bcache_simulate(argc, argv);
 	} else if (strcmp(subcmd, "tree") == 0) {
-		if (argc != 1)
+		enum out_format format = OUT_TEXT;
+		int o;
+
+		static struct option long_options[] = {
+			{"output", required_argument, 0, 'o'},
+			{"json", no_argument, 0, 'j'},
+			{0, 0, 0, 0}
+		};
+
+		while ((o = getopt_long(argc, argv, "o:j", long_options,
+					NULL)) != EOF) {
+			switch (o) {
+			case 'o':
+				if (out_format_parse(optarg, &format))
+					return tree_usage();
+				break;
+			case 'j':
+				format = OUT_JSON;
+				break;
+			default:
+				return tree_usage();
+			}
+		}
+		if (optind != argc)
 			return tree_usage();
-		return tree();
+		return tree(format);
+	} else if (strcmp(subcmd, "load") == 0) {
+		return bcache_load(argc, argv);
+	} else if (strcmp(subcmd, "check") == 0) {
+		return bcache_check(argc, argv);
+	} else if (strcmp(subcmd, "sb-backup") == 0) {
+		return bcache_sb_backup(argc, argv);
+	} else if (strcmp(subcmd, "sb-restore") == 0) {
+		return bcache_sb_restore(argc, argv);
 	} else if (strcmp(subcmd, "register") == 0) {
-		if (argc != 2 || strcmp(argv[1], "-h") == 0)
+		int i, first = 1, wait_ms = -1;
+
+		if (argc > 2 && (strcmp(argv[1], "-w") == 0 ||
+				 strcmp(argv[1], "--wait") == 0)) {
+			char *e;
+
+			wait_ms = strtoul(argv[2], &e, 10) * 1000;
+			if (*e || wait_ms < 0)
+				return register_usage();
+			first = 3;
+		}
+		if (argc <= first || strcmp(argv[1], "-h") == 0)
 			return register_usage();
-		devname = argv[1];
-		if (bad_dev(&devname)) {
-			fprintf(stderr, "Error:Wrong device name found\n");
+		for (i = first; i < argc; i++)
+			if (bad_dev(&argv[i])) {
+				fprintf(stderr,
+					"Error:Wrong device name found\n");
+				return 1;
+			}
+		if (register_devs(argv + first, argc - first))
 			return 1;
-		}
-		return register_dev(devname);
+		return wait_ms >= 0 ?
+			wait_registered(argv + first, argc - first, wait_ms) : 0;
 	} else if (strcmp(subcmd, "unregister") == 0) {
+		if (is_cset_form(argc, argv))
+			return bcache_cset_unregister(argc, argv);
 		if (argc != 2 || strcmp(argv[1], "-h") == 0)
 			return unregister_usage();
 		devname = argv[1];
@@ -366,6 +519,8 @@ int main(int argc, char **argv)
 		}
 		return 1;
 	} else if (strcmp(subcmd, "attach") == 0) {
+		if (argc > 3 || is_cset_form(argc, argv))
+			return bcache_cset_attach(argc, argv);
 		if (argc != 3 || strcmp(argv[1], "-h") == 0)
 			return attach_usage();
 		devname = argv[2];
@@ -379,6 +534,8 @@ int main(int argc, char **argv)
 		}
 		return attach_both(attachto, devname);
 	} else if (strcmp(subcmd, "detach") == 0) {
+		if (is_cset_form(argc, argv))
+			return bcache_cset_detach(argc, argv);
 		if (argc != 2 || strcmp(argv[1], "-h") == 0)
 			return detach_usage();
 		devname = argv[1];
@@ -388,6 +545,8 @@ int main(int argc, char **argv)
 		}
 		return detach_backdev(devname);
 	} else if (strcmp(subcmd, "set-cachemode") == 0) {
+		if (is_cset_form(argc, argv))
+			return bcache_cset_cachemode(argc, argv);
 		if (argc != 3)
 			return setcachemode_usage();
 		devname = argv[1];
@@ -167,6 +167,14 @@ static inline bool SB_IS_BDEV(const struct cache_sb *sb)
 		|| sb->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET;
 }
 
+/* Any of the cache device versions, with or without uuid and features */
+static inline bool SB_VERSION_IS_CDEV(uint64_t version)
+{
+	return version == BCACHE_SB_VERSION_CDEV
+		|| version == BCACHE_SB_VERSION_CDEV_WITH_UUID
+		|| version == BCACHE_SB_VERSION_CDEV_WITH_FEATURES;
+}
+
 BITMASK(CACHE_SYNC,		struct cache_sb, flags, 0, 1);
 BITMASK(CACHE_DISCARD,		struct cache_sb, flags, 1, 1);
 BITMASK(CACHE_REPLACEMENT,	struct cache_sb, flags, 2, 3);
@@ -186,6 +194,7 @@ BITMASK(BDEV_STATE,		struct cache_sb, flags, 61, 2);
 #define BDEV_STATE_STALE	3U
 
 uint64_t crc64(const void *data, size_t len);
+uint64_t crc64_seed(uint64_t seed, const void *data, size_t len);
 
 #define node(i, j)		((void *) ((i)->d + (j)))
 #define end(i)			node(i, (i)->keys)
@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Checks of the offline btree and journal reader against synthetic cache
+ * devices, run by make check.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+#include "btree.h"
+
+#define TEST_BUCKET		128	/* sectors */
+#define TEST_NBUCKETS		256
+#define TEST_JOURNAL		1	/* bucket */
+#define TEST_MAX_KEYS		4
+
+/* A dirty extent of inode 1, told apart by the cache sector it points to */
+struct test_key {
+	uint64_t		start;
+	uint64_t		end;
+	uint64_t		cache;
+};
+
+struct test_case {
+	const char		*name;
+	/* The keys of one jset, in journal order */
+	struct test_key		keys[TEST_MAX_KEYS];
+	unsigned int		nr_keys;
+	struct test_key		want[TEST_MAX_KEYS];
+	unsigned int		nr_want;
+};
+
+static const struct test_case cases[] = {
+	{
+		"newer key over the end of an older one",
+		{ { 0, 16, 1024 }, { 8, 24, 2048 } }, 2,
+		{ { 0, 8, 1024 }, { 8, 24, 2048 } }, 2,
+	}, {
+		"newer key over all of an older one",
+		{ { 8, 16, 1024 }, { 0, 24, 2048 } }, 2,
+		{ { 0, 24, 2048 } }, 1,
+	}, {
+		"newer key inside an older one",
+		{ { 0, 24, 1024 }, { 8, 16, 2048 } }, 2,
+		{ { 0, 8, 1024 }, { 8, 16, 2048 }, { 16, 24, 1024 } }, 3,
+	}, {
+		"older key inside a newer one",
+		{ { 0, 24, 1024 }, { 8, 16, 2048 }, { 4, 20, 4096 } }, 3,
+		{ { 0, 4, 1024 }, { 4, 20, 4096 }, { 20, 24, 1024 } }, 3,
+	},
+};
+
+struct test_result {
+	struct test_key		got[TEST_MAX_KEYS * 2];
+	unsigned int		nr;
+};
+
+static int collect(const struct bkey *k, uint64_t start, uint64_t end,
+		   void *arg)
+{
+	struct test_result *r = arg;
+
+	if (r->nr == sizeof(r->got) / sizeof(r->got[0]))
+		return -1;
+	r->got[r->nr++] = (struct test_key) {
+		start, end, PTR_OFFSET(k, 0)
+	};
+	return 0;
+}
+
+/* A cache device whose journal is one jset with the keys of t */
+static int write_cache(int fd, const struct test_case *t)
+{
+	struct cache_sb_disk sb_disk;
+	struct cache_sb sb;
+	struct jset *j;
+	uint64_t *d;
+	unsigned int i;
+	int ret = -1;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.offset = SB_SECTOR;
+	sb.version = BCACHE_SB_VERSION_CDEV_WITH_UUID;
+	memcpy(sb.magic, bcache_magic, 16);
+	memset(sb.set_uuid, 0x5a, sizeof(sb.set_uuid));
+	sb.block_size = 1;
+	sb.bucket_size = TEST_BUCKET;
+	sb.nbuckets = TEST_NBUCKETS;
+	sb.nr_in_set = 1;
+	sb.first_bucket = 1;
+	sb.njournal_buckets = 1;
+	sb.d[0] = TEST_JOURNAL;
+
+	memset(&sb_disk, 0, sizeof(sb_disk));
+	to_cache_sb_disk(&sb_disk, &sb);
+	sb_disk.csum = cpu_to_le64(csum_set(&sb_disk));
+
+	j = calloc(1, TEST_BUCKET << 9);
+	if (!j)
+		return -1;
+	j->magic = jset_magic(&sb);
+	j->seq = 1;
+	j->last_seq = 1;
+	j->version = BCACHE_JSET_VERSION;
+	for (i = 0, d = j->d; i < t->nr_keys; i++) {
+		struct bkey *k = (struct bkey *) d;
+
+		SET_KEY_PTRS(k, 1);
+		SET_KEY_DIRTY(k, 1);
+		SET_KEY_INODE(k, 1);
+		SET_KEY_SIZE(k, t->keys[i].end - t->keys[i].start);
+		k->low = t->keys[i].end;
+		k->ptr[0] = t->keys[i].cache << 8;
+		d = (uint64_t *) bkey_next(k);
+	}
+	j->keys = d - j->d;
+	j->csum = csum_set(j);
+
+	if (ftruncate(fd, (uint64_t) TEST_NBUCKETS * TEST_BUCKET << 9) ||
+	    pwrite(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk) ||
+	    pwrite(fd, j, set_bytes(j), TEST_JOURNAL * TEST_BUCKET << 9) !=
+	    (ssize_t) set_bytes(j))
+		perror("Can't write the test cache");
+	else
+		ret = 0;
+	free(j);
+	return ret;
+}
+
+static bool run_case(const char *path, const struct test_case *t)
+{
+	struct test_result r = { .nr = 0 };
+	struct cache_dev c;
+	unsigned int i;
+	bool ok;
+	int fd;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 || write_cache(fd, t)) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	close(fd);
+
+	ok = !cache_open(&c, path) && !cache_read_journal(&c) &&
+		!cache_journal_extents(&c, collect, &r);
+	cache_close(&c);
+
+	ok = ok && r.nr == t->nr_want;
+	for (i = 0; ok && i < r.nr; i++)
+		ok = !memcmp(&r.got[i], &t->want[i], sizeof(r.got[i]));
+
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", t->name);
+	for (i = 0; !ok && i < r.nr; i++)
+		printf("	got [%ju, %ju) at %ju\n", (uintmax_t) r.got[i].start,
+		       (uintmax_t) r.got[i].end, (uintmax_t) r.got[i].cache);
+	return ok;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/btree-test.XXXXXX";
+	unsigned int i, failed = 0;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		if (!run_case(path, &cases[i]))
+			failed++;
+
+	unlink(path);
+	return failed ? 1 : 0;
+}
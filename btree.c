@@ -0,0 +1,902 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Offline reader of a cache device: the journal, bucket generations, the
+ * uuid index and the btree, each verified against its checksum the way
+ * the kernel does when it registers the cache.
+ *
+ * Everything is read with large sequential preads. The journal buckets
+ * are read in the order of the super block, usually one contiguous range.
+ * The btree is walked a level at a time, every level in ascending device
+ * order with the following nodes prefetched, so each level is one sweep
+ * across the device instead of a seek per node.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+#include "btree.h"
+
+/* Nodes of a level the kernel is asked to read ahead of the walk */
+#define BTREE_READAHEAD		32
+
+static int read_at(struct cache_dev *c, void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(c->fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static inline uint64_t round_up_to(uint64_t v, uint64_t to)
+{
+	return (v + to - 1) / to * to;
+}
+
+int cache_open(struct cache_dev *c, const char *path)
+{
+	struct cache_sb_disk sb_disk;
+
+	memset(c, 0, sizeof(*c));
+	c->path = path;
+	c->fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (c->fd < 0) {
+		fprintf(stderr, "Can't open %s: %m\n", path);
+		return -1;
+	}
+
+	if (read_at(c, &sb_disk, sizeof(sb_disk), SB_START)) {
+		fprintf(stderr, "Can't read the super block of %s\n", path);
+		goto err;
+	}
+	if (memcmp(sb_disk.magic, bcache_magic, 16)) {
+		fprintf(stderr, "%s is not a bcache device\n", path);
+		goto err;
+	}
+	if (!sb_csum_ok(&sb_disk)) {
+		fprintf(stderr, "Bad super block checksum on %s\n", path);
+		goto err;
+	}
+
+	to_cache_sb(&c->sb, &sb_disk);
+	if (!SB_VERSION_IS_CDEV(c->sb.version)) {
+		fprintf(stderr, "%s is not a cache device\n", path);
+		goto err;
+	}
+
+	c->block_bytes = c->sb.block_size << 9;
+	c->bucket_bytes = c->sb.bucket_size << 9;
+	if (!c->block_bytes || !c->bucket_bytes ||
+	    c->bucket_bytes % c->block_bytes ||
+	    c->sb.njournal_buckets > SB_JOURNAL_BUCKETS ||
+	    c->sb.nr_this_dev >= MAX_CACHES_PER_SET) {
+		fprintf(stderr, "Bad geometry in the super block of %s\n", path);
+		goto err;
+	}
+
+	posix_fadvise(c->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return 0;
+err:
+	close(c->fd);
+	c->fd = -1;
+	return -1;
+}
+
+void cache_close(struct cache_dev *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	free(c->jset);
+	free(c->journal);
+	free(c->gens);
+	free(c->uuids);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static int journal_cmp(const void *l, const void *r)
+{
+	const struct journal_entry *a = l, *b = r;
+
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/*
+ * Every journal bucket holds a run of jsets, each starting on a block.
+ * Like the kernel, a bucket is only read up to the first entry with a bad
+ * magic or checksum; entries older than the newest last_seq are kept too,
+ * cache_journal_replay() skips them.
+ */
+int cache_read_journal(struct cache_dev *c)
+{
+	struct journal_entry *e, *new;
+	unsigned int i, nr = 0, size = 0;
+	uint64_t start, off;
+	struct jset *j;
+	size_t bytes;
+	void *buf;
+
+	buf = malloc(c->bucket_bytes);
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	e = NULL;
+
+	for (i = 0; i < c->sb.njournal_buckets; i++) {
+		start = c->sb.d[i] * c->bucket_bytes;
+		if (c->sb.d[i] >= c->sb.nbuckets ||
+		    read_at(c, buf, c->bucket_bytes, start)) {
+			c->err.journal_io++;
+			continue;
+		}
+
+		for (off = 0; off + sizeof(*j) <= c->bucket_bytes;
+		     off += round_up_to(bytes, c->block_bytes)) {
+			j = buf + off;
+			if (j->magic != jset_magic(&c->sb))
+				break;
+			bytes = set_bytes(j);
+			if (bytes > c->bucket_bytes - off)
+				break;
+			if (j->csum != csum_set(j)) {
+				c->err.journal_csum++;
+				break;
+			}
+
+			if (nr == size) {
+				size = size ? size * 2 : 64;
+				new = realloc(e, size * sizeof(*e));
+				if (!new) {
+					fprintf(stderr, "Out of memory\n");
+					goto err;
+				}
+				e = new;
+			}
+			e[nr++] = (struct journal_entry) {
+				.seq		= j->seq,
+				.last_seq	= j->last_seq,
+				.offset		= start + off,
+				.bytes		= bytes,
+				.keys		= j->keys,
+			};
+		}
+	}
+
+	if (!nr) {
+		fprintf(stderr, "No valid journal entries on %s\n", c->path);
+		goto err;
+	}
+	qsort(e, nr, sizeof(*e), journal_cmp);
+
+	c->jset = malloc(e[nr - 1].bytes);
+	if (!c->jset ||
+	    read_at(c, c->jset, e[nr - 1].bytes, e[nr - 1].offset)) {
+		fprintf(stderr, "Can't read the newest journal entry\n");
+		goto err;
+	}
+
+	free(buf);
+	c->journal = e;
+	c->nr_journal = nr;
+	return 0;
+err:
+	free(c->jset);
+	c->jset = NULL;
+	free(e);
+	free(buf);
+	return -1;
+}
+
+/* The entries since the newest last_seq, oldest first, as a replay sees them */
+int cache_journal_replay(struct cache_dev *c, jset_fn fn, void *arg)
+{
+	struct jset *j;
+	unsigned int i;
+	int ret = 0;
+
+	if (!c->jset)
+		return -1;
+
+	j = malloc(c->bucket_bytes);
+	if (!j)
+		return -1;
+
+	for (i = 0; i < c->nr_journal && !ret; i++) {
+		if (c->journal[i].seq < c->jset->last_seq ||
+		    (i && c->journal[i].seq == c->journal[i - 1].seq))
+			continue;
+		if (read_at(c, j, c->journal[i].bytes, c->journal[i].offset)) {
+			c->err.journal_io++;
+			continue;
+		}
+		ret = fn(c, j, arg);
+	}
+
+	free(j);
+	return ret;
+}
+
+/*
+ * Bucket generations, without which stale pointers can't be told from live
+ * ones. The prio_sets are a chain of buckets from the journal's
+ * prio_bucket, covering every bucket of the device in order.
+ */
+int cache_read_prios(struct cache_dev *c)
+{
+	unsigned int per = (c->bucket_bytes - sizeof(struct prio_set)) /
+		sizeof(struct bucket_disk);
+	uint64_t b = 0, bucket, i;
+	struct prio_set *p;
+
+	if (!c->jset)
+		return -1;
+
+	c->gens = calloc(c->sb.nbuckets ? c->sb.nbuckets : 1, 1);
+	p = malloc(c->bucket_bytes);
+	if (!c->gens || !p) {
+		fprintf(stderr, "Out of memory\n");
+		goto err;
+	}
+
+	bucket = c->jset->prio_bucket[c->sb.nr_this_dev];
+	while (b < c->sb.nbuckets) {
+		if (bucket >= c->sb.nbuckets ||
+		    read_at(c, p, c->bucket_bytes, bucket * c->bucket_bytes)) {
+			fprintf(stderr, "Can't read priorities at bucket %ju\n",
+				(uintmax_t) bucket);
+			goto err;
+		}
+		if (p->csum != crc64(&p->magic, c->bucket_bytes - 8))
+			c->err.prio_csum++;
+		if (p->magic != pset_magic(&c->sb)) {
+			c->err.prio_magic++;
+			fprintf(stderr, "Bad priorities magic at bucket %ju\n",
+				(uintmax_t) bucket);
+			goto err;
+		}
+
+		for (i = 0; i < per && b < c->sb.nbuckets; i++, b++)
+			c->gens[b] = p->data[i].gen;
+		bucket = p->next_bucket;
+	}
+
+	free(p);
+	return 0;
+err:
+	free(p);
+	free(c->gens);
+	c->gens = NULL;
+	return -1;
+}
+
+/* The uuid index, KEY_INODE of a key is the position in it */
+int cache_read_uuids(struct cache_dev *c)
+{
+	struct bkey *k = &c->jset->uuid_bucket;
+	size_t bytes;
+
+	if (!KEY_PTRS(k)) {
+		fprintf(stderr, "No uuid bucket in the journal\n");
+		return -1;
+	}
+	if (c->jset->version < BCACHE_JSET_VERSION_UUIDv1) {
+		fprintf(stderr, "Old uuid format isn't supported\n");
+		return -1;
+	}
+
+	bytes = KEY_SIZE(k) ? KEY_SIZE(k) << 9 : c->bucket_bytes;
+	c->uuids = malloc(bytes);
+	if (!c->uuids ||
+	    read_at(c, c->uuids, bytes, PTR_OFFSET(k, 0) << 9)) {
+		fprintf(stderr, "Can't read the uuid bucket\n");
+		free(c->uuids);
+		c->uuids = NULL;
+		return -1;
+	}
+	c->nr_uuids = bytes / sizeof(struct uuid_entry);
+	return 0;
+}
+
+/* The inode of the backing device in the cache set, and where its data is */
+int cache_find_backing(struct cache_dev *c, int fd, const char *path,
+		       uint64_t *inode, uint64_t *data_offset)
+{
+	struct cache_sb_disk sb_disk;
+	struct cache_sb sb;
+	char uuid[40];
+	unsigned int i;
+
+	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) !=
+	    sizeof(sb_disk) || memcmp(sb_disk.magic, bcache_magic, 16) ||
+	    !sb_csum_ok(&sb_disk)) {
+		fprintf(stderr, "%s has no valid bcache super block\n", path);
+		return -1;
+	}
+	to_cache_sb(&sb, &sb_disk);
+	if (sb.version != BCACHE_SB_VERSION_BDEV &&
+	    sb.version != BCACHE_SB_VERSION_BDEV_WITH_OFFSET &&
+	    sb.version != BCACHE_SB_VERSION_BDEV_WITH_FEATURES) {
+		fprintf(stderr, "%s is not a backing device\n", path);
+		return -1;
+	}
+	if (memcmp(sb.set_uuid, c->sb.set_uuid, 16)) {
+		fprintf(stderr, "%s is not attached to the set of %s\n",
+			path, c->path);
+		return -1;
+	}
+
+	*data_offset = sb.version == BCACHE_SB_VERSION_BDEV ?
+		BDEV_DATA_START_DEFAULT : sb.data_offset;
+
+	for (i = 0; i < c->nr_uuids; i++)
+		if (!memcmp(c->uuids[i].uuid, sb.uuid, 16) &&
+		    !(c->uuids[i].flags & UUID_FLASH_ONLY)) {
+			*inode = i;
+			return 0;
+		}
+
+	uuid_unparse(sb.uuid, uuid);
+	fprintf(stderr, "%s (%s) is not in the uuids of the cache set\n",
+		path, uuid);
+	return -1;
+}
+
+/* Without generations every pointer is taken to be live */
+bool ptr_stale(struct cache_dev *c, const struct bkey *k, unsigned int i)
+{
+	uint64_t bucket = PTR_OFFSET(k, i) / c->sb.bucket_size;
+
+	if (bucket >= c->sb.nbuckets)
+		return true;
+	return c->gens && c->gens[bucket] != PTR_GEN(k, i);
+}
+
+/* Like the kernel's bch_extent_bad(), for the pointers into this cache */
+bool extent_bad(struct cache_dev *c, const struct bkey *k)
+{
+	unsigned int i;
+
+	if (!KEY_PTRS(k) || !KEY_SIZE(k) || KEY_SIZE(k) > KEY_OFFSET(k))
+		return true;
+
+	for (i = 0; i < KEY_PTRS(k); i++)
+		if (PTR_DEV(k, i) == c->sb.nr_this_dev && ptr_stale(c, k, i))
+			return true;
+	return false;
+}
+
+/* A child in the level below the one being walked */
+struct node_ptr {
+	uint64_t		offset;		/* sectors */
+	unsigned int		sectors;
+	uint64_t		ptr;
+};
+
+struct node_list {
+	struct node_ptr		*p;
+	size_t			nr;
+	size_t			size;
+};
+
+static int node_cmp(const void *l, const void *r)
+{
+	const struct node_ptr *a = l, *b = r;
+
+	return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static int node_add(struct node_list *l, struct node_ptr p)
+{
+	struct node_ptr *new;
+
+	if (l->nr == l->size) {
+		l->size = l->size ? l->size * 2 : 256;
+		new = realloc(l->p, l->size * sizeof(*new));
+		if (!new) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		l->p = new;
+	}
+	l->p[l->nr++] = p;
+	return 0;
+}
+
+/* The pointer of a btree key into this cache, as a node to read */
+static int child_ptr(struct cache_dev *c, const struct bkey *k,
+		     struct node_ptr *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < KEY_PTRS(k); i++)
+		if (PTR_DEV(k, i) == c->sb.nr_this_dev)
+			break;
+	if (i == KEY_PTRS(k) || ptr_stale(c, k, i))
+		return -1;
+
+	p->offset = PTR_OFFSET(k, i);
+	p->sectors = KEY_SIZE(k);
+	p->ptr = k->ptr[i];
+	if (!p->sectors || p->sectors > c->sb.bucket_size ||
+	    (p->sectors << 9) % c->block_bytes) {
+		c->err.bad_keys++;
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t bset_csum(const struct node_ptr *p, struct bset *i)
+{
+	void *data = (void *) i + 8;
+
+	if (!i->version)
+		return csum_set(i);
+	/* Version 1 seeds the checksum with the pointer to the node */
+	return crc64_seed(p->ptr, data, (void *) bset_bkey_last(i) - data);
+}
+
+/*
+ * The bsets of a node: the first one, and those after it written with the
+ * same seq. A bad checksum ends the node, like the kernel's read does.
+ */
+static int read_node(struct cache_dev *c, const struct node_ptr *p,
+		     void *buf, struct btree_node *b)
+{
+	size_t bytes = (size_t) p->sectors << 9, off, len;
+	struct bset *i;
+
+	if (read_at(c, buf, bytes, p->offset << 9)) {
+		c->err.btree_io++;
+		return -1;
+	}
+
+	b->offset = p->offset;
+	b->sectors = p->sectors;
+	b->ptr = p->ptr;
+	b->nr_bsets = 0;
+
+	for (off = 0; off + sizeof(*i) <= bytes;
+	     off += round_up_to(len, c->block_bytes)) {
+		i = buf + off;
+		if (off && i->seq != b->seq)
+			break;
+		len = set_bytes(i);
+		if (i->magic != bset_magic(&c->sb) || len > bytes - off) {
+			c->err.btree_magic++;
+			break;
+		}
+		if (i->csum != bset_csum(p, i)) {
+			c->err.btree_csum++;
+			break;
+		}
+		if (!off)
+			b->seq = i->seq;
+		b->bsets[b->nr_bsets++] = i;
+	}
+
+	c->btree_nodes++;
+	c->btree_bytes += bytes;
+	return b->nr_bsets ? 0 : -1;
+}
+
+/*
+ * Calls fn for every node that could be read, parents before their
+ * children. A nonzero return of fn ends the walk and is returned.
+ */
+int cache_walk_btree(struct cache_dev *c, btree_node_fn fn, void *arg)
+{
+	struct node_list cur = { 0 }, next = { 0 }, tmp;
+	struct btree_node b = { 0 };
+	struct node_ptr p;
+	struct bkey *k;
+	unsigned int level, i;
+	size_t n, ra;
+	void *buf = NULL;
+	int ret = -1;
+
+	if (!c->jset)
+		return -1;
+
+	level = c->jset->btree_level;
+	if (child_ptr(c, &c->jset->btree_root, &p)) {
+		fprintf(stderr, "Bad btree root in the journal\n");
+		return -1;
+	}
+	if (node_add(&cur, p))
+		return -1;
+
+	buf = malloc(c->bucket_bytes);
+	b.bsets = calloc(c->bucket_bytes / c->block_bytes, sizeof(*b.bsets));
+	if (!buf || !b.bsets) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	while (1) {
+		qsort(cur.p, cur.nr, sizeof(*cur.p), node_cmp);
+
+		for (n = 0, ra = 0; n < cur.nr; n++) {
+			/* Without generations old pointers can repeat */
+			if (n && cur.p[n].offset == cur.p[n - 1].offset)
+				continue;
+
+			for (; ra < cur.nr && ra < n + BTREE_READAHEAD; ra++)
+				posix_fadvise(c->fd, cur.p[ra].offset << 9,
+					      (off_t) cur.p[ra].sectors << 9,
+					      POSIX_FADV_WILLNEED);
+
+			b.level = level;
+			if (read_node(c, &cur.p[n], buf, &b))
+				continue;
+
+			ret = fn(c, &b, arg);
+			if (ret)
+				goto out;
+
+			for (i = 0; level && i < b.nr_bsets; i++)
+				for_each_set_key(k, b.bsets[i])
+					if (!child_ptr(c, k, &p) &&
+					    node_add(&next, p))
+						goto err;
+		}
+
+		if (!level--)
+			break;
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		next.nr = 0;
+	}
+	ret = 0;
+	goto out;
+err:
+	ret = -1;
+out:
+	free(cur.p);
+	free(next.p);
+	free(b.bsets);
+	free(buf);
+	return ret;
+}
+
+/* Key ranges of a leaf node, ordered by inode and offset */
+struct range {
+	uint64_t		inode;
+	uint64_t		start;
+	uint64_t		end;
+};
+
+struct piece {
+	const struct bkey	*k;
+	uint64_t		start;
+	uint64_t		end;
+};
+
+static int key_cmp(const void *l, const void *r)
+{
+	const struct bkey *a = *(const struct bkey **) l;
+	const struct bkey *b = *(const struct bkey **) r;
+
+	if (KEY_INODE(a) != KEY_INODE(b))
+		return KEY_INODE(a) < KEY_INODE(b) ? -1 : 1;
+	return KEY_START(a) < KEY_START(b) ? -1 : KEY_START(a) > KEY_START(b);
+}
+
+static int piece_cmp(const void *l, const void *r)
+{
+	const struct piece *a = l, *b = r;
+
+	if (KEY_INODE(a->k) != KEY_INODE(b->k))
+		return KEY_INODE(a->k) < KEY_INODE(b->k) ? -1 : 1;
+	return a->start < b->start ? -1 : a->start > b->start;
+}
+
+static inline bool range_before(const struct range *r, uint64_t inode,
+				uint64_t start)
+{
+	return r->inode < inode || (r->inode == inode && r->end <= start);
+}
+
+/* Merges the sorted ranges of keys into the sorted cover, into out */
+static size_t cover_merge(const struct range *cover, size_t nr_cover,
+			  struct bkey **keys, size_t nr_keys, struct range *out)
+{
+	size_t a = 0, b = 0, nr = 0;
+	struct range r;
+
+	while (a < nr_cover || b < nr_keys) {
+		if (b == nr_keys ||
+		    (a < nr_cover &&
+		     (cover[a].inode < KEY_INODE(keys[b]) ||
+		      (cover[a].inode == KEY_INODE(keys[b]) &&
+		       cover[a].start <= KEY_START(keys[b]))))) {
+			r = cover[a++];
+		} else {
+			r.inode = KEY_INODE(keys[b]);
+			r.start = KEY_START(keys[b]);
+			r.end = KEY_OFFSET(keys[b]);
+			b++;
+		}
+
+		if (nr && out[nr - 1].inode == r.inode &&
+		    out[nr - 1].end >= r.start) {
+			if (r.end > out[nr - 1].end)
+				out[nr - 1].end = r.end;
+		} else {
+			out[nr++] = r;
+		}
+	}
+	return nr;
+}
+
+/* The keys of a bset or jset, oldest set first */
+struct key_set {
+	struct bkey		*start;
+	struct bkey		*end;
+};
+
+#define for_each_key(k, set)						\
+	for (k = (set)->start;						\
+	     k < (set)->end && bkey_next(k) <= (set)->end;		\
+	     k = bkey_next(k))
+
+/* What is visible so far while the sets are walked from the newest */
+struct visible {
+	struct range		*cover;
+	struct range		*merged;
+	size_t			nr_cover;
+	struct piece		*pieces;
+	size_t			nr;
+	size_t			size;
+};
+
+static int add_piece(struct visible *v, const struct bkey *k, uint64_t start,
+		     uint64_t end)
+{
+	struct piece *np;
+
+	if (v->nr == v->size) {
+		v->size = v->size ? v->size * 2 : 256;
+		np = realloc(v->pieces, v->size * sizeof(*np));
+		if (!np) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		v->pieces = np;
+	}
+	v->pieces[v->nr++] = (struct piece) { k, start, end };
+	return 0;
+}
+
+/*
+ * Adds the parts of keys that no newer key covers, then covers keys too.
+ * keys are sorted and don't overlap each other.
+ */
+static int keys_extents(struct cache_dev *c, struct visible *v,
+			struct bkey **keys, size_t m)
+{
+	struct range *cover = v->cover, *tmp;
+	size_t nr_cover = v->nr_cover, j, jj, n;
+	uint64_t s, e, pos, ino, hole;
+	struct bkey *k;
+
+	for (n = 0, j = 0; n < m; n++) {
+		k = keys[n];
+		ino = KEY_INODE(k);
+		s = KEY_START(k);
+		e = KEY_OFFSET(k);
+
+		while (j < nr_cover && range_before(&cover[j], ino, s))
+			j++;
+		if (extent_bad(c, k))
+			continue;
+
+		for (pos = s, jj = j; pos < e; jj++) {
+			hole = e;
+			if (jj < nr_cover && cover[jj].inode == ino &&
+			    cover[jj].start < e)
+				hole = cover[jj].start > pos ?
+					cover[jj].start : pos;
+
+			if (hole > pos && add_piece(v, k, pos, hole))
+				return -1;
+			if (hole == e)
+				break;
+			pos = cover[jj].end;
+		}
+	}
+
+	v->nr_cover = cover_merge(cover, nr_cover, keys, m, v->merged);
+	tmp = v->cover;
+	v->cover = v->merged;
+	v->merged = tmp;
+	return 0;
+}
+
+/* The keys of a set worth looking at, in the order of the set */
+static size_t set_keys(struct cache_dev *c, struct key_set *set,
+		       struct bkey **keys)
+{
+	struct bkey *k;
+	size_t m = 0;
+
+	for_each_key(k, set) {
+		if (!KEY_SIZE(k))
+			continue;
+		if (KEY_SIZE(k) > KEY_OFFSET(k)) {
+			c->err.bad_keys++;
+			continue;
+		}
+		keys[m++] = k;
+	}
+	return m;
+}
+
+static bool keys_overlap(struct bkey **keys, size_t m)
+{
+	uint64_t end = 0;
+	size_t n;
+
+	for (n = 0; n < m; n++) {
+		if (n && KEY_INODE(keys[n]) != KEY_INODE(keys[n - 1]))
+			end = 0;
+		if (KEY_START(keys[n]) < end)
+			return true;
+		if (KEY_OFFSET(keys[n]) > end)
+			end = KEY_OFFSET(keys[n]);
+	}
+	return false;
+}
+
+/*
+ * The extents of a series of sets that are still visible, in key order.
+ * On disk the older bsets of a node keep the keys that newer ones
+ * overwrote, and the journal keeps every insert, so the sets are walked
+ * from the newest on and only the parts not covered by a newer key
+ * survive. Deleted and stale keys still hide what is below them, but
+ * aren't passed to fn.
+ *
+ * The keys of one jset can overlap each other too. The replay inserts
+ * them in order, so there the later key wins: such a set is walked a key
+ * at a time from its last one.
+ */
+static int sets_extents(struct cache_dev *c, struct key_set *sets,
+			unsigned int nr_sets, btree_extent_fn fn, void *arg)
+{
+	struct visible v = { 0 };
+	struct bkey **keys = NULL, **order = NULL, *k;
+	size_t nr_keys = 0, m, n;
+	int bi, ret = -1;
+
+	for (bi = 0; bi < (int) nr_sets; bi++)
+		for_each_key(k, &sets[bi])
+			nr_keys++;
+
+	keys = malloc((nr_keys + 1) * sizeof(*keys));
+	order = malloc((nr_keys + 1) * sizeof(*order));
+	v.cover = malloc((nr_keys + 1) * sizeof(*v.cover));
+	v.merged = malloc((nr_keys + 1) * sizeof(*v.merged));
+	if (!keys || !order || !v.cover || !v.merged) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	for (bi = nr_sets - 1; bi >= 0; bi--) {
+		m = set_keys(c, &sets[bi], order);
+		memcpy(keys, order, m * sizeof(*keys));
+		qsort(keys, m, sizeof(*keys), key_cmp);
+
+		if (!keys_overlap(keys, m)) {
+			if (keys_extents(c, &v, keys, m))
+				goto out;
+			continue;
+		}
+
+		for (n = m; n-- > 0;)
+			if (keys_extents(c, &v, &order[n], 1))
+				goto out;
+	}
+
+	qsort(v.pieces, v.nr, sizeof(*v.pieces), piece_cmp);
+	for (n = 0, ret = 0; n < v.nr && !ret; n++)
+		ret = fn(v.pieces[n].k, v.pieces[n].start, v.pieces[n].end, arg);
+out:
+	free(v.pieces);
+	free(v.merged);
+	free(v.cover);
+	free(order);
+	free(keys);
+	return ret;
+}
+
+int btree_node_extents(struct cache_dev *c, struct btree_node *b,
+		       btree_extent_fn fn, void *arg)
+{
+	struct key_set *sets;
+	unsigned int i;
+	int ret;
+
+	sets = malloc((b->nr_bsets + 1) * sizeof(*sets));
+	if (!sets) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < b->nr_bsets; i++) {
+		sets[i].start = b->bsets[i]->start;
+		sets[i].end = bset_bkey_last(b->bsets[i]);
+	}
+
+	ret = sets_extents(c, sets, b->nr_bsets, fn, arg);
+	free(sets);
+	return ret;
+}
+
+struct journal_keys {
+	struct key_set		*sets;
+	unsigned int		nr;
+};
+
+static int journal_keys_add(struct cache_dev *c, struct jset *j, void *arg)
+{
+	struct journal_keys *jk = arg;
+	struct key_set *set = &jk->sets[jk->nr];
+	size_t bytes = (void *) bset_bkey_last(j) - (void *) j->start;
+
+	set->start = malloc(bytes + 1);
+	if (!set->start) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	memcpy(set->start, j->start, bytes);
+	set->end = (void *) set->start + bytes;
+	jk->nr++;
+	return 0;
+}
+
+/*
+ * The extents the journal replay would insert, as they'd be on top of
+ * the btree once it's replayed. Only as big as the journal since last_seq.
+ */
+int cache_journal_extents(struct cache_dev *c, btree_extent_fn fn, void *arg)
+{
+	struct journal_keys jk = { 0 };
+	unsigned int i;
+	int ret;
+
+	jk.sets = calloc(c->nr_journal + 1, sizeof(*jk.sets));
+	if (!jk.sets) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	ret = cache_journal_replay(c, journal_keys_add, &jk);
+	if (!ret)
+		ret = sets_extents(c, jk.sets, jk.nr, fn, arg);
+
+	for (i = 0; i < jk.nr; i++)
+		free(jk.sets[i].start);
+	free(jk.sets);
+	return ret;
+}
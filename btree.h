@@ -0,0 +1,265 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHE_BTREE_H
+#define _BCACHE_BTREE_H
+
+/*
+ * On disk format of the journal, btree nodes, bucket priorities and uuids
+ * of a cache device, as in the kernel's include/uapi/linux/bcache.h. The
+ * kernel writes these in CPU byte order, unlike the super block.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bcache.h"
+
+struct bkey {
+	uint64_t		high;
+	uint64_t		low;
+	uint64_t		ptr[];
+};
+
+#define KEY_FIELD(name, field, offset, size)				\
+	BITMASK(name, struct bkey, field, offset, size)
+
+#define PTR_FIELD(name, offset, size)					\
+static inline uint64_t name(const struct bkey *k, unsigned int i)	\
+{ return (k->ptr[i] >> offset) & ~(~0ULL << size); }
+
+#define KEY_SIZE_BITS		16
+#define KEY_MAX_U64S		8
+
+KEY_FIELD(KEY_PTRS,	high, 60, 3)
+KEY_FIELD(HEADER_SIZE,	high, 58, 2)
+KEY_FIELD(KEY_CSUM,	high, 56, 2)
+KEY_FIELD(KEY_PINNED,	high, 55, 1)
+KEY_FIELD(KEY_DIRTY,	high, 36, 1)
+KEY_FIELD(KEY_SIZE,	high, 20, KEY_SIZE_BITS)
+KEY_FIELD(KEY_INODE,	high, 0,  20)
+
+/* Extents end at KEY_OFFSET, in sectors of the backing device */
+static inline uint64_t KEY_OFFSET(const struct bkey *k)
+{
+	return k->low;
+}
+
+static inline uint64_t KEY_START(const struct bkey *k)
+{
+	return KEY_OFFSET(k) - KEY_SIZE(k);
+}
+
+#define PTR_DEV_BITS		12
+
+PTR_FIELD(PTR_DEV,	51, PTR_DEV_BITS)
+PTR_FIELD(PTR_OFFSET,	8,  43)
+PTR_FIELD(PTR_GEN,	0,  8)
+
+#define PTR_CHECK_DEV		((1 << PTR_DEV_BITS) - 1)
+
+static inline unsigned int bkey_u64s(const struct bkey *k)
+{
+	return 2 + KEY_PTRS(k);
+}
+
+static inline struct bkey *bkey_next(const struct bkey *k)
+{
+	return (struct bkey *) ((uint64_t *) k + bkey_u64s(k));
+}
+
+/* A key with room for its pointers */
+#define BKEY_PAD		8
+
+#define BKEY_PADDED(key)						\
+	union { struct bkey key; uint64_t key ## _pad[BKEY_PAD]; }
+
+#define JSET_MAGIC		0x245235c1a3625032ULL
+#define PSET_MAGIC		0x6750e15f87337f91ULL
+#define BSET_MAGIC		0x90135c78b99e07f5ULL
+
+static inline uint64_t jset_magic(const struct cache_sb *sb)
+{
+	return sb->set_magic ^ JSET_MAGIC;
+}
+
+static inline uint64_t pset_magic(const struct cache_sb *sb)
+{
+	return sb->set_magic ^ PSET_MAGIC;
+}
+
+static inline uint64_t bset_magic(const struct cache_sb *sb)
+{
+	return sb->set_magic ^ BSET_MAGIC;
+}
+
+#define BCACHE_JSET_VERSION_UUIDv1	1
+#define BCACHE_JSET_VERSION_UUID	1
+#define BCACHE_JSET_VERSION		1
+
+#define MAX_CACHES_PER_SET	8
+
+/* One journal write, the keys follow it */
+struct jset {
+	uint64_t		csum;
+	uint64_t		magic;
+	uint64_t		seq;
+	uint32_t		version;
+	uint32_t		keys;		/* u64s */
+
+	uint64_t		last_seq;
+
+	BKEY_PADDED(uuid_bucket);
+	BKEY_PADDED(btree_root);
+	uint16_t		btree_level;
+	uint16_t		pad[3];
+
+	uint64_t		prio_bucket[MAX_CACHES_PER_SET];
+
+	union {
+		struct bkey	start[0];
+		uint64_t	d[0];
+	};
+};
+
+/* Bucket priorities and generations, a chain of buckets */
+struct prio_set {
+	uint64_t		csum;
+	uint64_t		magic;
+	uint64_t		seq;
+	uint32_t		version;
+	uint32_t		pad;
+
+	uint64_t		next_bucket;
+
+	struct bucket_disk {
+		uint16_t	prio;
+		uint8_t		gen;
+	} __attribute((packed)) data[];
+};
+
+#define UUID_FLASH_ONLY		1U
+
+/* Index KEY_INODE of the btree, one per attached device */
+struct uuid_entry {
+	union {
+		struct {
+			uint8_t		uuid[16];
+			uint8_t		label[32];
+			uint32_t	first_reg;
+			uint32_t	last_reg;
+			uint32_t	invalidated;
+			uint32_t	flags;
+			uint64_t	sectors;	/* flash only devices */
+		};
+		uint8_t		pad[128];
+	};
+};
+
+#define BCACHE_BSET_CSUM	1
+#define BCACHE_BSET_VERSION	1
+
+/* A btree node is a series of bsets with the seq of the first */
+struct bset {
+	uint64_t		csum;
+	uint64_t		magic;
+	uint64_t		seq;
+	uint32_t		version;
+	uint32_t		keys;		/* u64s */
+
+	union {
+		struct bkey	start[0];
+		uint64_t	d[0];
+	};
+};
+
+/* Bytes, rounded up to whole blocks when it's written */
+#define set_bytes(i)		(sizeof(*(i)) + (i)->keys * sizeof(uint64_t))
+
+#define bset_bkey_last(i)	((struct bkey *) ((i)->d + (i)->keys))
+
+/* Keys of a jset or bset, stops short of a key that runs past the end */
+#define for_each_set_key(k, i)						\
+	for (k = (i)->start;						\
+	     k < bset_bkey_last(i) && bkey_next(k) <= bset_bkey_last(i);	\
+	     k = bkey_next(k))
+
+/*
+ * Offline reader of a cache device that isn't registered, see btree.c.
+ * Nothing is written to the device.
+ */
+
+/* Where a valid journal entry was found */
+struct journal_entry {
+	uint64_t		seq;
+	uint64_t		last_seq;
+	uint64_t		offset;		/* bytes */
+	uint32_t		bytes;
+	uint32_t		keys;
+};
+
+/* Everything that failed verification, none of it is fatal */
+struct cache_errors {
+	unsigned int		journal_io;
+	unsigned int		journal_csum;
+	unsigned int		prio_csum;
+	unsigned int		prio_magic;
+	unsigned int		btree_io;
+	unsigned int		btree_magic;
+	unsigned int		btree_csum;
+	unsigned int		bad_keys;
+};
+
+struct cache_dev {
+	int			fd;
+	const char		*path;
+	struct cache_sb		sb;
+	unsigned int		block_bytes;
+	unsigned int		bucket_bytes;
+
+	struct jset		*jset;		/* newest journal entry */
+	struct journal_entry	*journal;	/* all valid ones, by seq */
+	unsigned int		nr_journal;
+
+	uint8_t			*gens;		/* per bucket, from the prios */
+	struct uuid_entry	*uuids;
+	unsigned int		nr_uuids;
+
+	struct cache_errors	err;
+
+	/* Read during the btree walk */
+	uint64_t		btree_nodes;
+	uint64_t		btree_bytes;
+};
+
+/* A btree node as read from disk, bsets in the order they were written */
+struct btree_node {
+	unsigned int		level;
+	uint64_t		offset;		/* sectors */
+	unsigned int		sectors;
+	uint64_t		ptr;		/* pointer in the parent */
+	uint64_t		seq;
+	struct bset		**bsets;
+	unsigned int		nr_bsets;
+};
+
+typedef int (*jset_fn)(struct cache_dev *c, struct jset *j, void *arg);
+typedef int (*btree_node_fn)(struct cache_dev *c, struct btree_node *b,
+			     void *arg);
+typedef int (*btree_extent_fn)(const struct bkey *k, uint64_t start,
+			       uint64_t end, void *arg);
+
+int cache_open(struct cache_dev *c, const char *path);
+void cache_close(struct cache_dev *c);
+int cache_read_journal(struct cache_dev *c);
+int cache_read_prios(struct cache_dev *c);
+int cache_read_uuids(struct cache_dev *c);
+int cache_find_backing(struct cache_dev *c, int fd, const char *path,
+		       uint64_t *inode, uint64_t *data_offset);
+int cache_journal_replay(struct cache_dev *c, jset_fn fn, void *arg);
+int cache_walk_btree(struct cache_dev *c, btree_node_fn fn, void *arg);
+int btree_node_extents(struct cache_dev *c, struct btree_node *b,
+		       btree_extent_fn fn, void *arg);
+int cache_journal_extents(struct cache_dev *c, btree_extent_fn fn, void *arg);
+bool ptr_stale(struct cache_dev *c, const struct bkey *k, unsigned int i);
+bool extent_bad(struct cache_dev *c, const struct bkey *k);
+
+#endif
@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache check: the super block of every bcache device on the host, and
+ * whether the cache sets they add up to match what the kernel has live.
+ *
+ * The super blocks come from the parallel scan of lib.c with the checks
+ * of __detail_dev(), and the sysfs view of each device is read from the
+ * scan threads as it is found; only the cross checks between devices run
+ * afterwards, on the collected results. The exit code is that of a
+ * monitoring plugin: 0 when all is well, 1 for warnings, 2 for errors and
+ * 3 when the check itself could not run.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uuid.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "out.h"
+#include "check.h"
+
+#define CHECK_MAX_PROBLEMS	8
+#define CHECK_MSG_LEN		160
+#define CHECK_UUID_LEN		40
+/* The kernel refuses cache devices with fewer buckets */
+#define CHECK_MIN_BUCKETS	(1U << 7)
+
+enum check_severity {
+	CHECK_OK,
+	CHECK_WARNING,
+	CHECK_ERROR,
+};
+
+static const char * const severity_names[] = { "ok", "warning", "error" };
+
+struct check_problem {
+	enum check_severity	severity;
+	char			msg[CHECK_MSG_LEN];
+};
+
+struct check_dev {
+	char			name[NAME_MAX + 1];
+	dev_t			rdev;
+	struct cache_sb		sb;
+	const char		*type;		/* NULL if the sb is unusable */
+	bool			cache;
+	char			uuid[CHECK_UUID_LEN];
+	char			set_uuid[CHECK_UUID_LEN];	/* "" if none */
+
+	/* The kernel's view */
+	bool			registered;
+	char			live_set[CHECK_UUID_LEN];	/* "" if none */
+
+	enum check_severity	status;
+	unsigned int		nr_problems;
+	struct check_problem	problems[CHECK_MAX_PROBLEMS];
+};
+
+struct check_ctx {
+	pthread_mutex_t		lock;
+	struct check_dev	*devs;
+	unsigned int		nr;
+	unsigned int		size;
+	bool			nomem;
+};
+
+int check_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	check [option]\n"
+		"	check the super blocks and cache sets of all bcache devices\n"
+		"	-q	--quiet			only list devices with problems\n"
+		"	-o	--output {text|json|tsv0}	output format, text by default\n"
+		"	-j	--json			same as --output=json\n"
+		"	-h	--help			show help information\n"
+		"	exits 0 if all is well, 1 on warnings, 2 on errors and 3 if\n"
+		"	the check could not run\n");
+	return CHECK_EXIT_UNKNOWN;
+}
+
+static void __attribute__((format(printf, 3, 4)))
+problem(struct check_dev *d, enum check_severity severity,
+	const char *fmt, ...)
+{
+	struct check_problem *p;
+	va_list args;
+
+	if (severity > d->status)
+		d->status = severity;
+	if (d->nr_problems == CHECK_MAX_PROBLEMS)
+		return;
+	p = &d->problems[d->nr_problems++];
+	p->severity = severity;
+	va_start(args, fmt);
+	vsnprintf(p->msg, sizeof(p->msg), fmt, args);
+	va_end(args);
+}
+
+/* The basename of a sysfs link of a device's bcache directory */
+static void read_link_name(const char *name, const char *link,
+			   char *buf, size_t size)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	ssize_t n;
+
+	*buf = '\0';
+	snprintf(path, sizeof(path), "%s/sys/class/block/%s/bcache/%s",
+		 root_prefix(), name, link);
+	n = readlink(path, target, sizeof(target) - 1);
+	if (n < 0)
+		return;
+	target[n] = '\0';
+	if (snprintf(buf, size, "%s", strrchr(target, '/') ?
+		     strrchr(target, '/') + 1 : target) >= (int) size)
+		*buf = '\0';
+}
+
+static bool cset_registered(const char *uuid)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/sys/fs/bcache/%s", root_prefix(),
+		 uuid);
+	return access(path, F_OK) == 0;
+}
+
+static void check_sb(struct check_dev *d)
+{
+	struct cache_sb *sb = &d->sb;
+
+	if (d->cache) {
+		if (!sb->nr_in_set || sb->nr_this_dev >= sb->nr_in_set)
+			problem(d, CHECK_ERROR,
+				"member %u of a cache set of %u devices",
+				sb->nr_this_dev, sb->nr_in_set);
+		if (!sb->bucket_size || !sb->block_size)
+			problem(d, CHECK_ERROR,
+				"bucket size %u, block size %u",
+				sb->bucket_size, sb->block_size);
+		if (sb->nbuckets < CHECK_MIN_BUCKETS)
+			problem(d, CHECK_ERROR,
+				"%llu buckets, the kernel wants at least %u",
+				(unsigned long long) sb->nbuckets,
+				CHECK_MIN_BUCKETS);
+		/* As the kernel checks it, the super block ends at sector 16 */
+		if (sb->bucket_size &&
+		    (uint64_t) sb->first_bucket * sb->bucket_size < 16)
+			problem(d, CHECK_ERROR,
+				"first bucket %u comes before the end of the "
+				"super block", sb->first_bucket);
+		if (uuid_is_null(sb->set_uuid))
+			problem(d, CHECK_ERROR, "no cache set uuid");
+	} else {
+		if (sb->version >= BCACHE_SB_VERSION_BDEV_WITH_OFFSET &&
+		    sb->data_offset < BDEV_DATA_START_DEFAULT)
+			problem(d, CHECK_ERROR,
+				"data offset %llu overlaps the super block",
+				(unsigned long long) sb->data_offset);
+	}
+}
+
+static void check_one(const char *name, dev_t rdev,
+		      struct cache_sb_disk *sb_disk, void *arg)
+{
+	struct check_ctx *ctx = arg;
+	struct check_dev d, *devs;
+	const char *err;
+	char path[PATH_MAX];
+
+	memset(&d, 0, sizeof(d));
+	snprintf(d.name, sizeof(d.name), "%s", name);
+	d.rdev = rdev;
+
+	to_cache_sb(&d.sb, sb_disk);
+	err = sb_check(sb_disk, &d.sb);
+	if (!err && !sb_type_name(d.sb.version))
+		err = "Unknown bcache device type found";
+	if (err) {
+		problem(&d, CHECK_ERROR, "%s", err);
+	} else {
+		d.type = sb_type_name(d.sb.version);
+		d.cache = !strcmp(d.type, "cache");
+		uuid_unparse(d.sb.uuid, d.uuid);
+		/* A detached backing device's set_uuid means nothing */
+		if (!uuid_is_null(d.sb.set_uuid) &&
+		    (d.cache || BDEV_STATE(&d.sb) != BDEV_STATE_NONE))
+			uuid_unparse(d.sb.set_uuid, d.set_uuid);
+		check_sb(&d);
+	}
+
+	snprintf(path, sizeof(path), "%s/sys/class/block/%s/bcache",
+		 root_prefix(), name);
+	d.registered = access(path, F_OK) == 0;
+	if (d.registered)
+		read_link_name(name, d.cache ? "set" : "cache",
+			       d.live_set, sizeof(d.live_set));
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nr == ctx->size) {
+		ctx->size = ctx->size ? ctx->size * 2 : 64;
+		devs = realloc(ctx->devs, ctx->size * sizeof(*devs));
+		if (!devs) {
+			ctx->nomem = true;
+			ctx->size = ctx->nr;
+			goto out;
+		}
+		ctx->devs = devs;
+	}
+	ctx->devs[ctx->nr++] = d;
+out:
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static int cmp_dev(const void *a, const void *b)
+{
+	return strverscmp(((const struct check_dev *) a)->name,
+			  ((const struct check_dev *) b)->name);
+}
+
+static bool have_cache(struct check_ctx *ctx, const char *set_uuid)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr; i++)
+		if (ctx->devs[i].type && ctx->devs[i].cache &&
+		    !strcmp(ctx->devs[i].set_uuid, set_uuid))
+			return true;
+	return false;
+}
+
+/* Cache devices against the other members of their set, and the kernel */
+static void check_cache(struct check_ctx *ctx, struct check_dev *d)
+{
+	unsigned int i, members = 0;
+	struct check_dev *o;
+
+	if (!*d->set_uuid)
+		return;
+	for (i = 0; i < ctx->nr; i++) {
+		o = &ctx->devs[i];
+		if (!o->type || !o->cache || strcmp(o->set_uuid, d->set_uuid))
+			continue;
+		members++;
+		if (o == d)
+			continue;
+		if (o->sb.nr_this_dev == d->sb.nr_this_dev)
+			problem(d, CHECK_ERROR,
+				"cache set %s: %s is member %u as well",
+				d->set_uuid, o->name, d->sb.nr_this_dev);
+		if (o->sb.nr_in_set != d->sb.nr_in_set)
+			problem(d, CHECK_ERROR,
+				"cache set %s: %s has it at %u devices, "
+				"this one at %u", d->set_uuid, o->name,
+				o->sb.nr_in_set, d->sb.nr_in_set);
+	}
+	if (members < d->sb.nr_in_set)
+		problem(d, CHECK_WARNING,
+			"cache set %s: %u of its %u cache devices found",
+			d->set_uuid, members, d->sb.nr_in_set);
+
+	if (*d->live_set && strcmp(d->live_set, d->set_uuid))
+		problem(d, CHECK_ERROR,
+			"set_uuid mismatch: registered in cache set %s, the "
+			"super block is of %s", d->live_set, d->set_uuid);
+	else if (!*d->live_set && cset_registered(d->set_uuid))
+		problem(d, CHECK_WARNING,
+			"not registered, though its cache set %s is",
+			d->set_uuid);
+}
+
+/* Backing devices against the cache devices found, and the kernel */
+static void check_backing(struct check_ctx *ctx, struct check_dev *d)
+{
+	unsigned int state = BDEV_STATE(&d->sb);
+
+	if (state == BDEV_STATE_NONE) {
+		if (*d->live_set)
+			problem(d, CHECK_ERROR,
+				"set_uuid mismatch: attached to cache set %s, "
+				"the super block is detached", d->live_set);
+		return;
+	}
+
+	if (!*d->set_uuid)
+		problem(d, CHECK_ERROR,
+			"%s, but has no cache set uuid",
+			bdev_state_name(state) ?: "attached");
+	else if (!have_cache(ctx, d->set_uuid))
+		problem(d, state == BDEV_STATE_DIRTY ?
+			CHECK_ERROR : CHECK_WARNING,
+			"orphaned: %s for cache set %s, which has no cache "
+			"device here", state == BDEV_STATE_DIRTY ?
+			"dirty data" : "attached", d->set_uuid);
+
+	if (*d->live_set && strcmp(d->live_set, d->set_uuid))
+		problem(d, CHECK_ERROR,
+			"set_uuid mismatch: attached to cache set %s, the "
+			"super block to %s", d->live_set, d->set_uuid);
+	else if (d->registered && !*d->live_set && *d->set_uuid &&
+		 cset_registered(d->set_uuid))
+		problem(d, CHECK_WARNING,
+			"not attached, though its cache set %s is registered",
+			d->set_uuid);
+}
+
+static void check_cross(struct check_ctx *ctx)
+{
+	struct check_dev *d, *o;
+	unsigned int i, j;
+
+	for (i = 0; i < ctx->nr; i++) {
+		d = &ctx->devs[i];
+		if (!d->type)
+			continue;
+
+		/* Cloned disks, or multiple paths to one */
+		for (j = 0; j < ctx->nr; j++) {
+			o = &ctx->devs[j];
+			if (j != i && o->type && !strcmp(o->uuid, d->uuid))
+				problem(d, CHECK_WARNING,
+					"same device uuid as %s", o->name);
+		}
+
+		if (d->cache)
+			check_cache(ctx, d);
+		else
+			check_backing(ctx, d);
+	}
+}
+
+static void print_text(struct check_ctx *ctx, bool quiet,
+		       const unsigned int *count)
+{
+	struct check_dev *d;
+	unsigned int i, j;
+
+	for (i = 0; i < ctx->nr; i++) {
+		d = &ctx->devs[i];
+		if (quiet && d->status == CHECK_OK)
+			continue;
+		printf("%-16s %-8s %s\n", d->name,
+		       d->type ? (d->cache ? "cache" : "backing") : "unknown",
+		       severity_names[d->status]);
+		for (j = 0; j < d->nr_problems; j++)
+			printf("	%s: %s\n",
+			       severity_names[d->problems[j].severity],
+			       d->problems[j].msg);
+	}
+	printf("%u bcache devices: %u ok, %u with warnings, %u with errors\n",
+	       ctx->nr, count[CHECK_OK], count[CHECK_WARNING],
+	       count[CHECK_ERROR]);
+}
+
+static int print_out(struct check_ctx *ctx, bool quiet,
+		     const unsigned int *count, enum check_severity status,
+		     enum out_format format)
+{
+	struct check_dev *d;
+	unsigned int i, j;
+	char rdev[32];
+	struct out *o;
+	int ret;
+
+	o = malloc(sizeof(*o));
+	if (!o) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		return 1;
+	}
+	out_init(o, stdout, format);
+	out_begin_object(o, NULL);
+	out_str(o, "status", severity_names[status]);
+	out_u64(o, "devices", ctx->nr);
+	out_u64(o, "ok", count[CHECK_OK]);
+	out_u64(o, "warnings", count[CHECK_WARNING]);
+	out_u64(o, "errors", count[CHECK_ERROR]);
+	out_begin_list(o, "results");
+	for (i = 0; i < ctx->nr; i++) {
+		d = &ctx->devs[i];
+		if (quiet && d->status == CHECK_OK)
+			continue;
+		out_begin_object(o, NULL);
+		out_str(o, "name", d->name);
+		snprintf(rdev, sizeof(rdev), "%u:%u", major(d->rdev),
+			 minor(d->rdev));
+		out_str(o, "dev", rdev);
+		out_str(o, "type", d->type ?
+			(d->cache ? "cache" : "backing") : "unknown");
+		out_str(o, "uuid", d->uuid);
+		out_str(o, "set_uuid", d->set_uuid);
+		out_bool(o, "registered", d->registered);
+		out_str(o, "live_set_uuid", d->live_set);
+		out_str(o, "status", severity_names[d->status]);
+		out_begin_list(o, "problems");
+		for (j = 0; j < d->nr_problems; j++) {
+			out_begin_object(o, NULL);
+			out_str(o, "severity",
+				severity_names[d->problems[j].severity]);
+			out_str(o, "message", d->problems[j].msg);
+			out_end_object(o);
+		}
+		out_end_list(o);
+		out_end_object(o);
+	}
+	out_end_list(o);
+	out_end_object(o);
+	ret = out_finish(o);
+	free(o);
+	return ret;
+}
+
+int bcache_check(int argc, char **argv)
+{
+	struct check_ctx ctx = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	enum check_severity status = CHECK_OK;
+	enum out_format format = OUT_TEXT;
+	unsigned int i, count[3] = { 0 };
+	bool quiet = false;
+	int c, ret;
+
+	static struct option long_options[] = {
+		{"quiet", no_argument, 0, 'q'},
+		{"output", required_argument, 0, 'o'},
+		{"json", no_argument, 0, 'j'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "qo:jh", long_options,
+				NULL)) != EOF) {
+		switch (c) {
+		case 'q':
+			quiet = true;
+			break;
+		case 'o':
+			if (out_format_parse(optarg, &format))
+				return check_usage();
+			break;
+		case 'j':
+			format = OUT_JSON;
+			break;
+		default:
+			return check_usage();
+		}
+	}
+	if (optind != argc)
+		return check_usage();
+
+	if (scan_each(check_one, &ctx)) {
+		ret = CHECK_EXIT_UNKNOWN;
+		goto out;
+	}
+	if (ctx.nomem) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		ret = CHECK_EXIT_UNKNOWN;
+		goto out;
+	}
+
+	qsort(ctx.devs, ctx.nr, sizeof(*ctx.devs), cmp_dev);
+	check_cross(&ctx);
+
+	for (i = 0; i < ctx.nr; i++) {
+		count[ctx.devs[i].status]++;
+		if (ctx.devs[i].status > status)
+			status = ctx.devs[i].status;
+	}
+
+	if (format == OUT_TEXT)
+		print_text(&ctx, quiet, count);
+	else if (print_out(&ctx, quiet, count, status, format)) {
+		ret = CHECK_EXIT_UNKNOWN;
+		goto out;
+	}
+
+	ret = status == CHECK_ERROR ? CHECK_EXIT_ERROR :
+	      status == CHECK_WARNING ? CHECK_EXIT_WARNING : CHECK_EXIT_OK;
+out:
+	free(ctx.devs);
+	return ret;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __CHECK_H
+#define __CHECK_H
+
+/* Exit codes of bcache check, those of monitoring plugins */
+#define CHECK_EXIT_OK		0
+#define CHECK_EXIT_WARNING	1
+#define CHECK_EXIT_ERROR	2
+#define CHECK_EXIT_UNKNOWN	3
+
+int check_usage(void);
+int bcache_check(int argc, char **argv);
+
+#endif
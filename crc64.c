@@ -171,6 +171,9 @@ static const uint64_t crc64table[256] = {
         or the previous crc64 value if computing incrementally.
  * @p: pointer to buffer over which CRC64 is run
  * @len: length of buffer @p
+ *
+ * This is the byte-at-a-time reference implementation, the faster
+ * variants below must always produce the same result.
  */
 static uint64_t crc64_be(uint64_t crc, const void *p, size_t len)
 {
@@ -186,10 +189,295 @@ static uint64_t crc64_be(uint64_t crc, const void *p, size_t len)
         return crc;
 }
 
+/*
+ * Slice-by-8
+ *
+ * crc64slice[k][b] is the crc of byte b followed by k zero bytes, so
+ * eight input bytes can be folded into the crc with eight independent
+ * table lookups instead of eight dependent ones. The tables are derived
+ * from crc64table[] at startup.
+ */
+static uint64_t crc64slice[8][256];
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	return ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) |
+	       ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32) |
+	       ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+	       ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+}
+
+/* Reduce v * x^64 modulo the polynomial, i.e. the crc of 8 bytes of v */
+static inline uint64_t crc64_slice_word(uint64_t v)
+{
+	return crc64slice[7][v >> 56] ^
+	       crc64slice[6][(v >> 48) & 0xFF] ^
+	       crc64slice[5][(v >> 40) & 0xFF] ^
+	       crc64slice[4][(v >> 32) & 0xFF] ^
+	       crc64slice[3][(v >> 24) & 0xFF] ^
+	       crc64slice[2][(v >> 16) & 0xFF] ^
+	       crc64slice[1][(v >> 8) & 0xFF] ^
+	       crc64slice[0][v & 0xFF];
+}
+
+static uint64_t crc64_be_slice8(uint64_t crc, const void *p, size_t len)
+{
+	const unsigned char *_p = p;
+
+	while (len >= 8) {
+		crc = crc64_slice_word(crc ^ load_be64(_p));
+		_p += 8;
+		len -= 8;
+	}
+
+	return crc64_be(crc, _p, len);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+/*
+ * Carry-less multiplication folding
+ *
+ * Following Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction", the input is consumed as 128 bit polynomials.
+ * An accumulator X = hi * x^64 + lo is moved forward over D bits of data
+ * as hi * (x^(D+64) mod P) + lo * (x^D mod P), which keeps it congruent
+ * modulo P at 128 bits. The constants are computed at startup by
+ * crc64_xpow(), and the last 128 bits are reduced with the slice tables.
+ *
+ * Since this crc is not bit reflected, every 16 byte block is byte
+ * swapped so that the first byte of the block is the most significant.
+ */
+static uint64_t crc64_k128[2], crc64_k256[2], crc64_k384[2];
+static uint64_t crc64_k512[2], crc64_k1024[2];
+
+#define CRC64_FOLD_MIN		64
+#define CRC64_FOLD512_MIN	256
+
+#define CRC64_TARGET_PCLMUL	__attribute__((target("pclmul,ssse3,sse4.1")))
+#define CRC64_TARGET_VPCLMUL	\
+	__attribute__((target("pclmul,ssse3,sse4.1,avx512f,avx512bw,vpclmulqdq")))
+
+CRC64_TARGET_PCLMUL
+static inline __m128i crc64_bswap128(__m128i x)
+{
+	const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					  8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(x, mask);
+}
+
+CRC64_TARGET_PCLMUL
+static inline __m128i crc64_load128(const unsigned char *p)
+{
+	return crc64_bswap128(_mm_loadu_si128((const __m128i *) p));
+}
+
+CRC64_TARGET_PCLMUL
+static inline __m128i crc64_fold128(__m128i x, const uint64_t *k)
+{
+	__m128i kk = _mm_set_epi64x(k[1], k[0]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, kk, 0x11),
+			     _mm_clmulepi64_si128(x, kk, 0x00));
+}
+
+/* Turn the 128 bit remainder X into the crc register, X * x^64 mod P */
+CRC64_TARGET_PCLMUL
+static inline uint64_t crc64_reduce128(__m128i x)
+{
+	__m128i kk = _mm_set_epi64x(0, crc64_k128[0]);
+	__m128i y;
+
+	y = _mm_clmulepi64_si128(x, kk, 0x01);
+	y = _mm_xor_si128(y, _mm_slli_si128(x, 8));
+
+	return crc64_slice_word(_mm_extract_epi64(y, 1)) ^
+	       _mm_cvtsi128_si64(y);
+}
+
+/* Fold the remaining 16 byte blocks into x and reduce it */
+CRC64_TARGET_PCLMUL
+static uint64_t crc64_fold_tail(__m128i x, const unsigned char **p,
+				size_t *len)
+{
+	while (*len >= 16) {
+		x = _mm_xor_si128(crc64_fold128(x, crc64_k128),
+				  crc64_load128(*p));
+		*p += 16;
+		*len -= 16;
+	}
+
+	return crc64_reduce128(x);
+}
+
+CRC64_TARGET_PCLMUL
+static uint64_t crc64_be_pclmul(uint64_t crc, const void *p, size_t len)
+{
+	const unsigned char *_p = p;
+	__m128i x0, x1, x2, x3;
+
+	if (len < CRC64_FOLD_MIN)
+		return crc64_be_slice8(crc, p, len);
+
+	x0 = _mm_xor_si128(crc64_load128(_p), _mm_set_epi64x(crc, 0));
+	x1 = crc64_load128(_p + 16);
+	x2 = crc64_load128(_p + 32);
+	x3 = crc64_load128(_p + 48);
+	_p += 64;
+	len -= 64;
+
+	/* Four independent accumulators to hide the multiplier latency */
+	while (len >= 64) {
+		x0 = _mm_xor_si128(crc64_fold128(x0, crc64_k512),
+				   crc64_load128(_p));
+		x1 = _mm_xor_si128(crc64_fold128(x1, crc64_k512),
+				   crc64_load128(_p + 16));
+		x2 = _mm_xor_si128(crc64_fold128(x2, crc64_k512),
+				   crc64_load128(_p + 32));
+		x3 = _mm_xor_si128(crc64_fold128(x3, crc64_k512),
+				   crc64_load128(_p + 48));
+		_p += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_xor_si128(_mm_xor_si128(crc64_fold128(x0, crc64_k384),
+					 crc64_fold128(x1, crc64_k256)),
+			   _mm_xor_si128(crc64_fold128(x2, crc64_k128), x3));
+
+	crc = crc64_fold_tail(x0, &_p, &len);
+	return crc64_be_slice8(crc, _p, len);
+}
+
+/*
+ * Same folding on 512 bit registers: each of the four 128 bit lanes of
+ * a register carries its own accumulator, and two registers are folded
+ * forward by 1024 bits per iteration.
+ */
+CRC64_TARGET_VPCLMUL
+static inline __m512i crc64_load512(const unsigned char *p)
+{
+	const __m512i mask = _mm512_broadcast_i32x4(
+		_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			     8, 9, 10, 11, 12, 13, 14, 15));
+
+	return _mm512_shuffle_epi8(_mm512_loadu_si512(p), mask);
+}
+
+CRC64_TARGET_VPCLMUL
+static inline __m512i crc64_fold512(__m512i x, const uint64_t *k)
+{
+	__m512i kk = _mm512_broadcast_i32x4(_mm_set_epi64x(k[1], k[0]));
+
+	return _mm512_xor_si512(_mm512_clmulepi64_epi128(x, kk, 0x11),
+				_mm512_clmulepi64_epi128(x, kk, 0x00));
+}
+
+CRC64_TARGET_VPCLMUL
+static uint64_t crc64_be_vpclmul(uint64_t crc, const void *p, size_t len)
+{
+	const unsigned char *_p = p;
+	__m512i z0, z1;
+	__m128i x;
+
+	if (len < CRC64_FOLD512_MIN)
+		return crc64_be_pclmul(crc, p, len);
+
+	z0 = _mm512_xor_si512(crc64_load512(_p),
+			      _mm512_inserti32x4(_mm512_setzero_si512(),
+						 _mm_set_epi64x(crc, 0), 0));
+	z1 = crc64_load512(_p + 64);
+	_p += 128;
+	len -= 128;
+
+	while (len >= 128) {
+		z0 = _mm512_xor_si512(crc64_fold512(z0, crc64_k1024),
+				      crc64_load512(_p));
+		z1 = _mm512_xor_si512(crc64_fold512(z1, crc64_k1024),
+				      crc64_load512(_p + 64));
+		_p += 128;
+		len -= 128;
+	}
+
+	z0 = _mm512_xor_si512(crc64_fold512(z0, crc64_k512), z1);
+
+	/* Lane 0 holds the oldest data */
+	x = _mm_xor_si128(
+		_mm_xor_si128(
+			crc64_fold128(_mm512_extracti32x4_epi32(z0, 0),
+				      crc64_k384),
+			crc64_fold128(_mm512_extracti32x4_epi32(z0, 1),
+				      crc64_k256)),
+		_mm_xor_si128(
+			crc64_fold128(_mm512_extracti32x4_epi32(z0, 2),
+				      crc64_k128),
+			_mm512_extracti32x4_epi32(z0, 3)));
+
+	crc = crc64_fold_tail(x, &_p, &len);
+	return crc64_be_slice8(crc, _p, len);
+}
+#endif
+
+/* x^n mod P, the polynomial is crc64table[1] plus the implicit x^64 */
+static uint64_t crc64_xpow(unsigned int n)
+{
+	uint64_t r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r >> 63) ? crc64table[1] : 0);
+	return r;
+}
+
+static uint64_t (*crc64_update)(uint64_t crc, const void *p, size_t len) =
+	crc64_be;
+
+__attribute__((constructor))
+static void crc64_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc64slice[0][i] = crc64table[i];
+		for (k = 1; k < 8; k++)
+			crc64slice[k][i] = (crc64slice[k - 1][i] << 8) ^
+				crc64table[crc64slice[k - 1][i] >> 56];
+	}
+	crc64_update = crc64_be_slice8;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	crc64_k128[0] = crc64_xpow(128);
+	crc64_k128[1] = crc64_xpow(128 + 64);
+	crc64_k256[0] = crc64_xpow(256);
+	crc64_k256[1] = crc64_xpow(256 + 64);
+	crc64_k384[0] = crc64_xpow(384);
+	crc64_k384[1] = crc64_xpow(384 + 64);
+	crc64_k512[0] = crc64_xpow(512);
+	crc64_k512[1] = crc64_xpow(512 + 64);
+	crc64_k1024[0] = crc64_xpow(1024);
+	crc64_k1024[1] = crc64_xpow(1024 + 64);
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		crc64_update = crc64_be_pclmul;
+	if (crc64_update == crc64_be_pclmul &&
+	    __builtin_cpu_supports("avx512bw") &&
+	    __builtin_cpu_supports("vpclmulqdq"))
+		crc64_update = crc64_be_vpclmul;
+#endif
+}
+
 uint64_t crc64(const void *data, size_t len)
 {
 	uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
 
-	crc = crc64_be(crc, data, len);
+	crc = crc64_update(crc, data, len);
 	return crc ^ 0xFFFFFFFFFFFFFFFFULL;
 }
+
+/* Starting from seed instead of all ones, like btree node checksums */
+uint64_t crc64_seed(uint64_t seed, const void *data, size_t len)
+{
+	return crc64_update(seed, data, len) ^ 0xFFFFFFFFFFFFFFFFULL;
+}
@@ -0,0 +1,599 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Cache set wide attach, detach, set-cachemode and unregister.
+ *
+ * The backing devices of a set are taken from the bdev<n> links of
+ * /sys/fs/bcache/<uuid>, which point to their bcache directories, so the
+ * members are resolved once with no walk of /sys/block per device. The
+ * sysfs writes go out from up to --jobs threads, as a detach or stop
+ * write can block; the transitions they start are then waited for on all
+ * devices at once (watch.c).
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "inventory.h"
+#include "cset.h"
+#include "watch.h"
+
+#define CSET_JOBS		16
+#define CSET_MAX_JOBS		256
+#define CSET_UUID_LEN		36
+
+struct cset_dev {
+	char		name[NAME_MAX + 1];
+	char		dir[PATH_MAX];		/* its bcache directory */
+	int		err;
+};
+
+struct cset_opts {
+	char		cset[CSET_UUID_LEN + 1];
+	bool		all;
+	bool		wait;
+	unsigned int	jobs;
+	int		timeout_ms;
+};
+
+struct cset_write {
+	struct cset_dev	*devs;
+	unsigned int	nr;
+	unsigned int	next;
+	const char	*attr;
+	const char	*val;
+};
+
+int cset_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	attach [option] cset_uuid|cachedevice datadevice...\n"
+		"	detach [option] -c cset [-a|datadevice...]\n"
+		"	set-cachemode [option] -c cset [-a] modetype [datadevice...]\n"
+		"	unregister [option] -c cset [-a]\n"
+		"	the devices, or all backing devices of the cache set, at once\n"
+		"	-c	--cset {uuid|cachedevice}	the cache set\n"
+		"	-a	--all			all its backing devices; for unregister,\n"
+		"					stop them before the cache set\n"
+		"	-j	--jobs {n}		sysfs writes at a time, 16 by default\n"
+		"	-t	--timeout {seconds}	give up waiting after this long\n"
+		"	-n	--no-wait		don't wait for the devices to change\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* A cache set by uuid or by one of its cache devices */
+static int cset_resolve(const char *arg, char *uuid)
+{
+	struct bdev bd;
+	struct cdev cd;
+	int type = 1;
+
+	if (strlen(arg) == CSET_UUID_LEN) {
+		strcpy(uuid, arg);
+		return 0;
+	}
+	if (detail_dev((char *) arg, &bd, &cd, &type))
+		return 1;
+	if (type != BCACHE_SB_VERSION_CDEV &&
+	    type != BCACHE_SB_VERSION_CDEV_WITH_UUID &&
+	    type != BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
+		fprintf(stderr, "%s is not a cache device\n", arg);
+		return 1;
+	}
+	snprintf(uuid, CSET_UUID_LEN + 1, "%.36s", cd.base.cset);
+	return 0;
+}
+
+static void cset_path(char *path, size_t size, const char *uuid,
+		      const char *file)
+{
+	snprintf(path, size, "%s/sys/fs/bcache/%s/%s", root_prefix(), uuid,
+		 file);
+}
+
+/* The kernel name of a bcache directory, .../block/sdb/sdb1/bcache */
+static void dev_name_of_dir(char *name, const char *dir)
+{
+	const char *end = strrchr(dir, '/'), *p = end;
+
+	while (p > dir && p[-1] != '/')
+		p--;
+	snprintf(name, NAME_MAX + 1, "%.*s", (int) (end - p), p);
+}
+
+static int add_dev(struct cset_dev **devs, unsigned int *nr,
+		   unsigned int *size)
+{
+	struct cset_dev *d;
+
+	if (*nr == *size) {
+		*size = *size ? *size * 2 : 64;
+		d = realloc(*devs, *size * sizeof(*d));
+		if (!d) {
+			fprintf(stderr,
+				"Error: fail to allocate memory buffer\n");
+			return 1;
+		}
+		*devs = d;
+	}
+	memset(&(*devs)[*nr], 0, sizeof(**devs));
+	(*nr)++;
+	return 0;
+}
+
+/* The backing devices attached to a cache set */
+static int cset_members(const char *uuid, struct cset_dev **devs,
+			unsigned int *nr)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	unsigned int size = 0, i;
+	struct dirent *e;
+	DIR *dir;
+	int ret = 0;
+
+	cset_path(path, sizeof(path), uuid, "");
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Cache set %s is not registered\n", uuid);
+		return 1;
+	}
+	while (!ret && (e = readdir(dir))) {
+		struct cset_dev *d;
+
+		if (sscanf(e->d_name, "bdev%u", &i) != 1)
+			continue;
+		if (snprintf(link, sizeof(link), "%s%s", path, e->d_name) >=
+		    (int) sizeof(link))
+			continue;
+		ret = add_dev(devs, nr, &size);
+		if (ret)
+			break;
+		d = &(*devs)[*nr - 1];
+		if (!realpath(link, d->dir)) {
+			/* Raced with a detach */
+			(*nr)--;
+			continue;
+		}
+		dev_name_of_dir(d->name, d->dir);
+	}
+	closedir(dir);
+	return ret;
+}
+
+/* A backing device by its name in /dev */
+static int dev_lookup(const char *devname, struct cset_dev *d)
+{
+	char real[PATH_MAX];
+	const char *name;
+
+	if (!realpath(devname, real)) {
+		fprintf(stderr, "Can't find %s: %m\n", devname);
+		return 1;
+	}
+	name = strrchr(real, '/') + 1;
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	snprintf(d->dir, sizeof(d->dir), "%s/sys/class/block/%s/bcache",
+		 root_prefix(), name);
+	if (access(d->dir, F_OK)) {
+		fprintf(stderr, "%s is not a registered backing device\n",
+			devname);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The devices named, which have to be members if a cache set is given,
+ * or all the members.
+ */
+static int cset_select(const struct cset_opts *o, char **names,
+		       unsigned int nr_names, struct cset_dev **devs,
+		       unsigned int *nr)
+{
+	struct cset_dev *members = NULL, d;
+	unsigned int nr_members = 0, size = 0, i, j;
+	int ret = 0;
+
+	*devs = NULL;
+	*nr = 0;
+
+	if (*o->cset && cset_members(o->cset, &members, &nr_members))
+		return 1;
+	if (*o->cset && !nr_names) {
+		*devs = members;
+		*nr = nr_members;
+		return 0;
+	}
+
+	for (i = 0; !ret && i < nr_names; i++) {
+		ret = dev_lookup(names[i], &d);
+		if (ret)
+			break;
+		if (*o->cset) {
+			for (j = 0; j < nr_members; j++)
+				if (!strcmp(members[j].name, d.name))
+					break;
+			if (j == nr_members) {
+				fprintf(stderr, "%s is not in cache set %s\n",
+					names[i], o->cset);
+				ret = 1;
+				break;
+			}
+		}
+		ret = add_dev(devs, nr, &size);
+		if (!ret)
+			(*devs)[*nr - 1] = d;
+	}
+	free(members);
+	if (ret) {
+		free(*devs);
+		*devs = NULL;
+		*nr = 0;
+	}
+	return ret;
+}
+
+static void cset_write_one(struct cset_write *w, struct cset_dev *d)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s", d->dir, w->attr) >=
+	    (int) sizeof(path)) {
+		d->err = ENAMETOOLONG;
+		return;
+	}
+	fd = open(path, O_WRONLY|O_CLOEXEC);
+	if (fd < 0) {
+		d->err = errno;
+		return;
+	}
+	if (dprintf(fd, "%s\n", w->val) < 0)
+		d->err = errno;
+	close(fd);
+}
+
+static void *cset_write_worker(void *arg)
+{
+	struct cset_write *w = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->nr)
+		cset_write_one(w, &w->devs[i]);
+	return NULL;
+}
+
+/* Writes val to attr of every device, jobs at a time */
+static void cset_write_all(struct cset_dev *devs, unsigned int nr,
+			   unsigned int jobs, const char *attr,
+			   const char *val)
+{
+	struct cset_write w = {
+		.devs	= devs,
+		.nr	= nr,
+		.attr	= attr,
+		.val	= val,
+	};
+	pthread_t threads[CSET_MAX_JOBS];
+	unsigned int i, nr_threads;
+
+	if (!nr)
+		return;
+	/* The calling thread is one of the jobs */
+	nr_threads = (nr < jobs ? nr : jobs) - 1;
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, cset_write_worker, &w))
+			break;
+	nr_threads = i;
+
+	/* And covers pthread_create failure */
+	cset_write_worker(&w);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* The kernel has rewritten the super blocks */
+	inventory_invalidate();
+}
+
+/* Waits for attr of the devices written to successfully to be done */
+static void cset_wait(struct cset_dev *devs, unsigned int nr,
+		      const struct cset_opts *o, const char *attr,
+		      bool (*done)(const char *val, void *arg), void *arg)
+{
+	struct attr_wait *w;
+	unsigned int i, n = 0;
+
+	if (!o->wait || !nr)
+		return;
+
+	w = calloc(nr, sizeof(*w));
+	if (!w) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		return;
+	}
+	for (i = 0; i < nr; i++) {
+		if (devs[i].err)
+			continue;
+		snprintf(w[n].path, sizeof(w[n].path), "%s/%s", devs[i].dir,
+			 attr);
+		w[n].done = done;
+		w[n].arg = arg;
+		n++;
+	}
+
+	attr_wait_all(w, n, o->timeout_ms);
+
+	for (i = n = 0; i < nr; i++) {
+		if (devs[i].err)
+			continue;
+		if (!w[n++].finished)
+			devs[i].err = ETIMEDOUT;
+	}
+	free(w);
+}
+
+/* Prints the failures and a summary, returns the exit code */
+static int cset_report(struct cset_dev *devs, unsigned int nr,
+		       const char *what, int64_t start)
+{
+	unsigned int i, failed = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!devs[i].err)
+			continue;
+		fprintf(stderr, "%s: %s\n", devs[i].name,
+			devs[i].err == ETIMEDOUT ? "timed out" :
+			strerror(devs[i].err));
+		failed++;
+	}
+	printf("%u of %u %s in %.2fs\n", nr - failed, nr, what,
+	       (now_ms() - start) / 1000.0);
+	return failed ? 1 : 0;
+}
+
+static int cset_parse(int argc, char **argv, struct cset_opts *o)
+{
+	char *e;
+	int c;
+
+	static struct option opts[] = {
+		{ "cset",	1, NULL,	'c' },
+		{ "all",	0, NULL,	'a' },
+		{ "jobs",	1, NULL,	'j' },
+		{ "timeout",	1, NULL,	't' },
+		{ "no-wait",	0, NULL,	'n' },
+		{ "help",	0, NULL,	'h' },
+		{ NULL,		0, NULL,	0 },
+	};
+
+	memset(o, 0, sizeof(*o));
+	o->wait = true;
+	o->jobs = CSET_JOBS;
+	o->timeout_ms = -1;
+
+	while ((c = getopt_long(argc, argv, "c:aj:t:nh", opts, NULL)) != -1)
+		switch (c) {
+		case 'c':
+			if (cset_resolve(optarg, o->cset))
+				return 1;
+			break;
+		case 'a':
+			o->all = true;
+			break;
+		case 'j':
+			o->jobs = strtoul(optarg, &e, 10);
+			if (*e || !o->jobs || o->jobs > CSET_MAX_JOBS) {
+				fprintf(stderr, "Bad number of jobs %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			o->timeout_ms = strtoul(optarg, &e, 10) * 1000;
+			if (*e || o->timeout_ms < 0) {
+				fprintf(stderr, "Bad timeout %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			o->wait = false;
+			break;
+		default:
+			cset_usage();
+			return 1;
+		}
+	return 0;
+}
+
+static bool state_detached(const char *val, void *arg)
+{
+	return !val || !strcmp(val, "no cache");
+}
+
+static bool state_attached(const char *val, void *arg)
+{
+	return val && strcmp(val, "no cache");
+}
+
+/* cache_mode reads as "writethrough [writeback] writearound none" */
+static bool mode_selected(const char *val, void *arg)
+{
+	char sel[32];
+
+	snprintf(sel, sizeof(sel), "[%s]", (const char *) arg);
+	return val && strstr(val, sel);
+}
+
+static int cset_attach(const struct cset_opts *o, char **names,
+		       unsigned int nr_names)
+{
+	struct cset_opts plain = *o;
+	struct cset_dev *devs;
+	unsigned int nr;
+	int64_t start = now_ms();
+	int ret;
+
+	/* Not members yet, looked up as plain backing devices */
+	*plain.cset = '\0';
+	if (cset_select(&plain, names, nr_names, &devs, &nr))
+		return 1;
+
+	cset_write_all(devs, nr, o->jobs, "attach", o->cset);
+	cset_wait(devs, nr, o, "state", state_attached, NULL);
+	ret = cset_report(devs, nr, "devices attached", start);
+	free(devs);
+	return ret;
+}
+
+int bcache_cset_attach(int argc, char **argv)
+{
+	struct cset_opts o;
+
+	if (cset_parse(argc, argv, &o))
+		return 1;
+	if (!*o.cset) {
+		if (optind >= argc)
+			return cset_usage();
+		if (cset_resolve(argv[optind++], o.cset))
+			return 1;
+	}
+	if (optind >= argc)
+		return cset_usage();
+	return cset_attach(&o, argv + optind, argc - optind);
+}
+
+/* For bcache load, which has the cache set uuid and no options */
+int cset_attach_devs(const char *cset, char **devnames, unsigned int nr,
+		     int timeout_ms)
+{
+	struct cset_opts o = {
+		.wait		= true,
+		.jobs		= CSET_JOBS,
+		.timeout_ms	= timeout_ms,
+	};
+
+	snprintf(o.cset, sizeof(o.cset), "%s", cset);
+	return cset_attach(&o, devnames, nr);
+}
+
+int bcache_cset_detach(int argc, char **argv)
+{
+	struct cset_dev *devs;
+	struct cset_opts o;
+	unsigned int nr;
+	int64_t start = now_ms();
+	int ret;
+
+	if (cset_parse(argc, argv, &o))
+		return 1;
+	if (optind == argc && !(*o.cset && o.all))
+		return cset_usage();
+	if (o.all && optind != argc)
+		return cset_usage();
+
+	if (cset_select(&o, argv + optind, argc - optind, &devs, &nr))
+		return 1;
+
+	/* Dirty devices only detach once their data is written back */
+	cset_write_all(devs, nr, o.jobs, "detach", "1");
+	cset_wait(devs, nr, &o, "state", state_detached, NULL);
+	ret = cset_report(devs, nr, "devices detached", start);
+	free(devs);
+	return ret;
+}
+
+int bcache_cset_cachemode(int argc, char **argv)
+{
+	struct cset_dev *devs;
+	struct cset_opts o;
+	unsigned int nr, i;
+	const char *mode;
+	int64_t start = now_ms();
+	int ret;
+
+	if (cset_parse(argc, argv, &o))
+		return 1;
+	if (optind >= argc)
+		return cset_usage();
+	mode = argv[optind++];
+	if (optind == argc && !(*o.cset && o.all))
+		return cset_usage();
+	if (o.all && optind != argc)
+		return cset_usage();
+
+	for (i = 0; cache_mode_name(i); i++)
+		if (!strcmp(cache_mode_name(i), mode))
+			break;
+	if (!cache_mode_name(i)) {
+		fprintf(stderr, "Unknown cache mode %s\n", mode);
+		return 1;
+	}
+
+	if (cset_select(&o, argv + optind, argc - optind, &devs, &nr))
+		return 1;
+
+	cset_write_all(devs, nr, o.jobs, "cache_mode", mode);
+	cset_wait(devs, nr, &o, "cache_mode", mode_selected, (void *) mode);
+	ret = cset_report(devs, nr, "devices switched", start);
+	free(devs);
+	return ret;
+}
+
+int bcache_cset_unregister(int argc, char **argv)
+{
+	struct cset_dev *devs = NULL, set = { 0 };
+	struct cset_opts o;
+	unsigned int nr = 0;
+	int64_t start = now_ms();
+	int ret = 0;
+
+	if (cset_parse(argc, argv, &o))
+		return 1;
+	if (!*o.cset || optind != argc)
+		return cset_usage();
+
+	if (o.all) {
+		if (cset_select(&o, NULL, 0, &devs, &nr))
+			return 1;
+		cset_write_all(devs, nr, o.jobs, "stop", "1");
+		cset_wait(devs, nr, &o, "state", attr_gone, NULL);
+		ret = cset_report(devs, nr, "devices stopped", start);
+		free(devs);
+		if (ret)
+			return ret;
+	}
+
+	/* The cache set itself, as a member of one */
+	snprintf(set.name, sizeof(set.name), "%s", o.cset);
+	cset_path(set.dir, sizeof(set.dir), o.cset, "");
+	set.dir[strlen(set.dir) - 1] = '\0';
+	cset_write_all(&set, 1, 1, "unregister", "1");
+	cset_wait(&set, 1, &o, "block_size", attr_gone, NULL);
+	return cset_report(&set, 1, "cache sets unregistered", start);
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __CSET_H
+#define __CSET_H
+
+int cset_usage(void);
+int bcache_cset_attach(int argc, char **argv);
+int bcache_cset_detach(int argc, char **argv);
+int bcache_cset_cachemode(int argc, char **argv);
+int bcache_cset_unregister(int argc, char **argv);
+int cset_attach_devs(const char *cset, char **devnames, unsigned int nr,
+		     int timeout_ms);
+
+#endif
@@ -6,38 +6,7 @@
 #include <unistd.h>
 #include <limits.h>
 
-#include "../bcache.h"
-
-struct bkey {
-	__u64   high;
-	__u64   low;
-	__u64   ptr;
-};
-
-#define KEY_SIZE_BITS	   16
-#define KEY_MAX_U64S	    8
-
-
-#define KEY_FIELD(name, field, offset, size)		\
-	BITMASK(name, struct bkey, field, offset, size)
-
-#define PTR_FIELD(name, offset, size)			\
-static inline __u64 name(const struct bkey *k)		\
-{ return (k->ptr >> offset) & ~(~0ULL << size); }
-
-KEY_FIELD(KEY_PTRS,     high, 60, 3)
-KEY_FIELD(HEADER_SIZE,  high, 58, 2)
-KEY_FIELD(KEY_CSUM,     high, 56, 2)
-KEY_FIELD(KEY_PINNED,   high, 55, 1)
-KEY_FIELD(KEY_DIRTY,    high, 36, 1)
-KEY_FIELD(KEY_SIZE,     high, 20, KEY_SIZE_BITS)
-KEY_FIELD(KEY_INODE,    high, 0,  20)
-
-#define PTR_DEV_BITS		12
-
-PTR_FIELD(PTR_DEV,	51, PTR_DEV_BITS)
-PTR_FIELD(PTR_OFFSET,	8,  43)
-PTR_FIELD(PTR_GEN,	0,  8)
+#include "../btree.h"
 
 void usage()
 {
@@ -47,44 +16,45 @@ void usage()
 
 int main(int argc, char *argv[])
 {
-	struct bkey k;
+	BKEY_PADDED(k) key;
+	struct bkey *k = &key.k;
 
 	if (argc != 4)
 		usage();
 
-	k.high = strtoul(argv[1], NULL, 0);
-	if (k.high == ULLONG_MAX) {
-		printf("invalid key high %llu (0x%llx)\n",
-		       k.high, k.high);
+	k->high = strtoul(argv[1], NULL, 0);
+	if (k->high == ULLONG_MAX) {
+		printf("invalid key high %" PRIu64 " (0x%" PRIx64 ")\n",
+		       k->high, k->high);
 		exit(1);
 	}
 
-	k.low = strtoul(argv[2], NULL, 0);
-	if (k.high == ULLONG_MAX) {
-		printf("invalid key low %llu (0x%llx)\n",
-		       k.low, k.low);
+	k->low = strtoul(argv[2], NULL, 0);
+	if (k->high == ULLONG_MAX) {
+		printf("invalid key low %" PRIu64 " (0x%" PRIx64 ")\n",
+		       k->low, k->low);
 		exit(1);
 	}
 
-	k.ptr = strtoul(argv[3], NULL, 0);
-	if (k.high == ULLONG_MAX) {
-		printf("invalid key ptr %llu (0x%llx)\n",
-		       k.ptr, k.ptr);
+	k->ptr[0] = strtoul(argv[3], NULL, 0);
+	if (k->high == ULLONG_MAX) {
+		printf("invalid key ptr %" PRIu64 " (0x%" PRIx64 ")\n",
+		       k->ptr[0], k->ptr[0]);
 		exit(1);
 	}
 
-	printf("key {h: %llu, l: %llu, p: %llu} / {0x%llx, 0x%llx, 0x%llx}\n",
-	       k.high, k.low, k.ptr, k.high, k.low, k.ptr);
-
-	printf("KEY_INODE	%lu (0x%lx)\n", KEY_INODE(&k), KEY_INODE(&k));
-	printf("KEY_SIZE	%lu (0x%lx)\n", KEY_SIZE(&k), KEY_SIZE(&k));
-	printf("KEY_DIRTY	%lu (0x%lx)\n", KEY_DIRTY(&k), KEY_DIRTY(&k));
-	printf("KEY_PINNED	%lu (0x%lx)\n", KEY_PINNED(&k), KEY_PINNED(&k));
-	printf("KEY_CSUM	%lu (0x%lx)\n", KEY_CSUM(&k), KEY_CSUM(&k));
-	printf("HEADER_SIZE	%lu (0x%lx)\n", HEADER_SIZE(&k), HEADER_SIZE(&k));
-	printf("KEY_PTRS	%lu (0x%lx)\n", KEY_PTRS(&k), KEY_PTRS(&k));
-	printf("PTR_GEN		%llu (0x%llx)\n", PTR_GEN(&k), PTR_GEN(&k));
-	printf("PTR_OFFSET	%llu (0x%llx)\n", PTR_OFFSET(&k), PTR_OFFSET(&k));
-	printf("PTR_DEV		%llu (0x%llx)\n", PTR_DEV(&k), PTR_DEV(&k));
+	printf("key {h: %" PRIu64 ", l: %" PRIu64 ", p: %" PRIu64 "} / {0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 "}\n",
+	       k->high, k->low, k->ptr[0], k->high, k->low, k->ptr[0]);
+
+	printf("KEY_INODE	%lu (0x%lx)\n", KEY_INODE(k), KEY_INODE(k));
+	printf("KEY_SIZE	%lu (0x%lx)\n", KEY_SIZE(k), KEY_SIZE(k));
+	printf("KEY_DIRTY	%lu (0x%lx)\n", KEY_DIRTY(k), KEY_DIRTY(k));
+	printf("KEY_PINNED	%lu (0x%lx)\n", KEY_PINNED(k), KEY_PINNED(k));
+	printf("KEY_CSUM	%lu (0x%lx)\n", KEY_CSUM(k), KEY_CSUM(k));
+	printf("HEADER_SIZE	%lu (0x%lx)\n", HEADER_SIZE(k), HEADER_SIZE(k));
+	printf("KEY_PTRS	%lu (0x%lx)\n", KEY_PTRS(k), KEY_PTRS(k));
+	printf("PTR_GEN		%" PRIu64 " (0x%" PRIx64 ")\n", PTR_GEN(k, 0), PTR_GEN(k, 0));
+	printf("PTR_OFFSET	%" PRIu64 " (0x%" PRIx64 ")\n", PTR_OFFSET(k, 0), PTR_OFFSET(k, 0));
+	printf("PTR_DEV		%" PRIu64 " (0x%" PRIx64 ")\n", PTR_DEV(k, 0), PTR_DEV(k, 0));
 	return 0;
 }
@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * The dirty extents of a cache device, as the kernel would see them once
+ * it replayed the journal: the dirty keys of the btree leaves, minus what
+ * the journal overwrites, plus the dirty keys of the journal itself.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcache.h"
+#include "btree.h"
+#include "dirtymap.h"
+
+struct map_ctx {
+	struct cache_dev	*c;
+	struct dirty_map	*m;
+};
+
+static int extent_cmp(const void *l, const void *r)
+{
+	const struct dirty_extent *a = l, *b = r;
+
+	if (a->inode != b->inode)
+		return a->inode < b->inode ? -1 : 1;
+	return a->start < b->start ? -1 : a->start > b->start;
+}
+
+/* Sorts the run in memory out to a temporary file */
+static int map_spill(struct dirty_map *m)
+{
+	FILE **runs, *f;
+
+	qsort(m->run, m->nr, sizeof(*m->run), extent_cmp);
+
+	runs = realloc(m->runs, (m->nr_runs + 1) * sizeof(*runs));
+	if (!runs) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	m->runs = runs;
+
+	f = tmpfile();
+	if (!f || fwrite(m->run, sizeof(*m->run), m->nr, f) != m->nr ||
+	    fflush(f)) {
+		fprintf(stderr, "Can't write a dirty map run: %m\n");
+		if (f)
+			fclose(f);
+		return -1;
+	}
+	m->runs[m->nr_runs++] = f;
+	m->nr = 0;
+	return 0;
+}
+
+static int map_add(struct dirty_map *m, const struct dirty_extent *e)
+{
+	if (m->nr == DIRTY_MAP_RUN && map_spill(m))
+		return -1;
+	m->run[m->nr++] = *e;
+	m->extents++;
+	m->sectors += e->end - e->start;
+	return 0;
+}
+
+/* The part start..end of a dirty key, where it is on this cache */
+static int map_add_key(struct map_ctx *ctx, const struct bkey *k,
+		       uint64_t start, uint64_t end)
+{
+	struct dirty_extent e;
+	unsigned int i;
+
+	for (i = 0; i < KEY_PTRS(k); i++)
+		if (PTR_DEV(k, i) == ctx->c->sb.nr_this_dev)
+			break;
+	if (i == KEY_PTRS(k)) {
+		ctx->m->elsewhere += end - start;
+		return 0;
+	}
+
+	e.inode = KEY_INODE(k);
+	e.start = start;
+	e.end = end;
+	e.cache = PTR_OFFSET(k, i) + start - KEY_START(k);
+	return map_add(ctx->m, &e);
+}
+
+/* Everything a journal key covers, whether it's dirty, clean or deleted */
+static int journal_cover(struct cache_dev *c, struct jset *j, void *arg)
+{
+	struct dirty_map *m = arg;
+	struct dirty_extent *new;
+	struct bkey *k;
+	size_t n = 0;
+
+	for_each_set_key(k, j)
+		n++;
+	new = realloc(m->journal, (m->nr_journal + n + 1) * sizeof(*new));
+	if (!new) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	m->journal = new;
+
+	for_each_set_key(k, j)
+		if (KEY_SIZE(k) && KEY_SIZE(k) <= KEY_OFFSET(k))
+			m->journal[m->nr_journal++] = (struct dirty_extent) {
+				.inode	= KEY_INODE(k),
+				.start	= KEY_START(k),
+				.end	= KEY_OFFSET(k),
+			};
+	return 0;
+}
+
+static void journal_cover_merge(struct dirty_map *m)
+{
+	struct dirty_extent *e = m->journal;
+	size_t i, nr = 0;
+
+	qsort(e, m->nr_journal, sizeof(*e), extent_cmp);
+	for (i = 0; i < m->nr_journal; i++) {
+		if (nr && e[nr - 1].inode == e[i].inode &&
+		    e[nr - 1].end >= e[i].start) {
+			if (e[i].end > e[nr - 1].end)
+				e[nr - 1].end = e[i].end;
+		} else {
+			e[nr++] = e[i];
+		}
+	}
+	m->nr_journal = nr;
+}
+
+static int journal_dirty(const struct bkey *k, uint64_t start, uint64_t end,
+			 void *arg)
+{
+	return KEY_DIRTY(k) ? map_add_key(arg, k, start, end) : 0;
+}
+
+/* The first range of the journal that ends after start */
+static size_t journal_find(struct dirty_map *m, uint64_t inode,
+			   uint64_t start)
+{
+	size_t l = 0, r = m->nr_journal, mid;
+
+	while (l < r) {
+		mid = l + (r - l) / 2;
+		if (m->journal[mid].inode < inode ||
+		    (m->journal[mid].inode == inode &&
+		     m->journal[mid].end <= start))
+			l = mid + 1;
+		else
+			r = mid;
+	}
+	return l;
+}
+
+/* A btree extent, without the parts the journal replay overwrites */
+static int btree_dirty(const struct bkey *k, uint64_t start, uint64_t end,
+		       void *arg)
+{
+	struct map_ctx *ctx = arg;
+	struct dirty_map *m = ctx->m;
+	struct dirty_extent *j;
+	size_t i;
+	int ret;
+
+	if (!KEY_DIRTY(k))
+		return 0;
+
+	for (i = journal_find(m, KEY_INODE(k), start); start < end; i++) {
+		j = &m->journal[i];
+		if (i == m->nr_journal || j->inode != KEY_INODE(k) ||
+		    j->start >= end)
+			return map_add_key(ctx, k, start, end);
+
+		if (j->start > start) {
+			ret = map_add_key(ctx, k, start, j->start);
+			if (ret)
+				return ret;
+		}
+		start = j->end;
+	}
+	return 0;
+}
+
+static int btree_leaf(struct cache_dev *c, struct btree_node *b, void *arg)
+{
+	return b->level ? 0 : btree_node_extents(c, b, btree_dirty, arg);
+}
+
+/* Needs the journal read, and the prios to tell stale keys apart */
+int dirty_map_build(struct cache_dev *c, struct dirty_map *m)
+{
+	struct map_ctx ctx = { c, m };
+
+	memset(m, 0, sizeof(*m));
+	m->run = malloc(DIRTY_MAP_RUN * sizeof(*m->run));
+	if (!m->run) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	if (cache_journal_replay(c, journal_cover, m))
+		return -1;
+	journal_cover_merge(m);
+
+	if (cache_journal_extents(c, journal_dirty, &ctx) ||
+	    cache_walk_btree(c, btree_leaf, &ctx))
+		return -1;
+	return 0;
+}
+
+/* A binary heap of the heads of the spilled runs */
+struct run_head {
+	struct dirty_extent	e;
+	FILE			*f;
+};
+
+static void heap_down(struct run_head *h, size_t nr, size_t i)
+{
+	struct run_head tmp;
+	size_t min, l;
+
+	while ((l = 2 * i + 1) < nr) {
+		min = l + 1 < nr && extent_cmp(&h[l + 1].e, &h[l].e) < 0 ?
+			l + 1 : l;
+		if (extent_cmp(&h[min].e, &h[i].e) >= 0)
+			break;
+		tmp = h[i];
+		h[i] = h[min];
+		h[min] = tmp;
+		i = min;
+	}
+}
+
+/*
+ * Calls fn for every extent in order of backing device and offset. The
+ * extents don't overlap; adjacent ones aren't merged, as they needn't be
+ * adjacent on the cache.
+ */
+int dirty_map_walk(struct dirty_map *m, dirty_extent_fn fn, void *arg)
+{
+	struct run_head *h;
+	size_t i, nr = 0;
+	int ret = 0;
+
+	if (!m->nr_runs) {
+		qsort(m->run, m->nr, sizeof(*m->run), extent_cmp);
+		for (i = 0; i < m->nr && !ret; i++)
+			ret = fn(&m->run[i], arg);
+		return ret;
+	}
+
+	if (m->nr && map_spill(m))
+		return -1;
+
+	h = malloc(m->nr_runs * sizeof(*h));
+	if (!h) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < m->nr_runs; i++) {
+		rewind(m->runs[i]);
+		h[nr].f = m->runs[i];
+		if (fread(&h[nr].e, sizeof(h[nr].e), 1, h[nr].f) == 1)
+			nr++;
+	}
+	for (i = nr; i--;)
+		heap_down(h, nr, i);
+
+	while (nr && !ret) {
+		ret = fn(&h[0].e, arg);
+		if (fread(&h[0].e, sizeof(h[0].e), 1, h[0].f) != 1)
+			h[0] = h[--nr];
+		heap_down(h, nr, 0);
+	}
+
+	free(h);
+	return ret;
+}
+
+void dirty_map_free(struct dirty_map *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->nr_runs; i++)
+		fclose(m->runs[i]);
+	free(m->runs);
+	free(m->run);
+	free(m->journal);
+	memset(m, 0, sizeof(*m));
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __DIRTYMAP_H
+#define __DIRTYMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "btree.h"
+
+/*
+ * The dirty data of a cache device, sorted by backing device and offset
+ *
+ * Extents are collected into runs of DIRTY_MAP_RUN, each sorted and
+ * spilled to a temporary file once it's full, and merged when the map is
+ * walked. Memory stays at one run however many keys the btree has.
+ */
+#define DIRTY_MAP_RUN		(1U << 19)
+
+struct dirty_extent {
+	uint64_t		inode;
+	uint64_t		start;		/* sectors on the backing device */
+	uint64_t		end;
+	uint64_t		cache;		/* sectors on the cache device */
+};
+
+struct dirty_map {
+	struct dirty_extent	*run;
+	size_t			nr;
+	FILE			**runs;		/* spilled, each sorted */
+	unsigned int		nr_runs;
+
+	/* What the journal replay overwrites, sorted */
+	struct dirty_extent	*journal;
+	size_t			nr_journal;
+
+	uint64_t		extents;
+	uint64_t		sectors;
+	uint64_t		elsewhere;	/* sectors on other caches */
+};
+
+typedef int (*dirty_extent_fn)(const struct dirty_extent *e, void *arg);
+
+int dirty_map_build(struct cache_dev *c, struct dirty_map *m);
+int dirty_map_walk(struct dirty_map *m, dirty_extent_fn fn, void *arg);
+void dirty_map_free(struct dirty_map *m);
+
+#endif
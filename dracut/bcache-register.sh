@@ -0,0 +1,15 @@
+#!/bin/sh
+# -*- mode: shell-script; indent-tabs-mode: nil; sh-basic-offset: 4; -*-
+# ex: ts=8 sw=4 sts=4 et filetype=sh
+
+# Register every bcache device in one go once the coldplug events have
+# settled. Until then 69-bcache.rules leaves registering to this hook.
+
+modprobe -q bcache
+rm -f /etc/bcache/coldplug-batch
+for dir in /usr/lib/udev /lib/udev; do
+    if [ -x $dir/bcache-register ]; then
+        $dir/bcache-register -a -q
+        break
+    fi
+done
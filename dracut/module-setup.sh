@@ -31,4 +31,13 @@ installkernel() {
 install() {
     inst_multiple ${udevdir}/probe-bcache ${udevdir}/bcache-register
     inst_rules 69-bcache.rules
+    # Devices set up from bcache.conf, with no Python in the initramfs
+    if [[ -f /etc/bcache/bcache.conf ]]; then
+        inst_multiple /usr/sbin/bcache /etc/bcache/bcache.conf
+        inst_rules 70-bcache-config.rules
+    fi
+    inst_hook initqueue/settled 10 "$moddir/bcache-register.sh"
+    # udev leaves registering to the hook until it has run
+    mkdir -p "${initdir}/etc/bcache"
+    : > "${initdir}/etc/bcache/coldplug-batch"
 }
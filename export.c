@@ -0,0 +1,659 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache export: the statistics bcache-status knows about, as Prometheus
+ * metrics. Either served over HTTP for a scraper, or written to a file for
+ * the node exporter's textfile collector.
+ *
+ * The sets are discovered once and their attributes kept open (stats.c).
+ * A scrape only checks that the sets are unchanged, which is a readdir per
+ * set, and re-reads the values. Super block details, like the labels of
+ * backing devices, come from list_bdevs() when the sets are discovered.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "list.h"
+#include "stats.h"
+#include "export.h"
+
+/* A client gets this long to send its request */
+#define EXPORT_TIMEOUT		5
+
+/* What list_bdevs() knows about a backing device */
+struct export_sb {
+	char			dev[NAME_MAX + 1];
+	char			uuid[40];
+	char			label[SB_LABEL_SIZE + 1];
+};
+
+struct exporter {
+	struct list_head	sets;
+	struct export_sb	*sb;
+	unsigned int		nr_sb;
+};
+
+static void exporter_close(struct exporter *e)
+{
+	stats_close(&e->sets);
+	free(e->sb);
+	e->sb = NULL;
+	e->nr_sb = 0;
+}
+
+static void exporter_open(struct exporter *e)
+{
+	struct list_head head;
+	struct dev *dev, *n;
+	unsigned int nr = 0;
+	const char *p;
+
+	stats_open(&e->sets);
+
+	INIT_LIST_HEAD(&head);
+	if (list_bdevs(&head))
+		goto out;
+
+	list_for_each_entry(dev, &head, dev_list)
+		nr++;
+	e->sb = calloc(nr ? nr : 1, sizeof(*e->sb));
+	if (!e->sb)
+		goto out;
+
+	list_for_each_entry(dev, &head, dev_list) {
+		struct export_sb *sb = &e->sb[e->nr_sb++];
+
+		p = strrchr(dev->name, '/');
+		snprintf(sb->dev, sizeof(sb->dev), "%s", p ? p + 1 : dev->name);
+		snprintf(sb->uuid, sizeof(sb->uuid), "%s", dev->uuid);
+		snprintf(sb->label, sizeof(sb->label), "%s", dev->label);
+	}
+out:
+	list_for_each_entry_safe(dev, n, &head, dev_list) {
+		list_del(&dev->dev_list);
+		free(dev);
+	}
+}
+
+static struct export_sb *exporter_sb(struct exporter *e, const char *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->nr_sb; i++)
+		if (!strcmp(e->sb[i].dev, dev))
+			return &e->sb[i];
+	return NULL;
+}
+
+/* Label values escape backslash, double quote and newline */
+static void put_label(FILE *out, const char *name, const char *val)
+{
+	fprintf(out, "%s=\"", name);
+	for (; *val; val++) {
+		if (*val == '\\' || *val == '"')
+			fputc('\\', out);
+		if (*val == '\n')
+			fputs("\\n", out);
+		else
+			fputc(*val, out);
+	}
+	fputc('"', out);
+}
+
+static void put_help(FILE *out, const char *name, const char *type,
+		     const char *help)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* The labels of a metric, a set is labelled by uuid, members by name too */
+struct export_labels {
+	const char		*set;
+	const char		*member;	/* backing or cache */
+	struct stats_dev	*dev;
+};
+
+static void put_labels(FILE *out, const struct export_labels *l)
+{
+	fputc('{', out);
+	put_label(out, "set", l->set);
+	if (l->dev) {
+		fputc(',', out);
+		put_label(out, l->member, l->dev->dev);
+	}
+	if (l->dev && l->dev->backing) {
+		fputc(',', out);
+		put_label(out, "device", l->dev->bcache);
+	}
+}
+
+static void put_value(FILE *out, const char *name,
+		      const struct export_labels *l, uint64_t v)
+{
+	fputs(name, out);
+	put_labels(out, l);
+	fprintf(out, "} %" PRIu64 "\n", v);
+}
+
+static void put_u64(FILE *out, const char *name,
+		    const struct export_labels *l, int fd)
+{
+	uint64_t v;
+
+	if (!stats_read_u64(fd, &v))
+		put_value(out, name, l, v);
+}
+
+static void put_bytes(FILE *out, const char *name,
+		      const struct export_labels *l, int fd)
+{
+	uint64_t v;
+
+	if (!stats_read_sectors(fd, &v))
+		put_value(out, name, l, v << 9);
+}
+
+static const struct {
+	const char	*name;
+	const char	*help;
+} counter_metrics[] = {
+	[STATS_HITS]		= { "hits_total", "Cache hits" },
+	[STATS_MISSES]		= { "misses_total", "Cache misses" },
+	[STATS_BYPASS_HITS]	= { "bypass_hits_total",
+				    "Hits of I/O that bypassed the cache" },
+	[STATS_BYPASS_MISSES]	= { "bypass_misses_total",
+				    "Misses of I/O that bypassed the cache" },
+	[STATS_BYPASSED]	= { "bypassed_bytes_total",
+				    "Data that bypassed the cache" },
+};
+
+/*
+ * A counter of every set, or of every backing device. Metrics are written
+ * one family at a time, with all the samples of each family together.
+ */
+static void put_counter(FILE *out, struct exporter *e, bool backing,
+			enum stats_counter c)
+{
+	struct export_labels l = { .member = "backing" };
+	char name[64], help[128];
+	uint64_t v[NR_STATS_COUNTERS];
+	struct stats_set *s;
+	unsigned int i;
+
+	snprintf(name, sizeof(name), "bcache_%s_%s",
+		 backing ? "backing" : "set", counter_metrics[c].name);
+	snprintf(help, sizeof(help), "%s, since the %s was registered",
+		 counter_metrics[c].help, backing ? "device" : "set");
+	put_help(out, name, "counter", help);
+
+	list_for_each_entry(s, &e->sets, list) {
+		l.set = s->uuid;
+		l.dev = NULL;
+		if (!backing) {
+			if (!stats_read_counters(s->stats[STATS_TOTAL], v))
+				put_value(out, name, &l, c == STATS_BYPASSED ?
+					  v[c] << 9 : v[c]);
+			continue;
+		}
+		for (i = 0; i < s->nr_devs; i++) {
+			l.dev = &s->devs[i];
+			if (l.dev->backing &&
+			    !stats_read_counters(l.dev->stats[STATS_TOTAL], v))
+				put_value(out, name, &l, c == STATS_BYPASSED ?
+					  v[c] << 9 : v[c]);
+		}
+	}
+}
+
+enum export_kind {
+	EXPORT_U64,
+	EXPORT_BYTES,		/* printed by bch_hprint() */
+	EXPORT_SECTORS,
+};
+
+static const struct {
+	const char		*name;
+	const char		*type;
+	enum export_kind	kind;
+	int			attr;
+	const char		*help;
+} dev_metrics[] = {
+	{ "bcache_backing_dirty_bytes", "gauge", EXPORT_BYTES,
+	  DEV_DIRTY_DATA, "Dirty data in the cache" },
+	{ "bcache_backing_writeback_rate_bytes", "gauge", EXPORT_BYTES,
+	  DEV_WRITEBACK_RATE, "Current writeback rate per second" },
+	{ "bcache_backing_writeback_running", "gauge", EXPORT_U64,
+	  DEV_WRITEBACK_RUNNING, "Whether writeback is running" },
+	{ "bcache_backing_writeback_percent", "gauge", EXPORT_U64,
+	  DEV_WRITEBACK_PERCENT, "Dirty data writeback aims for, percent" },
+	{ "bcache_backing_size_bytes", "gauge", EXPORT_SECTORS,
+	  DEV_SIZE, "Size of the backing device" },
+	{ "bcache_cache_size_bytes", "gauge", EXPORT_SECTORS,
+	  DEV_SIZE, "Size of the cache device" },
+	{ "bcache_cache_buckets", "gauge", EXPORT_U64,
+	  DEV_NBUCKETS, "Buckets of the cache device" },
+	{ "bcache_cache_io_errors", "gauge", EXPORT_U64,
+	  DEV_IO_ERRORS, "Decaying count of I/O errors" },
+	{ "bcache_cache_written_bytes_total", "counter", EXPORT_BYTES,
+	  DEV_WRITTEN, "Data written to the cache device" },
+	{ "bcache_cache_metadata_written_bytes_total", "counter", EXPORT_BYTES,
+	  DEV_METADATA_WRITTEN, "Metadata written to the cache device" },
+};
+
+static void put_dev_metric(FILE *out, struct exporter *e, unsigned int m)
+{
+	bool backing = !strncmp(dev_metrics[m].name, "bcache_backing_", 15);
+	struct export_labels l = { .member = backing ? "backing" : "cache" };
+	struct stats_set *s;
+	unsigned int i;
+	uint64_t v;
+	int fd;
+
+	put_help(out, dev_metrics[m].name, dev_metrics[m].type,
+		 dev_metrics[m].help);
+
+	list_for_each_entry(s, &e->sets, list) {
+		l.set = s->uuid;
+		for (i = 0; i < s->nr_devs; i++) {
+			l.dev = &s->devs[i];
+			if (l.dev->backing != backing)
+				continue;
+			fd = l.dev->attr[dev_metrics[m].attr];
+
+			switch (dev_metrics[m].kind) {
+			case EXPORT_U64:
+				put_u64(out, dev_metrics[m].name, &l, fd);
+				break;
+			case EXPORT_BYTES:
+				put_bytes(out, dev_metrics[m].name, &l, fd);
+				break;
+			case EXPORT_SECTORS:
+				if (!stats_read_u64(fd, &v))
+					put_value(out, dev_metrics[m].name,
+						  &l, v << 9);
+				break;
+			}
+		}
+	}
+}
+
+static void put_info(FILE *out, struct exporter *e)
+{
+	struct export_labels l = { .member = "backing" };
+	struct export_sb *sb;
+	struct stats_set *s;
+	char buf[256];
+	unsigned int i;
+
+	put_help(out, "bcache_backing_info", "gauge",
+		 "Backing device details, always 1");
+	list_for_each_entry(s, &e->sets, list) {
+		l.set = s->uuid;
+		for (i = 0; i < s->nr_devs; i++) {
+			l.dev = &s->devs[i];
+			if (!l.dev->backing)
+				continue;
+			sb = exporter_sb(e, l.dev->dev);
+
+			fputs("bcache_backing_info", out);
+			put_labels(out, &l);
+			fputc(',', out);
+			put_label(out, "uuid", sb ? sb->uuid : "");
+			fputc(',', out);
+			put_label(out, "label", sb ? sb->label : "");
+			fputc(',', out);
+			if (stats_read_selected(l.dev->attr[DEV_CACHE_MODE],
+						buf, sizeof(buf)) < 0)
+				*buf = '\0';
+			put_label(out, "cache_mode", buf);
+			fputc(',', out);
+			if (stats_read(l.dev->attr[DEV_STATE], buf,
+				       sizeof(buf)) < 0)
+				*buf = '\0';
+			put_label(out, "state", buf);
+			fputs("} 1\n", out);
+		}
+	}
+}
+
+static void put_priority(FILE *out, struct exporter *e)
+{
+	static const char * const kinds[] = {
+		"unused", "clean", "dirty", "metadata",
+	};
+	struct export_labels l = { .member = "cache" };
+	struct stats_priority prio;
+	unsigned int i, k, v[4];
+	struct stats_set *s;
+
+	put_help(out, "bcache_cache_priority_percent", "gauge",
+		 "Share of the cache by content, from priority_stats");
+	list_for_each_entry(s, &e->sets, list) {
+		l.set = s->uuid;
+		for (i = 0; i < s->nr_devs; i++) {
+			l.dev = &s->devs[i];
+			if (l.dev->backing ||
+			    stats_read_priority(l.dev->attr[DEV_PRIORITY_STATS],
+						&prio))
+				continue;
+
+			v[0] = prio.unused;
+			v[1] = prio.clean;
+			v[2] = prio.dirty;
+			v[3] = prio.metadata;
+			for (k = 0; k < 4; k++) {
+				fputs("bcache_cache_priority_percent", out);
+				put_labels(out, &l);
+				fputc(',', out);
+				put_label(out, "kind", kinds[k]);
+				fprintf(out, "} %u\n", v[k]);
+			}
+		}
+	}
+}
+
+static void put_set_u64(FILE *out, struct exporter *e, const char *name,
+			enum stats_set_attr attr, const char *help)
+{
+	struct export_labels l = { 0 };
+	struct stats_set *s;
+
+	put_help(out, name, "gauge", help);
+	list_for_each_entry(s, &e->sets, list) {
+		l.set = s->uuid;
+		put_u64(out, name, &l, s->attr[attr]);
+	}
+}
+
+/* Rediscovers the sets if they changed, then writes every metric */
+static void exporter_scrape(struct exporter *e, FILE *out)
+{
+	unsigned int i;
+
+	if (stats_stale(&e->sets)) {
+		exporter_close(e);
+		exporter_open(e);
+	}
+
+	put_help(out, "bcache_up", "gauge", "Whether bcache is loaded");
+	fprintf(out, "bcache_up %d\n", stats_loaded());
+
+	put_set_u64(out, e, "bcache_set_available_percent",
+		    SET_AVAILABLE_PERCENT, "Evictable share of the cache set");
+	for (i = 0; i < NR_STATS_COUNTERS; i++)
+		put_counter(out, e, false, i);
+	for (i = 0; i < NR_STATS_COUNTERS; i++)
+		put_counter(out, e, true, i);
+	put_info(out, e);
+	for (i = 0; i < sizeof(dev_metrics) / sizeof(dev_metrics[0]); i++)
+		put_dev_metric(out, e, i);
+	put_priority(out, e);
+}
+
+/* Replaces path, so the textfile collector never sees half a file */
+static int export_textfile(struct exporter *e, const char *path)
+{
+	char tmp[PATH_MAX];
+	FILE *out;
+
+	if (!strcmp(path, "-")) {
+		exporter_scrape(e, stdout);
+		return fflush(stdout) ? -1 : 0;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	out = fopen(tmp, "w");
+	if (!out) {
+		fprintf(stderr, "Can't create %s: %m\n", tmp);
+		return -1;
+	}
+	exporter_scrape(e, out);
+	if (fclose(out) || rename(tmp, path)) {
+		fprintf(stderr, "Can't write %s: %m\n", path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* [host]:port, host:port or :port for every address */
+static int export_listen(const char *addr)
+{
+	struct addrinfo hints = {
+		.ai_family	= AF_UNSPEC,
+		.ai_socktype	= SOCK_STREAM,
+		.ai_flags	= AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	char host[256], *port;
+	int fd = -1, one = 1, ret;
+
+	snprintf(host, sizeof(host), "%s", addr);
+	port = strrchr(host, ':');
+	if (!port) {
+		fprintf(stderr, "Bad listen address %s, need [host]:port\n",
+			addr);
+		return -1;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	ret = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "Bad listen address %s: %s\n", addr,
+			gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		fprintf(stderr, "Can't listen on %s: %m\n", addr);
+	return fd;
+}
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0 && errno != EINTR)
+			return;
+		if (n > 0) {
+			buf += n;
+			len -= n;
+		}
+	}
+}
+
+static void send_response(int fd, const char *status, const char *type,
+			  const char *body, size_t len)
+{
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr),
+		     "HTTP/1.0 %s\r\n"
+		     "Content-Type: %s\r\n"
+		     "Content-Length: %zu\r\n"
+		     "Connection: close\r\n\r\n", status, type, len);
+	send_all(fd, hdr, n);
+	send_all(fd, body, len);
+}
+
+/* One request per connection, anything but GET /metrics is refused */
+static void export_serve(struct exporter *e, int fd)
+{
+	struct timeval tv = { .tv_sec = EXPORT_TIMEOUT };
+	char req[4096], *path, *end;
+	size_t len = 0, size;
+	ssize_t n;
+	char *body;
+	FILE *out;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* Only the request line matters, the headers are read and dropped */
+	while (len < sizeof(req) - 1) {
+		n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (n <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if (strncmp(req, "GET ", 4)) {
+		send_response(fd, "405 Method Not Allowed", "text/plain",
+			      "Method not allowed\n", 19);
+		return;
+	}
+	path = req + 4;
+	end = strpbrk(path, " \r\n");
+	if (end)
+		*end = '\0';
+	end = strchr(path, '?');
+	if (end)
+		*end = '\0';
+
+	if (strcmp(path, "/metrics") && strcmp(path, "/")) {
+		send_response(fd, "404 Not Found", "text/plain",
+			      "Not found, try /metrics\n", 24);
+		return;
+	}
+
+	out = open_memstream(&body, &size);
+	if (!out) {
+		send_response(fd, "500 Internal Server Error", "text/plain",
+			      "Out of memory\n", 14);
+		return;
+	}
+	exporter_scrape(e, out);
+	fclose(out);
+	send_response(fd, "200 OK", "text/plain; version=0.0.4; charset=utf-8",
+		      body, size);
+	free(body);
+}
+
+int export_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	export [option]\n"
+		"	export statistics as Prometheus metrics\n"
+		"	-l	--listen {[host]:port}	serve them over HTTP at /metrics\n"
+		"	-t	--textfile {file}	write them to file, - for stdout\n"
+		"	-i	--interval {seconds}	rewrite the textfile every interval\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+int bcache_export(int argc, char **argv)
+{
+	struct exporter e = { 0 };
+	const char *listen_addr = NULL, *textfile = NULL;
+	double interval = 0;
+	struct timespec ts;
+	char *end;
+	int c, fd, ret = 0;
+
+	static struct option opts[] = {
+		{ "listen",	1, NULL,	'l' },
+		{ "textfile",	1, NULL,	't' },
+		{ "interval",	1, NULL,	'i' },
+		{ "help",	0, NULL,	'h' },
+		{ NULL,		0, NULL,	0 },
+	};
+
+	while ((c = getopt_long(argc, argv, "l:t:i:h", opts, NULL)) != -1)
+		switch (c) {
+		case 'l':
+			listen_addr = optarg;
+			break;
+		case 't':
+			textfile = optarg;
+			break;
+		case 'i':
+			interval = strtod(optarg, &end);
+			if (*end || !(interval > 0)) {
+				fprintf(stderr, "Bad interval %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			return export_usage();
+		}
+
+	if (argc != optind || !listen_addr == !textfile ||
+	    (interval && !textfile))
+		return export_usage();
+
+	exporter_open(&e);
+
+	if (textfile) {
+		ts.tv_sec = interval;
+		ts.tv_nsec = (interval - ts.tv_sec) * 1e9;
+		do {
+			if (export_textfile(&e, textfile))
+				ret = 1;
+		} while (interval && !nanosleep(&ts, NULL));
+		exporter_close(&e);
+		return ret;
+	}
+
+	fd = export_listen(listen_addr);
+	if (fd < 0) {
+		exporter_close(&e);
+		return 1;
+	}
+
+	while (1) {
+		c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "accept failed: %m\n");
+			ret = 1;
+			break;
+		}
+		export_serve(&e, c);
+		close(c);
+	}
+
+	close(fd);
+	exporter_close(&e);
+	return ret;
+}
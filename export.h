@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __EXPORT_H
+#define __EXPORT_H
+
+int export_usage(void);
+int bcache_export(int argc, char **argv);
+
+#endif
@@ -12,6 +12,8 @@
 #include <string.h>
 
 #include "bcache.h"
+#include "out.h"
+#include "features.h"
 
 struct feature {
 	int		compat;
@@ -74,3 +76,41 @@ void print_cache_set_supported_feature_sets(struct cache_sb *sb)
 	compose_feature_string(INCOMPAT, "sb.feature_incompat");
 	printf("%s", buf);
 }
+
+static uint64_t feature_set(struct cache_sb *sb, int compat)
+{
+	switch (compat) {
+	case BCH_FEATURE_COMPAT:
+		return sb->feature_compat;
+	case BCH_FEATURE_RO_COMPAT:
+		return sb->feature_ro_compat;
+	default:
+		return sb->feature_incompat;
+	}
+}
+
+/* The same sets, as lists of names; empty sets are left out */
+static void out_feature_set(struct out *o, struct cache_sb *sb, int compat,
+			    const char *key)
+{
+	struct feature *f;
+	bool first = true;
+
+	for (f = &feature_list[0]; f->string; f++) {
+		if (f->compat != compat || !(feature_set(sb, compat) & f->mask))
+			continue;
+		if (first)
+			out_begin_list(o, key);
+		first = false;
+		out_str(o, NULL, f->string);
+	}
+	if (!first)
+		out_end_list(o);
+}
+
+void out_cache_set_supported_feature_sets(struct out *o, struct cache_sb *sb)
+{
+	out_feature_set(o, sb, BCH_FEATURE_COMPAT, "sb.feature_compat");
+	out_feature_set(o, sb, BCH_FEATURE_RO_COMPAT, "sb.feature_ro_compat");
+	out_feature_set(o, sb, BCH_FEATURE_INCOMPAT, "sb.feature_incompat");
+}
@@ -3,6 +3,9 @@
 #ifndef _BCACHE_FEATURES_H
 #define _BCACHE_FEATURES_H
 
+struct out;
+
 void print_cache_set_supported_feature_sets(struct cache_sb *sb);
+void out_cache_set_supported_feature_sets(struct out *o, struct cache_sb *sb);
 
 #endif
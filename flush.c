@@ -0,0 +1,510 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache flush-offline: write the dirty data of a cache device that
+ * can't be registered back to its backing device.
+ *
+ * The dirty extent map (dirtymap.c) comes out sorted by backing device
+ * offset, so the writes are one ascending sweep of the backing device.
+ * Extents that follow each other on both devices are coalesced into one
+ * read and one write of up to FLUSH_MAX_IO. Up to queue depth copies are
+ * in flight through Linux aio with O_DIRECT, each a read of the cache
+ * followed by a write of the backing device.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bcache.h"
+#include "btree.h"
+#include "dirtymap.h"
+#include "flush.h"
+
+#define FLUSH_MAX_IO		(1U << 20)
+#define FLUSH_QUEUE_DEPTH	32
+#define FLUSH_MAX_QUEUE_DEPTH	1024
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/* A copy, bytes at cache on the cache device to backing */
+struct flush_io {
+	uint64_t		cache;
+	uint64_t		backing;
+	size_t			bytes;
+};
+
+struct flush_req {
+	struct iocb		iocb;
+	void			*buf;
+	struct flush_io		io;
+	bool			writing;
+	bool			busy;
+};
+
+struct flusher {
+	unsigned int		queue_depth;
+	bool			dry_run;
+
+	int			cache_fd;	/* O_DIRECT */
+	int			backing_fd;
+	int			cache_bfd;	/* buffered, for unaligned I/O */
+	int			backing_bfd;
+	unsigned int		align;
+
+	uint64_t		inode;
+	uint64_t		data_offset;	/* sectors */
+	uint64_t		backing_size;	/* bytes */
+
+	aio_context_t		ctx;
+	struct flush_req	*reqs;
+	unsigned int		inflight;
+	struct flush_io		next;		/* being coalesced */
+	uint64_t		last_end;	/* sectors, of the last extent */
+	int			err;
+
+	uint64_t		extents;
+	uint64_t		ios;
+	uint64_t		bytes;
+};
+
+/* Logical block size and size in bytes, of a block device or a file */
+static int dev_geometry(int fd, const char *path, unsigned int *align,
+			uint64_t *size)
+{
+	struct stat st;
+	int secsize;
+
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Can't stat %s: %m\n", path);
+		return -1;
+	}
+	if (!S_ISBLK(st.st_mode)) {
+		*align = st.st_blksize;
+		*size = st.st_size;
+		return 0;
+	}
+
+	if (ioctl(fd, BLKSSZGET, &secsize) ||
+	    ioctl(fd, BLKGETSIZE64, size)) {
+		fprintf(stderr, "Can't get the geometry of %s: %m\n", path);
+		return -1;
+	}
+	*align = secsize;
+	return 0;
+}
+
+/* Exclusive, so neither device can be in use by the kernel */
+static int open_dev(const char *path, int flags, int *fd, int *bfd)
+{
+	*fd = open(path, flags|O_DIRECT|O_EXCL|O_CLOEXEC);
+	if (*fd < 0) {
+		fprintf(stderr, "Can't open %s exclusively: %m\n", path);
+		return -1;
+	}
+	*bfd = open(path, flags|O_CLOEXEC);
+	if (*bfd < 0) {
+		fprintf(stderr, "Can't open %s: %m\n", path);
+		close(*fd);
+		return -1;
+	}
+	return 0;
+}
+
+static bool io_aligned(struct flusher *f, const struct flush_io *io)
+{
+	return !(io->cache % f->align) && !(io->backing % f->align) &&
+		!(io->bytes % f->align);
+}
+
+static void prep_iocb(struct flush_req *r, int fd, uint64_t offset)
+{
+	memset(&r->iocb, 0, sizeof(r->iocb));
+	r->iocb.aio_data	= (uint64_t) (uintptr_t) r;
+	r->iocb.aio_lio_opcode	= r->writing ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	r->iocb.aio_fildes	= fd;
+	r->iocb.aio_buf		= (uint64_t) (uintptr_t) r->buf;
+	r->iocb.aio_nbytes	= r->io.bytes;
+	r->iocb.aio_offset	= offset;
+}
+
+static int submit_req(struct flusher *f, struct flush_req *r)
+{
+	struct iocb *iocb = &r->iocb;
+
+	if (r->writing)
+		prep_iocb(r, f->backing_fd, r->io.backing);
+	else
+		prep_iocb(r, f->cache_fd, r->io.cache);
+
+	if (io_submit(f->ctx, 1, &iocb) != 1) {
+		fprintf(stderr, "Can't submit I/O: %m\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void reap(struct flusher *f, unsigned int min_nr)
+{
+	struct io_event events[FLUSH_MAX_QUEUE_DEPTH];
+	struct flush_req *r;
+	int i, nr;
+
+	nr = io_getevents(f->ctx, min_nr, f->queue_depth, events, NULL);
+	if (nr < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "Can't reap I/O: %m\n");
+			f->err = -1;
+			f->inflight = 0;
+		}
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		r = (void *) (uintptr_t) events[i].data;
+
+		if ((long) events[i].res != (long) r->io.bytes) {
+			errno = (long) events[i].res < 0 ?
+				-(long) events[i].res : EIO;
+			fprintf(stderr, "Error %s %s at %" PRIu64 ": %m\n",
+				r->writing ? "writing" : "reading",
+				r->writing ? "the backing device" : "the cache",
+				r->writing ? r->io.backing : r->io.cache);
+			f->err = -1;
+		} else if (!r->writing && !f->err) {
+			/* The data is in, now write it where it belongs */
+			r->writing = true;
+			if (!submit_req(f, r))
+				continue;
+			f->err = -1;
+		}
+
+		r->busy = false;
+		f->inflight--;
+	}
+}
+
+/* Unaligned copies, possible with 512 byte blocks on 4k devices */
+static int copy_sync(struct flusher *f, struct flush_req *r)
+{
+	if (pread(f->cache_bfd, r->buf, r->io.bytes, r->io.cache) !=
+	    (ssize_t) r->io.bytes) {
+		fprintf(stderr, "Error reading the cache at %" PRIu64 ": %m\n",
+			r->io.cache);
+		return -1;
+	}
+	if (pwrite(f->backing_bfd, r->buf, r->io.bytes, r->io.backing) !=
+	    (ssize_t) r->io.bytes) {
+		fprintf(stderr,
+			"Error writing the backing device at %" PRIu64 ": %m\n",
+			r->io.backing);
+		return -1;
+	}
+	return 0;
+}
+
+static int queue_io(struct flusher *f, const struct flush_io *io)
+{
+	struct flush_req *r = NULL;
+	unsigned int i;
+
+	f->ios++;
+	f->bytes += io->bytes;
+	if (f->dry_run)
+		return 0;
+
+	while (!f->err) {
+		for (i = 0; i < f->queue_depth; i++)
+			if (!f->reqs[i].busy) {
+				r = &f->reqs[i];
+				break;
+			}
+		if (r)
+			break;
+		reap(f, 1);
+	}
+	if (f->err)
+		return -1;
+
+	r->io = *io;
+	r->writing = false;
+	if (!io_aligned(f, io))
+		return copy_sync(f, r);
+
+	r->busy = true;
+	f->inflight++;
+	if (submit_req(f, r)) {
+		r->busy = false;
+		f->inflight--;
+		return -1;
+	}
+
+	/* Pick up whatever has completed without blocking */
+	reap(f, 0);
+	return f->err;
+}
+
+static int flush_extent(const struct dirty_extent *e, void *arg)
+{
+	struct flusher *f = arg;
+	struct flush_io io = {
+		.cache		= e->cache << 9,
+		.backing	= (e->start + f->data_offset) << 9,
+		.bytes		= (e->end - e->start) << 9,
+	};
+	struct flush_io *n = &f->next;
+	size_t len;
+
+	if (e->inode != f->inode)
+		return 0;
+
+	/* Writes in flight together land in any order, they mustn't overlap */
+	if (e->start < f->last_end) {
+		fprintf(stderr, "Dirty extent %" PRIu64 "+%" PRIu64
+			" overlaps the one before it, not flushing\n",
+			e->start, e->end - e->start);
+		return -1;
+	}
+	f->last_end = e->end;
+
+	if (io.backing + io.bytes > f->backing_size) {
+		fprintf(stderr, "Dirty extent %" PRIu64 "+%" PRIu64
+			" is past the end of the backing device\n",
+			e->start, e->end - e->start);
+		return -1;
+	}
+	f->extents++;
+
+	while (io.bytes) {
+		if (n->bytes && n->bytes < FLUSH_MAX_IO &&
+		    n->cache + n->bytes == io.cache &&
+		    n->backing + n->bytes == io.backing) {
+			len = io.bytes < FLUSH_MAX_IO - n->bytes ?
+				io.bytes : FLUSH_MAX_IO - n->bytes;
+			n->bytes += len;
+		} else {
+			if (n->bytes && queue_io(f, n))
+				return -1;
+			len = io.bytes < FLUSH_MAX_IO ? io.bytes : FLUSH_MAX_IO;
+			*n = io;
+			n->bytes = len;
+		}
+		io.cache += len;
+		io.backing += len;
+		io.bytes -= len;
+	}
+	return 0;
+}
+
+static int flusher_start(struct flusher *f)
+{
+	unsigned int i;
+
+	f->reqs = calloc(f->queue_depth, sizeof(*f->reqs));
+	if (!f->reqs) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < f->queue_depth; i++)
+		if (posix_memalign(&f->reqs[i].buf, 4096, FLUSH_MAX_IO)) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+
+	if (io_setup(f->queue_depth, &f->ctx)) {
+		fprintf(stderr, "Can't set up aio: %m\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void flusher_stop(struct flusher *f)
+{
+	unsigned int i;
+
+	while (f->inflight)
+		reap(f, 1);
+	if (f->ctx)
+		io_destroy(f->ctx);
+	for (i = 0; f->reqs && i < f->queue_depth; i++)
+		free(f->reqs[i].buf);
+	free(f->reqs);
+}
+
+/* Meta data that was skipped, the dirty data it pointed to with it */
+static bool meta_errors(const struct cache_errors *e)
+{
+	return e->journal_io || e->journal_csum || e->prio_csum ||
+		e->btree_io || e->btree_magic || e->btree_csum || e->bad_keys;
+}
+
+int flush_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	flush-offline [option] {cache} {backing}\n"
+		"	write the dirty data of a cache device that isn't registered\n"
+		"	to its backing device\n"
+		"	-q	--queue-depth {n}	copies in flight, default 32\n"
+		"	-n	--dry-run		only tell how much would be written\n"
+		"	-f	--force			flush even if meta data failed to verify\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+int bcache_flush(int argc, char **argv)
+{
+	struct flusher f = {
+		.queue_depth	= FLUSH_QUEUE_DEPTH,
+		.cache_fd	= -1,
+		.backing_fd	= -1,
+		.cache_bfd	= -1,
+		.backing_bfd	= -1,
+	};
+	struct timespec start, end;
+	struct dirty_map m = { 0 };
+	struct cache_dev c;
+	unsigned int align;
+	uint64_t size;
+	double secs;
+	bool force = false;
+	char *e;
+	int o, ret = 1;
+
+	static struct option opts[] = {
+		{ "queue-depth",	1, NULL,	'q' },
+		{ "dry-run",		0, NULL,	'n' },
+		{ "force",		0, NULL,	'f' },
+		{ "help",		0, NULL,	'h' },
+		{ NULL,			0, NULL,	0 },
+	};
+
+	while ((o = getopt_long(argc, argv, "q:nfh", opts, NULL)) != -1)
+		switch (o) {
+		case 'q':
+			f.queue_depth = strtoul(optarg, &e, 10);
+			if (*e || !f.queue_depth ||
+			    f.queue_depth > FLUSH_MAX_QUEUE_DEPTH) {
+				fprintf(stderr, "Bad queue depth %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			f.dry_run = true;
+			break;
+		case 'f':
+			force = true;
+			break;
+		default:
+			return flush_usage();
+		}
+
+	if (argc != optind + 2)
+		return flush_usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (cache_open(&c, argv[optind]))
+		return 1;
+	if (cache_read_journal(&c) || cache_read_uuids(&c))
+		goto out;
+	/* Without generations stale data would be written over good data */
+	if (cache_read_prios(&c)) {
+		fprintf(stderr, "Can't tell stale data apart without priorities\n");
+		goto out;
+	}
+
+	if (open_dev(argv[optind], O_RDONLY, &f.cache_fd, &f.cache_bfd) ||
+	    open_dev(argv[optind + 1], O_RDWR, &f.backing_fd, &f.backing_bfd) ||
+	    dev_geometry(f.cache_fd, argv[optind], &f.align, &size) ||
+	    dev_geometry(f.backing_fd, argv[optind + 1], &align,
+			 &f.backing_size) ||
+	    cache_find_backing(&c, f.backing_bfd, argv[optind + 1],
+			       &f.inode, &f.data_offset))
+		goto out;
+	if (align > f.align)
+		f.align = align;
+
+	if (dirty_map_build(&c, &m))
+		goto out;
+	if (meta_errors(&c.err) && !force && !f.dry_run) {
+		fprintf(stderr, "Parts of the journal or btree failed to verify, "
+			"not flushing without --force\n");
+		goto out;
+	}
+	if (!f.dry_run && flusher_start(&f))
+		goto stop;
+
+	if (!dirty_map_walk(&m, flush_extent, &f) &&
+	    (!f.next.bytes || !queue_io(&f, &f.next)))
+		ret = 0;
+stop:
+	flusher_stop(&f);
+	if (!f.dry_run && !f.err && !ret && fsync(f.backing_fd)) {
+		fprintf(stderr, "Can't sync %s: %m\n", argv[optind + 1]);
+		ret = 1;
+	}
+	if (f.err)
+		ret = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s %" PRIu64 " dirty extents, %" PRIu64 " sectors in %"
+	       PRIu64 " writes", f.dry_run ? "Would flush" : "Flushed",
+	       f.extents, f.bytes >> 9, f.ios);
+	if (!f.dry_run)
+		printf(", %.1f MB/s", secs > 0 ? f.bytes / secs / 1e6 : 0);
+	printf("\n");
+	if (meta_errors(&c.err)) {
+		fprintf(stderr,
+			"Warning: parts of the journal or btree failed to verify\n");
+		ret = 1;
+	}
+out:
+	dirty_map_free(&m);
+	if (f.cache_fd >= 0)
+		close(f.cache_fd);
+	if (f.cache_bfd >= 0)
+		close(f.cache_bfd);
+	if (f.backing_fd >= 0)
+		close(f.backing_fd);
+	if (f.backing_bfd >= 0)
+		close(f.backing_bfd);
+	cache_close(&c);
+	return ret;
+}
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __FLUSH_H
+#define __FLUSH_H
+
+int flush_usage(void);
+int bcache_flush(int argc, char **argv);
+
+#endif
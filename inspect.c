@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache inspect: what is on a cache device that isn't registered. The
+ * journal and the btree are read and verified with btree.c, and summed up
+ * into how much of each backing device is cached and how much is dirty.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uuid/uuid.h>
+
+#include "bcache.h"
+#include "btree.h"
+#include "dirtymap.h"
+#include "inspect.h"
+
+struct inspect {
+	bool			journal;	/* list the journal entries */
+	bool			keys;		/* list the btree nodes */
+	bool			map;		/* print the dirty extent map */
+
+	uint64_t		journal_keys;
+	uint64_t		journal_dirty;	/* sectors */
+
+	uint64_t		nodes[8];	/* per level */
+	uint64_t		extents;
+	uint64_t		cached;		/* sectors */
+	uint64_t		dirty;
+	uint64_t		*inode_dirty;
+	uint64_t		*inode_cached;
+	unsigned int		nr_inodes;
+};
+
+/* Keys in the column of the values, like bcache-super-show */
+static void field(const char *key)
+{
+	int n = strlen(key);
+
+	printf("%s\t", key);
+	for (n = n / 8 + 1; n < 3; n++)
+		putchar('\t');
+}
+
+static void print_key(struct cache_dev *c, const struct bkey *k)
+{
+	unsigned int i;
+
+	printf("\t%" PRIu64 ":%" PRIu64 " len %" PRIu64,
+	       KEY_INODE(k), KEY_START(k), KEY_SIZE(k));
+	for (i = 0; i < KEY_PTRS(k); i++)
+		printf(" ptr %" PRIu64 ":%" PRIu64 " gen %" PRIu64 "%s",
+		       PTR_DEV(k, i), PTR_OFFSET(k, i), PTR_GEN(k, i),
+		       PTR_DEV(k, i) == c->sb.nr_this_dev &&
+		       ptr_stale(c, k, i) ? " stale" : "");
+	printf("%s\n", KEY_DIRTY(k) ? " dirty" : "");
+}
+
+static int inode_grow(struct inspect *in, uint64_t inode)
+{
+	unsigned int nr = inode + 1;
+	uint64_t *d, *ca;
+
+	if (inode < in->nr_inodes)
+		return 0;
+
+	d = realloc(in->inode_dirty, nr * sizeof(*d));
+	if (d)
+		in->inode_dirty = d;
+	ca = realloc(in->inode_cached, nr * sizeof(*ca));
+	if (ca)
+		in->inode_cached = ca;
+	if (!d || !ca) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	memset(d + in->nr_inodes, 0, (nr - in->nr_inodes) * sizeof(*d));
+	memset(ca + in->nr_inodes, 0, (nr - in->nr_inodes) * sizeof(*ca));
+	in->nr_inodes = nr;
+	return 0;
+}
+
+static int inspect_jset(struct cache_dev *c, struct jset *j, void *arg)
+{
+	struct inspect *in = arg;
+	struct bkey *k;
+
+	if (in->journal)
+		printf("jset seq %" PRIu64 " last_seq %" PRIu64 " u64s %u\n",
+		       j->seq, j->last_seq, j->keys);
+
+	for_each_set_key(k, j) {
+		in->journal_keys++;
+		if (KEY_DIRTY(k) && !extent_bad(c, k))
+			in->journal_dirty += KEY_SIZE(k);
+		if (in->journal)
+			print_key(c, k);
+	}
+	return 0;
+}
+
+static int inspect_extent(const struct bkey *k, uint64_t start, uint64_t end,
+			  void *arg)
+{
+	struct inspect *in = arg;
+	uint64_t sectors = end - start;
+
+	if (inode_grow(in, KEY_INODE(k)))
+		return -1;
+
+	in->extents++;
+	in->cached += sectors;
+	in->inode_cached[KEY_INODE(k)] += sectors;
+	if (KEY_DIRTY(k)) {
+		in->dirty += sectors;
+		in->inode_dirty[KEY_INODE(k)] += sectors;
+	}
+	return 0;
+}
+
+static int inspect_node(struct cache_dev *c, struct btree_node *b, void *arg)
+{
+	struct inspect *in = arg;
+	struct bkey *k;
+	unsigned int i;
+
+	if (b->level < 8)
+		in->nodes[b->level]++;
+
+	if (in->keys) {
+		printf("node level %u offset %" PRIu64 " sectors %u seq %" PRIx64
+		       " bsets %u\n",
+		       b->level, b->offset, b->sectors, b->seq, b->nr_bsets);
+		for (i = 0; i < b->nr_bsets; i++)
+			for_each_set_key(k, b->bsets[i])
+				print_key(c, k);
+	}
+
+	if (b->level)
+		return 0;
+	return btree_node_extents(c, b, inspect_extent, in);
+}
+
+static void print_summary(struct cache_dev *c, struct inspect *in,
+			  double secs)
+{
+	char uuid[40], label[SB_LABEL_SIZE + 1], key[64];
+	uint64_t bytes, levels;
+	struct uuid_entry *u;
+	unsigned int i;
+
+	uuid_unparse(c->sb.set_uuid, uuid);
+	field("cset.uuid");
+	printf("%s\n", uuid);
+	field("dev.sectors_per_block");
+	printf("%u\n", c->sb.block_size);
+	field("dev.sectors_per_bucket");
+	printf("%u\n", c->sb.bucket_size);
+	field("dev.cache.nbuckets");
+	printf("%" PRIu64 "\n", (uint64_t) c->sb.nbuckets);
+
+	field("journal.buckets");
+	printf("%u\n", c->sb.njournal_buckets);
+	field("journal.entries");
+	printf("%u\n", c->nr_journal);
+	field("journal.seq");
+	printf("%" PRIu64 "-%" PRIu64 "\n",
+	       c->jset->last_seq, c->jset->seq);
+	field("journal.keys");
+	printf("%" PRIu64 "\n", in->journal_keys);
+	field("journal.dirty_sectors");
+	printf("%" PRIu64 "\n", in->journal_dirty);
+
+	levels = c->jset->btree_level + 1;
+	field("btree.levels");
+	printf("%" PRIu64 "\n", levels);
+	for (i = 0; i < levels && i < 8; i++) {
+		snprintf(key, sizeof(key), "btree.level%u.nodes", i);
+		field(key);
+		printf("%" PRIu64 "\n", in->nodes[i]);
+	}
+	field("btree.bytes");
+	printf("%" PRIu64 "\n", c->btree_bytes);
+	field("btree.extents");
+	printf("%" PRIu64 "\n", in->extents);
+	field("btree.cached_sectors");
+	printf("%" PRIu64 "\n", in->cached);
+	field("btree.dirty_sectors");
+	printf("%" PRIu64 "\n", in->dirty);
+
+	for (i = 0; i < in->nr_inodes; i++) {
+		if (!in->inode_cached[i])
+			continue;
+		u = i < c->nr_uuids ? &c->uuids[i] : NULL;
+		if (u && !(u->flags & UUID_FLASH_ONLY))
+			uuid_unparse(u->uuid, uuid);
+		else
+			strcpy(uuid, u ? "(flash only)" : "(unknown)");
+		memcpy(label, u ? (char *) u->label : "", SB_LABEL_SIZE);
+		label[SB_LABEL_SIZE] = '\0';
+
+		snprintf(key, sizeof(key), "inode%u.uuid", i);
+		field(key);
+		printf("%s\n", uuid);
+		if (*label) {
+			snprintf(key, sizeof(key), "inode%u.label", i);
+			field(key);
+			printf("%s\n", label);
+		}
+		snprintf(key, sizeof(key), "inode%u.cached_sectors", i);
+		field(key);
+		printf("%" PRIu64 "\n", in->inode_cached[i]);
+		snprintf(key, sizeof(key), "inode%u.dirty_sectors", i);
+		field(key);
+		printf("%" PRIu64 "\n", in->inode_dirty[i]);
+	}
+
+	field("errors.journal_io");
+	printf("%u\n", c->err.journal_io);
+	field("errors.journal_csum");
+	printf("%u\n", c->err.journal_csum);
+	field("errors.prio_csum");
+	printf("%u\n", c->err.prio_csum);
+	field("errors.btree_io");
+	printf("%u\n", c->err.btree_io);
+	field("errors.btree_magic");
+	printf("%u\n", c->err.btree_magic);
+	field("errors.btree_csum");
+	printf("%u\n", c->err.btree_csum);
+	field("errors.bad_keys");
+	printf("%u\n", c->err.bad_keys);
+
+	bytes = (uint64_t) c->sb.njournal_buckets * c->bucket_bytes +
+		c->btree_bytes;
+	field("read.bytes");
+	printf("%" PRIu64 "\n", bytes);
+	field("read.mb_per_sec");
+	printf("%.1f\n", secs > 0 ? bytes / secs / 1e6 : 0);
+}
+
+/* Adjacent extents of the map merged, as it's printed */
+struct map_printer {
+	struct cache_dev	*c;
+	struct dirty_extent	cur;
+	bool			have;
+	uint64_t		extents;
+};
+
+static void map_print_inode(struct cache_dev *c, uint64_t inode)
+{
+	struct uuid_entry *u = inode < c->nr_uuids ? &c->uuids[inode] : NULL;
+	char uuid[40] = "(unknown)";
+
+	if (u)
+		uuid_unparse(u->uuid, uuid);
+	printf("# inode %" PRIu64 " uuid %s label %.*s\n",
+	       inode, uuid, SB_LABEL_SIZE, u ? (char *) u->label : "");
+}
+
+static void map_flush(struct map_printer *p)
+{
+	if (!p->have)
+		return;
+	printf("%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+	       p->cur.inode, p->cur.start, p->cur.end - p->cur.start);
+	p->extents++;
+}
+
+static int map_print(const struct dirty_extent *e, void *arg)
+{
+	struct map_printer *p = arg;
+
+	if (p->have && p->cur.inode == e->inode && p->cur.end == e->start) {
+		p->cur.end = e->end;
+		return 0;
+	}
+
+	map_flush(p);
+	if (!p->have || p->cur.inode != e->inode)
+		map_print_inode(p->c, e->inode);
+	p->cur = *e;
+	p->have = true;
+	return 0;
+}
+
+/* The dirty extents of every backing device, in inode and offset order */
+static int print_map(struct cache_dev *c)
+{
+	struct map_printer p = { .c = c };
+	struct dirty_map m;
+	int ret;
+
+	ret = dirty_map_build(c, &m);
+	if (!ret) {
+		printf("# inode\tstart\tsectors\n");
+		ret = dirty_map_walk(&m, map_print, &p);
+		map_flush(&p);
+		printf("# %" PRIu64 " extents, %" PRIu64 " dirty sectors\n",
+		       p.extents, m.sectors);
+		if (m.elsewhere)
+			printf("# %" PRIu64 " dirty sectors on other caches\n",
+			       m.elsewhere);
+	}
+	dirty_map_free(&m);
+	return ret;
+}
+
+static bool cache_errors(const struct cache_errors *e)
+{
+	return e->journal_io || e->journal_csum || e->prio_csum ||
+		e->prio_magic || e->btree_io || e->btree_magic ||
+		e->btree_csum || e->bad_keys;
+}
+
+int inspect_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	inspect [option] {devname}\n"
+		"	read and verify the journal and btree of a cache device\n"
+		"	that isn't registered, and sum up its cached and dirty data\n"
+		"	-j	--journal		list the journal entries and their keys\n"
+		"	-k	--keys			list the btree nodes and their keys\n"
+		"	-m	--dirty-map		print the dirty extents of every backing device\n"
+		"	-h	--help			show help information\n"
+		"	exits 1 if anything failed verification, 2 if the device\n"
+		"	can't be read\n");
+	return EXIT_FAILURE;
+}
+
+int bcache_inspect(int argc, char **argv)
+{
+	struct inspect in = { 0 };
+	struct cache_dev c;
+	struct timespec start, end;
+	double secs;
+	int o, ret = 2;
+
+	static struct option opts[] = {
+		{ "journal",	0, NULL,	'j' },
+		{ "keys",	0, NULL,	'k' },
+		{ "dirty-map",	0, NULL,	'm' },
+		{ "help",	0, NULL,	'h' },
+		{ NULL,		0, NULL,	0 },
+	};
+
+	while ((o = getopt_long(argc, argv, "jkmh", opts, NULL)) != -1)
+		switch (o) {
+		case 'j':
+			in.journal = true;
+			break;
+		case 'k':
+			in.keys = true;
+			break;
+		case 'm':
+			in.map = true;
+			break;
+		default:
+			return inspect_usage();
+		}
+
+	if (argc != optind + 1 || (in.map && (in.journal || in.keys)))
+		return inspect_usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (cache_open(&c, argv[optind]))
+		return 2;
+	if (cache_read_journal(&c))
+		goto out;
+
+	/* Without prios or uuids stale keys count, and devices have no name */
+	cache_read_prios(&c);
+	cache_read_uuids(&c);
+
+	if (in.map) {
+		if (!print_map(&c))
+			ret = cache_errors(&c.err) || !c.gens ? 1 : 0;
+		goto out;
+	}
+
+	if (cache_journal_replay(&c, inspect_jset, &in) ||
+	    cache_walk_btree(&c, inspect_node, &in))
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	print_summary(&c, &in, secs);
+	ret = cache_errors(&c.err) || !c.gens ? 1 : 0;
+out:
+	free(in.inode_dirty);
+	free(in.inode_cached);
+	cache_close(&c);
+	return ret;
+}
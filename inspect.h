@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __INSPECT_H
+#define __INSPECT_H
+
+int inspect_usage(void);
+int bcache_inspect(int argc, char **argv);
+
+#endif
@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * On disk cache of the device scan, see inventory.h.
+ *
+ * The file is a header followed by one entry per bcache device. It is only
+ * trusted while the set of block devices is unchanged: the header keeps an
+ * order independent hash of the names in /sys/class/block, and every entry
+ * the device number its /dev node had. Checking it costs one readdir and a
+ * stat() per bcache device.
+ *
+ * Writers take an flock on a lock file next to it and replace the file
+ * with rename(), so readers never need the lock. A generation number lets
+ * a full scan notice udev having updated the file while it was running.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+#include "inventory.h"
+
+#define INVENTORY_MAGIC		0x766e696568636362ULL	/* "bcacheinv" */
+#define INVENTORY_VERSION	1
+
+struct inventory_header {
+	uint64_t		magic;
+	uint32_t		version;
+	uint32_t		entry_size;
+	uint64_t		generation;
+
+	/* Names in /sys/class/block: xor of their crc64, and their number */
+	uint64_t		names_hash;
+	uint32_t		names_nr;
+	uint32_t		nr;
+
+	/* crc64 of the entries */
+	uint64_t		csum;
+};
+
+struct names_hash {
+	uint64_t		hash;
+	uint32_t		nr;
+};
+
+/* BCACHE_INVENTORY overrides the path, set to "" it disables the cache */
+static const char *inventory_path(void)
+{
+	static char root_path[PATH_MAX];
+	const char *path = getenv("BCACHE_INVENTORY");
+
+	if (!path) {
+		if (!*root_prefix())
+			return INVENTORY_FILE;
+		snprintf(root_path, sizeof(root_path), "%s%s", root_prefix(),
+			 INVENTORY_FILE);
+		return root_path;
+	}
+	return *path ? path : NULL;
+}
+
+static inline uint64_t name_hash(const char *name)
+{
+	return crc64(name, strlen(name));
+}
+
+static int hash_names(struct names_hash *h)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/sys/class/block", root_prefix());
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	h->hash = 0;
+	h->nr = 0;
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		h->hash ^= name_hash(d->d_name);
+		h->nr++;
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int read_file(const char *path, struct inventory_header *hdr,
+		     struct inventory_entry **entries)
+{
+	struct inventory_entry *e = NULL;
+	size_t size;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (read(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+	    hdr->magic != INVENTORY_MAGIC ||
+	    hdr->version != INVENTORY_VERSION ||
+	    hdr->entry_size != sizeof(*e))
+		goto out;
+
+	size = (size_t) hdr->nr * sizeof(*e);
+	e = malloc(size ? size : 1);
+	if (!e)
+		goto out;
+
+	if (read(fd, e, size) != (ssize_t) size ||
+	    crc64(e, size) != hdr->csum) {
+		free(e);
+		goto out;
+	}
+
+	*entries = e;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int write_file(const char *path, struct inventory_header *hdr,
+		      struct inventory_entry *entries)
+{
+	size_t size = (size_t) hdr->nr * sizeof(*entries);
+	char tmp[PATH_MAX];
+	int fd;
+
+	hdr->magic = INVENTORY_MAGIC;
+	hdr->version = INVENTORY_VERSION;
+	hdr->entry_size = sizeof(*entries);
+	hdr->csum = crc64(entries, size);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+	    write(fd, entries, size) != (ssize_t) size) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Leaves a header that never validates, but keeps the generation going */
+static void mark_stale(const char *path, uint64_t generation)
+{
+	struct inventory_header hdr = {
+		.generation	= generation + 1,
+		.names_nr	= UINT32_MAX,
+	};
+
+	if (write_file(path, &hdr, NULL))
+		unlink(path);
+}
+
+static int lock_inventory(const char *path, bool create)
+{
+	char lock[PATH_MAX], *p;
+	int fd;
+
+	if (create) {
+		/* The directory is created, its parent has to exist */
+		snprintf(lock, sizeof(lock), "%s", path);
+		p = strrchr(lock, '/');
+		if (p && p != lock) {
+			*p = '\0';
+			mkdir(lock, 0755);
+		}
+	}
+
+	snprintf(lock, sizeof(lock), "%s.lock", path);
+	fd = open(lock, O_RDWR|(create ? O_CREAT : 0), 0644);
+	if (fd < 0)
+		return -1;
+
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Returns 0 and the cached entries if the inventory is still valid. On
+ * failure *generation is what a following inventory_save() should pass.
+ */
+int inventory_load(struct inventory_entry **entries, unsigned int *nr,
+		   uint64_t *generation)
+{
+	const char *path = inventory_path();
+	struct inventory_header hdr;
+	struct inventory_entry *e;
+	struct names_hash names;
+	char dev[PATH_MAX];
+	struct stat st;
+	unsigned int i;
+
+	*generation = 0;
+	if (!path || read_file(path, &hdr, &e))
+		return -1;
+	*generation = hdr.generation;
+
+	if (hash_names(&names) ||
+	    names.hash != hdr.names_hash || names.nr != hdr.names_nr)
+		goto stale;
+
+	for (i = 0; i < hdr.nr; i++) {
+		snprintf(dev, sizeof(dev), "%s/dev/%s", root_prefix(),
+			 e[i].name);
+		if (stat(dev, &st) || !S_ISBLK(st.st_mode) ||
+		    st.st_rdev != e[i].rdev)
+			goto stale;
+	}
+
+	*entries = e;
+	*nr = hdr.nr;
+	return 0;
+stale:
+	free(e);
+	return -1;
+}
+
+/*
+ * Stores the result of a full scan, unless someone else has written the
+ * inventory since it was loaded with generation. Failing to write it is
+ * not an error, unprivileged users just don't get the cache.
+ */
+int inventory_save(struct inventory_entry *entries, unsigned int nr,
+		   uint64_t generation)
+{
+	const char *path = inventory_path();
+	struct inventory_header hdr = { 0 };
+	struct inventory_entry *old;
+	struct names_hash names;
+	int lock, ret = 0;
+
+	if (!path)
+		return 0;
+
+	lock = lock_inventory(path, true);
+	if (lock < 0)
+		return 0;
+
+	/* Updated or invalidated while we were scanning? */
+	if (!read_file(path, &hdr, &old)) {
+		free(old);
+		if (hdr.generation != generation)
+			goto out;
+	} else if (generation) {
+		goto out;
+	}
+
+	if (hash_names(&names))
+		goto out;
+
+	hdr.generation = generation + 1;
+	hdr.names_hash = names.hash;
+	hdr.names_nr = names.nr;
+	hdr.nr = nr;
+	ret = write_file(path, &hdr, entries);
+out:
+	close(lock);
+	return ret;
+}
+
+static int probe_entry(struct inventory_entry *e, const char *name)
+{
+	struct cache_sb_disk *sb_disk;
+	char dev[PATH_MAX];
+	struct stat st;
+
+	snprintf(dev, sizeof(dev), "%s/dev/%s", root_prefix(), name);
+	sb_disk = sb_read_dev(dev, &st);
+	if (!sb_disk || !S_ISBLK(st.st_mode) || !sb_is_bcache(sb_disk))
+		return -1;
+
+	memset(e, 0, sizeof(*e));
+	strcpy(e->name, name);
+	e->rdev = st.st_rdev;
+	e->csum = sb_csum(sb_disk);
+	to_cache_sb(&e->sb, sb_disk);
+	return 0;
+}
+
+/*
+ * Called from udev for every event on a block device. An existing
+ * inventory is updated if it was valid before the event, otherwise it is
+ * dropped and the next scan rebuilds it.
+ */
+int inventory_update(const char *name)
+{
+	const char *path = inventory_path();
+	struct inventory_entry *e, *new, found;
+	struct inventory_header hdr;
+	struct names_hash names;
+	char sys[PATH_MAX];
+	struct stat st;
+	uint64_t before;
+	unsigned int i;
+	bool present, bcache;
+	int lock, ret = -1;
+
+	if (!path || strlen(name) > NAME_MAX || strchr(name, '/'))
+		return -1;
+
+	lock = lock_inventory(path, false);
+	if (lock < 0)
+		return 0;
+
+	if (read_file(path, &hdr, &e)) {
+		/* Nothing to update */
+		ret = 0;
+		goto out;
+	}
+
+	if (hash_names(&names))
+		goto drop;
+
+	/* What the names looked like before this device came or went */
+	snprintf(sys, sizeof(sys), "%s/sys/class/block/%s", root_prefix(),
+		 name);
+	present = !lstat(sys, &st);
+	before = names.hash ^ name_hash(name);
+
+	if (!(names.hash == hdr.names_hash && names.nr == hdr.names_nr) &&
+	    !(before == hdr.names_hash &&
+	      names.nr + (present ? -1 : 1) == hdr.names_nr))
+		goto drop;
+
+	bcache = present && !probe_entry(&found, name);
+
+	for (i = 0; i < hdr.nr; i++)
+		if (!strcmp(e[i].name, name))
+			break;
+
+	if (i < hdr.nr) {
+		if (bcache)
+			e[i] = found;
+		else
+			e[i] = e[--hdr.nr];
+	} else if (bcache) {
+		new = realloc(e, (hdr.nr + 1) * sizeof(*e));
+		if (!new)
+			goto drop;
+		e = new;
+		e[hdr.nr++] = found;
+	}
+
+	hdr.generation++;
+	hdr.names_hash = names.hash;
+	hdr.names_nr = names.nr;
+	ret = write_file(path, &hdr, e);
+	if (!ret)
+		goto free;
+drop:
+	mark_stale(path, hdr.generation);
+free:
+	free(e);
+out:
+	close(lock);
+	return ret;
+}
+
+/* Super blocks are about to change, make the next command rescan */
+void inventory_invalidate(void)
+{
+	const char *path = inventory_path();
+	struct inventory_header hdr = { 0 };
+	struct inventory_entry *e;
+	int lock;
+
+	if (!path)
+		return;
+
+	lock = lock_inventory(path, false);
+	if (lock < 0)
+		return;
+
+	if (!read_file(path, &hdr, &e)) {
+		free(e);
+		mark_stale(path, hdr.generation);
+	}
+	close(lock);
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __INVENTORY_H
+#define __INVENTORY_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+/*
+ * Device inventory
+ *
+ * A cache of the bcache super blocks found by the last device scan, so
+ * that repeated bcache(8) invocations don't have to open and read every
+ * block device in the system. Kept up to date by probe-bcache -i from
+ * udev, and dropped by commands that change a super block.
+ */
+#define INVENTORY_FILE		"/run/bcache/inventory"
+
+struct inventory_entry {
+	char			name[NAME_MAX + 1];
+	dev_t			rdev;
+	uint64_t		csum;
+	struct cache_sb		sb;
+};
+
+int inventory_load(struct inventory_entry **entries, unsigned int *nr,
+		   uint64_t *generation);
+int inventory_save(struct inventory_entry *entries, unsigned int nr,
+		   uint64_t generation);
+int inventory_update(const char *name);
+void inventory_invalidate(void);
+
+#endif
@@ -1,26 +1,50 @@
 // SPDX-License-Identifier: GPL-2.0
 // Author: Shaoxiong Li <dahefanteng@gmail.com>
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdbool.h>
 #include <blkid.h>
 #include <dirent.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <uuid.h>
 #include <string.h>
 #include <malloc.h>
 #include <regex.h>
+#include <pthread.h>
 
 #include "bcache.h"
 #include "lib.h"
 #include "bitwise.h"
+#include "inventory.h"
+#include "profile.h"
 /*
  * utils function
  */
 
+/*
+ * What /sys, /dev and /run are found under, from BCACHE_ROOT: make bench
+ * points the tools at a synthetic device tree with it. Empty normally.
+ */
+const char *root_prefix(void)
+{
+	static const char *root;
+
+	if (!root) {
+		root = getenv("BCACHE_ROOT");
+		if (!root)
+			root = "";
+	}
+	return root;
+}
+
 static unsigned int log2_u32(uint32_t n)
 {
 	int r = 0;
@@ -117,6 +141,66 @@ void print_encode(char *in)
 			printf("%%%x", *pos);
 }
 
+/*
+ * What the text output of show and bcache-super-show has in brackets, for
+ * the machine readable output. NULL for values the tools don't know.
+ */
+const char *sb_type_name(uint64_t version)
+{
+	switch (version) {
+	case BCACHE_SB_VERSION_CDEV:
+	case BCACHE_SB_VERSION_CDEV_WITH_UUID:
+	case BCACHE_SB_VERSION_CDEV_WITH_FEATURES:
+		return "cache";
+	case BCACHE_SB_VERSION_BDEV:
+	case BCACHE_SB_VERSION_BDEV_WITH_OFFSET:
+	case BCACHE_SB_VERSION_BDEV_WITH_FEATURES:
+		return "data";
+	}
+	return NULL;
+}
+
+const char *cache_mode_name(unsigned int mode)
+{
+	static const char * const names[] = {
+		[CACHE_MODE_WRITETHROUGH]	= "writethrough",
+		[CACHE_MODE_WRITEBACK]		= "writeback",
+		[CACHE_MODE_WRITEAROUND]	= "writearound",
+		[CACHE_MODE_NONE]		= "none",
+	};
+
+	if (mode >= sizeof(names) / sizeof(names[0]))
+		return NULL;
+	return names[mode];
+}
+
+const char *bdev_state_name(unsigned int state)
+{
+	static const char * const names[] = {
+		[BDEV_STATE_NONE]	= "detached",
+		[BDEV_STATE_CLEAN]	= "clean",
+		[BDEV_STATE_DIRTY]	= "dirty",
+		[BDEV_STATE_STALE]	= "inconsistent",
+	};
+
+	if (state >= sizeof(names) / sizeof(names[0]))
+		return NULL;
+	return names[state];
+}
+
+const char *cache_replacement_name(unsigned int replacement)
+{
+	static const char * const names[] = {
+		[CACHE_REPLACEMENT_LRU]		= "lru",
+		[CACHE_REPLACEMENT_FIFO]	= "fifo",
+		[CACHE_REPLACEMENT_RANDOM]	= "random",
+	};
+
+	if (replacement >= sizeof(names) / sizeof(names[0]))
+		return NULL;
+	return names[replacement];
+}
+
 bool part_of_disk(char *devname, char *partname)
 {
 	char pattern[40];
@@ -137,17 +221,18 @@ bool part_of_disk(char *devname, char *partname)
 
 int find_location(char *location, char *devname)
 {
-	char path[300];
+	char path[PATH_MAX];
 	DIR *blockdir, *bcachedir, *partdir = NULL;
 	struct dirent *ptr;
 
-	blockdir = opendir("/sys/block");
+	snprintf(path, sizeof(path), "%s/sys/block", root_prefix());
+	blockdir = PROF(PROF_SYSFS, opendir(path));
 	if (blockdir == NULL) {
 		fprintf(stderr, "Failed to open dir /sys/block/\n");
 		return 1;
 	}
-	sprintf(path, "/sys/block/%s/bcache", devname);
-	bcachedir = opendir(path);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache", root_prefix(), devname);
+	bcachedir = PROF(PROF_SYSFS, opendir(path));
 	if (bcachedir != NULL) {
 		strcpy(location, devname);
 		closedir(bcachedir);
@@ -155,9 +240,9 @@ int find_location(char *location, char *devname)
 	}
 	while ((ptr = readdir(blockdir)) != NULL) {
 		if (prefix_with(devname, ptr->d_name)) {
-			sprintf(path, "/sys/block/%s/%s", ptr->d_name,
+			snprintf(path, sizeof(path), "%s/sys/block/%s/%s", root_prefix(), ptr->d_name,
 				devname);
-			partdir = opendir(path);
+			partdir = PROF(PROF_SYSFS, opendir(path));
 			if (partdir != NULL) {
 				sprintf(location, "%s/%s", ptr->d_name,
 					devname);
@@ -175,7 +260,7 @@ int get_backdev_state(char *devname, char *state)
 {
 	FILE *fd;
 	int ret;
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 	char buf[40];
 
@@ -183,8 +268,8 @@ int get_backdev_state(char *devname, char *state)
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/state", location);
-	fd = fopen(path, "r");
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/state", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, fopen(path, "r"));
 	if (fd == NULL) {
 		strcpy(state, BCACHE_BASIC_STATE_INACTIVE);
 		return 0;
@@ -198,8 +283,8 @@ int get_backdev_state(char *devname, char *state)
 
 	int fd_run;
 
-	sprintf(path, "/sys/block/%s/bcache/running", location);
-	fd_run = open(path, O_RDONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/running", root_prefix(), location);
+	fd_run = PROF(PROF_SYSFS, open(path, O_RDONLY));
 	if (fd_run < 0) {
 		fprintf(stderr,
 			"Failed to open %s\n", path);
@@ -209,7 +294,7 @@ int get_backdev_state(char *devname, char *state)
 	char running[20];
 	int num;
 
-	num = read(fd_run, running, 10);
+	num = PROF(PROF_SYSFS, read(fd_run, running, 10));
 	if (num < 0) {
 		fprintf(stderr, "Failed to fetch running infomation\n");
 		close(fd_run);
@@ -224,10 +309,10 @@ int get_backdev_state(char *devname, char *state)
 int get_cachedev_state(char *cset_id, char *state)
 {
 	DIR *dir = NULL;
-	char path[100];
+	char path[PATH_MAX];
 
-	sprintf(path, "/sys/fs/bcache/%s/", cset_id);
-	dir = opendir(path);
+	snprintf(path, sizeof(path), "%s/sys/fs/bcache/%s/", root_prefix(), cset_id);
+	dir = PROF(PROF_SYSFS, opendir(path));
 	if (dir == NULL)
 		strcpy(state, BCACHE_BASIC_STATE_INACTIVE);
 	else
@@ -254,7 +339,7 @@ int get_state(struct dev *dev, char *state)
 int get_dev_bname(char *devname, char *bname)
 {
 	int ret;
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 	char buf[40];
 	char link[100];
@@ -263,8 +348,8 @@ int get_dev_bname(char *devname, char *bname)
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/dev", location);
-	ret = readlink(path, link, sizeof(link));
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/dev", root_prefix(), location);
+	ret = PROF(PROF_SYSFS, readlink(path, link, sizeof(link)));
 	if (ret < 0)
 		strcpy(bname, BCACHE_BNAME_NOT_EXIST);
 	else {
@@ -288,7 +373,7 @@ int get_bname(struct dev *dev, char *bname)
 int get_backdev_attachpoint(char *devname, char *point)
 {
 	int ret;
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 	char buf[20];
 	char link[100];
@@ -298,8 +383,8 @@ int get_backdev_attachpoint(char *devname, char *point)
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/cache", location);
-	ret = readlink(path, link, sizeof(link));
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/cache", root_prefix(), location);
+	ret = PROF(PROF_SYSFS, readlink(path, link, sizeof(link)));
 	if (ret < 0)
 		strcpy(point, BCACHE_BNAME_NOT_EXIST);
 	else {
@@ -321,14 +406,85 @@ int get_point(struct dev *dev, char *point)
 	return 0;
 }
 
-int cset_to_devname(struct list_head *head, char *cset, char *devname)
+static inline struct hlist_head *dev_table_bucket(struct hlist_head *table,
+						  unsigned int mask,
+						  const char *uuid)
+{
+	return &table[crc64(uuid, strlen(uuid)) & mask];
+}
+
+int dev_table_init(struct dev_table *t, struct list_head *head)
+{
+	unsigned int i, size = 16, nr = 0;
+	struct dev *dev;
+
+	list_for_each_entry(dev, head, dev_list)
+		nr++;
+	while (size < nr)
+		size <<= 1;
+
+	t->mask = size - 1;
+	t->cset = calloc(size, sizeof(*t->cset));
+	t->attach = calloc(size, sizeof(*t->attach));
+	if (!t->cset || !t->attach) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		dev_table_exit(t);
+		return 1;
+	}
+	for (i = 0; i < size; i++) {
+		INIT_HLIST_HEAD(&t->cset[i]);
+		INIT_HLIST_HEAD(&t->attach[i]);
+	}
+
+	/*
+	 * Added in reverse, so that every chain is in scan order: joins
+	 * print devices in the same order as walking the list did.
+	 */
+	list_for_each_entry_reverse(dev, head, dev_list) {
+		if (SB_VERSION_IS_CDEV(dev->version))
+			hlist_add_head(&dev->cset_node,
+				       dev_table_bucket(t->cset, t->mask,
+							dev->cset));
+		hlist_add_head(&dev->attach_node,
+			       dev_table_bucket(t->attach, t->mask,
+						dev->attachuuid));
+	}
+	return 0;
+}
+
+void dev_table_exit(struct dev_table *t)
+{
+	free(t->cset);
+	free(t->attach);
+	t->cset = t->attach = NULL;
+}
+
+/* The device after prev (NULL for the first) attached to cache set cset */
+struct dev *dev_table_next_attached(struct dev_table *t, const char *cset,
+				    struct dev *prev)
 {
+	struct hlist_node *n = prev ? prev->attach_node.next :
+		dev_table_bucket(t->attach, t->mask, cset)->first;
 	struct dev *dev;
 
-	list_for_each_entry(dev, head, dev_list) {
-		if ((dev->version == BCACHE_SB_VERSION_CDEV
-		     || dev->version == BCACHE_SB_VERSION_CDEV_WITH_UUID)
-		    && strcmp(dev->cset, cset) == 0)
+	for (; n; n = n->next) {
+		dev = hlist_entry(n, struct dev, attach_node);
+		if (!strcmp(dev->attachuuid, cset))
+			return dev;
+	}
+	return NULL;
+}
+
+/* Name of the cache device of cset, the last one scanned if several */
+int cset_to_devname(struct dev_table *t, char *cset, char *devname)
+{
+	struct hlist_node *n;
+	struct dev *dev;
+
+	n = dev_table_bucket(t->cset, t->mask, cset)->first;
+	for (; n; n = n->next) {
+		dev = hlist_entry(n, struct dev, cset_node);
+		if (!strcmp(dev->cset, cset))
 			strcpy(devname, dev->name);
 	}
 	return 0;
@@ -372,142 +528,291 @@ int detail_base(char *devname, struct cache_sb sb, struct dev *base)
 }
 
 
-int may_add_item(char *devname, struct list_head *head)
+/*
+ * Device scan
+ *
+ * Opening a block device and reading its super block may block for a
+ * long time on a loaded host, so list_bdevs() does not do it inline
+ * while walking /sys/block. It first collects every disk and partition
+ * name, then reads the super blocks of all candidates concurrently from
+ * a small pool of threads, and only afterwards runs the sysfs lookups of
+ * detail_base() for the devices whose magic matched. The sysfs part is
+ * done in scan order, so the output ordering is unchanged.
+ */
+#define SCAN_MAX_THREADS	32
+
+struct scan_item {
+	struct inventory_entry	e;
+	bool			found;
+};
+
+struct scan_ctx {
+	struct scan_item	*items;
+	unsigned int		nr;
+	unsigned int		next;
+	scan_fn			fn;
+	void			*arg;
+};
+
+static void scan_probe_item(struct scan_ctx *ctx, struct scan_item *item)
 {
-	struct cache_sb_disk sb_disk;
-	struct cache_sb sb;
-	char dev[512];
-	struct dev *tmp;
-	int ret = 0;
+	struct cache_sb_disk *sb_disk;
+	char dev[PATH_MAX];
+	struct stat st;
+
+	snprintf(dev, sizeof(dev), "%s/dev/%s", root_prefix(), item->e.name);
+	sb_disk = sb_read_dev(dev, &st);
+	if (!sb_disk || !sb_is_bcache(sb_disk))
+		return;
+
+	if (ctx->fn) {
+		ctx->fn(item->e.name, st.st_rdev, sb_disk, ctx->arg);
+		return;
+	}
+	to_cache_sb(&item->e.sb, sb_disk);
+	item->e.rdev = st.st_rdev;
+	item->e.csum = sb_csum(sb_disk);
+	item->found = true;
+}
 
-	if (strcmp(devname, ".") == 0 || strcmp(devname, "..") == 0)
-		return 0;
+static void *scan_worker(void *arg)
+{
+	struct scan_ctx *ctx = arg;
+	unsigned int i;
 
-	sprintf(dev, "/dev/%s", devname);
-	int fd = open(dev, O_RDONLY);
-	if (fd == -1)
-		return 0;
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+	       ctx->nr)
+		scan_probe_item(ctx, &ctx->items[i]);
+	return NULL;
+}
 
-	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk))
-		goto out;
+static void scan_probe_all(struct scan_ctx *ctx)
+{
+	pthread_t threads[SCAN_MAX_THREADS];
+	unsigned int i, nr_threads;
 
-	if (memcmp(sb_disk.magic, bcache_magic, 16))
-		goto out;
+	nr_threads = ctx->nr < SCAN_MAX_THREADS ? ctx->nr : SCAN_MAX_THREADS;
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, scan_worker, ctx))
+			break;
+	nr_threads = i;
 
-	to_cache_sb(&sb, &sb_disk);
+	/* The calling thread helps out, and covers pthread_create failure */
+	scan_worker(ctx);
 
-	tmp = (struct dev *) malloc(DEVLEN);
-	if (tmp == NULL) {
-		fprintf(stderr, "Error: fail to allocate memory buffer\n");
-		ret = 1;
-		goto out;
-	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+}
 
-	tmp->csum = le64_to_cpu(sb_disk.csum);
-	ret = detail_base(dev, sb, tmp);
-	if (ret != 0) {
-		fprintf(stderr, "Failed to get information for %s\n", dev);
-		free(tmp);
-		goto out;
-	}
-	list_add_tail(&tmp->dev_list, head);
+static int scan_add_name(struct scan_ctx *ctx, unsigned int *size,
+			 const char *name)
+{
+	struct scan_item *items;
 
-out:
-	close(fd);
-	return ret;
+	if (ctx->nr == *size) {
+		*size = *size ? *size * 2 : 64;
+		items = realloc(ctx->items, *size * sizeof(*items));
+		if (items == NULL) {
+			fprintf(stderr,
+				"Error: fail to allocate memory buffer\n");
+			return 1;
+		}
+		ctx->items = items;
+	}
+	memset(&ctx->items[ctx->nr], 0, sizeof(struct scan_item));
+	strcpy(ctx->items[ctx->nr].e.name, name);
+	ctx->nr++;
+	return 0;
 }
 
-int list_bdevs(struct list_head *head)
+static int scan_collect(struct scan_ctx *ctx)
 {
-	int ret;
 	DIR *dir, *subdir;
 	struct dirent *ptr, *subptr;
-	char path[300];
+	char path[PATH_MAX];
+	unsigned int size = 0;
+	int ret = 0;
 
-	dir = opendir("/sys/block");
+	snprintf(path, sizeof(path), "%s/sys/block", root_prefix());
+	dir = PROF(PROF_SYSFS, opendir(path));
 	if (dir == NULL) {
 		fprintf(stderr, "Unable to open dir /sys/block\n");
 		return 1;
 	}
-	while ((ptr = readdir(dir)) != NULL) {
+	while (!ret && (ptr = readdir(dir)) != NULL) {
 		if (strcmp(ptr->d_name, ".") == 0
 			|| strcmp(ptr->d_name, "..") == 0)
 			continue;
-		sprintf(path, "/sys/block/%s", ptr->d_name);
-		subdir = opendir(path);
+		snprintf(path, sizeof(path), "%s/sys/block/%s", root_prefix(), ptr->d_name);
+		subdir = PROF(PROF_SYSFS, opendir(path));
 		if (subdir == NULL) {
 			fprintf(stderr, "Unable to open dir /sys/block\n");
-			return 1;
+			ret = 1;
+			break;
 		}
 		while ((subptr = readdir(subdir)) != NULL) {
 			if (strcmp(subptr->d_name, ".") == 0
 				|| strcmp(subptr->d_name, "..") == 0)
 				continue;
 			if (part_of_disk(ptr->d_name, subptr->d_name)) {
-				ret = may_add_item(subptr->d_name, head);
+				ret = scan_add_name(ctx, &size, subptr->d_name);
 				if (ret != 0)
-					return ret;
+					break;
 			}
 		}
-		ret = may_add_item(ptr->d_name, head);
-		if (ret != 0)
-			return ret;
+		closedir(subdir);
+		if (!ret)
+			ret = scan_add_name(ctx, &size, ptr->d_name);
 	}
 	closedir(dir);
-	return 0;
+	return ret;
 }
 
-int __detail_dev(char *devname, struct cache_sb_disk *sb_disk,
-		 struct bdev *bd, struct cdev *cd, int *type)
+/* Full scan, returns the bcache devices found in scan order */
+static int scan_devices(struct inventory_entry **entries, unsigned int *nr)
 {
-	struct cache_sb sb;
-	uint64_t expected_csum;
+	struct scan_ctx ctx = { 0 };
+	unsigned int i;
+	int ret;
 
-	to_cache_sb(&sb, sb_disk);
+	*entries = NULL;
+	*nr = 0;
 
-	if (memcmp(sb.magic, bcache_magic, 16)) {
-		fprintf(stderr,
-			"Bad magic, make sure this is an bcache device\n");
-		goto Fail;
+	ret = scan_collect(&ctx);
+	if (ret != 0)
+		goto out;
+
+	scan_probe_all(&ctx);
+
+	*entries = malloc((ctx.nr ? ctx.nr : 1) * sizeof(**entries));
+	if (*entries == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		ret = 1;
+		goto out;
 	}
 
-	if (!(sb.offset == SB_SECTOR)) {
-		fprintf(stderr, "Invalid superblock (bad sector)\n");
-		goto Fail;
+	for (i = 0; i < ctx.nr; i++)
+		if (ctx.items[i].found)
+			(*entries)[(*nr)++] = ctx.items[i].e;
+out:
+	free(ctx.items);
+	return ret;
+}
+
+/*
+ * The same parallel pass, handing every super block with the bcache magic
+ * to fn as it is read. fn runs in the scan threads, concurrently with
+ * itself, and sb_disk is only valid until it returns.
+ */
+int scan_each(scan_fn fn, void *arg)
+{
+	struct scan_ctx ctx = { .fn = fn, .arg = arg };
+	int ret;
+
+	ret = scan_collect(&ctx);
+	if (ret == 0)
+		scan_probe_all(&ctx);
+	free(ctx.items);
+	return ret;
+}
+
+static int may_add_item(struct inventory_entry *e, struct list_head *head)
+{
+	char dev[NAME_MAX + 6];
+	struct dev *tmp;
+	int ret;
+
+	sprintf(dev, "/dev/%s", e->name);
+	tmp = (struct dev *) malloc(DEVLEN);
+	if (tmp == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		return 1;
 	}
 
-	expected_csum = csum_set(sb_disk);
-	if (le64_to_cpu(sb_disk->csum) != expected_csum) {
-		fprintf(stderr, "Csum is not match with expected one\n");
-		goto Fail;
+	tmp->csum = e->csum;
+	ret = detail_base(dev, e->sb, tmp);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to get information for %s\n", dev);
+		free(tmp);
+		return ret;
+	}
+	list_add_tail(&tmp->dev_list, head);
+	return 0;
+}
+
+/*
+ * The super blocks come from the inventory when it is still valid, and
+ * only otherwise from a full scan, which then refreshes the inventory.
+ * Device state always comes from sysfs.
+ */
+int list_bdevs(struct list_head *head)
+{
+	struct inventory_entry *entries;
+	unsigned int i, nr;
+	uint64_t generation;
+	int ret = 0;
+
+	if (inventory_load(&entries, &nr, &generation)) {
+		ret = scan_devices(&entries, &nr);
+		if (ret != 0)
+			goto out;
+		inventory_save(entries, nr, generation);
 	}
 
+	for (i = 0; i < nr; i++) {
+		ret = may_add_item(&entries[i], head);
+		if (ret != 0)
+			break;
+	}
+out:
+	free(entries);
+	return ret;
+}
+
+/*
+ * What __detail_dev() checks before it trusts a super block: NULL if sb,
+ * decoded from sb_disk, passes, or what is wrong with it.
+ */
+const char *sb_check(const struct cache_sb_disk *sb_disk,
+		     const struct cache_sb *sb)
+{
+	if (memcmp(sb->magic, bcache_magic, 16))
+		return "Bad magic, make sure this is an bcache device";
+
+	if (!(sb->offset == SB_SECTOR))
+		return "Invalid superblock (bad sector)";
+
+	if (!sb_csum_ok(sb_disk))
+		return "Csum is not match with expected one";
+
 	/* Check for incompat feature set */
-	if (sb.version >= BCACHE_SB_VERSION_BDEV_WITH_FEATURES ||
-	    sb.version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
-		uint64_t features;
+	if (sb->version >= BCACHE_SB_VERSION_BDEV_WITH_FEATURES ||
+	    sb->version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
+		if (sb->feature_compat & ~BCH_FEATURE_COMPAT_SUPP)
+			return "Unsupported compatible feature found";
+		if (sb->feature_ro_compat & ~BCH_FEATURE_RO_COMPAT_SUPP)
+			return "Unsupported read-only compatible feature found";
+		if (sb->feature_incompat & ~BCH_FEATURE_INCOMPAT_SUPP)
+			return "Unsupported incompatible feature found";
+	}
+	return NULL;
+}
 
-		features = sb.feature_compat & ~BCH_FEATURE_COMPAT_SUPP;
-		if (features) {
-			fprintf(stderr,
-				"Unsupported compatible feature found\n");
-			goto Fail;
-		}
+int __detail_dev(char *devname, struct cache_sb_disk *sb_disk,
+		 struct bdev *bd, struct cdev *cd, int *type)
+{
+	struct cache_sb sb;
+	uint64_t expected_csum;
+	const char *err;
 
-		features = sb.feature_ro_compat & ~BCH_FEATURE_RO_COMPAT_SUPP;
-		if (features) {
-			fprintf(stderr,
-				"Unsupported read-only compatible feature found\n");
-			goto Fail;
-		}
+	to_cache_sb(&sb, sb_disk);
 
-		features = sb.feature_incompat & ~BCH_FEATURE_INCOMPAT_SUPP;
-		if (features) {
-			fprintf(stderr,
-				"Unsupported incompatible feature found\n");
-			goto Fail;
-		}
+	err = sb_check(sb_disk, &sb);
+	if (err) {
+		fprintf(stderr, "%s\n", err);
+		goto Fail;
 	}
+	expected_csum = sb_csum(sb_disk);
 
 	*type = sb.version;
 	if (sb.version == BCACHE_SB_VERSION_BDEV ||
@@ -542,77 +847,76 @@ Fail:
 
 int detail_dev(char *devname, struct bdev *bd, struct cdev *cd, int *type)
 {
-	char *buf = NULL;
-	struct cache_sb_disk *sb_disk = NULL;
-	int buf_size = 16<<10, ret = 1;
+	struct cache_sb_disk *sb_disk;
 	int fd;
 
-	buf = malloc(buf_size);
-	if (buf == NULL) {
-		fprintf(stderr, "Error: fail to allocate read buffer\n");
-		goto out;
-	}
-
-	fd = open(devname, O_RDONLY);
+	fd = PROF(PROF_OPEN, open(devname, O_RDONLY));
 	if (fd < 0) {
 		fprintf(stderr, "Error: Can't open dev  %s\n", devname);
-		goto out;
+		return 1;
 	}
 
-	memset(buf, 0, buf_size);
-	if (pread(fd, buf, buf_size, 0) != buf_size) {
+	sb_disk = sb_read(fd);
+	close(fd);
+	if (!sb_disk) {
 		fprintf(stderr, "Couldn't read\n");
-		goto out_memory;
+		return 1;
 	}
 
 	/* Try whether it is bcache super block */
-	sb_disk = (struct cache_sb_disk *)(buf + SB_START);
-	if (!memcmp(sb_disk->magic, bcache_magic, 16)) {
-		ret = __detail_dev(devname, sb_disk, bd, cd, type);
-		goto out_memory;
+	if (!sb_is_bcache(sb_disk)) {
+		fprintf(stderr, "Error: Bad magic, not bcache device\n");
+		return 1;
 	}
 
-	fprintf(stderr, "Error: Bad magic, not bcache device\n");
-
-out_memory:
-	free(buf);
-out:
-	return ret;
+	return __detail_dev(devname, sb_disk, bd, cd, type);
 }
 
-int register_dev(char *devname)
+/*
+ * All devices through one open register file, register_async if the
+ * kernel has it so the registrations run in parallel.
+ */
+int register_devs(char **devnames, int nr)
 {
-	int fd;
+	int fd, i, ret = 0;
 
-	fd = open("/sys/fs/bcache/register", O_WRONLY);
+	fd = PROF(PROF_SYSFS, open("/sys/fs/bcache/register_async", O_WRONLY));
+	if (fd < 0)
+		fd = PROF(PROF_SYSFS,
+			  open("/sys/fs/bcache/register", O_WRONLY));
 	if (fd < 0) {
 		perror("Error opening /sys/fs/bcache/register");
 		fprintf(stderr,
 			"The bcache kernel module must be loaded\n");
 		return 1;
 	}
-	if (dprintf(fd, "%s\n", devname) < 0) {
-		fprintf(stderr, "Error registering %s with bcache: %m\n",
-			devname);
-		close(fd);
-		return 1;
-	}
+	for (i = 0; i < nr; i++)
+		if (PROF(PROF_SYSFS, dprintf(fd, "%s\n", devnames[i])) < 0) {
+			fprintf(stderr, "Error registering %s with bcache: %m\n",
+				devnames[i]);
+			ret = 1;
+		}
 	close(fd);
-	return 0;
+	return ret;
+}
+
+int register_dev(char *devname)
+{
+	return register_devs(&devname, 1);
 }
 
 int unregister_cset(char *cset)
 {
 	int fd;
-	char path[100];
+	char path[PATH_MAX];
 
-	sprintf(path, "/sys/fs/bcache/%s/unregister", cset);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/fs/bcache/%s/unregister", root_prefix(), cset);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr, "Can't open %s\n", path);
 		return 1;
 	}
-	if (dprintf(fd, "%d\n", 1) < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%d\n", 1)) < 0) {
 		fprintf(stderr, "Failed to unregister this cache device\n");
 		close(fd);
 		return 1;
@@ -623,7 +927,7 @@ int unregister_cset(char *cset)
 
 int stop_backdev(char *devname)
 {
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 	int fd, ret;
 	char buf[20];
@@ -632,13 +936,13 @@ int stop_backdev(char *devname)
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/stop", location);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/stop", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr, "Can't open %s\n", path);
 		return 1;
 	}
-	if (dprintf(fd, "%s\n", "1") < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%s\n", "1")) < 0) {
 		fprintf(stderr, "Error stop back device %s\n", devname);
 		close(fd);
 		return 1;
@@ -651,15 +955,15 @@ int stop_backdev(char *devname)
 int unregister_both(char *cset)
 {
 	int fd;
-	char path[100];
+	char path[PATH_MAX];
 
-	sprintf(path, "/sys/fs/bcache/%s/stop", cset);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/fs/bcache/%s/stop", root_prefix(), cset);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr, "Can't open %s\n", path);
 		return 1;
 	}
-	if (dprintf(fd, "%d\n", 1) < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%d\n", 1)) < 0) {
 		fprintf(stderr, "Failed to stop cset and its backends %m\n");
 		close(fd);
 		return 1;
@@ -673,23 +977,25 @@ int attach_backdev(char *cset, char *devname)
 	int fd, ret;
 	char buf[20];
 	char location[100] = "";
-	char path[150];
+	char path[PATH_MAX];
 
 	trim_prefix(buf, devname, DEV_PREFIX_LEN);
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/attach", location);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/attach", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr, "Can't open %s:%m\n", path);
 		return 1;
 	}
-	if (dprintf(fd, "%s\n", cset) < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%s\n", cset)) < 0) {
 		fprintf(stderr, "Failed to attache to cset %s\n", cset);
 		close(fd);
 		return 1;
 	}
+	/* The kernel has rewritten the super block */
+	inventory_invalidate();
 	close(fd);
 	return 0;
 }
@@ -698,26 +1004,28 @@ int detach_backdev(char *devname)
 {
 	int fd, ret;
 	char buf[20];
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 
 	trim_prefix(buf, devname, DEV_PREFIX_LEN);
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/detach", location);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/detach", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr,
 			"Can't open %s,Make sure the device name is correct\n",
 			path);
 		return 1;
 	}
-	if (dprintf(fd, "%d\n", 1) < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%d\n", 1)) < 0) {
 		close(fd);
 		fprintf(stderr, "Error detach device %s:%m\n", devname);
 		return 1;
 	}
+	/* The kernel has rewritten the super block */
+	inventory_invalidate();
 	close(fd);
 	return 0;
 }
@@ -725,7 +1033,7 @@ int detach_backdev(char *devname)
 int set_backdev_cachemode(char *devname, char *cachemode)
 {
 	int fd, ret;
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 	char buf[20];
 
@@ -733,20 +1041,22 @@ int set_backdev_cachemode(char *devname, char *cachemode)
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/cache_mode", location);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/cache_mode", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr,
 			"Can't open %s,Make sure the device name is correct\n",
 			path);
 		return 1;
 	}
-	if (dprintf(fd, "%s\n", cachemode) < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%s\n", cachemode)) < 0) {
 		fprintf(stderr, "Failed to set cachemode for device %s:%m\n",
 		       devname);
 		close(fd);
 		return 1;
 	}
+	/* The kernel has rewritten the super block */
+	inventory_invalidate();
 	close(fd);
 	return 0;
 }
@@ -754,21 +1064,21 @@ int set_backdev_cachemode(char *devname, char *cachemode)
 int get_backdev_cachemode(char *devname, char *mode)
 {
 	int fd, ret;
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 
 	ret = find_location(location, devname);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/cache_mode", location);
-	fd = open(path, O_RDONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/cache_mode", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, open(path, O_RDONLY));
 	if (fd < 0) {
 		perror("Error opening /sys/fs/bcache/register");
 		fprintf(stderr,
 			"The bcache kernel module must be loaded\n");
 		return 1;
 	}
-	if (read(fd, mode, 100) < 0) {
+	if (PROF(PROF_SYSFS, read(fd, mode, 100)) < 0) {
 		fprintf(stderr, "Failed to fetch device cache mode\n");
 		close(fd);
 		return 1;
@@ -780,7 +1090,7 @@ int get_backdev_cachemode(char *devname, char *mode)
 int set_label(char *devname, char *label)
 {
 	int fd, ret;
-	char path[150];
+	char path[PATH_MAX];
 	char location[100] = "";
 	char buf[20];
 
@@ -788,40 +1098,121 @@ int set_label(char *devname, char *label)
 	ret = find_location(location, buf);
 	if (ret < 0)
 		return ret;
-	sprintf(path, "/sys/block/%s/bcache/label", location);
-	fd = open(path, O_WRONLY);
+	snprintf(path, sizeof(path), "%s/sys/block/%s/bcache/label", root_prefix(), location);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY));
 	if (fd < 0) {
 		fprintf(stderr,
 			"Please register this device first\n");
 		return 1;
 	}
-	if (dprintf(fd, "%s\n", label) < 0) {
+	if (PROF(PROF_SYSFS, dprintf(fd, "%s\n", label)) < 0) {
 		fprintf(stderr, "Failed to set label for device %s:%m\n",
 		       devname);
 		close(fd);
 		return 1;
 	}
+	/* The kernel has rewritten the super block */
+	inventory_invalidate();
 	close(fd);
 	return 0;
 }
 
 
+/*
+ * Super block access
+ *
+ * One read of the block at SB_START into a buffer of the calling thread,
+ * which stays valid until its next sb_read(). The on-disk struct is used
+ * in place: checking the magic, csum or uuid needs no to_cache_sb().
+ */
+static __thread char sb_buf[SB_READ_BYTES] __attribute__((aligned(4096)));
+
+struct cache_sb_disk *sb_read(int fd)
+{
+	if (PROF(PROF_READ, pread(fd, sb_buf, SB_READ_BYTES, SB_START)) !=
+	    SB_READ_BYTES)
+		return NULL;
+	return (struct cache_sb_disk *) sb_buf;
+}
+
+/*
+ * Reads past the page cache where the device allows O_DIRECT, so scanning
+ * every device doesn't fill it. The stat of the device is optional.
+ */
+struct cache_sb_disk *sb_read_dev(const char *dev, struct stat *st)
+{
+	struct cache_sb_disk *sb_disk;
+	int fd;
+
+	fd = PROF(PROF_OPEN, open(dev, O_RDONLY|O_DIRECT|O_CLOEXEC));
+	if (fd < 0 && errno == EINVAL)
+		fd = PROF(PROF_OPEN, open(dev, O_RDONLY|O_CLOEXEC));
+	if (fd < 0)
+		return NULL;
+
+	sb_disk = st && fstat(fd, st) ? NULL : sb_read(fd);
+	close(fd);
+	return sb_disk;
+}
+
+bool sb_is_bcache(const struct cache_sb_disk *sb_disk)
+{
+	return !memcmp(sb_disk->magic, bcache_magic, 16);
+}
+
+/* Accessors for the little endian fields of the on-disk super block */
+#define SB_DISK_LE(field, bits)						\
+uint##bits##_t sb_##field(const struct cache_sb_disk *sb_disk)		\
+{									\
+	return le##bits##_to_cpu(sb_disk->field);			\
+}
+
+SB_DISK_LE(csum, 64)
+SB_DISK_LE(offset, 64)
+SB_DISK_LE(version, 64)
+SB_DISK_LE(flags, 64)
+SB_DISK_LE(seq, 64)
+SB_DISK_LE(feature_compat, 64)
+SB_DISK_LE(feature_incompat, 64)
+SB_DISK_LE(feature_ro_compat, 64)
+SB_DISK_LE(nbuckets, 64)
+SB_DISK_LE(block_size, 16)
+SB_DISK_LE(bucket_size, 16)
+SB_DISK_LE(nr_in_set, 16)
+SB_DISK_LE(nr_this_dev, 16)
+SB_DISK_LE(data_offset, 64)
+SB_DISK_LE(last_mount, 32)
+SB_DISK_LE(first_bucket, 16)
+SB_DISK_LE(keys, 16)
+SB_DISK_LE(obso_bucket_size_hi, 16)
+
+uint64_t sb_journal_bucket(const struct cache_sb_disk *sb_disk,
+			   unsigned int i)
+{
+	return le64_to_cpu(sb_disk->d[i]);
+}
+
+bool sb_csum_ok(const struct cache_sb_disk *sb_disk)
+{
+	return sb_csum(sb_disk) == csum_set(sb_disk);
+}
+
 struct cache_sb *to_cache_sb(struct cache_sb *sb,
 			     struct cache_sb_disk *sb_disk)
 {
 	/* Convert common part */
-	sb->offset = le64_to_cpu(sb_disk->offset);
-	sb->version = le64_to_cpu(sb_disk->version);
+	sb->offset = sb_offset(sb_disk);
+	sb->version = sb_version(sb_disk);
 	memcpy(sb->magic, sb_disk->magic, 16);
 	memcpy(sb->uuid, sb_disk->uuid, 16);
 	memcpy(sb->set_uuid, sb_disk->set_uuid, 16);
 	memcpy(sb->label, sb_disk->label, SB_LABEL_SIZE);
-	sb->flags = le64_to_cpu(sb_disk->flags);
-	sb->seq = le64_to_cpu(sb_disk->seq);
-	sb->block_size = le16_to_cpu(sb_disk->block_size);
-	sb->last_mount = le32_to_cpu(sb_disk->last_mount);
-	sb->first_bucket = le16_to_cpu(sb_disk->first_bucket);
-	sb->keys = le16_to_cpu(sb_disk->keys);
+	sb->flags = sb_flags(sb_disk);
+	sb->seq = sb_seq(sb_disk);
+	sb->block_size = sb_block_size(sb_disk);
+	sb->last_mount = sb_last_mount(sb_disk);
+	sb->first_bucket = sb_first_bucket(sb_disk);
+	sb->keys = sb_keys(sb_disk);
 
 	/* For cache or backing devices*/
 
@@ -831,32 +1222,32 @@ struct cache_sb *to_cache_sb(struct cache_sb *sb,
 			sb->version);
 	} else if (SB_IS_BDEV(sb)) {
 		/* Backing device */
-		sb->data_offset = le64_to_cpu(sb_disk->data_offset);
+		sb->data_offset = sb_data_offset(sb_disk);
 	} else {
 		int i;
 
 		/* Cache device */
-		sb->nbuckets = le64_to_cpu(sb_disk->nbuckets);
-		sb->nr_in_set = le16_to_cpu(sb_disk->nr_in_set);
-		sb->nr_this_dev = le16_to_cpu(sb_disk->nr_this_dev);
-		sb->bucket_size = le32_to_cpu(sb_disk->bucket_size);
+		sb->nbuckets = sb_nbuckets(sb_disk);
+		sb->nr_in_set = sb_nr_in_set(sb_disk);
+		sb->nr_this_dev = sb_nr_this_dev(sb_disk);
+		sb->bucket_size = sb_bucket_size(sb_disk);
 
 		for (i = 0; i < SB_JOURNAL_BUCKETS; i++)
-			sb->d[i]= le64_to_cpu(sb_disk->d[i]);
+			sb->d[i] = sb_journal_bucket(sb_disk, i);
 	}
 
 	if (sb->version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
-		sb->feature_compat = le64_to_cpu(sb_disk->feature_compat);
-		sb->feature_incompat = le64_to_cpu(sb_disk->feature_incompat);
-		sb->feature_ro_compat = le64_to_cpu(sb_disk->feature_ro_compat);
+		sb->feature_compat = sb_feature_compat(sb_disk);
+		sb->feature_incompat = sb_feature_incompat(sb_disk);
+		sb->feature_ro_compat = sb_feature_ro_compat(sb_disk);
 	}
 
 	if (sb->version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
 		if (bch_has_feature_large_bucket(sb))
-			sb->bucket_size = 1 << le16_to_cpu(sb_disk->bucket_size);
+			sb->bucket_size = 1 << sb_bucket_size(sb_disk);
 		else if (bch_has_feature_obso_large_bucket(sb))
 			sb->bucket_size +=
-				le16_to_cpu(sb_disk->obso_bucket_size_hi) << 16;
+				sb_obso_bucket_size_hi(sb_disk) << 16;
 	}
 
 	return sb;
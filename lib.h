@@ -22,6 +22,19 @@ struct dev {
 	uint64_t	feature_ro_compat;
 	uint64_t	feature_incompat;
 	struct	list_head	dev_list;
+	struct	hlist_node	cset_node;
+	struct	hlist_node	attach_node;
+};
+
+/*
+ * Devices of one list_bdevs() scan indexed by uuid, for the joins between
+ * cache and backing devices. Built once per scan, the list stays the owner
+ * of the devices.
+ */
+struct dev_table {
+	struct hlist_head	*cset;		/* cache devices by cset uuid */
+	struct hlist_head	*attach;	/* all devices by attachuuid */
+	unsigned int		mask;
 };
 
 struct bdev {
@@ -45,7 +58,11 @@ struct cdev {
 
 
 int list_bdevs(struct list_head *head);
+typedef void (*scan_fn)(const char *name, dev_t rdev,
+			struct cache_sb_disk *sb_disk, void *arg);
+int scan_each(scan_fn fn, void *arg);
 int detail_dev(char *devname, struct bdev *bd, struct cdev *cd, int *type);
+int register_devs(char **devnames, int nr);
 int register_dev(char *devname);
 int stop_backdev(char *devname);
 int unregister_cset(char *cset);
@@ -53,16 +70,55 @@ int attach_backdev(char *cset, char *devname);
 int detach_backdev(char *devname);
 int set_backdev_cachemode(char *devname, char *cachemode);
 int set_label(char *devname, char *label);
-int cset_to_devname(struct list_head *head, char *cset, char *devname);
+int dev_table_init(struct dev_table *t, struct list_head *head);
+void dev_table_exit(struct dev_table *t);
+struct dev *dev_table_next_attached(struct dev_table *t, const char *cset,
+				    struct dev *prev);
+int cset_to_devname(struct dev_table *t, char *cset, char *devname);
+const char *root_prefix(void);
+struct stat;
+struct cache_sb_disk *sb_read(int fd);
+struct cache_sb_disk *sb_read_dev(const char *dev, struct stat *st);
+bool sb_is_bcache(const struct cache_sb_disk *sb_disk);
+uint64_t sb_csum(const struct cache_sb_disk *sb_disk);
+uint64_t sb_offset(const struct cache_sb_disk *sb_disk);
+uint64_t sb_version(const struct cache_sb_disk *sb_disk);
+uint64_t sb_flags(const struct cache_sb_disk *sb_disk);
+uint64_t sb_seq(const struct cache_sb_disk *sb_disk);
+uint64_t sb_feature_compat(const struct cache_sb_disk *sb_disk);
+uint64_t sb_feature_incompat(const struct cache_sb_disk *sb_disk);
+uint64_t sb_feature_ro_compat(const struct cache_sb_disk *sb_disk);
+uint64_t sb_nbuckets(const struct cache_sb_disk *sb_disk);
+uint16_t sb_block_size(const struct cache_sb_disk *sb_disk);
+uint16_t sb_bucket_size(const struct cache_sb_disk *sb_disk);
+uint16_t sb_nr_in_set(const struct cache_sb_disk *sb_disk);
+uint16_t sb_nr_this_dev(const struct cache_sb_disk *sb_disk);
+uint64_t sb_data_offset(const struct cache_sb_disk *sb_disk);
+uint32_t sb_last_mount(const struct cache_sb_disk *sb_disk);
+uint16_t sb_first_bucket(const struct cache_sb_disk *sb_disk);
+uint16_t sb_keys(const struct cache_sb_disk *sb_disk);
+uint16_t sb_obso_bucket_size_hi(const struct cache_sb_disk *sb_disk);
+uint64_t sb_journal_bucket(const struct cache_sb_disk *sb_disk,
+			   unsigned int i);
+bool sb_csum_ok(const struct cache_sb_disk *sb_disk);
+const char *sb_check(const struct cache_sb_disk *sb_disk,
+		     const struct cache_sb *sb);
 struct cache_sb *to_cache_sb(struct cache_sb *sb, struct cache_sb_disk *sb_disk);
 struct cache_sb_disk *to_cache_sb_disk(struct cache_sb_disk *sb_disk,struct cache_sb *sb);
 void set_bucket_size(struct cache_sb *sb, unsigned int bucket_size);
 void free_dev(struct list_head *head);
 void print_encode(char *in);
+const char *sb_type_name(uint64_t version);
+const char *cache_mode_name(unsigned int mode);
+const char *bdev_state_name(unsigned int state);
+const char *cache_replacement_name(unsigned int replacement);
 bool accepted_char(char c);
 
 #define DEVLEN sizeof(struct dev)
 
+/* Covers struct cache_sb_disk, and is a multiple of any sector size */
+#define SB_READ_BYTES			4096
+
 #define BCACHE_NO_SUPPORT		"N/A"
 
 #define BCACHE_BASIC_STATE_ACTIVE	"active"
@@ -0,0 +1,746 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache load: set up the devices of /etc/bcache/bcache.conf, what
+ * bcache-loader does, without a Python runtime and in a few steps for all
+ * devices rather than a few commands for each:
+ *
+ * - blank cache devices are formatted, on backing devices the super block
+ *   is written through /dev/bcache_ctrl if the kernel has one, all by
+ *   make-bcache code run in a child, one for each kind of device
+ * - every device is registered through register_async, so the kernel does
+ *   them in parallel, and the registrations are waited for together
+ * - the backing devices are attached to the cache sets, each set's at once
+ *
+ * The configuration is read with a parser of the small part of YAML that
+ * bcache.conf.example uses: block mappings and sequences, plain and quoted
+ * scalars, and comments.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "make.h"
+#include "cset.h"
+#include "watch.h"
+#include "load.h"
+
+#define LOAD_CONFIG		"/etc/bcache/bcache.conf"
+#define LOAD_CTRL_DEV		"/dev/bcache_ctrl"
+/* What bcache-loader waited for a cache set at most */
+#define LOAD_TIMEOUT		12
+#define LOAD_MAX_LINE		1024
+
+struct load_backing {
+	char			dev[PATH_MAX];
+	bool			writeback;
+	bool			found;
+	unsigned int		line;
+};
+
+struct load_cache {
+	char			dev[PATH_MAX];
+	bool			found;
+	unsigned int		line;
+	struct load_backing	*backing;
+	unsigned int		nr_backing;
+};
+
+struct load_config {
+	struct load_cache	*caches;
+	unsigned int		nr_caches;
+};
+
+struct load_opts {
+	const char		*config;
+	int			timeout_ms;
+	bool			dry_run;
+	bool			verbose;
+};
+
+int load_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	load [option] [device]\n"
+		"	set up the devices of the bcache configuration, or only\n"
+		"	those that go with device\n"
+		"	-c	--config {file}		" LOAD_CONFIG " by default\n"
+		"	-w	--wait {seconds}	wait this long for registrations, 12 by default\n"
+		"	-n	--dry-run		print what would be done\n"
+		"	-v	--verbose		print what is done, and make-bcache output\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+/* Configuration */
+
+static void *grow(void *p, unsigned int nr, size_t size)
+{
+	/* Doubles at powers of two */
+	if (nr & (nr - 1))
+		return p;
+	p = realloc(p, (nr ? nr * 2 : 1) * size);
+	if (!p)
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+	return p;
+}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while (*s == ' ')
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char) end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+/* A comment starts at a # that begins the line or follows a blank */
+static void strip_comment(char *s)
+{
+	char quote = 0, *p;
+
+	for (p = s; *p; p++) {
+		if (quote) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+		} else if (*p == '#' && (p == s || p[-1] == ' ' ||
+					 p[-1] == '\t')) {
+			*p = '\0';
+			return;
+		}
+	}
+}
+
+static int parse_scalar(const char *path, unsigned int line, char *v,
+			char *out, size_t size)
+{
+	size_t len = strlen(v);
+
+	if (len && (*v == '\'' || *v == '"')) {
+		if (len < 2 || v[len - 1] != *v) {
+			fprintf(stderr, "%s:%u: unterminated string\n", path,
+				line);
+			return 1;
+		}
+		v[len - 1] = '\0';
+		v++;
+		len -= 2;
+	}
+	if (!len || len >= size) {
+		fprintf(stderr, "%s:%u: bad value\n", path, line);
+		return 1;
+	}
+	strcpy(out, v);
+	return 0;
+}
+
+static int parse_mode(const char *path, unsigned int line, const char *v,
+		      bool *writeback)
+{
+	if (!strcasecmp(v, "wb") || !strcasecmp(v, "writeback"))
+		*writeback = true;
+	else if (!strcasecmp(v, "wt") || !strcasecmp(v, "writethrough"))
+		*writeback = false;
+	else {
+		fprintf(stderr, "%s:%u: unknown cache_mode %s\n", path, line,
+			v);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Indentation alone says what a line belongs to: list items under
+ * backing_devices: are backing devices, other list items under
+ * cache_devices: are cache devices, and keys belong to the innermost item
+ * they are indented under. As in YAML, a list may be indented as far as
+ * its key.
+ */
+struct load_parser {
+	const char		*path;
+	unsigned int		line;
+	int			caches_indent;
+	int			cache_indent;
+	int			backing_key_indent;
+	int			backing_indent;
+};
+
+static int parse_key(struct load_parser *p, struct load_config *c,
+		     int indent, char *key, char *val)
+{
+	struct load_cache *cache = c->nr_caches ?
+		&c->caches[c->nr_caches - 1] : NULL;
+	struct load_backing *b = cache && cache->nr_backing ?
+		&cache->backing[cache->nr_backing - 1] : NULL;
+
+	if (indent == 0) {
+		if (strcmp(key, "cache_devices") || *val) {
+			fprintf(stderr, "%s:%u: unknown key %s\n", p->path,
+				p->line, key);
+			return 1;
+		}
+		p->caches_indent = 0;
+		return 0;
+	}
+
+	if (b && p->backing_key_indent >= 0 && indent > p->backing_indent) {
+		if (!strcmp(key, "device"))
+			return parse_scalar(p->path, p->line, val, b->dev,
+					    sizeof(b->dev));
+		if (!strcmp(key, "cache_mode"))
+			return parse_mode(p->path, p->line, val,
+					  &b->writeback);
+	} else if (cache && indent > p->cache_indent) {
+		if (!strcmp(key, "device"))
+			return parse_scalar(p->path, p->line, val, cache->dev,
+					    sizeof(cache->dev));
+		if (!strcmp(key, "backing_devices") && !*val) {
+			p->backing_key_indent = indent;
+			p->backing_indent = INT_MAX;
+			return 0;
+		}
+	}
+	fprintf(stderr, "%s:%u: unexpected %s\n", p->path, p->line, key);
+	return 1;
+}
+
+static int parse_item(struct load_parser *p, struct load_config *c,
+		      int indent)
+{
+	struct load_cache *cache;
+
+	if (p->caches_indent < 0) {
+		fprintf(stderr, "%s:%u: list outside of cache_devices\n",
+			p->path, p->line);
+		return 1;
+	}
+
+	if (c->nr_caches && p->backing_key_indent >= 0 &&
+	    indent >= p->backing_key_indent &&
+	    (p->backing_indent == INT_MAX || indent == p->backing_indent)) {
+		cache = &c->caches[c->nr_caches - 1];
+		cache->backing = grow(cache->backing, cache->nr_backing,
+				      sizeof(*cache->backing));
+		if (!cache->backing)
+			return 1;
+		memset(&cache->backing[cache->nr_backing], 0,
+		       sizeof(*cache->backing));
+		cache->backing[cache->nr_backing++].line = p->line;
+		p->backing_indent = indent;
+		return 0;
+	}
+
+	if (indent < p->caches_indent ||
+	    (c->nr_caches && indent != p->cache_indent)) {
+		fprintf(stderr, "%s:%u: bad indentation\n", p->path, p->line);
+		return 1;
+	}
+	c->caches = grow(c->caches, c->nr_caches, sizeof(*c->caches));
+	if (!c->caches)
+		return 1;
+	memset(&c->caches[c->nr_caches], 0, sizeof(*c->caches));
+	c->caches[c->nr_caches++].line = p->line;
+	p->cache_indent = indent;
+	p->backing_key_indent = -1;
+	return 0;
+}
+
+static int parse_line(struct load_parser *p, struct load_config *c, char *s)
+{
+	char *key, *val;
+	int indent;
+
+	strip_comment(s);
+	for (indent = 0; s[indent] == ' '; indent++)
+		;
+	if (s[indent] == '\t') {
+		fprintf(stderr, "%s:%u: tabs can't indent YAML\n", p->path,
+			p->line);
+		return 1;
+	}
+	s = trim(s);
+	if (!*s || !strcmp(s, "---"))
+		return 0;
+
+	if (*s == '-' && (s[1] == ' ' || !s[1])) {
+		if (parse_item(p, c, indent))
+			return 1;
+		/* The item's first key is indented past the dash */
+		indent += 2;
+		s = trim(s + 1);
+		if (!*s)
+			return 0;
+	}
+
+	val = strchr(s, ':');
+	if (!val || (val[1] && val[1] != ' ')) {
+		fprintf(stderr, "%s:%u: expected key: value\n", p->path,
+			p->line);
+		return 1;
+	}
+	*val++ = '\0';
+	key = trim(s);
+	val = trim(val);
+	return parse_key(p, c, indent, key, val);
+}
+
+static void load_config_free(struct load_config *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->nr_caches; i++)
+		free(c->caches[i].backing);
+	free(c->caches);
+	memset(c, 0, sizeof(*c));
+}
+
+static int load_config_parse(const char *path, struct load_config *c)
+{
+	struct load_parser p = {
+		.path			= path,
+		.caches_indent		= -1,
+		.cache_indent		= -1,
+		.backing_key_indent	= -1,
+	};
+	char buf[LOAD_MAX_LINE];
+	unsigned int i, j;
+	FILE *f;
+	int ret = 0;
+
+	memset(c, 0, sizeof(*c));
+	f = fopen(path, "re");
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %m\n", path);
+		return 1;
+	}
+	while (!ret && fgets(buf, sizeof(buf), f)) {
+		p.line++;
+		if (!strchr(buf, '\n') && !feof(f)) {
+			fprintf(stderr, "%s:%u: line too long\n", path,
+				p.line);
+			ret = 1;
+			break;
+		}
+		ret = parse_line(&p, c, buf);
+	}
+	fclose(f);
+
+	for (i = 0; !ret && i < c->nr_caches; i++) {
+		if (!*c->caches[i].dev) {
+			fprintf(stderr, "%s:%u: cache without a device\n",
+				path, c->caches[i].line);
+			ret = 1;
+		}
+		for (j = 0; !ret && j < c->caches[i].nr_backing; j++)
+			if (!*c->caches[i].backing[j].dev) {
+				fprintf(stderr, "%s:%u: backing device without "
+					"a device\n", path,
+					c->caches[i].backing[j].line);
+				ret = 1;
+			}
+	}
+	if (ret)
+		load_config_free(c);
+	return ret;
+}
+
+/* Devices */
+
+/*
+ * As bcache-loader, config devices are compared by what they point to.
+ * Those that don't exist yet are left out, as they are in bcache-loader.
+ */
+static bool resolve(const struct load_opts *o, char *dev)
+{
+	char real[PATH_MAX];
+
+	if (!realpath(dev, real)) {
+		if (o->verbose || o->dry_run)
+			printf("%s does not exist\n", dev);
+		return false;
+	}
+	strcpy(dev, real);
+	return true;
+}
+
+/*
+ * The devices there are, or only what goes with dev: a cache device with
+ * all its backing devices, a backing device with its cache device.
+ */
+static void load_select(const struct load_opts *o, struct load_config *c,
+			const char *dev)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < c->nr_caches; i++) {
+		struct load_cache *cache = &c->caches[i];
+		bool match, any = false;
+
+		cache->found = resolve(o, cache->dev);
+		match = !dev || (cache->found && !strcmp(cache->dev, dev));
+		for (j = 0; j < cache->nr_backing; j++) {
+			struct load_backing *b = &cache->backing[j];
+
+			b->found = resolve(o, b->dev) &&
+				(match || !strcmp(b->dev, dev));
+			any |= b->found;
+		}
+		cache->found &= match || any;
+	}
+}
+
+static bool has_bcache_sb(const char *dev)
+{
+	struct cache_sb_disk *sb_disk;
+	struct stat st;
+
+	sb_disk = sb_read_dev(dev, &st);
+	return sb_disk && sb_is_bcache(sb_disk);
+}
+
+/*
+ * make-bcache exits on errors, so it runs in a child, with its output
+ * only shown when verbose.
+ */
+static int load_make(const struct load_opts *o, char **args, int nr)
+{
+	int status, fd;
+	pid_t pid;
+
+	if (o->dry_run || o->verbose) {
+		int i;
+
+		printf("%smake-bcache", o->dry_run ? "would run " : "");
+		for (i = 1; i < nr; i++)
+			printf(" %s", args[i]);
+		putchar('\n');
+		if (o->dry_run)
+			return 0;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Can't fork: %m\n");
+		return 1;
+	}
+	if (!pid) {
+		if (!o->verbose) {
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0)
+				dup2(fd, STDOUT_FILENO);
+		}
+		optind = 0;
+		exit(make_bcache(nr, args));
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		return 1;
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static int modprobe(const struct load_opts *o)
+{
+	int status;
+	pid_t pid;
+
+	if (!access("/sys/fs/bcache", F_OK) || o->dry_run)
+		return 0;
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (!pid) {
+		execlp("modprobe", "modprobe", "-q", "bcache", NULL);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "The bcache kernel module must be loaded\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* The cache set a registered cache device is in */
+static int cache_set_of(const char *dev, char *uuid, size_t size)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	const char *name = strrchr(dev, '/') + 1;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s/sys/class/block/%s/bcache/set",
+		 root_prefix(), name);
+	n = readlink(path, link, sizeof(link) - 1);
+	if (n < 0)
+		return 1;
+	link[n] = '\0';
+	snprintf(uuid, size, "%s", strrchr(link, '/') + 1);
+	return 0;
+}
+
+static bool backing_attached(const char *dev)
+{
+	char path[PATH_MAX], state[32] = "";
+	const char *name = strrchr(dev, '/') + 1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/sys/class/block/%s/bcache/state",
+		 root_prefix(), name);
+	f = fopen(path, "re");
+	if (!f)
+		return false;
+	if (!fgets(state, sizeof(state), f))
+		*state = '\0';
+	fclose(f);
+	return *state && strncmp(state, "no cache", 8);
+}
+
+/* Blank cache devices and, with a control device, all backing devices */
+static int load_format(const struct load_opts *o, struct load_config *c)
+{
+	unsigned int i, j, n = 0;
+	char *args[1 + 2 * c->nr_caches];
+	int ret = 0, wb;
+
+	args[n++] = "make";
+	for (i = 0; i < c->nr_caches; i++) {
+		struct load_cache *cache = &c->caches[i];
+
+		if (!cache->found || dev_registered(cache->dev) ||
+		    has_bcache_sb(cache->dev))
+			continue;
+		args[n++] = "-C";
+		args[n++] = cache->dev;
+	}
+	if (n > 1)
+		ret |= load_make(o, args, n);
+
+	if (access(LOAD_CTRL_DEV, F_OK))
+		return ret;
+
+	/* make-bcache's --writeback goes for all devices given */
+	for (wb = 0; wb < 2; wb++) {
+		unsigned int nr = 0;
+		char **bargs;
+
+		for (i = 0; i < c->nr_caches; i++)
+			nr += c->caches[i].nr_backing;
+		bargs = calloc(3 + 2 * nr, sizeof(*bargs));
+		if (!bargs)
+			return 1;
+
+		n = 0;
+		bargs[n++] = "make";
+		bargs[n++] = "--ioctl";
+		if (wb)
+			bargs[n++] = "--writeback";
+		for (i = 0; i < c->nr_caches; i++)
+			for (j = 0; j < c->caches[i].nr_backing; j++) {
+				struct load_backing *b = &c->caches[i].backing[j];
+
+				if (b->found && b->writeback == wb &&
+				    !dev_registered(b->dev)) {
+					bargs[n++] = "-B";
+					bargs[n++] = b->dev;
+				}
+			}
+		if (n > 2 + wb)
+			ret |= load_make(o, bargs, n);
+		free(bargs);
+	}
+	return ret;
+}
+
+/* Everything not registered yet with one register_async write each */
+static int load_register(const struct load_opts *o, struct load_config *c,
+			 char **devs, unsigned int *nr_devs)
+{
+	unsigned int i, j, nr = 0, n = 0;
+	char **todo;
+	int ret = 0;
+
+	for (i = 0; i < c->nr_caches; i++)
+		nr += 1 + c->caches[i].nr_backing;
+	todo = calloc(nr ? nr : 1, sizeof(*todo));
+	if (!todo)
+		return 1;
+
+	/* Cache devices first, their sets are what takes time */
+	for (i = 0; i < c->nr_caches; i++)
+		if (c->caches[i].found)
+			devs[(*nr_devs)++] = c->caches[i].dev;
+	for (i = 0; i < c->nr_caches; i++)
+		for (j = 0; j < c->caches[i].nr_backing; j++)
+			if (c->caches[i].backing[j].found)
+				devs[(*nr_devs)++] = c->caches[i].backing[j].dev;
+
+	for (i = 0; i < *nr_devs; i++)
+		if (!dev_registered(devs[i]))
+			todo[n++] = devs[i];
+
+	if (o->dry_run || o->verbose)
+		for (i = 0; i < n; i++)
+			printf("%sregister %s\n", o->dry_run ? "would " : "",
+			       todo[i]);
+	if (n && !o->dry_run)
+		ret = register_devs(todo, n);
+	free(todo);
+	return ret;
+}
+
+static int load_attach(const struct load_opts *o, struct load_config *c)
+{
+	char uuid[40], **devs;
+	unsigned int i, j, n;
+	int ret = 0;
+
+	for (i = 0; i < c->nr_caches; i++) {
+		struct load_cache *cache = &c->caches[i];
+
+		if (!cache->found || !cache->nr_backing)
+			continue;
+		if (o->dry_run) {
+			for (j = 0; j < cache->nr_backing; j++)
+				if (cache->backing[j].found)
+					printf("would attach %s to the cache "
+					       "set of %s\n",
+					       cache->backing[j].dev,
+					       cache->dev);
+			continue;
+		}
+		if (cache_set_of(cache->dev, uuid, sizeof(uuid))) {
+			fprintf(stderr, "%s is not in a cache set, its backing "
+				"devices stay detached\n", cache->dev);
+			ret = 1;
+			continue;
+		}
+
+		devs = calloc(cache->nr_backing, sizeof(*devs));
+		if (!devs)
+			return 1;
+		for (j = n = 0; j < cache->nr_backing; j++) {
+			struct load_backing *b = &cache->backing[j];
+
+			if (b->found && dev_registered(b->dev) &&
+			    !backing_attached(b->dev))
+				devs[n++] = b->dev;
+		}
+		if (n) {
+			if (o->verbose)
+				printf("attaching %u devices to %s\n", n, uuid);
+			ret |= cset_attach_devs(uuid, devs, n, o->timeout_ms);
+		}
+		free(devs);
+	}
+	return ret;
+}
+
+int bcache_load(int argc, char **argv)
+{
+	struct load_opts o = {
+		.config		= LOAD_CONFIG,
+		.timeout_ms	= LOAD_TIMEOUT * 1000,
+	};
+	struct load_config c;
+	char dev[PATH_MAX], **devs = NULL;
+	unsigned int i, nr_devs = 0, nr = 0;
+	char *e;
+	int opt, ret = 0;
+
+	static struct option opts[] = {
+		{ "config",	1, NULL,	'c' },
+		{ "wait",	1, NULL,	'w' },
+		{ "dry-run",	0, NULL,	'n' },
+		{ "verbose",	0, NULL,	'v' },
+		{ "help",	0, NULL,	'h' },
+		{ NULL,		0, NULL,	0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "c:w:nvh", opts, NULL)) != -1)
+		switch (opt) {
+		case 'c':
+			o.config = optarg;
+			break;
+		case 'w':
+			o.timeout_ms = strtoul(optarg, &e, 10) * 1000;
+			if (*e || o.timeout_ms < 0) {
+				fprintf(stderr, "Bad wait %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			o.dry_run = true;
+			break;
+		case 'v':
+			o.verbose = true;
+			break;
+		default:
+			return load_usage();
+		}
+	if (argc > optind + 1)
+		return load_usage();
+
+	if (optind < argc) {
+		snprintf(dev, sizeof(dev), "%s", argv[optind]);
+		if (!realpath(argv[optind], dev)) {
+			fprintf(stderr, "Can't find %s: %m\n", argv[optind]);
+			return 1;
+		}
+	}
+
+	if (load_config_parse(o.config, &c))
+		return 1;
+	load_select(&o, &c, optind < argc ? dev : NULL);
+	for (i = 0; i < c.nr_caches; i++)
+		nr += 1 + c.caches[i].nr_backing;
+
+	devs = calloc(nr ? nr : 1, sizeof(*devs));
+	if (!devs) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		ret = 1;
+		goto out;
+	}
+
+	if (modprobe(&o)) {
+		ret = 1;
+		goto out;
+	}
+	ret |= load_format(&o, &c);
+	ret |= load_register(&o, &c, devs, &nr_devs);
+
+	if (!o.dry_run && !watch_registered(devs, nr_devs, o.timeout_ms)) {
+		for (i = 0; i < nr_devs; i++)
+			if (!dev_registered(devs[i]))
+				fprintf(stderr, "%s did not register\n",
+					devs[i]);
+		ret = 1;
+	}
+
+	ret |= load_attach(&o, &c);
+out:
+	free(devs);
+	load_config_free(&c);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __LOAD_H
+#define __LOAD_H
+
+int load_usage(void);
+int bcache_load(int argc, char **argv);
+
+#endif
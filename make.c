@@ -12,7 +12,7 @@
 
 #define _FILE_OFFSET_BITS	64
 #define __USE_FILE_OFFSET64
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 
 #include <blkid/blkid.h>
 #include <ctype.h>
@@ -21,6 +21,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,19 +30,25 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
 #include "bcache.h"
 #include "lib.h"
 #include "bitwise.h"
+#include "topology.h"
 #include "zoned.h"
+#include "inventory.h"
+#include "watch.h"
+#include "profile.h"
 
 struct sb_context {
 	unsigned int	block_size;
 	unsigned int	bucket_size;
 	bool		writeback;
 	bool		discard;
+	bool		zeroout;
 	bool		wipe_bcache;
 	unsigned int	cache_replacement_policy;
 	uint64_t	data_offset;
@@ -49,6 +56,30 @@ struct sb_context {
 	char		*label;
 };
 
+/*
+ * Every device is formatted by its own thread. Output goes to a memory
+ * stream and is printed once all of them are done, in the order the
+ * devices were given on the command line.
+ */
+struct format_job {
+	char			*dev;
+	bool			bdev;
+	bool			use_ioctl;
+	bool			force;
+	struct sb_context	sbc;
+
+	pthread_t		thread;
+	FILE			*out;
+	char			*outbuf;
+	size_t			outlen;
+	int			ret;
+	bool			finished;
+
+	/* Discard progress in bytes, read by the main thread */
+	uint64_t		discard_done;
+	uint64_t		discard_total;
+};
+
 
 #define max(x, y) ({				\
 	typeof(x) _max1 = (x);			\
@@ -67,7 +98,7 @@ uint64_t getblocks(int fd)
 	}
 	ret = statbuf.st_size / 512;
 	if (S_ISBLK(statbuf.st_mode))
-		if (ioctl(fd, BLKGETSIZE, &ret)) {
+		if (PROF(PROF_IOCTL, ioctl(fd, BLKGETSIZE, &ret))) {
 			perror("ioctl error");
 			exit(EXIT_FAILURE);
 		}
@@ -178,14 +209,19 @@ void usage(void)
 	       "	-b, --bucket		bucket size\n"
 	       "	-w, --block		block size (hard sector size of SSD, often 2k)\n"
 	       "	-o, --data-offset	data offset in sectors\n"
+	       "	-a, --auto		pick block size, bucket size and data offset\n"
+	       "				to line up with the device topology\n"
 	       "	    --cset-uuid		UUID for the cache set\n"
 //	       "	-U			UUID\n"
 	       "	    --writeback		enable writeback\n"
 	       "	    --discard		enable discards\n"
+	       "	    --zeroout		with --discard, zero devices that can't discard\n"
 	       "	    --force		reformat a bcache device even if it is running\n"
 	       "	-l, --label		set label for device\n"
 	       "	    --cache_replacement_policy=(lru|fifo)\n"
 		   "	    --ioctl		Communicate via IOCTL with the control device\n"
+	       "	    --profile		count and time the I/O calls at exit; a\n"
+	       "				blkid probe or a discard is one call\n"
 	       "	-h, --help		display this help and exit\n");
 	exit(EXIT_FAILURE);
 }
@@ -197,22 +233,34 @@ const char * const cache_replacement_policies[] = {
 	NULL
 };
 
-int blkdiscard_all(char *path, int fd)
-{
-	printf("%s blkdiscard beginning...", path);
-	fflush(stdout);
+/* Discard and zeroout are issued in pieces of this size */
+#define DISCARD_CHUNK	(1ULL << 30)
 
-	uint64_t end, blksize, secsize, range[2];
+/*
+ * Discard the whole device a chunk at a time, so that progress can be
+ * reported and one huge BLKDISCARD doesn't block for minutes. With
+ * --zeroout, devices that don't support discard are zeroed with BLKZEROOUT
+ * instead, which uses write zeroes where the device has it.
+ *
+ * Returns 0 once discarded, 1 if the device doesn't support discard and -1
+ * on errors.
+ */
+static int blkdiscard_all(struct format_job *job, int fd)
+{
+	unsigned long cmd = BLKDISCARD;
+	uint64_t offset, len, blksize, range[2];
+	unsigned int secsize;
 	struct stat sb;
 
-	range[0] = 0;
-	range[1] = ULLONG_MAX;
+	fprintf(job->out, "%s blkdiscard beginning...", job->dev);
 
 	if (fstat(fd, &sb) == -1)
 		goto err;
 
-	if (!S_ISBLK(sb.st_mode))
-		goto err;
+	if (!S_ISBLK(sb.st_mode)) {
+		fprintf(job->out, "not a block device\n");
+		return 1;
+	}
 
 	if (ioctl(fd, BLKGETSIZE64, &blksize))
 		goto err;
@@ -220,27 +268,45 @@ int blkdiscard_all(char *path, int fd)
 	if (ioctl(fd, BLKSSZGET, &secsize))
 		goto err;
 
-	/* align range to the sector size */
-	range[0] = (range[0] + secsize - 1) & ~(secsize - 1);
-	range[1] &= ~(secsize - 1);
+	/* align the end of the range to the sector size */
+	blksize &= ~((uint64_t) secsize - 1);
+	__atomic_store_n(&job->discard_total, blksize, __ATOMIC_RELAXED);
 
-	/* is the range end behind the end of the device ?*/
-	end = range[0] + range[1];
-	if (end < range[0] || end > blksize)
-		range[1] = blksize - range[0];
+	for (offset = 0; offset < blksize; offset += len) {
+		len = blksize - offset < DISCARD_CHUNK
+			? blksize - offset : DISCARD_CHUNK;
+		range[0] = offset;
+		range[1] = len;
 
-	if (ioctl(fd, BLKDISCARD, &range))
+		if (!ioctl(fd, cmd, &range)) {
+			__atomic_store_n(&job->discard_done, offset + len,
+					 __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (cmd == BLKDISCARD && !offset &&
+		    (errno == EOPNOTSUPP || errno == ENOTTY)) {
+			if (!job->sbc.zeroout) {
+				fprintf(job->out, "not supported\n");
+				return 1;
+			}
+			fprintf(job->out, "not supported, zeroing...");
+			cmd = BLKZEROOUT;
+			len = 0;
+			continue;
+		}
 		goto err;
+	}
 
-	printf("done\n");
-	return 0;
+	fprintf(job->out, "done\n");
+	return cmd == BLKDISCARD ? 0 : 1;
 err:
-	printf("\r                                ");
+	fprintf(job->out, "failed: %s\n", strerror(errno));
 	return -1;
 }
 
-static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *sbc,
-	bool bdev, unsigned long long nbuckets)
+static int write_sb_common(FILE *out, char *dev, struct cache_sb *sb,
+	struct sb_context *sbc, bool bdev, unsigned long long nbuckets)
 {
 	char uuid_str[40], set_uuid_str[40];
 	unsigned int block_size = sbc->block_size;
@@ -279,7 +345,7 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 		 */
 		if (is_zoned_device(dev) &&
 		    BDEV_CACHE_MODE(sb) == CACHE_MODE_WRITEBACK) {
-			printf("Zoned device %s detected: convert to writethrough mode.\n\n",
+			fprintf(out, "Zoned device %s detected: convert to writethrough mode.\n\n",
 				dev);
 			SET_BDEV_CACHE_MODE(sb, CACHE_MODE_WRITETHROUGH);
 		}
@@ -290,10 +356,10 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 			sb->data_offset = data_offset;
 		}
 
-		printf("Name			%s\n", dev);
-		printf("Label			%s\n", label);
-		printf("Type			data\n");
-		printf("UUID:			%s\n"
+		fprintf(out, "Name			%s\n", dev);
+		fprintf(out, "Label			%s\n", label);
+		fprintf(out, "Type			data\n");
+		fprintf(out, "UUID:			%s\n"
 		       "Set UUID:		%s\n"
 		       "version:		%u\n"
 		       "block_size_in_sectors:	%u\n"
@@ -302,7 +368,7 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 		       (unsigned int) sb->version,
 		       sb->block_size,
 		       data_offset);
-		putchar('\n');
+		fputc('\n', out);
 	} else {
 		set_bucket_size(sb, bucket_size);
 
@@ -312,18 +378,18 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 		sb->first_bucket		= (23 / sb->bucket_size) + 1;
 
 		if (sb->nbuckets < 1 << 7) {
-			fprintf(stderr, "Not enough buckets: %llu, need %u\n",
-			       sb->nbuckets, 1 << 7);
-			exit(EXIT_FAILURE);
+			fprintf(stderr, "%s: not enough buckets: %llu, need %u\n",
+			       dev, sb->nbuckets, 1 << 7);
+			return -1;
 		}
 
 		SET_CACHE_DISCARD(sb, discard);
 		SET_CACHE_REPLACEMENT(sb, cache_replacement_policy);
 
-		printf("Name			%s\n", dev);
-		printf("Label			%s\n", label);
-		printf("Type			cache\n");
-		printf("UUID:			%s\n"
+		fprintf(out, "Name			%s\n", dev);
+		fprintf(out, "Label			%s\n", label);
+		fprintf(out, "Type			cache\n");
+		fprintf(out, "UUID:			%s\n"
 		       "Set UUID:		%s\n"
 		       "version:		%u\n"
 		       "nbuckets:		%llu\n"
@@ -341,7 +407,7 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 		       sb->nr_this_dev,
 		       sb->first_bucket);
 
-		putchar('\n');
+		fputc('\n', out);
 	}
 
 	/* write label */
@@ -352,31 +418,51 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 		sb->label[i] = sbc->label[i];
 	sb->label[i] = '\0';
 
+	return 0;
 }
 
-static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
+/* Longer than the three tries of three seconds this used to be */
+#define WRITE_SB_CLOSE_MS	10000
+
+/* The device is closed once bcache lets go of its exclusive open */
+struct excl_open {
+	const char	*dev;
+	int		fd;
+};
+
+static bool excl_opened(void *arg)
 {
-	int fd;
+	struct excl_open *eo = arg;
+
+	eo->fd = PROF(PROF_OPEN, open(eo->dev, O_RDWR|O_EXCL));
+	return eo->fd >= 0;
+}
+
+static int write_sb(struct format_job *job)
+{
+	char *dev = job->dev;
+	struct sb_context *sbc = &job->sbc;
+	bool bdev = job->bdev, force = job->force;
+	int fd, ret = -1;
 	char zeroes[SB_START] = {0};
-	struct cache_sb_disk sb_disk;
+	struct cache_sb_disk sb_disk, *old;
 	struct cache_sb sb;
 	blkid_probe pr;
 	uint64_t nbuckets;
 	bool wipe_bcache = sbc->wipe_bcache;
 	bool discard = sbc->discard;
 
-	fd = open(dev, O_RDWR|O_EXCL);
+	fd = PROF(PROF_OPEN, open(dev, O_RDWR|O_EXCL));
 
 	if (fd == -1) {
 		if ((errno == 16) && force) {
 			struct bdev bd;
 			struct cdev cd;
 			int type = 1;
-			int ret;
 
 			ret = detail_dev(dev, &bd, &cd, &type);
 			if (ret != 0)
-				exit(EXIT_FAILURE);
+				return -1;
 			if (type == BCACHE_SB_VERSION_BDEV) {
 				ret = stop_backdev(dev);
 			} else if (type == BCACHE_SB_VERSION_CDEV
@@ -386,85 +472,92 @@ static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 				fprintf(stderr,
 					"%s,And this is not a bcache device.\n",
 					strerror(errno));
-				exit(EXIT_FAILURE);
+				return -1;
 			}
 			if (ret != 0)
-				exit(EXIT_FAILURE);
-			int i;
-			bool opened;
-
-			for (i = 0; i < 3; i++) {
-				sleep(3);
-				fd = open(dev, O_RDWR|O_EXCL);
-				if (fd == -1) {
-					fprintf(stdout,
-						"Waiting for bcache device to be closed.\n");
-				} else {
-					opened = true;
-					break;
-				}
-			}
-			if (!opened) {
+				return -1;
+			struct excl_open eo = { .dev = dev, .fd = -1 };
+
+			fprintf(job->out,
+				"Waiting for bcache device to be closed.\n");
+			if (!watch_until(excl_opened, &eo, WRITE_SB_CLOSE_MS)) {
 				fprintf(stderr,
 					"Bcache devices has not completely closed,");
 				fprintf(stderr, "you can try it sooner.\n");
-				exit(EXIT_FAILURE);
+				return -1;
 			}
+			fd = eo.fd;
 		} else {
 			fprintf(stderr, "Can't open dev %s: %s\n",
 					dev, strerror(errno));
-			exit(EXIT_FAILURE);
+			return -1;
 		}
 	}
 
 	if (force)
 		wipe_bcache = true;
 
-	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk))
-		exit(EXIT_FAILURE);
+	old = sb_read(fd);
+	if (!old) {
+		fprintf(stderr, "Can't read super block of %s\n", dev);
+		goto out;
+	}
 
-	if (!memcmp(sb_disk.magic, bcache_magic, 16)) {
+	if (sb_is_bcache(old)) {
 		if (wipe_bcache) {
-			if (pwrite(fd, zeroes, sizeof(sb_disk),
-				SB_START) != sizeof(sb_disk)) {
+			if (PROF(PROF_WRITE, pwrite(fd, zeroes,
+				sizeof(sb_disk), SB_START)) != sizeof(sb_disk)) {
 				fprintf(stderr,
 					"Failed to erase super block for %s\n",
 					dev);
-				exit(EXIT_FAILURE);
+				goto out;
 			}
 		} else {
 			fprintf(stderr, "Already a bcache device on %s,", dev);
 			fprintf(stderr,
 				"overwrite with --wipe-bcache or --force\n");
-			exit(EXIT_FAILURE);
+			goto out;
 		}
 	}
 	pr = blkid_new_probe();
 	if (!pr)
-		exit(EXIT_FAILURE);
-	if (blkid_probe_set_device(pr, fd, 0, 0))
-		exit(EXIT_FAILURE);
+		goto out;
+	if (PROF(PROF_BLKID, blkid_probe_set_device(pr, fd, 0, 0)) ||
 	/* enable ptable probing; superblock probing is enabled by default */
-	if (blkid_probe_enable_partitions(pr, true))
-		exit(EXIT_FAILURE);
-	if (!blkid_do_probe(pr)) {
+	    PROF(PROF_BLKID, blkid_probe_enable_partitions(pr, true))) {
+		blkid_free_probe(pr);
+		goto out;
+	}
+	if (!PROF(PROF_BLKID, blkid_do_probe(pr))) {
 		/* XXX wipefs doesn't know how to remove partition tables */
 		fprintf(stderr,
 			"Device %s already has a non-bcache superblock,", dev);
 		fprintf(stderr,	"remove it using wipefs and wipefs -a\n");
-		exit(EXIT_FAILURE);
+		blkid_free_probe(pr);
+		goto out;
 	}
+	blkid_free_probe(pr);
 
 	memset(&sb_disk, 0, sizeof(struct cache_sb_disk));
 
 	nbuckets = getblocks(fd) / sbc->bucket_size;
 
-	write_sb_common(dev, &sb, sbc, bdev, nbuckets);
+	if (write_sb_common(job->out, dev, &sb, sbc, bdev, nbuckets))
+		goto out;
 
-	if (!SB_IS_BDEV(&sb)) {
+	if (!SB_IS_BDEV(&sb) && discard) {
 		/* Attempting to discard cache device */
-		if (discard)
-			blkdiscard_all(dev, fd);
+		switch (PROF(PROF_DISCARD, blkdiscard_all(job, fd))) {
+		case 0:
+			break;
+		case 1:
+			/* Discards would only fail on it once registered */
+			SET_CACHE_DISCARD(&sb, false);
+			break;
+		default:
+			fprintf(stderr, "%s: discard failed\n", dev);
+			goto out;
+		}
 	}
 
 	/*
@@ -476,18 +569,25 @@ static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 	/* write csum */
 	sb_disk.csum = cpu_to_le64(csum_set(&sb_disk));
 	/* Zero start of disk */
-	if (pwrite(fd, zeroes, SB_START, 0) != SB_START) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+	if (PROF(PROF_WRITE, pwrite(fd, zeroes, SB_START, 0)) != SB_START) {
+		fprintf(stderr, "%s: write error: %s\n", dev, strerror(errno));
+		goto out;
 	}
 	/* Write superblock */
-	if (pwrite(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk)) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+	if (PROF(PROF_WRITE, pwrite(fd, &sb_disk, sizeof(sb_disk),
+				    SB_START)) != sizeof(sb_disk)) {
+		fprintf(stderr, "%s: write error: %s\n", dev, strerror(errno));
+		goto out;
 	}
 
-	fsync(fd);
+	if (PROF(PROF_FSYNC, fsync(fd))) {
+		fprintf(stderr, "%s: fsync error: %s\n", dev, strerror(errno));
+		goto out;
+	}
+	ret = 0;
+out:
 	close(fd);
+	return ret;
 }
 
 // TODO(atom): Move it to common header file
@@ -505,8 +605,10 @@ struct bch_register_device {
 
 #define CUSTOM_BCACHE_CTRL_DEV "/dev/bcache_ctrl"
 
-static void write_sb_ioctl(char *dev, struct sb_context *sbc, bool bdev, bool force)
+static int write_sb_ioctl(struct format_job *job)
 {
+	char *dev = job->dev;
+	struct sb_context *sbc = &job->sbc;
 	int fd;
 	uint64_t dev_blocks;
 
@@ -514,10 +616,10 @@ static void write_sb_ioctl(char *dev, struct sb_context *sbc, bool bdev, bool fo
 	struct stat query_core;
 
 	/* Check if core device provided is valid */
-	fd = open(dev, 0);
+	fd = PROF(PROF_OPEN, open(dev, 0));
 	if (fd < 0) {
 		fprintf(stderr, "Device %s not found.\n", dev);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	dev_blocks = getblocks(fd);
@@ -527,32 +629,160 @@ static void write_sb_ioctl(char *dev, struct sb_context *sbc, bool bdev, bool fo
 	/* Check if the core device is a block device or a file */
 	if (stat(dev, &query_core)) {
 		fprintf(stderr, "Could not stat target core device %s!\n", dev);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	if (!S_ISBLK(query_core.st_mode)) {
 		fprintf(stderr, "Core object %s is not supported!\n", dev);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
-	fd = open(CUSTOM_BCACHE_CTRL_DEV, 0);
+	fd = PROF(PROF_OPEN, open(CUSTOM_BCACHE_CTRL_DEV, 0));
 	if (fd < 0) {
 		fprintf(stderr, "Unable to open " CUSTOM_BCACHE_CTRL_DEV ": %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	memset(&cmd, 0, sizeof(cmd));
 	strncpy(&cmd.dev_name[0], dev, BDEVNAME_SIZE - 1);
 
-	write_sb_common(dev, &cmd.sb, sbc, bdev, dev_blocks/sbc->bucket_size);
+	if (write_sb_common(job->out, dev, &cmd.sb, sbc, job->bdev,
+			    dev_blocks/sbc->bucket_size)) {
+		close(fd);
+		return -1;
+	}
 
-	if (ioctl(fd, BCH_IOCTL_REGISTER_DEVICE, &cmd) < 0) {
+	if (PROF(PROF_IOCTL, ioctl(fd, BCH_IOCTL_REGISTER_DEVICE, &cmd)) < 0) {
 		fprintf(stderr, "Error during ioctl operation: %s\n", strerror(errno));
 		close(fd);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	close(fd);
+	return 0;
+}
+
+/* Wakes the progress meter as soon as a job is done */
+static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t format_cond = PTHREAD_COND_INITIALIZER;
+
+static void *format_worker(void *arg)
+{
+	struct format_job *job = arg;
+
+	if (job->use_ioctl)
+		job->ret = write_sb_ioctl(job);
+	else
+		job->ret = write_sb(job);
+
+	pthread_mutex_lock(&format_lock);
+	job->finished = true;
+	pthread_cond_signal(&format_cond);
+	pthread_mutex_unlock(&format_lock);
+	return NULL;
+}
+
+/* A one line discard progress meter, for a terminal */
+static void format_progress(struct format_job *jobs, unsigned int nr,
+			    bool done)
+{
+	static bool shown;
+	unsigned int i, pct;
+	uint64_t total;
+	bool any = false;
+
+	for (i = 0; i < nr && !done; i++) {
+		total = __atomic_load_n(&jobs[i].discard_total,
+					__ATOMIC_RELAXED);
+		if (!total)
+			continue;
+
+		pct = __atomic_load_n(&jobs[i].discard_done,
+				      __ATOMIC_RELAXED) * 100 / total;
+		fprintf(stderr, "%s %s %u%%", any ? "" : "\rDiscarding:",
+			jobs[i].dev, pct);
+		any = shown = true;
+	}
+
+	if (any)
+		fprintf(stderr, "\033[K");
+	else if (done && shown)
+		fprintf(stderr, "\r\033[K");
+	fflush(stderr);
+}
+
+static bool format_running(struct format_job *jobs, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (!jobs[i].finished)
+			return true;
+	return false;
+}
+
+/*
+ * Formats all devices in parallel, 0 if every one of them succeeded. The
+ * discard progress is redrawn every 250ms until the last job is done.
+ */
+static int format_devices(struct format_job *jobs, unsigned int nr)
+{
+	bool progress = isatty(STDERR_FILENO);
+	unsigned int i;
+	struct timespec ts;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++)
+		if (!jobs[i].bdev && jobs[i].sbc.discard && !jobs[i].use_ioctl)
+			break;
+	if (i == nr)
+		progress = false;
+
+	for (i = 0; i < nr; i++) {
+		jobs[i].out = open_memstream(&jobs[i].outbuf,
+					     &jobs[i].outlen);
+		if (!jobs[i].out) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pthread_create(&jobs[i].thread, NULL, format_worker,
+				   &jobs[i])) {
+			fprintf(stderr, "Can't create thread for %s\n",
+				jobs[i].dev);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (progress) {
+		pthread_mutex_lock(&format_lock);
+		while (format_running(jobs, nr)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 250 * 1000 * 1000;
+			if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000 * 1000 * 1000;
+			}
+			pthread_cond_timedwait(&format_cond, &format_lock, &ts);
+			format_progress(jobs, nr, false);
+		}
+		pthread_mutex_unlock(&format_lock);
+		format_progress(jobs, nr, true);
+	}
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(jobs[i].thread, NULL);
+
+		fclose(jobs[i].out);
+		fwrite(jobs[i].outbuf, 1, jobs[i].outlen, stdout);
+		free(jobs[i].outbuf);
+
+		if (jobs[i].ret)
+			ret = -1;
+	}
+	fflush(stdout);
+
+	return ret;
 }
 
 static unsigned int get_blocksize(const char *path)
@@ -579,13 +809,14 @@ static unsigned int get_blocksize(const char *path)
 		 * we want to use logical_block_size.
 		 */
 		unsigned int logical_block_size;
-		int fd = open(path, O_RDONLY);
+		int fd = PROF(PROF_OPEN, open(path, O_RDONLY));
 
 		if (fd < 0) {
 			fprintf(stderr, "open(%s) failed: %m\n", path);
 			exit(EXIT_FAILURE);
 		}
-		if (ioctl(fd, BLKSSZGET, &logical_block_size)) {
+		if (PROF(PROF_IOCTL,
+			 ioctl(fd, BLKSSZGET, &logical_block_size))) {
 			fprintf(stderr,
 				"ioctl(%s, BLKSSZGET) failed: %m\n", path);
 			exit(EXIT_FAILURE);
@@ -605,11 +836,22 @@ int make_bcache(int argc, char **argv)
 	char *backing_devices[argc];
 	char label[SB_LABEL_SIZE] = { 0 };
 	unsigned int block_size = 0, bucket_size = 1024;
-	int writeback = 0, discard = 0, wipe_bcache = 0, force = 0, use_ioctl = 0;
+	int writeback = 0, discard = 0, zeroout = 0, wipe_bcache = 0, force = 0;
+	int use_ioctl = 0;
+	int auto_align = 0;
+	bool bucket_given = false, data_offset_given = false;
+	unsigned int cache_bucket[argc];
+	uint64_t backing_offset[argc];
+	struct dev_topology topo;
+	struct zone_report zones;
 	unsigned int cache_replacement_policy = 0;
 	uint64_t data_offset = BDEV_DATA_START_DEFAULT;
 	uuid_t set_uuid;
+	bool cset_uuid_given = false;
 	struct sb_context sbc;
+	struct format_job jobs[argc], *job;
+	unsigned int njobs = 0;
+	int ret;
 
 	uuid_generate(set_uuid);
 
@@ -621,6 +863,7 @@ int make_bcache(int argc, char **argv)
 		{ "writeback",		0, &writeback,	1 },
 		{ "wipe-bcache",	0, &wipe_bcache,	1 },
 		{ "discard",		0, &discard,	1 },
+		{ "zeroout",		0, &zeroout,	1 },
 		{ "cache_replacement_policy", 1, NULL, 'p' },
 		{ "cache-replacement-policy", 1, NULL, 'p' },
 		{ "data_offset",	1, NULL,	'o' },
@@ -630,11 +873,13 @@ int make_bcache(int argc, char **argv)
 		{ "force",		0, &force,	 1 },
 		{ "label",		1, NULL,	 'l' },
 		{ "ioctl",		0, &use_ioctl,	1},
+		{ "auto",		0, NULL,	'a' },
+		{ "profile",		0, NULL,	'P' },
 		{ NULL,			0, NULL,	0 },
 	};
 
 	while ((c = getopt_long(argc, argv,
-				"-hCBUo:w:b:l:",
+				"-hCBUao:w:b:l:",
 				opts, NULL)) != -1)
 		switch (c) {
 		case 'C':
@@ -646,6 +891,7 @@ int make_bcache(int argc, char **argv)
 		case 'b':
 			bucket_size =
 				hatoi_validate(optarg, "bucket size", UINT_MAX);
+			bucket_given = true;
 			break;
 		case 'w':
 			block_size =
@@ -671,12 +917,20 @@ int make_bcache(int argc, char **argv)
 				       BDEV_DATA_START_DEFAULT);
 				exit(EXIT_FAILURE);
 			}
+			data_offset_given = true;
+			break;
+		case 'a':
+			auto_align = 1;
+			break;
+		case 'P':
+			profile_enable();
 			break;
 		case 'u':
 			if (uuid_parse(optarg, set_uuid)) {
 				fprintf(stderr, "Bad uuid\n");
 				exit(EXIT_FAILURE);
 			}
+			cset_uuid_given = true;
 			break;
 		case 'l':
 			if (strlen(optarg) >= SB_LABEL_SIZE) {
@@ -706,7 +960,12 @@ int make_bcache(int argc, char **argv)
 		usage();
 	}
 
-	if (ncache_devices > 1) {
+	/*
+	 * The kernel only supports one cache device per cache set, several
+	 * cache devices each become their own set, and a backing device
+	 * could only be attached to one of them.
+	 */
+	if (ncache_devices > 1 && (nbacking_devices || cset_uuid_given)) {
 		fprintf(stderr, "Please specify only one cache device\n");
 		usage();
 	}
@@ -717,6 +976,34 @@ int make_bcache(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (auto_align) {
+		unsigned int auto_block_size = 0;
+
+		for (i = 0; i < ncache_devices; i++) {
+			if (dev_topology(cache_devices[i], &topo))
+				exit(EXIT_FAILURE);
+			topology_print(stdout, cache_devices[i], &topo);
+			auto_block_size = max(auto_block_size,
+					      topology_block_size(stdout, &topo));
+			cache_bucket[i] = topology_bucket_size(stdout, &topo,
+					bucket_given ? bucket_size : 0);
+		}
+
+		for (i = 0; i < nbacking_devices; i++) {
+			if (dev_topology(backing_devices[i], &topo))
+				exit(EXIT_FAILURE);
+			topology_print(stdout, backing_devices[i], &topo);
+			auto_block_size = max(auto_block_size,
+					      topology_block_size(stdout, &topo));
+			backing_offset[i] = topology_data_offset(stdout, &topo,
+					data_offset_given ? data_offset : 0);
+		}
+
+		if (!block_size)
+			block_size = auto_block_size;
+		putchar('\n');
+	}
+
 	if (!block_size) {
 		for (i = 0; i < ncache_devices; i++)
 			block_size = max(block_size,
@@ -731,33 +1018,65 @@ int make_bcache(int argc, char **argv)
 	sbc.bucket_size = bucket_size;
 	sbc.writeback = writeback;
 	sbc.discard = discard;
+	sbc.zeroout = zeroout;
 	sbc.wipe_bcache = wipe_bcache;
 	sbc.cache_replacement_policy = cache_replacement_policy;
 	sbc.data_offset = data_offset;
 	memcpy(sbc.set_uuid, set_uuid, sizeof(sbc.set_uuid));
 	sbc.label = label;
 
+	memset(jobs, 0, sizeof(jobs));
+
 	for (i = 0; i < ncache_devices; i++) {
 		if (use_ioctl) {
 			fprintf(stderr, "WARNING. Cache devices should use the normal way!\n");
 		}
-		write_sb(cache_devices[i], &sbc, false, force);
+
+		job = &jobs[njobs++];
+		job->dev = cache_devices[i];
+		job->force = force;
+		job->sbc = sbc;
+		if (auto_align)
+			job->sbc.bucket_size = cache_bucket[i];
+		/* Several cache devices are independent cache sets */
+		if (i)
+			uuid_generate(job->sbc.set_uuid);
 	}
 
 	for (i = 0; i < nbacking_devices; i++) {
+		if (auto_align)
+			sbc.data_offset = backing_offset[i];
 		check_data_offset_for_zoned_device(backing_devices[i],
 						   &sbc.data_offset);
+
+		job = &jobs[njobs++];
+		job->dev = backing_devices[i];
+		job->bdev = true;
+		job->force = force;
 		if (use_ioctl) {
 			if (sbc.data_offset != 0)
 				fprintf(stderr, "WARNING. data_offset must be 0 when using IOCTL"
 								" registration! Enforcing it...\n");
 
 			sbc.data_offset = 0;
-			write_sb_ioctl(backing_devices[i], &sbc, true, force);
-		} else {
-			write_sb(backing_devices[i], &sbc, true, force);
+			job->use_ioctl = true;
+		}
+		job->sbc = sbc;
+
+		if (zone_report(backing_devices[i], &zones))
+			exit(EXIT_FAILURE);
+		if (zones.nr_zones) {
+			zone_report_print(stdout, backing_devices[i], &zones);
+			if (zone_check(stderr, backing_devices[i], &zones,
+				       sbc.data_offset))
+				exit(EXIT_FAILURE);
 		}
 	}
 
+	ret = format_devices(jobs, njobs);
+	inventory_invalidate();
+	if (ret)
+		exit(EXIT_FAILURE);
+
 	return 0;
 }
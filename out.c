@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * The output builder behind --output=json and --output=tsv0.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "out.h"
+
+int out_format_parse(const char *s, enum out_format *format)
+{
+	if (!strcmp(s, "text"))
+		*format = OUT_TEXT;
+	else if (!strcmp(s, "json"))
+		*format = OUT_JSON;
+	else if (!strcmp(s, "tsv0"))
+		*format = OUT_TSV0;
+	else
+		return -1;
+	return 0;
+}
+
+void out_init(struct out *o, FILE *f, enum out_format format)
+{
+	o->f = f;
+	o->format = format;
+	o->err = false;
+	o->depth = 0;
+	o->overflow = 0;
+	o->path_len = 0;
+	o->path[0] = '\0';
+	o->len = 0;
+}
+
+static void out_flush(struct out *o)
+{
+	if (o->len && fwrite(o->buf, 1, o->len, o->f) != o->len)
+		o->err = true;
+	o->len = 0;
+}
+
+static void out_write(struct out *o, const char *s, size_t n)
+{
+	size_t room;
+
+	while (n) {
+		if (o->len == sizeof(o->buf))
+			out_flush(o);
+		room = sizeof(o->buf) - o->len;
+		if (room > n)
+			room = n;
+		memcpy(o->buf + o->len, s, room);
+		o->len += room;
+		s += room;
+		n -= room;
+	}
+}
+
+static void out_putc(struct out *o, char c)
+{
+	if (o->len == sizeof(o->buf))
+		out_flush(o);
+	o->buf[o->len++] = c;
+}
+
+static void out_puts(struct out *o, const char *s)
+{
+	out_write(o, s, strlen(s));
+}
+
+/* Formats backwards from the end of a buffer of at least 20 bytes */
+static char *fmt_u64(char *end, uint64_t v, unsigned int base)
+{
+	static const char digits[] = "0123456789ABCDEF";
+
+	do {
+		*--end = digits[v % base];
+		v /= base;
+	} while (v);
+	return end;
+}
+
+/* Length of the valid UTF-8 sequence at s, 0 if it isn't one */
+static unsigned int utf8_len(const unsigned char *s)
+{
+	unsigned int n, i;
+	uint32_t cp;
+
+	if (s[0] < 0xc2 || s[0] > 0xf4)
+		return 0;
+	n = s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : 4;
+	cp = s[0] & (0x7f >> n);
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		cp = cp << 6 | (s[i] & 0x3f);
+	}
+
+	/* Overlong, a surrogate or past U+10FFFF */
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+	    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+		return 0;
+	return n;
+}
+
+/* Bytes that aren't valid UTF-8 become U+FFFD, one for each byte */
+static void out_json_str(struct out *o, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run = s;
+	unsigned int n;
+
+	out_putc(o, '"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c >= 0x80) {
+			n = utf8_len((const unsigned char *) s);
+			if (n) {
+				s += n - 1;
+				continue;
+			}
+			out_write(o, run, s - run);
+			run = s + 1;
+			out_puts(o, "\\ufffd");
+			continue;
+		}
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		out_write(o, run, s - run);
+		run = s + 1;
+		out_putc(o, '\\');
+		switch (c) {
+		case '"':
+		case '\\':
+			out_putc(o, c);
+			break;
+		case '\n':
+			out_putc(o, 'n');
+			break;
+		case '\t':
+			out_putc(o, 't');
+			break;
+		default:
+			out_puts(o, "u00");
+			out_putc(o, hex[c >> 4]);
+			out_putc(o, hex[c & 15]);
+		}
+	}
+	out_write(o, run, s - run);
+	out_putc(o, '"');
+}
+
+/*
+ * Starts a value of the current container: the comma and key for JSON,
+ * the path of the value for TSV0.
+ */
+static void out_key(struct out *o, const char *key)
+{
+	struct out_level *l = o->depth ? &o->level[o->depth - 1] : NULL;
+	char num[20], *p;
+	size_t n;
+
+	if (!l) {
+		if (o->format == OUT_TSV0)
+			o->path_len = 0;
+		return;
+	}
+
+	if (o->format == OUT_JSON) {
+		if (l->nr)
+			out_putc(o, ',');
+		if (!l->list) {
+			out_json_str(o, key);
+			out_putc(o, ':');
+		}
+	} else {
+		if (l->list) {
+			p = fmt_u64(num + sizeof(num), l->nr, 10);
+			n = num + sizeof(num) - p;
+		} else {
+			p = (char *) key;
+			n = strlen(key);
+		}
+
+		o->path_len = l->path_len;
+		if (o->path_len && o->path_len < sizeof(o->path) - 1)
+			o->path[o->path_len++] = '.';
+		if (n > sizeof(o->path) - 1 - o->path_len)
+			n = sizeof(o->path) - 1 - o->path_len;
+		memcpy(o->path + o->path_len, p, n);
+		o->path_len += n;
+	}
+	l->nr++;
+}
+
+static void out_begin(struct out *o, const char *key, bool list)
+{
+	struct out_level *l;
+
+	out_key(o, key);
+	if (o->format == OUT_JSON)
+		out_putc(o, list ? '[' : '{');
+
+	if (o->depth == OUT_MAX_DEPTH) {
+		o->err = true;
+		o->overflow++;
+		return;
+	}
+	l = &o->level[o->depth++];
+	l->list = list;
+	l->nr = 0;
+	l->path_len = o->path_len;
+}
+
+static void out_end(struct out *o, bool list)
+{
+	if (o->format == OUT_JSON)
+		out_putc(o, list ? ']' : '}');
+	/* The levels past OUT_MAX_DEPTH were never pushed */
+	if (o->overflow)
+		o->overflow--;
+	else if (o->depth)
+		o->depth--;
+}
+
+void out_begin_object(struct out *o, const char *key)
+{
+	out_begin(o, key, false);
+}
+
+void out_end_object(struct out *o)
+{
+	out_end(o, false);
+}
+
+void out_begin_list(struct out *o, const char *key)
+{
+	out_begin(o, key, true);
+}
+
+void out_end_list(struct out *o)
+{
+	out_end(o, true);
+}
+
+/* A value as it's written, quoted for JSON if it's a string */
+static void out_value(struct out *o, const char *key, const char *val,
+		      size_t n, bool string)
+{
+	out_key(o, key);
+	if (o->format == OUT_JSON) {
+		if (string)
+			out_json_str(o, val);
+		else
+			out_write(o, val, n);
+	} else {
+		out_write(o, o->path, o->path_len);
+		out_putc(o, '\t');
+		out_write(o, val, n);
+		out_putc(o, '\0');
+	}
+}
+
+void out_str(struct out *o, const char *key, const char *val)
+{
+	out_value(o, key, val, strlen(val), true);
+}
+
+void out_u64(struct out *o, const char *key, uint64_t val)
+{
+	char num[20], *p = fmt_u64(num + sizeof(num), val, 10);
+
+	out_value(o, key, p, num + sizeof(num) - p, false);
+}
+
+/* In upper case, as the text output has checksums; a string in JSON */
+void out_hex(struct out *o, const char *key, uint64_t val)
+{
+	char num[21], *p;
+
+	num[sizeof(num) - 1] = '\0';
+	p = fmt_u64(num + sizeof(num) - 1, val, 16);
+	out_value(o, key, p, num + sizeof(num) - 1 - p, true);
+}
+
+void out_bool(struct out *o, const char *key, bool val)
+{
+	out_value(o, key, val ? "true" : "false", val ? 4 : 5, false);
+}
+
+/* Writes out what's left; JSON gets a final newline */
+int out_finish(struct out *o)
+{
+	if (o->format == OUT_JSON)
+		out_putc(o, '\n');
+	out_flush(o);
+	if (fflush(o->f))
+		o->err = true;
+	if (o->err) {
+		fprintf(stderr, "Error writing output\n");
+		return -1;
+	}
+	return 0;
+}
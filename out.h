@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __OUT_H
+#define __OUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Machine readable output, appended to one buffer and written out to the
+ * stream in large chunks, so a listing of many devices costs a handful of
+ * writes and no printf per field.
+ *
+ * OUT_JSON is one compact JSON document. OUT_TSV0 is one record per value,
+ * "path\tvalue" terminated by a NUL, where the path is the keys leading to
+ * the value joined by dots and list entries are numbered from 0: split at
+ * the NUL, then at the first tab, and no value needs quoting.
+ */
+enum out_format {
+	OUT_TEXT,
+	OUT_JSON,
+	OUT_TSV0,
+};
+
+#define OUT_BUF_SIZE		(64 << 10)
+#define OUT_MAX_DEPTH		8
+
+struct out_level {
+	bool			list;
+	unsigned int		nr;		/* values so far */
+	unsigned int		path_len;	/* of the path up to here */
+};
+
+struct out {
+	FILE			*f;
+	enum out_format		format;
+	bool			err;
+
+	unsigned int		depth;
+	unsigned int		overflow;	/* levels too deep to push */
+	struct out_level	level[OUT_MAX_DEPTH];
+	char			path[256];
+	unsigned int		path_len;
+
+	size_t			len;
+	char			buf[OUT_BUF_SIZE];
+};
+
+int out_format_parse(const char *s, enum out_format *format);
+
+void out_init(struct out *o, FILE *f, enum out_format format);
+int out_finish(struct out *o);
+
+/* Keys are ignored inside lists and at the top */
+void out_begin_object(struct out *o, const char *key);
+void out_end_object(struct out *o);
+void out_begin_list(struct out *o, const char *key);
+void out_end_list(struct out *o);
+
+void out_str(struct out *o, const char *key, const char *val);
+void out_u64(struct out *o, const char *key, uint64_t val);
+void out_hex(struct out *o, const char *key, uint64_t val);
+void out_bool(struct out *o, const char *key, bool val);
+
+#endif
@@ -23,18 +23,127 @@
 #include <uuid/uuid.h>
 
 #include "bcache.h"
+#include "lib.h"
+#include "inventory.h"
+
+/*
+ * The fast path reads the super block once and trusts it as it is if its
+ * checksum is good; udev only runs probe-bcache on devices its own blkid
+ * found nothing on. Anything else gets the full blkid probe.
+ */
+static bool fast, udev;
+
+/* 1 for bcache, 0 for not, -1 if it takes the full probe */
+static int probe_fast(int fd, struct cache_sb_disk **sb_disk)
+{
+	*sb_disk = sb_read(fd);
+	if (!*sb_disk)
+		return -1;
+
+	if (!sb_is_bcache(*sb_disk))
+		return 0;
+	return sb_csum_ok(*sb_disk) ? 1 : -1;
+}
+
+static int probe_full(int fd, struct cache_sb_disk **sb_disk)
+{
+	blkid_probe pr;
+	int ret;
+
+	if (!(pr = blkid_new_probe()))
+		return 0;
+	if (blkid_probe_set_device(pr, fd, 0, 0) ||
+	    /* probe partitions too */
+	    blkid_probe_enable_partitions(pr, true)) {
+		blkid_free_probe(pr);
+		return 0;
+	}
+	/* bail if anything was found
+	 * probe-bcache isn't needed once blkid recognizes bcache */
+	ret = blkid_do_probe(pr);
+	blkid_free_probe(pr);
+	if (!ret)
+		return 0;
+
+	*sb_disk = sb_read(fd);
+	return *sb_disk && sb_is_bcache(*sb_disk);
+}
+
+static void probe(const char *dev, bool batch)
+{
+	struct cache_sb_disk *sb_disk;
+	char uuid[40];
+	int fd, ret = -1;
+
+	fd = open(dev, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	if (fast)
+		ret = probe_fast(fd, &sb_disk);
+	if (ret < 0)
+		ret = probe_full(fd, &sb_disk);
+	close(fd);
+	if (!ret)
+		return;
+
+	uuid_unparse(sb_disk->uuid, uuid);
+
+	if (udev) {
+		/* One block per device, like blkid -o udev */
+		if (batch)
+			printf("DEVNAME=%s\n", dev);
+		printf("ID_FS_UUID=%s\n"
+		       "ID_FS_UUID_ENC=%s\n"
+		       "ID_FS_TYPE=bcache\n",
+		       uuid, uuid);
+		if (batch)
+			printf("\n");
+	} else
+		printf("%s: UUID=\"%s\" TYPE=\"bcache\"\n", dev, uuid);
+}
+
+/* Coldplug: every block device the kernel knows about */
+static void probe_all(void)
+{
+	char line[256], name[NAME_MAX + 1], dev[NAME_MAX + 6];
+	unsigned long long blocks;
+	unsigned int major, minor;
+	FILE *f;
+
+	f = fopen("/proc/partitions", "re");
+	if (!f) {
+		perror("Error opening /proc/partitions");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %u %u %llu %255s", &major, &minor, &blocks,
+			   name) != 4)
+			continue;
+		snprintf(dev, sizeof(dev), "/dev/%s", name);
+		probe(dev, true);
+	}
+	fclose(f);
+}
 
 int main(int argc, char **argv)
 {
-	bool udev = false;
+	bool inventory = false, all = false;
 	int i, o;
 	extern char *optarg;
-	struct cache_sb_disk sb_disk;
-	char uuid[40];
-	blkid_probe pr;
 
-	while ((o = getopt(argc, argv, "o:")) != EOF)
+	while ((o = getopt(argc, argv, "o:ifa")) != EOF)
 		switch (o) {
+		case 'i':
+			inventory = true;
+			break;
+		case 'f':
+			fast = true;
+			break;
+		case 'a':
+			all = true;
+			break;
 		case 'o':
 			if (strcmp("udev", optarg)) {
 				printf("Invalid output format %s\n", optarg);
@@ -48,40 +157,18 @@ int main(int argc, char **argv)
 	argv += optind;
 	argc -= optind;
 
-	for (i = 0; i < argc; i++) {
-		int fd = open(argv[i], O_RDONLY);
-		if (fd == -1)
-			continue;
-
-		if (!(pr = blkid_new_probe()))
-			continue;
-		if (blkid_probe_set_device(pr, fd, 0, 0))
-			continue;
-		/* probe partitions too */
-		if (blkid_probe_enable_partitions(pr, true))
-			continue;
-		/* bail if anything was found
-		 * probe-bcache isn't needed once blkid recognizes bcache */
-		if (!blkid_do_probe(pr)) {
-			continue;
-		}
-
-		if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk))
-			continue;
-
-		if (memcmp(sb_disk.magic, bcache_magic, 16))
-			continue;
-
-		uuid_unparse(sb_disk.uuid, uuid);
-
-		if (udev)
-			printf("ID_FS_UUID=%s\n"
-			       "ID_FS_UUID_ENC=%s\n"
-			       "ID_FS_TYPE=bcache\n",
-			       uuid, uuid);
-		else
-			printf("%s: UUID=\"\" TYPE=\"bcache\"\n", uuid);
+	/* Device events from udev, arguments are kernel device names */
+	if (inventory) {
+		for (i = 0; i < argc; i++)
+			inventory_update(strncmp(argv[i], "/dev/", 5)
+					 ? argv[i] : argv[i] + 5);
+		return 0;
 	}
 
+	if (all)
+		probe_all();
+	for (i = 0; i < argc; i++)
+		probe(argv[i], all || argc > 1);
+
 	return 0;
 }
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * The counters behind PROF(), see profile.h. They are added to with
+ * relaxed atomics, as spans close in the scan threads too, and printed
+ * from an atexit() handler, so every exit path of a command reports.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "profile.h"
+
+struct prof_counter {
+	uint64_t		calls;
+	uint64_t		ns;
+	uint64_t		max_ns;
+};
+
+static const char * const prof_phase_names[PROF_NR] = {
+	[PROF_OPEN]		= "open",
+	[PROF_READ]		= "read",
+	[PROF_WRITE]		= "write",
+	[PROF_FSYNC]		= "fsync",
+	[PROF_IOCTL]		= "ioctl",
+	[PROF_DISCARD]		= "discard",
+	[PROF_SYSFS]		= "sysfs",
+	[PROF_BLKID]		= "blkid",
+};
+
+bool prof_enabled;
+static uint64_t prof_start_ns;
+static struct prof_counter prof_counters[PROF_NR];
+
+uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void prof_add(enum prof_phase phase, uint64_t start)
+{
+	struct prof_counter *c = &prof_counters[phase];
+	uint64_t ns = prof_now() - start;
+	uint64_t max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->ns, ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&c->max_ns, &max, ns, true,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+static double ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+static double tv_ms(struct timeval tv)
+{
+	return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+static void profile_report(void)
+{
+	uint64_t wall = prof_now() - prof_start_ns, calls = 0, ns = 0;
+	struct prof_counter *c;
+	struct rusage ru;
+	unsigned int i;
+
+	fprintf(stderr, "\nprofile: %.3f ms wall\n", ms(wall));
+	fprintf(stderr, "  %-8s %8s %12s %12s %12s\n",
+		"phase", "calls", "total ms", "avg us", "max us");
+	for (i = 0; i < PROF_NR; i++) {
+		c = &prof_counters[i];
+		if (!c->calls)
+			continue;
+		fprintf(stderr, "  %-8s %8llu %12.3f %12.1f %12.1f\n",
+			prof_phase_names[i], (unsigned long long) c->calls,
+			ms(c->ns), c->ns / 1e3 / c->calls, c->max_ns / 1e3);
+		calls += c->calls;
+		ns += c->ns;
+	}
+	/* More than the wall time when the spans ran in parallel */
+	fprintf(stderr, "  %-8s %8llu %12.3f\n", "all",
+		(unsigned long long) calls, ms(ns));
+
+	if (!getrusage(RUSAGE_SELF, &ru))
+		fprintf(stderr, "  user %.3f ms, system %.3f ms, %ld blocks "
+			"in, %ld out, %ld voluntary and %ld involuntary "
+			"context switches\n", tv_ms(ru.ru_utime),
+			tv_ms(ru.ru_stime), ru.ru_inblock, ru.ru_oublock,
+			ru.ru_nvcsw, ru.ru_nivcsw);
+}
+
+void profile_enable(void)
+{
+	if (prof_enabled)
+		return;
+	prof_enabled = true;
+	atexit(profile_report);
+}
+
+/* Wall time counts from here, even if --profile turns it on later */
+__attribute__((constructor))
+static void profile_init(void)
+{
+	const char *env = getenv("BCACHE_PROFILE");
+
+	prof_start_ns = prof_now();
+	if (env && *env && strcmp(env, "0"))
+		profile_enable();
+}
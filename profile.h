@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Where a command spends its time
+ *
+ * PROF(phase, expr) evaluates to expr, timed as a span of phase. With
+ * BCACHE_PROFILE set in the environment, or --profile, the number and
+ * time of the spans of each phase are printed to stderr at exit; without,
+ * a span costs one test of a flag. Every span is also a pair of USDT
+ * probes, bcache:span_begin and bcache:span_end with the phase number as
+ * argument, for bpftrace, in builds that have <sys/sdt.h>.
+ *
+ * A span wraps one system call, or one library call that makes many, so
+ * the counts are of those calls and not of system calls: a blkid probe or
+ * the discard of a whole device is one span.
+ */
+enum prof_phase {
+	PROF_OPEN,
+	PROF_READ,
+	PROF_WRITE,
+	PROF_FSYNC,
+	PROF_IOCTL,
+	PROF_DISCARD,
+	PROF_SYSFS,
+	PROF_BLKID,
+	PROF_NR,
+};
+
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifndef DTRACE_PROBE1
+#define DTRACE_PROBE1(provider, name, arg)	do { } while (0)
+#endif
+
+extern bool prof_enabled;
+
+void profile_enable(void);
+uint64_t prof_now(void);
+void prof_add(enum prof_phase phase, uint64_t start);
+
+#define PROF(phase, expr)						\
+({									\
+	uint64_t __prof_start = 0;					\
+	__typeof__(expr) __prof_ret;					\
+									\
+	DTRACE_PROBE1(bcache, span_begin, phase);			\
+	if (__builtin_expect(prof_enabled, 0))				\
+		__prof_start = prof_now();				\
+	__prof_ret = (expr);						\
+	if (__builtin_expect(prof_enabled, 0))				\
+		prof_add(phase, __prof_start);				\
+	DTRACE_PROBE1(bcache, span_end, phase);				\
+	__prof_ret;							\
+})
+
+#endif
@@ -0,0 +1,614 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache sb-backup and sb-restore: the start of every bcache device, as
+ * make-bcache would overwrite it, kept in one archive file.
+ *
+ * The archive is a header followed by one entry per device: a small
+ * header naming the device, its size and its identity, and the
+ * SB_ARCHIVE_REGION bytes from offset 0, each with a crc64. Fields are
+ * little endian, so an archive can be restored from another host.
+ *
+ * A backup reads the devices from the scan threads of lib.c, which costs
+ * one read per bcache device on top of the scan's own. A restore checks
+ * every entry it is asked for before it writes any, so one mismatched
+ * device stops the lot. The writes then go out with O_DIRECT to all of
+ * the devices, and are flushed by one fsync pass at the end instead of
+ * one after each.
+ *
+ * The identity of a device is the wwid, serial, dm uuid or loop backing
+ * file of its disk, with the start sector appended for a partition.
+ * Devices that have none are only checked by size.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+#include "inventory.h"
+#include "sbarchive.h"
+
+#define SB_ARCHIVE_MAGIC	0x6273656863616362ULL	/* "bcachesb" */
+#define SB_ARCHIVE_VERSION	1
+#define SB_ARCHIVE_NAME_LEN	64
+#define SB_ARCHIVE_IDENT_LEN	128
+#define SB_ARCHIVE_HOST_LEN	64
+
+struct sb_archive_header {
+	__le64			magic;
+	__le32			version;
+	__le32			nr;
+	__le32			region;		/* bytes per entry */
+	__le32			pad;
+	__le64			time;
+	char			host[SB_ARCHIVE_HOST_LEN];
+	__le64			csum;		/* of the fields above */
+};
+
+struct sb_archive_entry {
+	char			name[SB_ARCHIVE_NAME_LEN];
+	char			ident[SB_ARCHIVE_IDENT_LEN];
+	__le64			size;		/* of the device, in bytes */
+	__le64			data_csum;
+	__le64			csum;		/* of the fields above */
+};
+
+/* As it is in the file */
+struct sb_image {
+	struct sb_archive_entry	e;
+	char			data[SB_ARCHIVE_REGION];
+};
+
+struct backup_ctx {
+	pthread_mutex_t		lock;
+	struct sb_image		*images;
+	unsigned int		nr;
+	unsigned int		size;
+	unsigned int		failed;
+};
+
+int sb_backup_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	sb-backup archive\n"
+		"	save the super blocks of all bcache devices to archive\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+int sb_restore_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	sb-restore [option] archive [devname...]\n"
+		"	write the super blocks of archive back, to the named\n"
+		"	devices only if any are given\n"
+		"	-l	--list			list the archive, write nothing\n"
+		"	-n	--dry-run		check the devices, write nothing\n"
+		"	-h	--help			show help information\n");
+	return EXIT_FAILURE;
+}
+
+static uint64_t header_csum(const struct sb_archive_header *hdr)
+{
+	return crc64(hdr, offsetof(struct sb_archive_header, csum));
+}
+
+static uint64_t entry_csum(const struct sb_archive_entry *e)
+{
+	return crc64(e, offsetof(struct sb_archive_entry, csum));
+}
+
+static bool image_ok(const struct sb_image *img)
+{
+	return le64_to_cpu(img->e.csum) == entry_csum(&img->e) &&
+	       le64_to_cpu(img->e.data_csum) ==
+	       crc64(img->data, SB_ARCHIVE_REGION);
+}
+
+/* Past the page cache where the device allows it */
+static int open_dev(const char *dev, int flags)
+{
+	int fd;
+
+	fd = open(dev, flags|O_DIRECT|O_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(dev, flags|O_CLOEXEC);
+	return fd;
+}
+
+static int dev_size(int fd, uint64_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+	if (!S_ISBLK(st.st_mode)) {
+		*size = st.st_size;
+		return 0;
+	}
+	return ioctl(fd, BLKGETSIZE64, size);
+}
+
+static int read_attr(const char *dir, const char *attr, char *buf,
+		     size_t size)
+{
+	char path[PATH_MAX];
+	size_t len;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	if (!fgets(buf, size, f))
+		*buf = '\0';
+	fclose(f);
+
+	len = strlen(buf);
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		buf[--len] = '\0';
+	return len ? 0 : -1;
+}
+
+static void read_ident(const char *name, char *buf, size_t size)
+{
+	static const char * const attrs[] = {
+		"wwid", "device/wwid", "serial", "device/serial", "dm/uuid",
+		"loop/backing_file",
+	};
+	char dir[PATH_MAX], val[SB_ARCHIVE_IDENT_LEN], start[32] = "";
+	unsigned int i;
+
+	*buf = '\0';
+	snprintf(dir, sizeof(dir), "%s/sys/class/block/%s", root_prefix(),
+		 name);
+
+	/* A partition goes by its disk, and where on it it starts */
+	if (!read_attr(dir, "partition", val, sizeof(val))) {
+		if (read_attr(dir, "start", start, sizeof(start)))
+			return;
+		strncat(dir, "/..", sizeof(dir) - strlen(dir) - 1);
+	}
+
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		if (read_attr(dir, attrs[i], val, sizeof(val)))
+			continue;
+		/* Cut short it still compares the same */
+		if (snprintf(buf, size, "%s=%s%s%s", attrs[i], val,
+			     *start ? "@" : "", start) >= (int) size)
+			buf[size - 1] = '\0';
+		return;
+	}
+}
+
+static void backup_one(const char *name, dev_t rdev,
+		       struct cache_sb_disk *sb_disk, void *arg)
+{
+	static __thread char buf[SB_ARCHIVE_REGION]
+		__attribute__((aligned(4096)));
+	struct backup_ctx *ctx = arg;
+	char dev[PATH_MAX], ident[SB_ARCHIVE_IDENT_LEN];
+	struct sb_image *img, *images;
+	uint64_t size;
+	int fd;
+
+	if (strlen(name) >= SB_ARCHIVE_NAME_LEN) {
+		fprintf(stderr, "%s: name too long for the archive\n", name);
+		goto fail;
+	}
+
+	snprintf(dev, sizeof(dev), "%s/dev/%s", root_prefix(), name);
+	fd = open_dev(dev, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s: %m\n", dev);
+		goto fail;
+	}
+	if (dev_size(fd, &size) ||
+	    pread(fd, buf, SB_ARCHIVE_REGION, 0) != SB_ARCHIVE_REGION) {
+		fprintf(stderr, "Error reading %s: %m\n", dev);
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	/* Wiped since the scan read it */
+	if (!sb_is_bcache((struct cache_sb_disk *) (buf + SB_START)))
+		return;
+	read_ident(name, ident, sizeof(ident));
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nr == ctx->size) {
+		ctx->size = ctx->size ? ctx->size * 2 : 64;
+		images = realloc(ctx->images, ctx->size * sizeof(*images));
+		if (!images) {
+			ctx->size = ctx->nr;
+			pthread_mutex_unlock(&ctx->lock);
+			fprintf(stderr,
+				"Error: fail to allocate memory buffer\n");
+			goto fail;
+		}
+		ctx->images = images;
+	}
+	img = &ctx->images[ctx->nr++];
+	memset(&img->e, 0, sizeof(img->e));
+	strcpy(img->e.name, name);
+	strcpy(img->e.ident, ident);
+	img->e.size = cpu_to_le64(size);
+	memcpy(img->data, buf, SB_ARCHIVE_REGION);
+	img->e.data_csum = cpu_to_le64(crc64(img->data, SB_ARCHIVE_REGION));
+	img->e.csum = cpu_to_le64(entry_csum(&img->e));
+	pthread_mutex_unlock(&ctx->lock);
+	return;
+fail:
+	__atomic_fetch_add(&ctx->failed, 1, __ATOMIC_RELAXED);
+}
+
+static int cmp_image(const void *a, const void *b)
+{
+	return strverscmp(((const struct sb_image *) a)->e.name,
+			  ((const struct sb_image *) b)->e.name);
+}
+
+/* Written next to path and renamed over it, so it is never half there */
+static int write_archive(const char *path, struct sb_image *images,
+			 unsigned int nr)
+{
+	struct sb_archive_header hdr = { 0 };
+	size_t size = (size_t) nr * sizeof(*images);
+	char tmp[PATH_MAX];
+	int fd;
+
+	hdr.magic = cpu_to_le64(SB_ARCHIVE_MAGIC);
+	hdr.version = cpu_to_le32(SB_ARCHIVE_VERSION);
+	hdr.nr = cpu_to_le32(nr);
+	hdr.region = cpu_to_le32(SB_ARCHIVE_REGION);
+	hdr.time = cpu_to_le64(time(NULL));
+	gethostname(hdr.host, sizeof(hdr.host) - 1);
+	hdr.csum = cpu_to_le64(header_csum(&hdr));
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >=
+	    (int) sizeof(tmp)) {
+		fprintf(stderr, "Error: %s: name too long\n", path);
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating %s: %m\n", tmp);
+		return -1;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, images, size) != (ssize_t) size || fsync(fd)) {
+		fprintf(stderr, "Error writing %s: %m\n", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		fprintf(stderr, "Error renaming %s to %s: %m\n", tmp, path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int bcache_sb_backup(int argc, char **argv)
+{
+	struct backup_ctx ctx = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	int ret = 1;
+
+	static struct option long_options[] = {
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	if (getopt_long(argc, argv, "h", long_options, NULL) != EOF ||
+	    optind != argc - 1)
+		return sb_backup_usage();
+
+	if (scan_each(backup_one, &ctx))
+		goto out;
+
+	qsort(ctx.images, ctx.nr, sizeof(*ctx.images), cmp_image);
+	if (write_archive(argv[optind], ctx.images, ctx.nr))
+		goto out;
+
+	printf("%u bcache devices backed up to %s\n", ctx.nr, argv[optind]);
+	if (ctx.failed) {
+		fprintf(stderr, "%u bcache devices could not be read\n",
+			ctx.failed);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(ctx.images);
+	return ret;
+}
+
+static int read_archive(const char *path, struct sb_archive_header *hdr,
+			struct sb_image **images, unsigned int *nr)
+{
+	size_t size;
+	char c;
+	int fd;
+
+	*images = NULL;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s: %m\n", path);
+		return -1;
+	}
+
+	if (read(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+	    le64_to_cpu(hdr->magic) != SB_ARCHIVE_MAGIC) {
+		fprintf(stderr, "%s is not a super block archive\n", path);
+		goto err;
+	}
+	if (le64_to_cpu(hdr->csum) != header_csum(hdr) ||
+	    le32_to_cpu(hdr->version) != SB_ARCHIVE_VERSION ||
+	    le32_to_cpu(hdr->region) != SB_ARCHIVE_REGION) {
+		fprintf(stderr, "%s: bad header, or of another version\n",
+			path);
+		goto err;
+	}
+	hdr->host[sizeof(hdr->host) - 1] = '\0';
+
+	*nr = le32_to_cpu(hdr->nr);
+	size = (size_t) *nr * sizeof(**images);
+	*images = malloc(size ? size : 1);
+	if (!*images) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		goto err;
+	}
+	if (read(fd, *images, size) != (ssize_t) size ||
+	    read(fd, &c, 1) != 0) {
+		fprintf(stderr, "%s: truncated, or has trailing data\n", path);
+		goto err;
+	}
+	close(fd);
+	return 0;
+err:
+	free(*images);
+	*images = NULL;
+	close(fd);
+	return -1;
+}
+
+static void list_archive(const struct sb_archive_header *hdr,
+			 struct sb_image *images, unsigned int nr)
+{
+	time_t t = le64_to_cpu(hdr->time);
+	struct cache_sb_disk *sb_disk;
+	char uuid[40], when[64];
+	unsigned int i;
+
+	strftime(when, sizeof(when), "%F %T %z", localtime(&t));
+	printf("%u bcache devices of %s, backed up %s\n", nr,
+	       *hdr->host ? hdr->host : "unknown host", when);
+
+	for (i = 0; i < nr; i++) {
+		images[i].e.name[SB_ARCHIVE_NAME_LEN - 1] = '\0';
+		images[i].e.ident[SB_ARCHIVE_IDENT_LEN - 1] = '\0';
+		if (!image_ok(&images[i])) {
+			printf("%-16s corrupt\n", images[i].e.name);
+			continue;
+		}
+		sb_disk = (struct cache_sb_disk *) (images[i].data + SB_START);
+		uuid_unparse(sb_disk->uuid, uuid);
+		printf("%-16s %-6s %s %" PRIu64 " bytes %s\n",
+		       images[i].e.name,
+		       sb_type_name(sb_version(sb_disk)) ?: "?", uuid,
+		       (uint64_t) le64_to_cpu(images[i].e.size),
+		       *images[i].e.ident ? images[i].e.ident : "-");
+	}
+}
+
+/* Opens the device of img exclusively if it is the one backed up */
+static int restore_check(struct sb_image *img)
+{
+	char dev[PATH_MAX], ident[SB_ARCHIVE_IDENT_LEN];
+	const char *name = img->e.name;
+	uint64_t size;
+	int fd;
+
+	if (!image_ok(img)) {
+		fprintf(stderr, "%s: the archive entry is corrupt\n", name);
+		return -1;
+	}
+
+	snprintf(dev, sizeof(dev), "%s/dev/%s", root_prefix(), name);
+	fd = open_dev(dev, O_WRONLY|O_EXCL);
+	if (fd < 0) {
+		if (errno == EBUSY)
+			fprintf(stderr, "%s: in use, unregister or unmount "
+				"it first\n", dev);
+		else
+			fprintf(stderr, "Error opening %s: %m\n", dev);
+		return -1;
+	}
+
+	if (dev_size(fd, &size)) {
+		fprintf(stderr, "Error getting the size of %s: %m\n", dev);
+		goto err;
+	}
+	if (size != le64_to_cpu(img->e.size)) {
+		fprintf(stderr, "%s: has %" PRIu64 " bytes, the backup is of "
+			"a device of %" PRIu64 "\n", dev, size,
+			(uint64_t) le64_to_cpu(img->e.size));
+		goto err;
+	}
+
+	read_ident(name, ident, sizeof(ident));
+	if (strcmp(ident, img->e.ident)) {
+		fprintf(stderr, "%s: is %s, the backup is of %s\n", dev,
+			*ident ? ident : "a device with no identity",
+			*img->e.ident ? img->e.ident :
+			"a device with no identity");
+		goto err;
+	}
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static struct sb_image *find_image(struct sb_image *images, unsigned int nr,
+				   const char *devname)
+{
+	const char *name = strrchr(devname, '/') ? strrchr(devname, '/') + 1 :
+			   devname;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (!strcmp(images[i].e.name, name))
+			return &images[i];
+	return NULL;
+}
+
+int bcache_sb_restore(int argc, char **argv)
+{
+	struct sb_archive_header hdr;
+	struct sb_image *images, **todo = NULL;
+	unsigned int i, nr, nr_todo = 0, written = 0;
+	bool list = false, dry_run = false;
+	int c, *fds = NULL, ret = 1;
+	char *buf = NULL;
+
+	static struct option long_options[] = {
+		{"list", no_argument, 0, 'l'},
+		{"dry-run", no_argument, 0, 'n'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "lnh", long_options,
+				NULL)) != EOF) {
+		switch (c) {
+		case 'l':
+			list = true;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		default:
+			return sb_restore_usage();
+		}
+	}
+	if (optind >= argc)
+		return sb_restore_usage();
+
+	if (read_archive(argv[optind], &hdr, &images, &nr))
+		return 1;
+	for (i = 0; i < nr; i++) {
+		images[i].e.name[SB_ARCHIVE_NAME_LEN - 1] = '\0';
+		images[i].e.ident[SB_ARCHIVE_IDENT_LEN - 1] = '\0';
+	}
+	if (list) {
+		list_archive(&hdr, images, nr);
+		ret = 0;
+		goto out;
+	}
+
+	todo = malloc((nr ? nr : 1) * sizeof(*todo));
+	fds = malloc((nr ? nr : 1) * sizeof(*fds));
+	if (!todo || !fds ||
+	    posix_memalign((void **) &buf, 4096, SB_ARCHIVE_REGION)) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		goto out;
+	}
+
+	if (optind + 1 == argc) {
+		for (i = 0; i < nr; i++)
+			todo[nr_todo++] = &images[i];
+	} else {
+		for (i = optind + 1; i < (unsigned int) argc; i++) {
+			struct sb_image *img = find_image(images, nr, argv[i]);
+			unsigned int j;
+
+			if (!img) {
+				fprintf(stderr, "%s is not in %s\n", argv[i],
+					argv[optind]);
+				goto out;
+			}
+			for (j = 0; j < nr_todo && todo[j] != img; j++)
+				;
+			if (j == nr_todo)
+				todo[nr_todo++] = img;
+		}
+	}
+
+	/* All of them or none */
+	for (i = 0; i < nr_todo; i++) {
+		fds[i] = restore_check(todo[i]);
+		if (fds[i] < 0)
+			break;
+	}
+	if (i < nr_todo) {
+		fprintf(stderr, "Nothing restored\n");
+		nr_todo = i;
+		goto close;
+	}
+	if (dry_run) {
+		for (i = 0; i < nr_todo; i++)
+			printf("%s would be restored\n", todo[i]->e.name);
+		ret = 0;
+		goto close;
+	}
+
+	ret = 0;
+	for (i = 0; i < nr_todo; i++) {
+		memcpy(buf, todo[i]->data, SB_ARCHIVE_REGION);
+		if (pwrite(fds[i], buf, SB_ARCHIVE_REGION, 0) !=
+		    SB_ARCHIVE_REGION) {
+			fprintf(stderr, "Error writing %s: %m\n",
+				todo[i]->e.name);
+			ret = 1;
+			todo[i] = NULL;
+		}
+	}
+	for (i = 0; i < nr_todo; i++) {
+		if (!todo[i])
+			continue;
+		if (fsync(fds[i])) {
+			fprintf(stderr, "Error flushing %s: %m\n",
+				todo[i]->e.name);
+			ret = 1;
+			continue;
+		}
+		written++;
+	}
+	inventory_invalidate();
+	printf("%u of %u super blocks restored\n", written, nr_todo);
+close:
+	for (i = 0; i < nr_todo; i++)
+		close(fds[i]);
+out:
+	free(buf);
+	free(fds);
+	free(todo);
+	free(images);
+	return ret;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __SBARCHIVE_H
+#define __SBARCHIVE_H
+
+/*
+ * What make-bcache overwrites at the start of a device: the SB_START bytes
+ * it zeroes and the super block after them.
+ */
+#define SB_ARCHIVE_REGION	(SB_START + SB_READ_BYTES)
+
+int sb_backup_usage(void);
+int sb_restore_usage(void);
+int bcache_sb_backup(int argc, char **argv);
+int bcache_sb_restore(int argc, char **argv);
+
+#endif
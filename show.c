@@ -15,6 +15,8 @@
 #include <locale.h>
 #include <limits.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <time.h>
 #include <blkid/blkid.h>
 #include <ctype.h>
 #include <errno.h>
@@ -32,10 +34,64 @@
 #include "zoned.h"
 #include "features.h"
 #include "list.h"
+#include "stats.h"
+#include "show.h"
+#include "out.h"
 
-int show_bdevs_detail(void)
+/* What the AttachToDev column has for a device */
+static void attach_devname(struct dev_table *t, struct dev *devs,
+			   char *attachdev)
+{
+	*attachdev = '\0';
+	if (strlen(devs->attachuuid) == 36) {
+		cset_to_devname(t, devs->cset, attachdev);
+	} else if (devs->version == BCACHE_SB_VERSION_CDEV
+		   || devs->version ==
+		   BCACHE_SB_VERSION_CDEV_WITH_UUID) {
+		strcpy(attachdev, BCACHE_NO_SUPPORT);
+	} else {
+		strcpy(attachdev, BCACHE_ATTACH_ALONE);
+	}
+}
+
+/* The columns of show, and with more those of show -m */
+static int show_bdevs_out(struct list_head *head, struct dev_table *t,
+			  bool more, enum out_format format)
+{
+	const char *type;
+	char attachdev[30];
+	struct dev *devs;
+	struct out o;
+
+	out_init(&o, stdout, format);
+	out_begin_list(&o, NULL);
+	list_for_each_entry(devs, head, dev_list) {
+		type = sb_type_name(devs->version);
+		attach_devname(t, devs, attachdev);
+
+		out_begin_object(&o, NULL);
+		out_str(&o, "name", devs->name);
+		if (more) {
+			out_str(&o, "uuid", devs->uuid);
+			out_str(&o, "cset", devs->cset);
+		}
+		out_u64(&o, "version", devs->version);
+		out_str(&o, "type", type ? type : "unknown");
+		out_str(&o, "state", devs->state);
+		out_str(&o, "bname", devs->bname);
+		out_str(&o, "attach_dev", attachdev);
+		if (more)
+			out_str(&o, "attach_cset", devs->attachuuid);
+		out_end_object(&o);
+	}
+	out_end_list(&o);
+	return out_finish(&o) ? 1 : 0;
+}
+
+int show_bdevs_detail(enum out_format format)
 {
 	struct list_head head;
+	struct dev_table table;
 	struct dev *devs, *n;
 
 	INIT_LIST_HEAD(&head);
@@ -46,6 +102,16 @@ int show_bdevs_detail(void)
 		fprintf(stderr, "Failed to list devices\n");
 		return ret;
 	}
+	ret = dev_table_init(&table, &head);
+	if (ret != 0) {
+		free_dev(&head);
+		return ret;
+	}
+	if (format != OUT_TEXT) {
+		ret = show_bdevs_out(&head, &table, true, format);
+		goto out;
+	}
+
 	printf("Name\t\tUuid\t\t\t\t\tCset_Uuid\t\t\t\tType\t\t\tState");
 	printf("\t\t\tBname\t\tAttachToDev\tAttachToCset\n");
 	list_for_each_entry_safe(devs, n, &head, dev_list) {
@@ -72,27 +138,22 @@ int show_bdevs_detail(void)
 		printf("\t%-16s", devs->bname);
 		char attachdev[30];
 
-		if (strlen(devs->attachuuid) == 36) {
-			cset_to_devname(&head, devs->cset, attachdev);
-		} else if (devs->version == BCACHE_SB_VERSION_CDEV
-			   || devs->version ==
-			   BCACHE_SB_VERSION_CDEV_WITH_UUID) {
-			strcpy(attachdev, BCACHE_NO_SUPPORT);
-		} else {
-			strcpy(attachdev, BCACHE_ATTACH_ALONE);
-		}
+		attach_devname(&table, devs, attachdev);
 		printf("%-16s", attachdev);
 		printf("%s", devs->attachuuid);
 		putchar('\n');
 	}
+out:
+	dev_table_exit(&table);
 	free_dev(&head);
-	return 0;
+	return ret;
 }
 
 
-int show_bdevs(void)
+int show_bdevs(enum out_format format)
 {
 	struct list_head head;
+	struct dev_table table;
 	struct dev *devs, *n;
 
 	INIT_LIST_HEAD(&head);
@@ -103,6 +164,16 @@ int show_bdevs(void)
 		fprintf(stderr, "Failed to list devices\n");
 		return ret;
 	}
+	ret = dev_table_init(&table, &head);
+	if (ret != 0) {
+		free_dev(&head);
+		return ret;
+	}
+
+	if (format != OUT_TEXT) {
+		ret = show_bdevs_out(&head, &table, false, format);
+		goto out;
+	}
 
 	printf("Name\t\tType\t\tState\t\t\tBname\t\tAttachToDev\n");
 	list_for_each_entry_safe(devs, n, &head, dev_list) {
@@ -132,24 +203,101 @@ int show_bdevs(void)
 
 		char attachdev[30];
 
-		if (strlen(devs->attachuuid) == 36) {
-			cset_to_devname(&head, devs->cset, attachdev);
-		} else if (devs->version == BCACHE_SB_VERSION_CDEV
-			   || devs->version ==
-			   BCACHE_SB_VERSION_CDEV_WITH_UUID) {
-			strcpy(attachdev, BCACHE_NO_SUPPORT);
-		} else {
-			strcpy(attachdev, BCACHE_ATTACH_ALONE);
-		}
+		attach_devname(&table, devs, attachdev);
 		printf("%s", attachdev);
 		putchar('\n');
 	}
+out:
+	dev_table_exit(&table);
 	free_dev(&head);
-	return 0;
+	return ret;
 }
 
-int detail_single(char *devname)
+/* Not a name for values unknown to the tools, the number is still there */
+static void out_name(struct out *o, const char *key, const char *name)
 {
+	if (name)
+		out_str(o, key, name);
+}
+
+/*
+ * Zones of a zoned backing device, with zone_check() warnings on stderr;
+ * nothing for other devices. The data offset is taken from the super block
+ * itself, bdev's first_sector is too narrow for large zones.
+ */
+static void detail_zones(struct out *o, const char *devname, struct dev *base,
+			 struct zone_report *zones)
+{
+	if (zone_report(devname, zones) || !zones->nr_zones) {
+		zones->nr_zones = 0;
+		return;
+	}
+	zone_check(stderr, devname, zones, base->sb.data_offset);
+	if (!o)
+		return;
+	out_u64(o, "zone.size_sectors", zones->zone_size);
+	out_u64(o, "zone.count", zones->nr_zones);
+	out_u64(o, "zone.conventional", zones->conventional);
+	out_u64(o, "zone.seq_required", zones->seq_required);
+	out_u64(o, "zone.seq_preferred", zones->seq_preferred);
+	out_u64(o, "zone.unusable", zones->unusable);
+}
+
+/* The keys of the text output, with the names in brackets as _name */
+static int detail_single_out(char *devname, struct bdev *bd, struct cdev *cd,
+			     int type, enum out_format format)
+{
+	struct zone_report zones;
+	struct dev *base = type == BCACHE_SB_VERSION_BDEV ||
+		type == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
+		type == BCACHE_SB_VERSION_BDEV_WITH_FEATURES ?
+		&bd->base : &cd->base;
+	struct out o;
+
+	out_init(&o, stdout, format);
+	out_begin_object(&o, NULL);
+	out_str(&o, "sb.magic", base->magic);
+	out_u64(&o, "sb.first_sector", base->first_sector);
+	out_hex(&o, "sb.csum", base->csum);
+	out_u64(&o, "sb.version", base->version);
+	out_name(&o, "sb.version_name", sb_type_name(base->version));
+	if (base == &cd->base)
+		out_cache_set_supported_feature_sets(&o, &base->sb);
+
+	out_str(&o, "dev.label", base->label);
+	out_str(&o, "dev.uuid", base->uuid);
+	out_u64(&o, "dev.sectors_per_block", base->sectors_per_block);
+	out_u64(&o, "dev.sectors_per_bucket", base->sectors_per_bucket);
+	if (base == &bd->base) {
+		out_u64(&o, "dev.data.first_sector", bd->first_sector);
+		out_u64(&o, "dev.data.cache_mode", bd->cache_mode);
+		out_name(&o, "dev.data.cache_mode_name",
+			 cache_mode_name(bd->cache_mode));
+		out_u64(&o, "dev.data.cache_state", bd->cache_state);
+		out_name(&o, "dev.data.cache_state_name",
+			 bdev_state_name(bd->cache_state));
+	} else {
+		out_u64(&o, "dev.cache.first_sector", cd->first_sector);
+		out_u64(&o, "dev.cache.cache_sectors", cd->cache_sectors);
+		out_u64(&o, "dev.cache.total_sectors", cd->total_sectors);
+		out_bool(&o, "dev.cache.ordered", cd->ordered);
+		out_bool(&o, "dev.cache.discard", cd->discard);
+		out_u64(&o, "dev.cache.pos", cd->pos);
+		out_u64(&o, "dev.cache.replacement", cd->replacement);
+		out_name(&o, "dev.cache.replacement_name",
+			 cache_replacement_name(cd->replacement));
+	}
+
+	out_str(&o, "cset.uuid", base->cset);
+	if (base == &bd->base)
+		detail_zones(&o, devname, base, &zones);
+	out_end_object(&o);
+	return out_finish(&o) ? 1 : 0;
+}
+
+int detail_single(char *devname, enum out_format format)
+{
+	struct zone_report zones;
 	struct bdev bd;
 	struct cdev cd;
 	int type = 1;
@@ -160,6 +308,11 @@ int detail_single(char *devname)
 		fprintf(stderr, "Failed to detail device\n");
 		return ret;
 	}
+	if (format != OUT_TEXT) {
+		if (!sb_type_name(type))
+			return 1;
+		return detail_single_out(devname, &bd, &cd, type, format);
+	}
 	if (type == BCACHE_SB_VERSION_BDEV ||
 	    type == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
 	    type == BCACHE_SB_VERSION_BDEV_WITH_FEATURES) {
@@ -220,6 +373,20 @@ int detail_single(char *devname)
 
 		putchar('\n');
 		printf("cset.uuid\t\t%s\n", bd.base.cset);
+
+		detail_zones(NULL, devname, &bd.base, &zones);
+		if (zones.nr_zones) {
+			putchar('\n');
+			printf("zone.size_sectors\t%" PRIu64 "\n"
+			       "zone.count\t\t%" PRIu64 "\n"
+			       "zone.conventional\t%" PRIu64 "\n"
+			       "zone.seq_required\t%" PRIu64 "\n"
+			       "zone.seq_preferred\t%" PRIu64 "\n"
+			       "zone.unusable\t\t%" PRIu64 "\n",
+			       zones.zone_size, zones.nr_zones,
+			       zones.conventional, zones.seq_required,
+			       zones.seq_preferred, zones.unusable);
+		}
 	} else if (type == BCACHE_SB_VERSION_CDEV ||
 		   type == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
 		   type == BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
@@ -275,3 +442,595 @@ int detail_single(char *devname)
 	}
 	return 0;
 }
+
+/*
+ * Every active cache device followed by the devices attached to its cache
+ * set, written out as it goes. One device of lookahead is enough to tell
+ * the last child, which gets the closing marker.
+ */
+static void tree_text(struct dev_table *table, struct dev *devs, bool first)
+{
+	const char *middle = "├─";
+	const char *tail = "└─";
+	struct dev *tmp, *next;
+
+	if (first)
+		printf(".\n");
+	printf("%s\n", devs->name);
+
+	for (tmp = dev_table_next_attached(table, devs->cset, NULL);
+	     tmp; tmp = next) {
+		next = dev_table_next_attached(table, devs->cset, tmp);
+		printf("%s%s %s\n", next ? middle : tail,
+		       tmp->name, tmp->bname);
+	}
+}
+
+static void tree_out(struct out *o, struct dev_table *table,
+		     struct dev *devs)
+{
+	struct dev *tmp = NULL;
+
+	out_begin_object(o, NULL);
+	out_str(o, "name", devs->name);
+	out_str(o, "cset", devs->cset);
+	out_begin_list(o, "devices");
+	while ((tmp = dev_table_next_attached(table, devs->cset, tmp))) {
+		out_begin_object(o, NULL);
+		out_str(o, "name", tmp->name);
+		out_str(o, "bname", tmp->bname);
+		out_end_object(o);
+	}
+	out_end_list(o);
+	out_end_object(o);
+}
+
+int tree(enum out_format format)
+{
+	struct list_head head;
+	struct dev_table table;
+	struct dev *devs;
+	struct out o;
+	bool empty = true;
+	int ret;
+
+	INIT_LIST_HEAD(&head);
+
+	ret = list_bdevs(&head);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to list devices\n");
+		return ret;
+	}
+	ret = dev_table_init(&table, &head);
+	if (ret != 0) {
+		free_dev(&head);
+		return ret;
+	}
+
+	if (format != OUT_TEXT) {
+		out_init(&o, stdout, format);
+		out_begin_list(&o, NULL);
+	}
+
+	list_for_each_entry(devs, &head, dev_list) {
+		if (!SB_VERSION_IS_CDEV(devs->version) ||
+		    strcmp(devs->state, BCACHE_BASIC_STATE_ACTIVE) != 0)
+			continue;
+
+		if (format == OUT_TEXT)
+			tree_text(&table, devs, empty);
+		else
+			tree_out(&o, &table, devs);
+		empty = false;
+	}
+
+	if (format != OUT_TEXT) {
+		out_end_list(&o);
+		ret = out_finish(&o) ? 1 : 0;
+	}
+
+	dev_table_exit(&table);
+	free_dev(&head);
+	return ret;
+}
+
+/*
+ * bcache status: what bcache-status prints, from attributes that stay
+ * open, so --watch can sample them every interval without re-opening
+ * anything.
+ */
+#define STATUS_KEY_WIDTH	28
+
+static const char * const status_interval_names[] = {
+	[STATS_FIVE_MINUTE]	= "Last 5min",
+	[STATS_HOUR]		= "Last Hour",
+	[STATS_DAY]		= "Last Day",
+	[STATS_TOTAL]		= "Total",
+};
+
+static char *format_sectors(char *buf, size_t size, double sectors)
+{
+	double a = sectors < 0 ? -sectors : sectors;
+
+	if (a < 2)
+		snprintf(buf, size, "%.0f B", sectors * 512);
+	else if (a < 2048)
+		snprintf(buf, size, "%.2f KiB", sectors / 2);
+	else if (a < 2097152)
+		snprintf(buf, size, "%.1f MiB", sectors / 2048);
+	else if (a < 2147483648.0)
+		snprintf(buf, size, "%.0f GiB", sectors / 2097152);
+	else
+		snprintf(buf, size, "%.0f TiB", sectors / 2147483648.0);
+	return buf;
+}
+
+static const char *attr_size(int fd, char *buf, size_t size)
+{
+	uint64_t v;
+
+	if (stats_read_sectors(fd, &v))
+		return "?";
+	return format_sectors(buf, size, v);
+}
+
+static const char *attr_str(int fd, char *buf, size_t size)
+{
+	return stats_read(fd, buf, size) < 0 ? "?" : buf;
+}
+
+/* Flags are 0 or 1, congested is a size that is 0 when it isn't */
+static const char *attr_bool(int fd, char *buf, size_t size)
+{
+	if (stats_read(fd, buf, size) <= 0)
+		return "?";
+	return strcmp(buf, "0") ? "True" : "False";
+}
+
+static void status_line(const char *indent, const char *key,
+			const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void status_line(const char *indent, const char *key,
+			const char *fmt, ...)
+{
+	va_list args;
+
+	printf("%s%-*s", indent, STATUS_KEY_WIDTH - (int) strlen(indent), key);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	putchar('\n');
+}
+
+static void status_ratio(const char *indent, const char *key,
+			 uint64_t hits, uint64_t misses)
+{
+	if (hits + misses)
+		status_line(indent, key, "%" PRIu64 "\t(%" PRIu64 "%%)", hits,
+			    100 * hits / (hits + misses));
+	else
+		status_line(indent, key, "%" PRIu64, hits);
+}
+
+static void status_counters(int fds[NR_STATS_INTERVALS][NR_STATS_COUNTERS],
+			    const char *indent, unsigned int intervals)
+{
+	uint64_t v[NR_STATS_COUNTERS];
+	char key[64], buf[32];
+	const char *name;
+	unsigned int i;
+
+	for (i = 0; i < NR_STATS_INTERVALS; i++) {
+		if (!(intervals & (1U << i)))
+			continue;
+		name = status_interval_names[i];
+		if (stats_read_counters(fds[i], v)) {
+			snprintf(key, sizeof(key), "%s Hits", name);
+			status_line(indent, key, "?");
+			continue;
+		}
+
+		snprintf(key, sizeof(key), "%s Hits", name);
+		status_ratio(indent, key, v[STATS_HITS], v[STATS_MISSES]);
+		snprintf(key, sizeof(key), "%s Misses", name);
+		status_line(indent, key, "%" PRIu64, v[STATS_MISSES]);
+		snprintf(key, sizeof(key), "%s Bypass Hits", name);
+		status_ratio(indent, key, v[STATS_BYPASS_HITS],
+			     v[STATS_BYPASS_MISSES]);
+		snprintf(key, sizeof(key), "%s Bypass Misses", name);
+		status_line(indent, key, "%" PRIu64, v[STATS_BYPASS_MISSES]);
+		snprintf(key, sizeof(key), "%s Bypassed", name);
+		status_line(indent, key, "%s",
+			    format_sectors(buf, sizeof(buf), v[STATS_BYPASSED]));
+	}
+}
+
+static void status_bdev(struct stats_dev *d)
+{
+	const char *in = "  ";
+	char buf[256];
+	uint64_t v;
+
+	puts("--- Backing Device ---");
+	status_line(in, "Device File", "/dev/%s (%s)", d->dev,
+		    attr_str(d->attr[DEV_DEV], buf, sizeof(buf)));
+	status_line(in, "bcache Device File", "/dev/%s (%s)", d->bcache,
+		    attr_str(d->attr[DEV_BCACHE_DEV], buf, sizeof(buf)));
+	if (stats_read_u64(d->attr[DEV_SIZE], &v))
+		status_line(in, "Size", "?");
+	else
+		status_line(in, "Size", "%s", format_sectors(buf, sizeof(buf), v));
+	status_line(in, "Cache Mode", "%s",
+		    stats_read_selected(d->attr[DEV_CACHE_MODE], buf,
+					sizeof(buf)) < 0 ? "?" : buf);
+	status_line(in, "Readahead", "%s",
+		    attr_str(d->attr[DEV_READAHEAD], buf, sizeof(buf)));
+	status_line(in, "Sequential Cutoff", "%s",
+		    attr_size(d->attr[DEV_SEQUENTIAL_CUTOFF], buf, sizeof(buf)));
+	status_line(in, "State", "%s",
+		    attr_str(d->attr[DEV_STATE], buf, sizeof(buf)));
+	status_line(in, "Writeback?", "%s",
+		    attr_bool(d->attr[DEV_WRITEBACK_RUNNING], buf, sizeof(buf)));
+	status_line(in, "Dirty Data", "%s",
+		    attr_size(d->attr[DEV_DIRTY_DATA], buf, sizeof(buf)));
+	status_line(in, "Writeback Rate", "%s/s",
+		    attr_str(d->attr[DEV_WRITEBACK_RATE], buf, sizeof(buf)));
+	status_line(in, "Dirty Target", "%s%%",
+		    attr_str(d->attr[DEV_WRITEBACK_PERCENT], buf, sizeof(buf)));
+}
+
+static void status_cache(struct stats_dev *d)
+{
+	struct stats_priority prio;
+	const char *in = "  ";
+	char buf[256];
+	uint64_t size = 0, unused;
+
+	puts("--- Cache Device ---");
+	status_line(in, "Device File", "/dev/%s (%s)", d->dev,
+		    attr_str(d->attr[DEV_DEV], buf, sizeof(buf)));
+	if (stats_read_u64(d->attr[DEV_SIZE], &size))
+		status_line(in, "Size", "?");
+	else
+		status_line(in, "Size", "%s",
+			    format_sectors(buf, sizeof(buf), size));
+	status_line(in, "Block Size", "%s",
+		    attr_size(d->attr[DEV_BLOCK_SIZE], buf, sizeof(buf)));
+	status_line(in, "Bucket Size", "%s",
+		    attr_size(d->attr[DEV_BUCKET_SIZE], buf, sizeof(buf)));
+	status_line(in, "Replacement Policy", "%s",
+		    stats_read_selected(d->attr[DEV_REPLACEMENT], buf,
+					sizeof(buf)) < 0 ? "?" : buf);
+	status_line(in, "Discard?", "%s",
+		    attr_bool(d->attr[DEV_DISCARD], buf, sizeof(buf)));
+	status_line(in, "I/O Errors", "%s",
+		    attr_str(d->attr[DEV_IO_ERRORS], buf, sizeof(buf)));
+	status_line(in, "Metadata Written", "%s",
+		    attr_size(d->attr[DEV_METADATA_WRITTEN], buf, sizeof(buf)));
+	status_line(in, "Data Written", "%s",
+		    attr_size(d->attr[DEV_WRITTEN], buf, sizeof(buf)));
+	status_line(in, "Buckets", "%s",
+		    attr_str(d->attr[DEV_NBUCKETS], buf, sizeof(buf)));
+
+	if (!size || stats_read_priority(d->attr[DEV_PRIORITY_STATS], &prio)) {
+		status_line(in, "Cache Used", "?");
+		status_line(in, "Cache Unused", "?");
+		return;
+	}
+	unused = size * prio.unused / 100;
+	status_line(in, "Cache Used", "%s\t(%.0f%%)",
+		    format_sectors(buf, sizeof(buf), size - unused),
+		    100.0 * (size - unused) / size);
+	status_line(in, "Cache Unused", "%s\t(%.0f%%)",
+		    format_sectors(buf, sizeof(buf), unused),
+		    100.0 * unused / size);
+}
+
+/* Copies the first value into common, and turns it into "(Various)" */
+static void status_common(char *common, size_t size, const char *val)
+{
+	if (!*common)
+		snprintf(common, size, "%s", val);
+	else if (strcmp(common, val))
+		snprintf(common, size, "(Various)");
+}
+
+static void status_set(struct stats_set *s, const struct status_opts *o)
+{
+	struct stats_priority prio;
+	char buf[256], mode[256] = "", policy[256] = "";
+	uint64_t cache = 0, unused = 0, size, v;
+	unsigned int i;
+
+	for (i = 0; i < s->nr_devs; i++) {
+		struct stats_dev *d = &s->devs[i];
+
+		if (d->backing) {
+			if (stats_read_selected(d->attr[DEV_CACHE_MODE], buf,
+						sizeof(buf)) >= 0)
+				status_common(mode, sizeof(mode), buf);
+			continue;
+		}
+		if (stats_read_u64(d->attr[DEV_SIZE], &size))
+			continue;
+		cache += size;
+		if (!stats_read_priority(d->attr[DEV_PRIORITY_STATS], &prio))
+			unused += size * prio.unused / 100;
+		if (stats_read_selected(d->attr[DEV_REPLACEMENT], buf,
+					sizeof(buf)) >= 0)
+			status_common(policy, sizeof(policy), buf);
+	}
+
+	puts("--- bcache ---");
+	status_line("", "UUID", "%s", s->uuid);
+	status_line("", "Block Size", "%s",
+		    attr_size(s->attr[SET_BLOCK_SIZE], buf, sizeof(buf)));
+	status_line("", "Bucket Size", "%s",
+		    attr_size(s->attr[SET_BUCKET_SIZE], buf, sizeof(buf)));
+	status_line("", "Congested?", "%s",
+		    attr_bool(s->attr[SET_CONGESTED], buf, sizeof(buf)));
+	if (!stats_read_u64(s->attr[SET_CONGESTED_READ_US], &v))
+		status_line("", "Read Congestion", "%.1fms", v / 1000.0);
+	if (!stats_read_u64(s->attr[SET_CONGESTED_WRITE_US], &v))
+		status_line("", "Write Congestion", "%.1fms", v / 1000.0);
+	status_line("", "Total Cache Size", "%s",
+		    format_sectors(buf, sizeof(buf), cache));
+	if (cache) {
+		status_line("", "Total Cache Used", "%s\t(%.0f%%)",
+			    format_sectors(buf, sizeof(buf), cache - unused),
+			    100.0 * (cache - unused) / cache);
+		status_line("", "Total Cache Unused", "%s\t(%.0f%%)",
+			    format_sectors(buf, sizeof(buf), unused),
+			    100.0 * unused / cache);
+	}
+	if (!stats_read_u64(s->attr[SET_AVAILABLE_PERCENT], &v))
+		status_line("", "Evictable Cache", "%s\t(%" PRIu64 "%%)",
+			    format_sectors(buf, sizeof(buf),
+					   (double) v * cache / 100), v);
+	status_line("", "Replacement Policy", "%s", *policy ? policy : "?");
+	status_line("", "Cache Mode", "%s", *mode ? mode : "?");
+	status_counters(s->stats, "", o->intervals);
+
+	if (!o->sub_status)
+		return;
+	for (i = 0; i < s->nr_devs; i++) {
+		if (s->devs[i].backing) {
+			status_bdev(&s->devs[i]);
+			status_counters(s->devs[i].stats, "  ", o->intervals);
+		} else {
+			status_cache(&s->devs[i]);
+		}
+	}
+}
+
+/* One row of --watch, for a set or one of its backing devices */
+struct status_sample {
+	bool		valid;
+	uint64_t	total[NR_STATS_COUNTERS];
+	uint64_t	five[NR_STATS_COUNTERS];
+	uint64_t	dirty;		/* sectors */
+	uint64_t	rate;		/* writeback, sectors/s */
+};
+
+static void sample_dev(struct stats_dev *d, struct status_sample *smp)
+{
+	smp->valid = !stats_read_counters(d->stats[STATS_TOTAL], smp->total) &&
+		!stats_read_counters(d->stats[STATS_FIVE_MINUTE], smp->five);
+	if (stats_read_sectors(d->attr[DEV_DIRTY_DATA], &smp->dirty))
+		smp->dirty = 0;
+	if (stats_read_sectors(d->attr[DEV_WRITEBACK_RATE], &smp->rate))
+		smp->rate = 0;
+}
+
+/* The set's own counters, dirty data and writeback summed over its bdevs */
+static unsigned int sample_set(struct stats_set *s, struct status_sample *smp)
+{
+	unsigned int i, nr = 1;
+
+	smp->valid = !stats_read_counters(s->stats[STATS_TOTAL], smp->total) &&
+		!stats_read_counters(s->stats[STATS_FIVE_MINUTE], smp->five);
+	smp->dirty = smp->rate = 0;
+
+	for (i = 0; i < s->nr_devs; i++) {
+		if (!s->devs[i].backing)
+			continue;
+		sample_dev(&s->devs[i], &smp[nr]);
+		smp->dirty += smp[nr].dirty;
+		smp->rate += smp[nr].rate;
+		nr++;
+	}
+	return nr;
+}
+
+static void watch_rate(char *buf, size_t size, double sectors, double dt)
+{
+	format_sectors(buf, size, sectors / dt);
+	strncat(buf, "/s", size - strlen(buf) - 1);
+}
+
+static void watch_row(const char *name, struct status_sample *prev,
+		      struct status_sample *cur, double dt)
+{
+	char hit[8] = "-", five[8] = "-", bypass[24] = "-", slope[24] = "-";
+	char dirty[24], rate[24];
+	double hits = 0, misses = 0;
+	uint64_t a;
+
+	if (cur->valid && prev->valid) {
+		hits = (double) cur->total[STATS_HITS] - prev->total[STATS_HITS];
+		misses = (double) cur->total[STATS_MISSES] -
+			prev->total[STATS_MISSES];
+		if (hits + misses > 0)
+			snprintf(hit, sizeof(hit), "%.1f",
+				 100 * hits / (hits + misses));
+		/* bypassed is rounded by the kernel, it can appear to shrink */
+		watch_rate(bypass, sizeof(bypass),
+			   cur->total[STATS_BYPASSED] > prev->total[STATS_BYPASSED] ?
+			   cur->total[STATS_BYPASSED] - prev->total[STATS_BYPASSED] :
+			   0, dt);
+		watch_rate(slope, sizeof(slope),
+			   (double) cur->dirty - prev->dirty, dt);
+	}
+	if (cur->valid) {
+		a = cur->five[STATS_HITS] + cur->five[STATS_MISSES];
+		if (a)
+			snprintf(five, sizeof(five), "%.1f",
+				 100.0 * cur->five[STATS_HITS] / a);
+	}
+	format_sectors(dirty, sizeof(dirty), cur->dirty);
+	watch_rate(rate, sizeof(rate), cur->rate, 1);
+
+	if (cur->valid && prev->valid)
+		printf("%-38s %9.0f %9.0f", name, hits / dt, misses / dt);
+	else
+		printf("%-38s %9s %9s", name, "-", "-");
+	printf(" %6s %6s %12s %10s %12s %12s\n",
+	       hit, five, bypass, dirty, slope, rate);
+}
+
+static unsigned int watch_rows(struct list_head *sets)
+{
+	struct stats_set *s;
+	unsigned int i, nr = 0;
+
+	list_for_each_entry(s, sets, list) {
+		nr++;
+		for (i = 0; i < s->nr_devs; i++)
+			nr += s->devs[i].backing;
+	}
+	return nr;
+}
+
+static double timespec_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static int status_watch(const struct status_opts *o)
+{
+	struct status_sample *prev = NULL, *cur = NULL, *tmp;
+	struct timespec next, then, now;
+	struct list_head sets;
+	struct stats_set *s;
+	bool tty = isatty(STDOUT_FILENO), reopen = false;
+	unsigned long iter, reports;
+	unsigned int i, nr, n;
+	char name[2 * NAME_MAX + 8], when[32];
+	uint64_t step;
+	time_t t;
+
+	if (stats_open(&sets)) {
+		printf("bcache is not loaded.\n");
+		return 0;
+	}
+
+	step = o->watch * 1e9;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	then = next;
+
+	for (iter = 0, reports = 0; ; iter++) {
+		if (reopen || !prev) {
+			nr = watch_rows(&sets);
+			free(prev);
+			free(cur);
+			prev = calloc(nr + 1, sizeof(*prev));
+			cur = calloc(nr + 1, sizeof(*cur));
+			if (!prev || !cur) {
+				fprintf(stderr, "Out of memory\n");
+				break;
+			}
+		}
+
+		n = 0;
+		list_for_each_entry(s, &sets, list)
+			n += sample_set(s, &cur[n]);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/* The first sample, and the one after a change, is a baseline */
+		if (iter && !reopen) {
+			t = time(NULL);
+			strftime(when, sizeof(when), "%F %T", localtime(&t));
+			if (tty)
+				printf("\033[H\033[2J");
+			printf("bcache status, every %gs\t\t\t\t%s\n\n",
+			       o->watch, when);
+			printf("%-38s %9s %9s %6s %6s %12s %10s %12s %12s\n",
+			       "DEVICE", "HITS/s", "MISSES/s", "HIT%", "5MIN%",
+			       "BYPASS", "DIRTY", "DIRTY SLOPE", "WB RATE");
+
+			n = 0;
+			list_for_each_entry(s, &sets, list) {
+				watch_row(s->uuid, &prev[n], &cur[n],
+					  timespec_sec(&now) - timespec_sec(&then));
+				n++;
+				for (i = 0; i < s->nr_devs; i++) {
+					if (!s->devs[i].backing)
+						continue;
+					snprintf(name, sizeof(name), "  %s (%s)",
+						 s->devs[i].bcache, s->devs[i].dev);
+					watch_row(name, &prev[n], &cur[n],
+						  timespec_sec(&now) -
+						  timespec_sec(&then));
+					n++;
+				}
+			}
+			if (!tty)
+				putchar('\n');
+			fflush(stdout);
+			reports++;
+		}
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+		then = now;
+
+		if (o->count && reports == o->count)
+			break;
+
+		next.tv_sec += (next.tv_nsec + step) / 1000000000;
+		next.tv_nsec = (next.tv_nsec + step) % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				       NULL) == EINTR)
+			;
+
+		/* Sets registered or stopped: start over with the new ones */
+		reopen = stats_stale(&sets);
+		if (reopen) {
+			stats_close(&sets);
+			stats_open(&sets);
+		}
+	}
+
+	free(prev);
+	free(cur);
+	stats_close(&sets);
+	return 0;
+}
+
+int show_status(const struct status_opts *o)
+{
+	struct list_head sets;
+	struct stats_set *s;
+	int ret = 0;
+
+	if (stats_open(&sets)) {
+		printf("bcache is not loaded.\n");
+		return 0;
+	}
+
+	list_for_each_entry(s, &sets, list) {
+		if (o->gc && stats_set_write(s, "internal/trigger_gc", "1\n"))
+			ret = 1;
+		if (o->watch)
+			continue;
+		status_set(s, o);
+		if (o->reset_stats && stats_set_write(s, "clear_stats", "1\n"))
+			ret = 1;
+	}
+	stats_close(&sets);
+
+	if (o->watch && status_watch(o))
+		ret = 1;
+	return ret;
+}
@@ -3,8 +3,23 @@
 #ifndef _BCH_MAKE_H
 #define _BCH_MAKE_H
 
-int show_bdevs_detail(void);
-int show_bdevs(void);
-int detail_single(char *devname);
+#include <stdbool.h>
+
+#include "out.h"
+
+struct status_opts {
+	unsigned int	intervals;	/* 1 << enum stats_interval */
+	bool		sub_status;
+	bool		reset_stats;
+	bool		gc;
+	double		watch;		/* seconds between samples, 0 for once */
+	unsigned long	count;		/* of --watch reports, 0 for no limit */
+};
+
+int show_bdevs_detail(enum out_format format);
+int show_bdevs(enum out_format format);
+int detail_single(char *devname, enum out_format format);
+int tree(enum out_format format);
+int show_status(const struct status_opts *o);
 
 #endif
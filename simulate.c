@@ -0,0 +1,1103 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * bcache simulate: replay a block trace against a model of a cache set,
+ * for every point of a sweep of cache sizes, bucket sizes, replacement
+ * policies, sequential cutoffs and cache modes.
+ *
+ * The trace is blkparse text or "time,op,sector,sectors" CSV, read in
+ * large chunks by one thread into batches of events. The points are
+ * split between worker threads, each replaying a batch through its
+ * points while the next batch is being read, so the trace is read once
+ * however big the sweep is and never held in memory.
+ *
+ * The model follows bcache where it matters for sizing:
+ *  - the cache is an array of buckets, written to in order from one open
+ *    bucket; overwritten and invalidated data leaves holes
+ *  - a bucket whose data is all gone is free again (as after a perfect
+ *    garbage collection), and when there are no free buckets the policy
+ *    picks a bucket to invalidate: least recently read or written, the
+ *    next in turn, or a random one
+ *  - sequential I/O is detected as bcache does, from where the last 64
+ *    streams ended, and bypasses the cache past sequential_cutoff
+ *  - in writeback mode, dirty data past writeback_percent is written
+ *    back at a rate proportional to the excess, as the proportional term
+ *    of bcache's writeback rate controller does. Dirty data in a bucket
+ *    picked for invalidation is written back first.
+ *
+ * Data is tracked in pages of the granularity (4k by default): one slot
+ * of 8 bytes per page of cache, and an open addressed hash from page to
+ * slot of twice that many entries of 12 bytes, so about 32 bytes per page
+ * and point.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "out.h"
+#include "simulate.h"
+#include "trace.h"
+#include "workload.h"
+
+#define SIM_BATCH		(1U << 20)	/* events */
+#define SIM_MAX_LIST		16
+#define SIM_MAX_POINTS		1024
+#define SIM_RECENT_IO		64
+#define SIM_P_TERM_INVERSE	40		/* writeback_rate_p_term_inverse */
+#define SIM_IOPS		10000
+#define SIM_EVENTS		10000000
+
+#define SLOT_DIRTY		(1ULL << 63)
+#define NONE			UINT32_MAX
+
+struct sim_batch {
+	struct trace_event	*ev;
+	size_t			nr;
+};
+
+struct sim_source {
+	struct trace		trace;
+	uint64_t		nr;
+	bool			err;
+
+	/* A synthetic workload instead of a trace */
+	struct workload_gen	*gen;
+	uint64_t		events;
+	unsigned int		io_pages;
+};
+
+struct sim_link {
+	uint32_t		prev;
+	uint32_t		next;
+};
+
+struct sim_bucket {
+	uint32_t		fill;		/* slots handed out */
+	uint32_t		live;
+	uint32_t		dirty;
+	uint32_t		wb;		/* writeback resumes here */
+};
+
+struct sim_stats {				/* in pages */
+	uint64_t		read;
+	uint64_t		read_hit;
+	uint64_t		read_bypass;
+	uint64_t		write;
+	uint64_t		write_bypass;
+	uint64_t		discard;
+	uint64_t		cache_write;	/* to the cache device */
+	uint64_t		backing_write;
+	uint64_t		writeback;
+	uint64_t		writeback_forced;
+	uint64_t		dirty_peak;
+	uint64_t		evicted;	/* live pages invalidated */
+	uint64_t		evicted_buckets;
+};
+
+struct sim_recent {
+	uint64_t		last;
+	uint64_t		sequential;
+};
+
+struct sim_point {
+	uint64_t		cache_size;
+	uint64_t		bucket_size;
+	uint64_t		cutoff;
+	unsigned int		policy;
+	unsigned int		mode;
+
+	uint32_t		gran;		/* sectors per page */
+	uint32_t		ppb;		/* pages per bucket */
+	uint32_t		nbuckets;
+
+	/* One per page of cache: 0 if empty, else page + 1 | SLOT_DIRTY */
+	uint64_t		*slot;
+	struct sim_bucket	*bucket;
+	/* Indexed by bucket; the entry past the last is the list head */
+	struct sim_link		*lru;
+	struct sim_link		*dirtyq;
+	uint32_t		*free;
+	uint32_t		nr_free;
+	uint32_t		open;
+	uint32_t		fifo;
+
+	/* Page + 1 to slot */
+	uint64_t		*key;
+	uint32_t		*val;
+	uint64_t		hash_mask;
+	unsigned int		hash_shift;
+
+	struct sim_recent	recent[SIM_RECENT_IO];
+	unsigned short		seed[3];
+
+	uint64_t		dirty;
+	uint64_t		wb_target;
+	uint64_t		now;
+	double			wb_credit;
+
+	struct sim_stats	s;
+};
+
+struct sim {
+	struct sim_point	*points;
+	unsigned int		nr_points;
+	unsigned int		nr_threads;
+	pthread_mutex_t		start;
+	pthread_barrier_t	barrier;
+	struct sim_batch	batch[2];
+};
+
+struct sim_worker {
+	struct sim		*sim;
+	pthread_t		thread;
+	unsigned int		first;
+};
+
+/* Events from the trace, or generated */
+
+static size_t source_workload(struct sim_source *src, struct trace_event *ev)
+{
+	size_t nr = 0;
+
+	for (; nr < SIM_BATCH && src->nr < src->events; nr++, ev++) {
+		ev->op = workload_next_write(src->gen) ? TRACE_WRITE : TRACE_READ;
+		ev->sector = (uint64_t) workload_next(src->gen,
+						      src->io_pages) * 8;
+		ev->sectors = src->io_pages * 8;
+		ev->time = src->nr++ * 1e9 / src->trace.iops;
+	}
+	return nr;
+}
+
+static size_t source_fill(struct sim_source *src, struct sim_batch *b)
+{
+	int ret = 0;
+
+	if (src->gen)
+		return b->nr = source_workload(src, b->ev);
+
+	for (b->nr = 0; b->nr < SIM_BATCH; b->nr++) {
+		ret = trace_next(&src->trace, &b->ev[b->nr]);
+		if (ret <= 0)
+			break;
+	}
+	src->nr = src->trace.nr;
+
+	if (ret < 0) {
+		src->err = true;
+		b->nr = 0;
+	}
+	return b->nr;
+}
+
+/* Lists of buckets */
+
+static void link_init(struct sim_link *l, uint32_t head)
+{
+	l[head].prev = l[head].next = head;
+}
+
+static void link_del(struct sim_link *l, uint32_t i)
+{
+	l[l[i].prev].next = l[i].next;
+	l[l[i].next].prev = l[i].prev;
+}
+
+static void link_add_tail(struct sim_link *l, uint32_t head, uint32_t i)
+{
+	l[i].prev = l[head].prev;
+	l[i].next = head;
+	l[l[head].prev].next = i;
+	l[head].prev = i;
+}
+
+/* The model */
+
+static inline uint64_t hash_home(struct sim_point *p, uint64_t key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL) >> p->hash_shift;
+}
+
+static uint64_t hash_lookup(struct sim_point *p, uint64_t page, bool *found)
+{
+	uint64_t i = hash_home(p, page + 1);
+
+	while (p->key[i]) {
+		if (p->key[i] == page + 1) {
+			*found = true;
+			return i;
+		}
+		i = (i + 1) & p->hash_mask;
+	}
+	*found = false;
+	return i;
+}
+
+/* Shifts back the entries that would no longer be found past the hole */
+static void hash_delete(struct sim_point *p, uint64_t i)
+{
+	uint64_t j = i, k;
+
+	for (;;) {
+		j = (j + 1) & p->hash_mask;
+		if (!p->key[j])
+			break;
+		k = hash_home(p, p->key[j]);
+		if (i <= j ? i < k && k <= j : i < k || k <= j)
+			continue;
+		p->key[i] = p->key[j];
+		p->val[i] = p->val[j];
+		i = j;
+	}
+	p->key[i] = 0;
+}
+
+static void bucket_free(struct sim_point *p, uint32_t b)
+{
+	link_del(p->lru, b);
+	p->bucket[b].fill = 0;
+	p->bucket[b].wb = 0;
+	p->free[p->nr_free++] = b;
+}
+
+static void slot_drop(struct sim_point *p, uint32_t slot)
+{
+	uint32_t b = slot / p->ppb;
+	struct sim_bucket *bucket = &p->bucket[b];
+
+	if (p->slot[slot] & SLOT_DIRTY) {
+		p->dirty--;
+		if (!--bucket->dirty)
+			link_del(p->dirtyq, b);
+	}
+	p->slot[slot] = 0;
+	if (!--bucket->live && b != p->open)
+		bucket_free(p, b);
+}
+
+static void bucket_evict(struct sim_point *p, uint32_t b)
+{
+	struct sim_bucket *bucket = &p->bucket[b];
+	uint64_t *slot = p->slot + (uint64_t) b * p->ppb;
+	uint64_t i;
+	uint32_t s;
+	bool found;
+
+	for (s = 0; s < bucket->fill; s++) {
+		if (!slot[s])
+			continue;
+		i = hash_lookup(p, (slot[s] & ~SLOT_DIRTY) - 1, &found);
+		hash_delete(p, i);
+		if (slot[s] & SLOT_DIRTY) {
+			p->s.writeback_forced++;
+			p->s.backing_write++;
+			p->dirty--;
+		}
+		slot[s] = 0;
+		p->s.evicted++;
+	}
+
+	if (bucket->dirty)
+		link_del(p->dirtyq, b);
+	link_del(p->lru, b);
+	memset(bucket, 0, sizeof(*bucket));
+	p->s.evicted_buckets++;
+}
+
+static uint32_t bucket_victim(struct sim_point *p)
+{
+	uint32_t b;
+
+	switch (p->policy) {
+	case CACHE_REPLACEMENT_FIFO:
+		b = p->fifo;
+		p->fifo = (p->fifo + 1) % p->nbuckets;
+		return b;
+	case CACHE_REPLACEMENT_RANDOM:
+		return nrand48(p->seed) % p->nbuckets;
+	default:
+		return p->lru[p->nbuckets].next;
+	}
+}
+
+static uint32_t slot_alloc(struct sim_point *p)
+{
+	uint32_t b = p->open;
+
+	if (b != NONE && p->bucket[b].fill < p->ppb)
+		return b * p->ppb + p->bucket[b].fill++;
+
+	p->open = NONE;
+	if (b != NONE && !p->bucket[b].live)
+		bucket_free(p, b);
+
+	if (p->nr_free) {
+		b = p->free[--p->nr_free];
+	} else {
+		b = bucket_victim(p);
+		bucket_evict(p, b);
+	}
+
+	link_add_tail(p->lru, p->nbuckets, b);
+	p->open = b;
+	return b * p->ppb + p->bucket[b].fill++;
+}
+
+static void page_insert(struct sim_point *p, uint64_t page, bool dirty)
+{
+	struct sim_bucket *bucket;
+	uint32_t slot, b;
+	uint64_t i;
+	bool found;
+
+	i = hash_lookup(p, page, &found);
+	if (found)
+		slot_drop(p, p->val[i]);
+
+	/* Allocating may invalidate a bucket, which moves hash entries */
+	slot = slot_alloc(p);
+	i = hash_lookup(p, page, &found);
+	p->key[i] = page + 1;
+	p->val[i] = slot;
+
+	b = slot / p->ppb;
+	bucket = &p->bucket[b];
+	bucket->live++;
+	p->slot[slot] = page + 1;
+	if (dirty) {
+		p->slot[slot] |= SLOT_DIRTY;
+		if (!bucket->dirty++)
+			link_add_tail(p->dirtyq, p->nbuckets, b);
+		if (++p->dirty > p->s.dirty_peak)
+			p->s.dirty_peak = p->dirty;
+	}
+	p->s.cache_write++;
+}
+
+static void page_invalidate(struct sim_point *p, uint64_t page)
+{
+	uint64_t i;
+	bool found;
+
+	i = hash_lookup(p, page, &found);
+	if (found) {
+		slot_drop(p, p->val[i]);
+		hash_delete(p, i);
+	}
+}
+
+static void page_read(struct sim_point *p, uint64_t page, bool bypass)
+{
+	uint32_t b;
+	uint64_t i;
+	bool found;
+
+	p->s.read++;
+	i = hash_lookup(p, page, &found);
+	if (found) {
+		p->s.read_hit++;
+		b = p->val[i] / p->ppb;
+		if (p->policy == CACHE_REPLACEMENT_LRU) {
+			link_del(p->lru, b);
+			link_add_tail(p->lru, p->nbuckets, b);
+		}
+	} else if (bypass) {
+		p->s.read_bypass++;
+	} else {
+		page_insert(p, page, false);
+	}
+}
+
+/* Like check_should_bypass() */
+static bool sequential_bypass(struct sim_point *p, struct trace_event *ev)
+{
+	struct sim_recent *i;
+	uint64_t end = ev->sector + ev->sectors, seq = 0;
+
+	if (!p->cutoff)
+		return false;
+
+	i = &p->recent[(ev->sector * 0x9E3779B97F4A7C15ULL) >> 58];
+	if (i->last == ev->sector)
+		seq = i->sequential;
+	seq += (uint64_t) ev->sectors << 9;
+
+	i = &p->recent[(end * 0x9E3779B97F4A7C15ULL) >> 58];
+	i->last = end;
+	i->sequential = seq;
+	return seq >= p->cutoff;
+}
+
+static void writeback_one(struct sim_point *p)
+{
+	uint32_t b = p->dirtyq[p->nbuckets].next;
+	struct sim_bucket *bucket = &p->bucket[b];
+	uint64_t *slot = p->slot + (uint64_t) b * p->ppb;
+
+	while (!(slot[bucket->wb] & SLOT_DIRTY))
+		bucket->wb++;
+	slot[bucket->wb++] &= ~SLOT_DIRTY;
+
+	if (!--bucket->dirty)
+		link_del(p->dirtyq, b);
+	p->dirty--;
+	p->s.writeback++;
+	p->s.backing_write++;
+}
+
+static void writeback(struct sim_point *p, uint64_t now)
+{
+	double rate;
+
+	if (now > p->now && p->dirty > p->wb_target) {
+		rate = (double) (p->dirty - p->wb_target) / SIM_P_TERM_INVERSE;
+		p->wb_credit += (rate > 1 ? rate : 1) * (now - p->now) / 1e9;
+	}
+	if (now > p->now)
+		p->now = now;
+
+	while (p->wb_credit >= 1 && p->dirty > p->wb_target) {
+		writeback_one(p);
+		p->wb_credit--;
+	}
+	if (p->dirty <= p->wb_target)
+		p->wb_credit = 0;
+}
+
+static void sim_event(struct sim_point *p, struct trace_event *ev)
+{
+	uint64_t first = ev->sector / p->gran;
+	uint64_t last = (ev->sector + ev->sectors - 1) / p->gran;
+	uint64_t page, n = last - first + 1;
+	bool bypass;
+
+	if (p->mode == CACHE_MODE_WRITEBACK)
+		writeback(p, ev->time);
+
+	switch (ev->op) {
+	case TRACE_DISCARD:
+		p->s.discard += n;
+		for (page = first; page <= last; page++)
+			page_invalidate(p, page);
+		break;
+	case TRACE_READ:
+		bypass = sequential_bypass(p, ev);
+		for (page = first; page <= last; page++)
+			page_read(p, page, bypass);
+		break;
+	case TRACE_WRITE:
+		bypass = sequential_bypass(p, ev);
+		p->s.write += n;
+		if (bypass || p->mode == CACHE_MODE_WRITEAROUND) {
+			if (bypass)
+				p->s.write_bypass += n;
+			p->s.backing_write += n;
+			for (page = first; page <= last; page++)
+				page_invalidate(p, page);
+		} else {
+			if (p->mode == CACHE_MODE_WRITETHROUGH)
+				p->s.backing_write += n;
+			for (page = first; page <= last; page++)
+				page_insert(p, page,
+					    p->mode == CACHE_MODE_WRITEBACK);
+		}
+		break;
+	}
+}
+
+static int point_init(struct sim_point *p, uint64_t gran,
+		      unsigned int writeback_percent)
+{
+	uint64_t pages, hash = 1;
+	unsigned int bits = 0;
+	uint32_t b;
+
+	if (p->bucket_size % gran || p->cache_size < p->bucket_size * 2) {
+		fprintf(stderr, "Bucket size %" PRIu64
+			" doesn't fit a cache of %" PRIu64
+			" in pages of %" PRIu64 "\n",
+			p->bucket_size, p->cache_size, gran);
+		return -1;
+	}
+
+	p->gran = gran >> 9;
+	p->ppb = p->bucket_size / gran;
+	p->nbuckets = p->cache_size / p->bucket_size;
+	pages = (uint64_t) p->nbuckets * p->ppb;
+	if (pages >= NONE || p->nbuckets >= NONE) {
+		fprintf(stderr, "Cache of %" PRIu64
+			" too large for pages of %" PRIu64 "\n",
+			p->cache_size, gran);
+		return -1;
+	}
+
+	while (hash < pages * 2) {
+		hash <<= 1;
+		bits++;
+	}
+	p->hash_mask = hash - 1;
+	p->hash_shift = 64 - (bits ? bits : 1);
+
+	p->slot = calloc(pages, sizeof(*p->slot));
+	p->bucket = calloc(p->nbuckets, sizeof(*p->bucket));
+	p->lru = calloc(p->nbuckets + 1, sizeof(*p->lru));
+	p->dirtyq = calloc(p->nbuckets + 1, sizeof(*p->dirtyq));
+	p->free = calloc(p->nbuckets, sizeof(*p->free));
+	p->key = calloc(hash, sizeof(*p->key));
+	p->val = calloc(hash, sizeof(*p->val));
+	if (!p->slot || !p->bucket || !p->lru || !p->dirtyq ||
+	    !p->free || !p->key || !p->val) {
+		fprintf(stderr, "Could not allocate a cache of %" PRIu64
+			" in pages of %" PRIu64 "\n", p->cache_size, gran);
+		return -ENOMEM;
+	}
+
+	link_init(p->lru, p->nbuckets);
+	link_init(p->dirtyq, p->nbuckets);
+	/* Handed out from the first bucket on, as a new cache would */
+	for (b = 0; b < p->nbuckets; b++)
+		p->free[b] = p->nbuckets - 1 - b;
+	p->nr_free = p->nbuckets;
+	p->open = NONE;
+	p->wb_target = pages * writeback_percent / 100;
+	p->seed[0] = 0x330e;
+	p->seed[1] = p->nbuckets;
+	p->seed[2] = p->nbuckets >> 16;
+	return 0;
+}
+
+static void point_exit(struct sim_point *p)
+{
+	free(p->slot);
+	free(p->bucket);
+	free(p->lru);
+	free(p->dirtyq);
+	free(p->free);
+	free(p->key);
+	free(p->val);
+}
+
+/* Sweep */
+
+static void *sim_worker(void *arg)
+{
+	struct sim_worker *w = arg;
+	struct sim *sim = w->sim;
+	struct sim_batch *b;
+	unsigned int cur = 0, i;
+	size_t e;
+
+	/* Until the barrier is set up for the threads that did start */
+	pthread_mutex_lock(&sim->start);
+	pthread_mutex_unlock(&sim->start);
+
+	for (;;) {
+		pthread_barrier_wait(&sim->barrier);
+		b = &sim->batch[cur];
+		if (!b->nr)
+			break;
+		for (i = w->first; i < sim->nr_points; i += sim->nr_threads)
+			for (e = 0; e < b->nr; e++)
+				sim_event(&sim->points[i], &b->ev[e]);
+		cur ^= 1;
+	}
+	return NULL;
+}
+
+/*
+ * The reader fills one batch while the workers replay the other: a batch
+ * is handed over at the barrier, and an empty one ends the run.
+ */
+static int sim_run(struct sim *sim, struct sim_source *src)
+{
+	struct sim_worker *workers;
+	unsigned int cur = 0, i, started = 0;
+	int ret = 0;
+
+	workers = calloc(sim->nr_threads, sizeof(*workers));
+	for (i = 0; i < 2; i++)
+		sim->batch[i].ev = malloc(SIM_BATCH * sizeof(struct trace_event));
+	if (!workers || !sim->batch[0].ev || !sim->batch[1].ev) {
+		fprintf(stderr, "Could not allocate event batches\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	source_fill(src, &sim->batch[0]);
+
+	pthread_mutex_init(&sim->start, NULL);
+	pthread_mutex_lock(&sim->start);
+	for (i = 0; i < sim->nr_threads; i++) {
+		workers[i].sim = sim;
+		workers[i].first = i;
+		errno = pthread_create(&workers[i].thread, NULL,
+				       sim_worker, &workers[i]);
+		if (errno) {
+			fprintf(stderr, "Could not start a thread: %m\n");
+			break;
+		}
+		started++;
+	}
+	/* Fewer threads take more points each */
+	sim->nr_threads = started;
+	if (started)
+		pthread_barrier_init(&sim->barrier, NULL, started + 1);
+	pthread_mutex_unlock(&sim->start);
+	if (!started) {
+		ret = -1;
+		goto out_mutex;
+	}
+
+	for (;;) {
+		pthread_barrier_wait(&sim->barrier);
+		if (!sim->batch[cur].nr)
+			break;
+		source_fill(src, &sim->batch[cur ^ 1]);
+		cur ^= 1;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	pthread_barrier_destroy(&sim->barrier);
+	if (src->err)
+		ret = -1;
+out_mutex:
+	pthread_mutex_destroy(&sim->start);
+out:
+	free(sim->batch[0].ev);
+	free(sim->batch[1].ev);
+	free(workers);
+	return ret;
+}
+
+/* Report */
+
+static const char *fmt_size(char *buf, size_t n, uint64_t bytes)
+{
+	static const char units[] = "kmgtp";
+	double v = bytes;
+	int u = -1;
+
+	while (v >= 1024 && u < (int) sizeof(units) - 2) {
+		v /= 1024;
+		u++;
+	}
+	if (u < 0)
+		snprintf(buf, n, "%" PRIu64, bytes);
+	else if (v == (uint64_t) v)
+		snprintf(buf, n, "%" PRIu64 "%c", (uint64_t) v, units[u]);
+	else
+		snprintf(buf, n, "%.1f%c", v, units[u]);
+	return buf;
+}
+
+static void report_text(struct sim *sim, struct sim_source *src,
+			uint64_t gran)
+{
+	char cache[16], bucket[16], cutoff[16], peak[16], wb[16];
+	struct sim_point *p;
+	unsigned int i;
+
+	printf("%" PRIu64 " events", src->nr);
+	if (src->trace.skipped)
+		printf(", %" PRIu64 " lines skipped",
+		       src->trace.skipped);
+	printf("\n%-8s %-8s %-7s %-7s %-12s %7s %6s %10s %10s\n",
+	       "cache", "bucket", "policy", "cutoff", "mode",
+	       "hit%", "wa", "dirty peak", "writeback");
+
+	for (i = 0; i < sim->nr_points; i++) {
+		p = &sim->points[i];
+		printf("%-8s %-8s %-7s %-7s %-12s %7.2f %6.2f %10s %10s\n",
+		       fmt_size(cache, sizeof(cache), p->cache_size),
+		       fmt_size(bucket, sizeof(bucket), p->bucket_size),
+		       cache_replacement_name(p->policy),
+		       p->cutoff ? fmt_size(cutoff, sizeof(cutoff),
+					    p->cutoff) : "off",
+		       cache_mode_name(p->mode),
+		       p->s.read ? 100.0 * p->s.read_hit / p->s.read : 0.0,
+		       p->s.write ? (double) p->s.cache_write / p->s.write
+				  : 0.0,
+		       fmt_size(peak, sizeof(peak), p->s.dirty_peak * gran),
+		       fmt_size(wb, sizeof(wb),
+				(p->s.writeback + p->s.writeback_forced) *
+				gran));
+	}
+}
+
+static int report_out(struct sim *sim, struct sim_source *src, uint64_t gran,
+		      enum out_format format)
+{
+	struct out *o = malloc(sizeof(*o));
+	struct sim_point *p;
+	unsigned int i;
+	int ret;
+
+	if (!o) {
+		fprintf(stderr, "Could not allocate output\n");
+		return -ENOMEM;
+	}
+
+	out_init(o, stdout, format);
+	out_begin_object(o, NULL);
+	out_u64(o, "events", src->nr);
+	out_u64(o, "skipped", src->trace.skipped);
+	out_u64(o, "granularity", gran);
+	out_begin_list(o, "points");
+	for (i = 0; i < sim->nr_points; i++) {
+		p = &sim->points[i];
+		out_begin_object(o, NULL);
+		out_u64(o, "cache_size", p->cache_size);
+		out_u64(o, "bucket_size", p->bucket_size);
+		out_str(o, "cache_replacement_policy",
+			cache_replacement_name(p->policy));
+		out_u64(o, "sequential_cutoff", p->cutoff);
+		out_str(o, "cache_mode", cache_mode_name(p->mode));
+		out_u64(o, "read", p->s.read * gran);
+		out_u64(o, "read_hit", p->s.read_hit * gran);
+		out_u64(o, "read_bypass", p->s.read_bypass * gran);
+		out_u64(o, "write", p->s.write * gran);
+		out_u64(o, "write_bypass", p->s.write_bypass * gran);
+		out_u64(o, "discard", p->s.discard * gran);
+		out_u64(o, "cache_write", p->s.cache_write * gran);
+		out_u64(o, "backing_write", p->s.backing_write * gran);
+		out_u64(o, "writeback", p->s.writeback * gran);
+		out_u64(o, "writeback_forced", p->s.writeback_forced * gran);
+		out_u64(o, "dirty_peak", p->s.dirty_peak * gran);
+		out_u64(o, "evicted", p->s.evicted * gran);
+		out_u64(o, "evicted_buckets", p->s.evicted_buckets);
+		out_end_object(o);
+	}
+	out_end_list(o);
+	out_end_object(o);
+
+	ret = out_finish(o);
+	free(o);
+	return ret;
+}
+
+/* Options */
+
+static int parse_bytes(const char *arg, uint64_t *bytes)
+{
+	unsigned long pages;
+
+	if (workload_parse_size(arg, &pages))
+		return -1;
+	*bytes = (uint64_t) pages * 4096;
+	return 0;
+}
+
+static int parse_list(char *arg, char **items, unsigned int *nr)
+{
+	char *save, *s;
+
+	*nr = 0;
+	for (s = strtok_r(arg, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+		if (*nr == SIM_MAX_LIST) {
+			fprintf(stderr, "At most %u values in a sweep\n",
+				SIM_MAX_LIST);
+			return -1;
+		}
+		items[(*nr)++] = s;
+	}
+	return *nr ? 0 : -1;
+}
+
+static int parse_name(const char *arg, const char *(*name)(unsigned int),
+		      unsigned int *v)
+{
+	const char *n;
+	unsigned int i;
+
+	for (i = 0; (n = name(i)); i++)
+		if (!strcmp(arg, n)) {
+			*v = i;
+			return 0;
+		}
+	fprintf(stderr, "Unknown %s\n", arg);
+	return -1;
+}
+
+int simulate_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	simulate [option] {trace|-}\n"
+		"	replay a blkparse or CSV (time,op,sector,sectors) trace\n"
+		"	against a model of a cache set, for every combination of\n"
+		"	the values given as comma separated lists\n"
+		"	-C	--cache-size {sizes}		required\n"
+		"	-B	--bucket-size {sizes}		default 512k\n"
+		"	-p	--policy {lru|fifo|random}	default lru\n"
+		"	-c	--sequential-cutoff {sizes}	default 4m, 0 for off\n"
+		"	-m	--cache-mode {modes}		default writeback\n"
+		"	-P	--writeback-percent {n}	default 10\n"
+		"	-g	--granularity {size}		tracking granularity, default 4k\n"
+		"	-f	--format {blkparse|csv}		default by the first line\n"
+		"	-a	--action {c}			blkparse action replayed, default Q\n"
+		"	-i	--iops {n}			spacing of untimed events, default %u\n"
+		"	-j	--jobs {n}			threads, default one per cpu\n"
+		"	-o	--output {text|json|tsv0}\n"
+		"	a generated workload instead of a trace:\n"
+		"	-w	--workload {spec}		as for bcache-test -p\n"
+		"	-n	--events {n}			default %u\n"
+		"	-s	--size {size}			device size, default 100g\n"
+		"	-b	--io-size {size}		default 4k\n"
+		"	-M	--read-pct {n}			default 70\n"
+		"	-W	--working-set {spec}		as for bcache-test -W\n"
+		"	-h	--help				show help information\n",
+		SIM_IOPS, SIM_EVENTS);
+	return EXIT_FAILURE;
+}
+
+int bcache_simulate(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "cache-size",		1, NULL,	'C' },
+		{ "bucket-size",	1, NULL,	'B' },
+		{ "policy",		1, NULL,	'p' },
+		{ "sequential-cutoff",	1, NULL,	'c' },
+		{ "cache-mode",		1, NULL,	'm' },
+		{ "writeback-percent",	1, NULL,	'P' },
+		{ "granularity",	1, NULL,	'g' },
+		{ "format",		1, NULL,	'f' },
+		{ "action",		1, NULL,	'a' },
+		{ "iops",		1, NULL,	'i' },
+		{ "jobs",		1, NULL,	'j' },
+		{ "output",		1, NULL,	'o' },
+		{ "workload",		1, NULL,	'w' },
+		{ "events",		1, NULL,	'n' },
+		{ "size",		1, NULL,	's' },
+		{ "io-size",		1, NULL,	'b' },
+		{ "read-pct",		1, NULL,	'M' },
+		{ "working-set",	1, NULL,	'W' },
+		{ "help",		0, NULL,	'h' },
+		{ NULL,			0, NULL,	0 },
+	};
+	static const unsigned short gen_seed[3] = { 0x330e, 0xabcd, 0x1234 };
+	char *cache_arg = NULL, *bucket_arg = NULL, *policy_arg = NULL;
+	char *cutoff_arg = NULL, *mode_arg = NULL;
+	char def_bucket[] = "512k", def_policy[] = "lru";
+	char def_cutoff[] = "4m", def_mode[] = "writeback";
+	char *cache_l[SIM_MAX_LIST], *bucket_l[SIM_MAX_LIST];
+	char *policy_l[SIM_MAX_LIST], *cutoff_l[SIM_MAX_LIST];
+	char *mode_l[SIM_MAX_LIST];
+	unsigned int nr_cache, nr_bucket, nr_policy, nr_cutoff, nr_mode;
+	unsigned int ic, ib, ip, ix, im, wb_percent = 10, jobs = 0;
+	struct sim_source src = {
+		.events		= SIM_EVENTS,
+		.io_pages	= 1,
+	};
+	struct workload wl;
+	struct workload_gen gen;
+	bool generate = false;
+	enum out_format format = OUT_TEXT;
+	unsigned long size = 100UL << 18, pages;
+	uint64_t gran = 4096;
+	struct sim sim = { 0 };
+	struct sim_point *p;
+	char *e;
+	int o, ret = 1;
+
+	workload_init(&wl);
+	trace_init(&src.trace);
+	src.trace.iops = SIM_IOPS;
+
+	while ((o = getopt_long(argc, argv, "C:B:p:c:m:P:g:f:a:i:j:o:w:n:s:b:M:W:h",
+				opts, NULL)) != -1)
+		switch (o) {
+		case 'C':
+			cache_arg = optarg;
+			break;
+		case 'B':
+			bucket_arg = optarg;
+			break;
+		case 'p':
+			policy_arg = optarg;
+			break;
+		case 'c':
+			cutoff_arg = optarg;
+			break;
+		case 'm':
+			mode_arg = optarg;
+			break;
+		case 'P':
+			wb_percent = strtoul(optarg, &e, 10);
+			if (*e || wb_percent > 100) {
+				fprintf(stderr, "Bad writeback percent %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'g':
+			if (parse_bytes(optarg, &gran))
+				return 1;
+			if (gran & (gran - 1)) {
+				fprintf(stderr,
+					"Granularity must be a power of two\n");
+				return 1;
+			}
+			break;
+		case 'f':
+			if (trace_format_parse(optarg, &src.trace.format))
+				return simulate_usage();
+			break;
+		case 'a':
+			if (!optarg[0] || optarg[1])
+				return simulate_usage();
+			src.trace.action = optarg[0];
+			break;
+		case 'i':
+			src.trace.iops = strtod(optarg, &e);
+			if (*e || !(src.trace.iops > 0)) {
+				fprintf(stderr, "Bad iops %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			jobs = strtoul(optarg, &e, 10);
+			if (*e || !jobs) {
+				fprintf(stderr, "Bad number of jobs %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			if (out_format_parse(optarg, &format))
+				return simulate_usage();
+			break;
+		case 'w':
+			if (workload_parse(&wl, optarg))
+				return 1;
+			generate = true;
+			break;
+		case 'n':
+			src.events = strtoull(optarg, &e, 10);
+			if (*e || !src.events) {
+				fprintf(stderr, "Bad number of events %s\n",
+					optarg);
+				return 1;
+			}
+			generate = true;
+			break;
+		case 's':
+			if (workload_parse_size(optarg, &size))
+				return 1;
+			generate = true;
+			break;
+		case 'b':
+			if (workload_parse_size(optarg, &pages))
+				return 1;
+			src.io_pages = pages;
+			generate = true;
+			break;
+		case 'M':
+			wl.read_pct = strtoul(optarg, &e, 10);
+			if (*e || wl.read_pct > 100) {
+				fprintf(stderr, "Bad read percentage %s\n",
+					optarg);
+				return 1;
+			}
+			generate = true;
+			break;
+		case 'W':
+			if (workload_parse_ws(&wl, optarg))
+				return 1;
+			generate = true;
+			break;
+		default:
+			return simulate_usage();
+		}
+
+	if (!cache_arg || argc != optind + !generate)
+		return simulate_usage();
+
+	if (parse_list(cache_arg, cache_l, &nr_cache) ||
+	    parse_list(bucket_arg ?: def_bucket, bucket_l, &nr_bucket) ||
+	    parse_list(policy_arg ?: def_policy, policy_l, &nr_policy) ||
+	    parse_list(cutoff_arg ?: def_cutoff, cutoff_l, &nr_cutoff) ||
+	    parse_list(mode_arg ?: def_mode, mode_l, &nr_mode))
+		return simulate_usage();
+
+	sim.nr_points = nr_cache * nr_bucket * nr_policy * nr_cutoff * nr_mode;
+	if (sim.nr_points > SIM_MAX_POINTS) {
+		fprintf(stderr, "%u points, at most %u in a sweep\n",
+			sim.nr_points, SIM_MAX_POINTS);
+		return 1;
+	}
+	sim.points = calloc(sim.nr_points, sizeof(*sim.points));
+	if (!sim.points) {
+		fprintf(stderr, "Could not allocate the sweep\n");
+		return 1;
+	}
+
+	p = sim.points;
+	for (ic = 0; ic < nr_cache; ic++)
+	for (ib = 0; ib < nr_bucket; ib++)
+	for (ip = 0; ip < nr_policy; ip++)
+	for (ix = 0; ix < nr_cutoff; ix++)
+	for (im = 0; im < nr_mode; im++, p++) {
+		if (parse_bytes(cache_l[ic], &p->cache_size) ||
+		    parse_bytes(bucket_l[ib], &p->bucket_size) ||
+		    parse_name(policy_l[ip], cache_replacement_name,
+			       &p->policy) ||
+		    parse_name(mode_l[im], cache_mode_name, &p->mode))
+			goto out;
+		if (strcmp(cutoff_l[ix], "0") &&
+		    parse_bytes(cutoff_l[ix], &p->cutoff))
+			goto out;
+		if (p->mode == CACHE_MODE_NONE) {
+			fprintf(stderr, "Nothing to simulate without a cache\n");
+			goto out;
+		}
+		if (point_init(p, gran, wb_percent))
+			goto out;
+	}
+
+	if (!jobs)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	sim.nr_threads = jobs < sim.nr_points ? jobs : sim.nr_points;
+
+	if (generate) {
+		if (wl.read_pct < 0)
+			wl.read_pct = 70;
+		/* A working set relative to the cache takes the first size */
+		wl.cache_pages = sim.points[0].cache_size / 4096;
+		if (workload_gen_init(&gen, &wl, size, size, gen_seed))
+			goto out;
+		src.gen = &gen;
+	} else if (trace_open(&src.trace, argv[optind])) {
+		goto out;
+	}
+
+	if (!sim_run(&sim, &src)) {
+		if (format == OUT_TEXT) {
+			report_text(&sim, &src, gran);
+			ret = 0;
+		} else {
+			ret = !!report_out(&sim, &src, gran, format);
+		}
+	}
+
+	if (generate)
+		workload_gen_exit(&gen);
+	trace_close(&src.trace);
+out:
+	for (ic = 0; ic < sim.nr_points; ic++)
+		point_exit(&sim.points[ic]);
+	free(sim.points);
+	return ret;
+}
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __SIMULATE_H
+#define __SIMULATE_H
+
+int simulate_usage(void);
+int bcache_simulate(int argc, char **argv);
+
+#endif
@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Cache set statistics from sysfs, see stats.h.
+ *
+ * A set lives in SYSFS_BCACHE_PATH/<uuid>, with its members linked as
+ * bdevN and cacheN to the bcache directory of their block device. Member
+ * directories are opened through those links, so "../size" and "../dev"
+ * are the attributes of the block device itself.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "stats.h"
+#include "profile.h"
+
+static const char * const interval_names[] = {
+	[STATS_FIVE_MINUTE]	= "five_minute",
+	[STATS_HOUR]		= "hour",
+	[STATS_DAY]		= "day",
+	[STATS_TOTAL]		= "total",
+};
+
+static const char * const counter_names[] = {
+	[STATS_HITS]		= "cache_hits",
+	[STATS_MISSES]		= "cache_misses",
+	[STATS_BYPASS_HITS]	= "cache_bypass_hits",
+	[STATS_BYPASS_MISSES]	= "cache_bypass_misses",
+	[STATS_BYPASSED]	= "bypassed",
+};
+
+static const char * const set_attr_names[] = {
+	[SET_BLOCK_SIZE]		= "block_size",
+	[SET_BUCKET_SIZE]		= "bucket_size",
+	[SET_CONGESTED]			= "congested",
+	[SET_CONGESTED_READ_US]		= "congested_read_threshold_us",
+	[SET_CONGESTED_WRITE_US]	= "congested_write_threshold_us",
+	[SET_AVAILABLE_PERCENT]		= "cache_available_percent",
+};
+
+#define FOR_BDEV	1
+#define FOR_CACHE	2
+
+static const struct {
+	const char	*name;
+	unsigned int	type;
+} dev_attrs[] = {
+	[DEV_DEV]		= { "../dev",			FOR_BDEV|FOR_CACHE },
+	[DEV_SIZE]		= { "../size",			FOR_BDEV|FOR_CACHE },
+	[DEV_BCACHE_DEV]	= { "dev/dev",			FOR_BDEV },
+	[DEV_CACHE_MODE]	= { "cache_mode",		FOR_BDEV },
+	[DEV_READAHEAD]		= { "readahead",		FOR_BDEV },
+	[DEV_SEQUENTIAL_CUTOFF]	= { "sequential_cutoff",	FOR_BDEV },
+	[DEV_STATE]		= { "state",			FOR_BDEV },
+	[DEV_WRITEBACK_RUNNING]	= { "writeback_running",	FOR_BDEV },
+	[DEV_DIRTY_DATA]	= { "dirty_data",		FOR_BDEV },
+	[DEV_WRITEBACK_RATE]	= { "writeback_rate",		FOR_BDEV },
+	[DEV_WRITEBACK_PERCENT]	= { "writeback_percent",	FOR_BDEV },
+	[DEV_BLOCK_SIZE]	= { "block_size",		FOR_CACHE },
+	[DEV_BUCKET_SIZE]	= { "bucket_size",		FOR_CACHE },
+	[DEV_REPLACEMENT]	= { "cache_replacement_policy",	FOR_CACHE },
+	[DEV_DISCARD]		= { "discard",			FOR_CACHE },
+	[DEV_IO_ERRORS]		= { "io_errors",		FOR_CACHE },
+	[DEV_METADATA_WRITTEN]	= { "metadata_written",		FOR_CACHE },
+	[DEV_WRITTEN]		= { "written",			FOR_CACHE },
+	[DEV_NBUCKETS]		= { "nbuckets",			FOR_CACHE },
+	[DEV_PRIORITY_STATS]	= { "priority_stats",		FOR_CACHE },
+};
+
+const char *stats_interval_name(enum stats_interval i)
+{
+	return interval_names[i];
+}
+
+const char *stats_counter_name(enum stats_counter c)
+{
+	return counter_names[c];
+}
+
+static inline int open_attr(int dirfd, const char *name)
+{
+	return PROF(PROF_SYSFS, openat(dirfd, name,
+				       O_RDONLY|O_CLOEXEC));
+}
+
+static void close_fds(int *fds, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+static void open_counters(int dirfd,
+			  int fds[NR_STATS_INTERVALS][NR_STATS_COUNTERS])
+{
+	char path[64];
+	unsigned int i, j;
+
+	for (i = 0; i < NR_STATS_INTERVALS; i++)
+		for (j = 0; j < NR_STATS_COUNTERS; j++) {
+			snprintf(path, sizeof(path), "stats_%s/%s",
+				 interval_names[i], counter_names[j]);
+			fds[i][j] = open_attr(dirfd, path);
+		}
+}
+
+static void link_name(int dirfd, const char *link, char *name)
+{
+	char buf[PATH_MAX], *p;
+	ssize_t len;
+
+	len = readlinkat(dirfd, link, buf, sizeof(buf) - 1);
+	if (len < 0) {
+		strcpy(name, "?");
+		return;
+	}
+	buf[len] = '\0';
+	p = strrchr(buf, '/');
+	snprintf(name, NAME_MAX + 1, "%.*s", NAME_MAX, p ? p + 1 : buf);
+}
+
+/* bdevN and cacheN, the set also has cache_* attributes */
+static int member_filter(const struct dirent *d)
+{
+	return (!strncmp(d->d_name, "bdev", 4) && isdigit(d->d_name[4])) ||
+		(!strncmp(d->d_name, "cache", 5) && isdigit(d->d_name[5]));
+}
+
+static int open_dev(struct stats_dev *d, int setfd, const char *setpath,
+		    const char *name)
+{
+	char path[PATH_MAX], real[PATH_MAX], *p;
+	unsigned int i, type;
+	int dirfd;
+
+	memset(d, 0, sizeof(*d));
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	d->backing = name[0] == 'b';
+	type = d->backing ? FOR_BDEV : FOR_CACHE;
+
+	dirfd = PROF(PROF_SYSFS, openat(setfd, name,
+					O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+	if (dirfd < 0)
+		return -1;
+
+	/* bdevN/.. is the block device the member sits on */
+	strcpy(d->dev, "?");
+	if (snprintf(path, sizeof(path), "%s/%s/..", setpath, name) <
+	    (int) sizeof(path) && realpath(path, real)) {
+		p = strrchr(real, '/');
+		snprintf(d->dev, sizeof(d->dev), "%.*s", NAME_MAX,
+			 p ? p + 1 : real);
+	}
+	if (d->backing)
+		link_name(dirfd, "dev", d->bcache);
+
+	for (i = 0; i < NR_DEV_ATTRS; i++)
+		d->attr[i] = dev_attrs[i].type & type ?
+			open_attr(dirfd, dev_attrs[i].name) : -1;
+
+	if (d->backing)
+		open_counters(dirfd, d->stats);
+	else
+		memset(d->stats, -1, sizeof(d->stats));
+
+	close(dirfd);
+	return 0;
+}
+
+static void close_set(struct stats_set *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nr_devs; i++) {
+		close_fds(s->devs[i].attr, NR_DEV_ATTRS);
+		close_fds(&s->devs[i].stats[0][0],
+			  NR_STATS_INTERVALS * NR_STATS_COUNTERS);
+	}
+	close_fds(s->attr, NR_SET_ATTRS);
+	close_fds(&s->stats[0][0], NR_STATS_INTERVALS * NR_STATS_COUNTERS);
+	free(s->devs);
+	free(s);
+}
+
+static struct stats_set *open_set(const char *uuid)
+{
+	struct dirent **names;
+	struct stats_set *s;
+	char path[PATH_MAX];
+	unsigned int i;
+	int setfd, n;
+
+	snprintf(path, sizeof(path), "%s%s/%s", root_prefix(), SYSFS_BCACHE_PATH,
+		 uuid);
+	setfd = PROF(PROF_SYSFS,
+		     open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+	if (setfd < 0)
+		return NULL;
+
+	n = scandir(path, &names, member_filter, versionsort);
+	if (n < 0) {
+		close(setfd);
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (s)
+		s->devs = calloc(n ? n : 1, sizeof(*s->devs));
+	if (!s || !s->devs) {
+		free(s);
+		s = NULL;
+		goto out;
+	}
+
+	snprintf(s->uuid, sizeof(s->uuid), "%.*s",
+		 (int) sizeof(s->uuid) - 1, uuid);
+	for (i = 0; i < NR_SET_ATTRS; i++)
+		s->attr[i] = open_attr(setfd, set_attr_names[i]);
+	open_counters(setfd, s->stats);
+
+	for (i = 0; i < (unsigned int) n; i++)
+		if (!open_dev(&s->devs[s->nr_devs], setfd, path,
+			      names[i]->d_name))
+			s->nr_devs++;
+out:
+	for (i = 0; i < (unsigned int) n; i++)
+		free(names[i]);
+	free(names);
+	close(setfd);
+	return s;
+}
+
+static int set_filter(const struct dirent *d)
+{
+	/* Everything else in there is a file, only sets are uuids */
+	return strlen(d->d_name) == 36 && isxdigit(d->d_name[0]);
+}
+
+/* Whether the bcache module is loaded, whatever sets it has */
+bool stats_loaded(void)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s%s", root_prefix(), SYSFS_BCACHE_PATH);
+	return !PROF(PROF_SYSFS, access(path, F_OK));
+}
+
+/*
+ * Discovers the registered sets and opens their attributes. Returns -1
+ * with errno ENOENT if bcache isn't loaded.
+ */
+int stats_open(struct list_head *sets)
+{
+	struct dirent **names;
+	struct stats_set *s;
+	char path[PATH_MAX];
+	int i, n;
+
+	INIT_LIST_HEAD(sets);
+
+	snprintf(path, sizeof(path), "%s%s", root_prefix(), SYSFS_BCACHE_PATH);
+	n = scandir(path, &names, set_filter, versionsort);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		s = open_set(names[i]->d_name);
+		if (s)
+			list_add_tail(&s->list, sets);
+		free(names[i]);
+	}
+	free(names);
+	return 0;
+}
+
+void stats_close(struct list_head *sets)
+{
+	struct stats_set *s, *n;
+
+	list_for_each_entry_safe(s, n, sets, list) {
+		list_del(&s->list);
+		close_set(s);
+	}
+}
+
+static bool set_changed(struct stats_set *s)
+{
+	struct dirent **names;
+	char path[PATH_MAX];
+	bool changed;
+	int i, n;
+
+	snprintf(path, sizeof(path), "%s%s/%s", root_prefix(), SYSFS_BCACHE_PATH,
+		 s->uuid);
+	n = scandir(path, &names, member_filter, versionsort);
+	if (n < 0)
+		return true;
+
+	changed = (unsigned int) n != s->nr_devs;
+	for (i = 0; i < n; i++) {
+		if (!changed && strcmp(names[i]->d_name, s->devs[i].name))
+			changed = true;
+		free(names[i]);
+	}
+	free(names);
+	return changed;
+}
+
+/*
+ * Whether sets or their members came or went since stats_open(); that
+ * only takes a readdir per set, a caller sampling in a loop can check it
+ * every time.
+ */
+bool stats_stale(struct list_head *sets)
+{
+	struct dirent **names;
+	struct list_head *pos = sets->next;
+	struct stats_set *s;
+	bool stale = false;
+	char path[PATH_MAX];
+	int i, n;
+
+	snprintf(path, sizeof(path), "%s%s", root_prefix(), SYSFS_BCACHE_PATH);
+	n = scandir(path, &names, set_filter, versionsort);
+	if (n < 0)
+		return !list_empty(sets);
+
+	for (i = 0; i < n; i++) {
+		if (!stale) {
+			s = list_entry(pos, struct stats_set, list);
+			if (pos == sets || strcmp(s->uuid, names[i]->d_name) ||
+			    set_changed(s))
+				stale = true;
+			pos = pos->next;
+		}
+		free(names[i]);
+	}
+	free(names);
+	return stale || pos != sets;
+}
+
+/* Writes one of the set's write only attributes, like clear_stats */
+int stats_set_write(struct stats_set *s, const char *attr, const char *val)
+{
+	char path[PATH_MAX];
+	ssize_t len = strlen(val);
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s%s/%s/%s", root_prefix(),
+		 SYSFS_BCACHE_PATH, s->uuid, attr);
+	fd = PROF(PROF_SYSFS, open(path, O_WRONLY|O_CLOEXEC));
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %m\n", path);
+		return -1;
+	}
+	if (PROF(PROF_SYSFS, write(fd, val, len)) != len) {
+		fprintf(stderr, "Can't write %s: %m\n", path);
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+}
+
+/* The whole attribute without its trailing newline, or -1 */
+int stats_read(int fd, char *buf, size_t size)
+{
+	ssize_t len;
+
+	if (fd < 0)
+		return -1;
+
+	len = PROF(PROF_SYSFS, pread(fd, buf, size - 1, 0));
+	if (len < 0)
+		return -1;
+	while (len && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+	return len;
+}
+
+int stats_read_u64(int fd, uint64_t *v)
+{
+	char buf[32], *end;
+
+	if (stats_read(fd, buf, sizeof(buf)) <= 0)
+		return -1;
+	*v = strtoull(buf, &end, 10);
+	return *end ? -1 : 0;
+}
+
+/*
+ * Sizes printed by the kernel's bch_hprint(): bytes with a binary unit
+ * suffix and at most one decimal, so only about three digits are exact.
+ */
+int stats_read_sectors(int fd, uint64_t *sectors)
+{
+	static const char units[] = "kMGTPEZY";
+	const char *u;
+	char buf[32], *end;
+	double v;
+
+	if (stats_read(fd, buf, sizeof(buf)) <= 0)
+		return -1;
+
+	v = strtod(buf, &end);
+	if (end == buf || v < 0)
+		return -1;
+	if (*end) {
+		u = strchr(units, *end);
+		if (!u || end[1])
+			return -1;
+		v *= 1ULL << (10 * (u - units + 1));
+	}
+
+	*sectors = v / 512;
+	return 0;
+}
+
+/* The bracketed choice out of "writethrough [writeback] writearound none" */
+int stats_read_selected(int fd, char *buf, size_t size)
+{
+	char *p, *e;
+	int len;
+
+	len = stats_read(fd, buf, size);
+	if (len < 0)
+		return -1;
+
+	p = strchr(buf, '[');
+	e = p ? strchr(p, ']') : NULL;
+	if (!e)
+		return len;
+
+	len = e - p - 1;
+	memmove(buf, p + 1, len);
+	buf[len] = '\0';
+	return len;
+}
+
+int stats_read_counters(const int fds[NR_STATS_COUNTERS],
+			uint64_t v[NR_STATS_COUNTERS])
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_STATS_COUNTERS; i++)
+		if (i == STATS_BYPASSED ? stats_read_sectors(fds[i], &v[i]) :
+					  stats_read_u64(fds[i], &v[i]))
+			return -1;
+	return 0;
+}
+
+int stats_read_priority(int fd, struct stats_priority *p)
+{
+	static const struct {
+		const char	*key;
+		size_t		offset;
+	} keys[] = {
+		{ "Unused:",	offsetof(struct stats_priority, unused) },
+		{ "Clean:",	offsetof(struct stats_priority, clean) },
+		{ "Dirty:",	offsetof(struct stats_priority, dirty) },
+		{ "Metadata:",	offsetof(struct stats_priority, metadata) },
+	};
+	char buf[4096], *line, *save;
+	unsigned int i;
+
+	if (stats_read(fd, buf, sizeof(buf)) < 0)
+		return -1;
+
+	memset(p, 0, sizeof(*p));
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save))
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+			if (!strncmp(line, keys[i].key, strlen(keys[i].key)))
+				*(unsigned int *) ((char *) p + keys[i].offset) =
+					strtoul(line + strlen(keys[i].key),
+						NULL, 10);
+	return 0;
+}
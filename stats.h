@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+
+/*
+ * Statistics of the registered cache sets, read from sysfs
+ *
+ * Every attribute is opened once when the sets are discovered and re-read
+ * with pread(), so sampling the same sets over and over costs one read per
+ * value and no path lookups. A missing attribute has fd -1 and reads fail.
+ */
+#ifndef SYSFS_BCACHE_PATH
+#define SYSFS_BCACHE_PATH	"/sys/fs/bcache"
+#endif
+
+enum stats_interval {
+	STATS_FIVE_MINUTE,
+	STATS_HOUR,
+	STATS_DAY,
+	STATS_TOTAL,
+	NR_STATS_INTERVALS,
+};
+
+/* The files of every stats_<interval> directory */
+enum stats_counter {
+	STATS_HITS,
+	STATS_MISSES,
+	STATS_BYPASS_HITS,
+	STATS_BYPASS_MISSES,
+	STATS_BYPASSED,		/* sectors */
+	NR_STATS_COUNTERS,
+};
+
+enum stats_set_attr {
+	SET_BLOCK_SIZE,
+	SET_BUCKET_SIZE,
+	SET_CONGESTED,
+	SET_CONGESTED_READ_US,
+	SET_CONGESTED_WRITE_US,
+	SET_AVAILABLE_PERCENT,
+	NR_SET_ATTRS,
+};
+
+enum stats_dev_attr {
+	DEV_DEV,		/* of the block device, both types */
+	DEV_SIZE,
+
+	/* backing devices */
+	DEV_BCACHE_DEV,
+	DEV_CACHE_MODE,
+	DEV_READAHEAD,
+	DEV_SEQUENTIAL_CUTOFF,
+	DEV_STATE,
+	DEV_WRITEBACK_RUNNING,
+	DEV_DIRTY_DATA,
+	DEV_WRITEBACK_RATE,
+	DEV_WRITEBACK_PERCENT,
+
+	/* cache devices */
+	DEV_BLOCK_SIZE,
+	DEV_BUCKET_SIZE,
+	DEV_REPLACEMENT,
+	DEV_DISCARD,
+	DEV_IO_ERRORS,
+	DEV_METADATA_WRITTEN,
+	DEV_WRITTEN,
+	DEV_NBUCKETS,
+	DEV_PRIORITY_STATS,
+	NR_DEV_ATTRS,
+};
+
+/* A member of a set: bdevN or cacheN in its sysfs directory */
+struct stats_dev {
+	char			name[NAME_MAX + 1];
+	char			dev[NAME_MAX + 1];	/* block device, sdb */
+	char			bcache[NAME_MAX + 1];	/* bcacheN, backing only */
+	bool			backing;
+	int			attr[NR_DEV_ATTRS];
+	int			stats[NR_STATS_INTERVALS][NR_STATS_COUNTERS];
+};
+
+struct stats_set {
+	char			uuid[40];
+	int			attr[NR_SET_ATTRS];
+	int			stats[NR_STATS_INTERVALS][NR_STATS_COUNTERS];
+	struct stats_dev	*devs;
+	unsigned int		nr_devs;
+	struct list_head	list;
+};
+
+/* Percentages from a cache's priority_stats */
+struct stats_priority {
+	unsigned int		unused;
+	unsigned int		clean;
+	unsigned int		dirty;
+	unsigned int		metadata;
+};
+
+bool stats_loaded(void);
+int stats_open(struct list_head *sets);
+void stats_close(struct list_head *sets);
+bool stats_stale(struct list_head *sets);
+int stats_set_write(struct stats_set *s, const char *attr, const char *val);
+
+const char *stats_interval_name(enum stats_interval i);
+const char *stats_counter_name(enum stats_counter c);
+
+int stats_read(int fd, char *buf, size_t size);
+int stats_read_u64(int fd, uint64_t *v);
+int stats_read_sectors(int fd, uint64_t *sectors);
+int stats_read_selected(int fd, char *buf, size_t size);
+int stats_read_counters(const int fds[NR_STATS_COUNTERS],
+			uint64_t v[NR_STATS_COUNTERS]);
+int stats_read_priority(int fd, struct stats_priority *p);
+
+#endif
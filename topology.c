@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Device topology for make-bcache --auto: the I/O limits the kernel knows
+ * about a device, and the block size, bucket size and data offset that
+ * line bcache up with them.
+ *
+ * Buckets are written sequentially and reused whole, so a bucket that
+ * covers erase blocks, RAID chunks or zones exactly lets the device drop
+ * them whole, where a misaligned one makes it move data on every reuse.
+ * Buckets start at offset 0 of a cache device, so they are aligned if
+ * their size is a multiple of every limit and the device itself starts
+ * on a boundary. Backing devices only need their data to start on one,
+ * which the data offset takes care of.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "topology.h"
+#include "zoned.h"
+
+/* What bcache used before there was an auto mode, 1024 sectors */
+#define TOPOLOGY_BUCKET_DEFAULT	(512U << 10)
+#define TOPOLOGY_MIN_BUCKETS	(1U << 7)
+
+static uint64_t read_sysfs_u64(const char *dir, const char *file)
+{
+	char path[PATH_MAX];
+	unsigned long long v;
+	FILE *f;
+	int ret;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file) >=
+	    (int) sizeof(path))
+		return 0;
+	f = fopen(path, "re");
+	if (!f)
+		return 0;
+	ret = fscanf(f, "%llu", &v);
+	fclose(f);
+	return ret == 1 ? v : 0;
+}
+
+int dev_topology(const char *dev, struct dev_topology *t)
+{
+	char sys[PATH_MAX], name[PATH_MAX];
+	unsigned int u;
+	struct stat st;
+	int fd, i;
+
+	memset(t, 0, sizeof(*t));
+
+	fd = open(dev, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s: %m\n", dev);
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Error statting %s: %m\n", dev);
+		close(fd);
+		return -1;
+	}
+
+	if (!S_ISBLK(st.st_mode)) {
+		t->size = st.st_size;
+		t->logical = t->physical = 512;
+		close(fd);
+		return 0;
+	}
+
+	t->blockdev = true;
+	if (ioctl(fd, BLKGETSIZE64, &t->size) ||
+	    ioctl(fd, BLKSSZGET, &i) ||
+	    ioctl(fd, BLKPBSZGET, &t->physical)) {
+		fprintf(stderr, "Error reading the I/O limits of %s: %m\n",
+			dev);
+		close(fd);
+		return -1;
+	}
+	t->logical = i;
+	if (!ioctl(fd, BLKIOMIN, &u))
+		t->min_io = u;
+	if (!ioctl(fd, BLKIOOPT, &u))
+		t->opt_io = u;
+	close(fd);
+
+	/* A partition's queue limits are those of its disk */
+	snprintf(sys, sizeof(sys), "%s/sys/dev/block/%u:%u",
+		 root_prefix(), major(st.st_rdev), minor(st.st_rdev));
+	t->start = read_sysfs_u64(sys, "start");
+	t->discard_granularity =
+		read_sysfs_u64(sys, "queue/discard_granularity") ?:
+		read_sysfs_u64(sys, "../queue/discard_granularity");
+
+	/* get_zone_size() wants a name it can take the basename of */
+	snprintf(name, sizeof(name), "%s", dev);
+	t->zone_size = (uint64_t) get_zone_size(name) << 9;
+	return 0;
+}
+
+void topology_print(FILE *out, const char *dev, const struct dev_topology *t)
+{
+	if (!t->blockdev) {
+		fprintf(out, "%s: not a block device, no I/O limits\n", dev);
+		return;
+	}
+
+	fprintf(out, "%s: logical block %u, physical block %u, "
+		"minimum I/O %u, optimal I/O %u, discard granularity %u",
+		dev, t->logical, t->physical, t->min_io, t->opt_io,
+		t->discard_granularity);
+	if (t->zone_size)
+		fprintf(out, ", zone %" PRIu64, t->zone_size);
+	if (t->start)
+		fprintf(out, ", starts at sector %" PRIu64, t->start);
+	fputc('\n', out);
+}
+
+unsigned int topology_block_size(FILE *out, const struct dev_topology *t)
+{
+	unsigned int page = sysconf(_SC_PAGESIZE);
+	unsigned int bytes = t->physical;
+
+	/* The kernel wants blocks no larger than a page */
+	if (bytes > page) {
+		fprintf(out, "  block size %u: physical block %u is larger "
+			"than a page\n", page, bytes);
+		bytes = page;
+	} else if (bytes > t->logical) {
+		fprintf(out, "  block size %u: writes smaller than the "
+			"physical block are read-modify-write\n", bytes);
+	} else {
+		fprintf(out, "  block size %u: the physical block\n", bytes);
+	}
+	return bytes / 512;
+}
+
+/* Bucket sizes are powers of two: the largest one dividing v */
+static uint64_t pow2_part(uint64_t v)
+{
+	return v & -v;
+}
+
+static void limit_pow2(FILE *out, uint64_t v, const char *what,
+		       uint64_t *unit, const char **why)
+{
+	uint64_t p = pow2_part(v);
+
+	if (!v)
+		return;
+	if (p != v)
+		fprintf(out, "  %s %" PRIu64 " is not a power of two, buckets "
+			"can only line up with %" PRIu64 " of it\n",
+			what, v, p);
+	if (p > *unit) {
+		*unit = p;
+		*why = what;
+	}
+}
+
+unsigned int topology_bucket_size(FILE *out, const struct dev_topology *t,
+				  unsigned int bucket_size)
+{
+	const char *why = "physical block";
+	uint64_t unit = t->physical, bytes;
+
+	limit_pow2(out, t->min_io, "minimum I/O", &unit, &why);
+	limit_pow2(out, t->opt_io, "optimal I/O", &unit, &why);
+	limit_pow2(out, t->discard_granularity, "discard granularity",
+		   &unit, &why);
+	limit_pow2(out, t->zone_size, "zone", &unit, &why);
+
+	if (bucket_size) {
+		bytes = (uint64_t) bucket_size << 9;
+		if (bytes % unit)
+			fprintf(out, "  bucket size %" PRIu64 " as given, "
+				"not a multiple of the %s %" PRIu64 ": "
+				"buckets straddle its boundaries\n",
+				bytes, why, unit);
+		else
+			fprintf(out, "  bucket size %" PRIu64 " as given, a "
+				"multiple of the %s %" PRIu64 "\n",
+				bytes, why, unit);
+	} else if (unit > TOPOLOGY_BUCKET_DEFAULT) {
+		bytes = unit;
+		fprintf(out, "  bucket size %" PRIu64 ": the %s%s\n", bytes,
+			why, bytes >> 9 > USHRT_MAX ?
+			", large buckets" : "");
+	} else {
+		bytes = TOPOLOGY_BUCKET_DEFAULT;
+		fprintf(out, "  bucket size %" PRIu64 ": the default, a "
+			"multiple of the %s %" PRIu64 "\n", bytes, why, unit);
+	}
+
+	if ((t->start << 9) % unit)
+		fprintf(out, "  the device starts at sector %" PRIu64
+			", not on a %" PRIu64 " boundary: no bucket size "
+			"lines up, move the partition\n", t->start, unit);
+	if (t->size / bytes < TOPOLOGY_MIN_BUCKETS)
+		fprintf(out, "  only %" PRIu64 " buckets, %u are needed\n",
+			t->size / bytes, TOPOLOGY_MIN_BUCKETS);
+
+	return bytes >> 9;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	while (b) {
+		uint64_t r = a % b;
+
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+static void limit_lcm(uint64_t v, const char *what, uint64_t *unit,
+		      const char **why)
+{
+	uint64_t l;
+
+	if (!v)
+		return;
+	l = *unit / gcd(*unit, v) * v;
+	if (l == *unit)
+		return;
+	*why = l == v ? what : "common multiple of the limits";
+	*unit = l;
+}
+
+uint64_t topology_data_offset(FILE *out, const struct dev_topology *t,
+			      uint64_t data_offset)
+{
+	const char *why = "physical block";
+	uint64_t unit = t->physical, offset;
+
+	/* The data offset is in sectors, RAID stripes needn't be 2^n */
+	limit_lcm(t->min_io, "minimum I/O", &unit, &why);
+	limit_lcm(t->opt_io, "optimal I/O", &unit, &why);
+	limit_lcm(t->zone_size, "zone", &unit, &why);
+	unit >>= 9;
+
+	if (data_offset) {
+		if ((t->start + data_offset) % unit)
+			fprintf(out, "  data offset %" PRIu64 " as given, "
+				"data does not start on a %s boundary "
+				"(%" PRIu64 " sectors)\n",
+				data_offset, why, unit);
+		else
+			fprintf(out, "  data offset %" PRIu64 " as given, on a "
+				"%s boundary\n", data_offset, why);
+		return data_offset;
+	}
+
+	/* The first boundary past the super block */
+	offset = t->start + BDEV_DATA_START_DEFAULT + unit - 1;
+	offset -= offset % unit;
+	offset -= t->start;
+
+	if (offset == BDEV_DATA_START_DEFAULT)
+		fprintf(out, "  data offset %" PRIu64 ": the default, on a "
+			"%s boundary\n", offset, why);
+	else
+		fprintf(out, "  data offset %" PRIu64 ": the data starts on "
+			"a %s boundary (%" PRIu64 " sectors)\n",
+			offset, why, unit);
+	return offset;
+}
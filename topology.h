@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __TOPOLOGY_H
+#define __TOPOLOGY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* I/O limits of a block device, in bytes; 0 where it has none */
+struct dev_topology {
+	uint64_t	size;
+	unsigned int	logical;
+	unsigned int	physical;
+	unsigned int	min_io;
+	unsigned int	opt_io;
+	unsigned int	discard_granularity;
+	uint64_t	zone_size;	/* or chunk size */
+	uint64_t	start;		/* of a partition on its disk */
+	bool		blockdev;
+};
+
+int dev_topology(const char *dev, struct dev_topology *t);
+void topology_print(FILE *out, const char *dev, const struct dev_topology *t);
+
+/* In sectors, with the reasons printed to out; 0 for not given */
+unsigned int topology_block_size(FILE *out, const struct dev_topology *t);
+unsigned int topology_bucket_size(FILE *out, const struct dev_topology *t,
+				  unsigned int bucket_size);
+uint64_t topology_data_offset(FILE *out, const struct dev_topology *t,
+			      uint64_t data_offset);
+
+#endif
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Block trace reader: blkparse text or "time,op,sector,sectors" CSV,
+ * read in large chunks and split into lines in place, so that traces of
+ * billions of events stream through without a copy or an allocation per
+ * event.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+void trace_init(struct trace *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->format = TRACE_AUTO;
+	t->action = 'Q';
+}
+
+int trace_format_parse(const char *s, enum trace_format *format)
+{
+	if (!strcmp(s, "blkparse"))
+		*format = TRACE_BLKPARSE;
+	else if (!strcmp(s, "csv"))
+		*format = TRACE_CSV;
+	else
+		return -1;
+	return 0;
+}
+
+/* A name of - is stdin */
+int trace_open(struct trace *t, const char *name)
+{
+	t->name = name;
+	t->f = strcmp(name, "-") ? fopen(name, "re") : stdin;
+	if (!t->f) {
+		fprintf(stderr, "Error opening %s: %m\n", name);
+		return -1;
+	}
+
+	t->buf = malloc(TRACE_READ_BUF + 1);
+	if (!t->buf) {
+		fprintf(stderr, "Could not allocate a read buffer\n");
+		trace_close(t);
+		return -1;
+	}
+	return 0;
+}
+
+void trace_close(struct trace *t)
+{
+	if (t->f && t->f != stdin)
+		fclose(t->f);
+	t->f = NULL;
+	free(t->buf);
+	t->buf = NULL;
+}
+
+/* The next line, NUL terminated, or NULL at the end */
+static char *trace_line(struct trace *t)
+{
+	char *line, *nl;
+	size_t n;
+
+	for (;;) {
+		nl = memchr(t->buf + t->pos, '\n', t->len - t->pos);
+		if (nl) {
+			line = t->buf + t->pos;
+			*nl = '\0';
+			if (nl > line && nl[-1] == '\r')
+				nl[-1] = '\0';
+			t->pos = nl + 1 - t->buf;
+			if (!t->overlong)
+				return line;
+			t->overlong = false;
+			t->skipped++;
+			continue;
+		}
+
+		if (t->eof) {
+			if (t->pos == t->len)
+				return NULL;
+			line = t->buf + t->pos;
+			t->buf[t->len] = '\0';
+			t->pos = t->len;
+			return line;
+		}
+
+		if (t->len - t->pos == TRACE_READ_BUF) {
+			/* No line is that long: drop it */
+			t->pos = t->len;
+			t->overlong = true;
+		}
+		memmove(t->buf, t->buf + t->pos, t->len - t->pos);
+		t->len -= t->pos;
+		t->pos = 0;
+
+		n = fread(t->buf + t->len, 1, TRACE_READ_BUF - t->len, t->f);
+		t->len += n;
+		if (!n) {
+			if (ferror(t->f))
+				t->err = true;
+			t->eof = true;
+		}
+	}
+}
+
+static char *next_field(char **s, char sep)
+{
+	char *p = *s, *start;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	start = p;
+	while (*p && *p != sep && !(sep == ' ' && *p == '\t'))
+		p++;
+	if (*p)
+		*p++ = '\0';
+	*s = p;
+	return start;
+}
+
+static bool parse_u64(const char *s, uint64_t *v)
+{
+	char *end;
+
+	if (*s < '0' || *s > '9')
+		return false;
+	errno = 0;
+	*v = strtoull(s, &end, 10);
+	return !*end && !errno;
+}
+
+/* Seconds with up to nine decimals */
+static bool parse_time(const char *s, uint64_t *ns)
+{
+	uint64_t sec = 0, frac = 0;
+	unsigned int digits = 0;
+
+	if (*s < '0' || *s > '9')
+		return false;
+	for (; *s >= '0' && *s <= '9'; s++)
+		sec = sec * 10 + *s - '0';
+	if (*s == '.')
+		for (s++; *s >= '0' && *s <= '9'; s++)
+			if (digits < 9) {
+				frac = frac * 10 + *s - '0';
+				digits++;
+			}
+	if (*s)
+		return false;
+	for (; digits < 9; digits++)
+		frac *= 10;
+	*ns = sec * 1000000000ULL + frac;
+	return true;
+}
+
+/* Discards are flagged as writes too */
+static int parse_rwbs(const char *s)
+{
+	if (strchr(s, 'D'))
+		return TRACE_DISCARD;
+	if (strchr(s, 'W'))
+		return TRACE_WRITE;
+	if (strchr(s, 'R'))
+		return TRACE_READ;
+	return -1;
+}
+
+/*
+ * The default blkparse output:
+ *   8,0  3  1  0.000000000  697  Q  WS 223490 + 8 [kjournald]
+ * dev, cpu, sequence, time, pid, action, RWBS, sector + sectors
+ */
+static int parse_blkparse(struct trace *t, char *line,
+			  struct trace_event *ev, bool *timed)
+{
+	char *dev, *action, *rwbs, *sector, *plus, *sectors;
+	uint64_t n;
+	int op;
+
+	dev = next_field(&line, ' ');
+	if (!strchr(dev, ','))
+		return -1;
+	next_field(&line, ' ');
+	next_field(&line, ' ');
+	if (!parse_time(next_field(&line, ' '), &ev->time))
+		return -1;
+	next_field(&line, ' ');
+	action = next_field(&line, ' ');
+	rwbs = next_field(&line, ' ');
+	sector = next_field(&line, ' ');
+	plus = next_field(&line, ' ');
+	sectors = next_field(&line, ' ');
+
+	if (action[0] != t->action || action[1] ||
+	    strcmp(plus, "+") ||
+	    !parse_u64(sector, &ev->sector) ||
+	    !parse_u64(sectors, &n) || !n || n > UINT32_MAX ||
+	    (op = parse_rwbs(rwbs)) < 0)
+		return -1;
+
+	ev->sectors = n;
+	ev->op = op;
+	*timed = true;
+	return 0;
+}
+
+/* time,op,sector,sectors with the time in seconds, or left out */
+static int parse_csv(char *line, struct trace_event *ev, bool *timed)
+{
+	char *time, *op, *sector, *sectors;
+	uint64_t n;
+
+	time = next_field(&line, ',');
+	op = next_field(&line, ',');
+	sector = next_field(&line, ',');
+	sectors = next_field(&line, ',');
+
+	*timed = *time;
+	if ((*timed && !parse_time(time, &ev->time)) ||
+	    !parse_u64(sector, &ev->sector) ||
+	    !parse_u64(sectors, &n) || !n || n > UINT32_MAX)
+		return -1;
+
+	switch (op[0]) {
+	case 'R':
+	case 'r':
+		ev->op = TRACE_READ;
+		break;
+	case 'W':
+	case 'w':
+		ev->op = TRACE_WRITE;
+		break;
+	case 'D':
+	case 'd':
+		ev->op = TRACE_DISCARD;
+		break;
+	default:
+		return -1;
+	}
+	ev->sectors = n;
+	return 0;
+}
+
+static void trace_time(struct trace *t, struct trace_event *ev, bool timed)
+{
+	if (!timed) {
+		ev->time = t->iops > 0 ? t->nr * 1e9 / t->iops : 0;
+	} else if (!t->started) {
+		t->started = true;
+		t->start = ev->time;
+		ev->time = 0;
+	} else {
+		/* blkparse merges per cpu streams, a little out of order */
+		ev->time = ev->time > t->start ? ev->time - t->start : 0;
+	}
+	t->nr++;
+}
+
+/* Returns 1 with the next event, 0 at the end of the trace, -1 on error */
+int trace_next(struct trace *t, struct trace_event *ev)
+{
+	char *line, *p;
+	bool timed;
+	int ret;
+
+	while ((line = trace_line(t))) {
+		if (!*line || *line == '#')
+			continue;
+
+		if (t->format == TRACE_AUTO) {
+			unsigned int commas = 0;
+
+			for (p = line; *p; p++)
+				commas += *p == ',';
+			t->format = commas >= 3 ? TRACE_CSV : TRACE_BLKPARSE;
+		}
+
+		if (t->format == TRACE_CSV)
+			ret = parse_csv(line, ev, &timed);
+		else
+			ret = parse_blkparse(t, line, ev, &timed);
+		if (ret) {
+			t->skipped++;
+			continue;
+		}
+
+		trace_time(t, ev, timed);
+		return 1;
+	}
+
+	if (t->err) {
+		fprintf(stderr, "Error reading %s\n", t->name);
+		return -1;
+	}
+	return 0;
+}
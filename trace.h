@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Block trace reader, shared by bcache-test and the cache simulator.
+ */
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum trace_op {
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_DISCARD,
+};
+
+enum trace_format {
+	TRACE_AUTO,		/* by the first line */
+	TRACE_BLKPARSE,
+	TRACE_CSV,
+};
+
+struct trace_event {
+	uint64_t		time;		/* ns from the first event */
+	uint64_t		sector;
+	uint32_t		sectors;
+	uint32_t		op;
+};
+
+#define TRACE_READ_BUF		(1U << 20)
+
+struct trace {
+	/* Set up by trace_init(), may be changed before trace_open() */
+	enum trace_format	format;
+	char			action;		/* blkparse action replayed */
+	double			iops;		/* spacing of untimed events */
+
+	FILE			*f;
+	const char		*name;
+	char			*buf;
+	size_t			pos;
+	size_t			len;
+	bool			eof;
+	bool			overlong;
+	bool			err;
+
+	bool			started;
+	uint64_t		start;
+	uint64_t		nr;		/* events so far */
+	uint64_t		skipped;	/* lines */
+};
+
+void trace_init(struct trace *t);
+int trace_format_parse(const char *s, enum trace_format *format);
+int trace_open(struct trace *t, const char *name);
+void trace_close(struct trace *t);
+int trace_next(struct trace *t, struct trace_event *ev);
+
+#endif
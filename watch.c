@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Waiting for device state to change, without fixed sleeps.
+ *
+ * A wait sleeps in poll() on everything that can signal the change: the
+ * kernel's uevent netlink socket, which sees block devices come and go,
+ * and for sysfs attributes the attributes themselves, kept open and
+ * polled for POLLPRI, which sysfs_notify() wakes up. Not every bcache
+ * attribute is notified, nor every transition a uevent, so the poll also
+ * returns after WATCH_RECHECK_MS and the condition is checked again: a
+ * transition is seen within that time at worst, instead of after whole
+ * seconds of sleep.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "watch.h"
+
+bool attr_gone(const char *val, void *arg)
+{
+	return !val;
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct watch {
+	int64_t		deadline;
+	int		timeout_ms;
+	int		uevent_fd;
+};
+
+/* Kernel uevents, as udev gets them; the rechecks do without */
+static void watch_init(struct watch *wt, int timeout_ms)
+{
+	struct sockaddr_nl addr = {
+		.nl_family	= AF_NETLINK,
+		.nl_groups	= 1,
+	};
+
+	wt->timeout_ms = timeout_ms;
+	wt->deadline = now_ms() + timeout_ms;
+	wt->uevent_fd = socket(AF_NETLINK,
+			       SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,
+			       NETLINK_KOBJECT_UEVENT);
+	if (wt->uevent_fd >= 0 &&
+	    bind(wt->uevent_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(wt->uevent_fd);
+		wt->uevent_fd = -1;
+	}
+}
+
+static void watch_exit(struct watch *wt)
+{
+	if (wt->uevent_fd >= 0)
+		close(wt->uevent_fd);
+}
+
+/*
+ * Sleeps until one of fds, which has room for one more, or a uevent
+ * wakes us up, or for WATCH_RECHECK_MS. Returns false past the deadline.
+ */
+static bool watch_sleep(struct watch *wt, struct pollfd *fds, unsigned int n)
+{
+	char buf[4096];
+	int slice = WATCH_RECHECK_MS;
+
+	if (wt->timeout_ms >= 0) {
+		int64_t rest = wt->deadline - now_ms();
+
+		if (rest <= 0)
+			return false;
+		if (rest < slice)
+			slice = rest;
+	}
+
+	if (wt->uevent_fd >= 0) {
+		fds[n].fd = wt->uevent_fd;
+		fds[n].events = POLLIN;
+		n++;
+	}
+	if (poll(fds, n, slice) < 0 && errno != EINTR) {
+		fprintf(stderr, "Error waiting for devices: %m\n");
+		return false;
+	}
+
+	/* What changed doesn't matter, the caller checks again */
+	if (wt->uevent_fd >= 0)
+		while (recv(wt->uevent_fd, buf, sizeof(buf), 0) > 0)
+			;
+	return true;
+}
+
+/*
+ * Waits until cond() holds, for timeout_ms at most, or for ever if it's
+ * negative. Returns whether it does.
+ */
+bool watch_until(bool (*cond)(void *arg), void *arg, int timeout_ms)
+{
+	struct pollfd fds[1];
+	struct watch wt;
+	bool ret;
+
+	watch_init(&wt, timeout_ms);
+	while (!(ret = cond(arg)) && watch_sleep(&wt, fds, 0))
+		;
+	watch_exit(&wt);
+	return ret;
+}
+
+/*
+ * Reads the attribute, which also rearms POLLPRI on it, and checks it.
+ * The attribute may only show up later, so it is reopened until then.
+ */
+static void attr_check(struct attr_wait *w)
+{
+	char buf[256];
+	struct stat st;
+	ssize_t n = -1;
+
+	if (w->fd < 0)
+		w->fd = open(w->path, O_RDONLY|O_CLOEXEC);
+	if (w->fd >= 0) {
+		n = pread(w->fd, buf, sizeof(buf) - 1, 0);
+		/* sysfs fails reads once removed, other files don't */
+		if (n >= 0 && stat(w->path, &st))
+			n = -1;
+		if (n < 0) {
+			close(w->fd);
+			w->fd = -1;
+		}
+	}
+
+	if (n < 0) {
+		w->finished = w->done(NULL, w->arg);
+	} else {
+		while (n && buf[n - 1] == '\n')
+			n--;
+		buf[n] = '\0';
+		w->finished = w->done(buf, w->arg);
+	}
+
+	if (w->finished && w->fd >= 0) {
+		close(w->fd);
+		w->fd = -1;
+	}
+}
+
+/*
+ * Waits until every attribute is done, for timeout_ms at most, or for
+ * ever if it's negative. Returns how many are not done yet.
+ */
+int attr_wait_all(struct attr_wait *w, unsigned int nr, int timeout_ms)
+{
+	struct pollfd *fds;
+	struct watch wt;
+	unsigned int i, n, left;
+
+	fds = calloc(nr + 1, sizeof(*fds));
+	if (!fds) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		return nr;
+	}
+
+	for (i = 0; i < nr; i++) {
+		w[i].fd = -1;
+		w[i].finished = false;
+	}
+
+	watch_init(&wt, timeout_ms);
+	do {
+		left = n = 0;
+		for (i = 0; i < nr; i++) {
+			if (w[i].finished)
+				continue;
+			attr_check(&w[i]);
+			if (w[i].finished)
+				continue;
+			left++;
+			if (w[i].fd >= 0) {
+				fds[n].fd = w[i].fd;
+				fds[n].events = POLLPRI;
+				n++;
+			}
+		}
+	} while (left && watch_sleep(&wt, fds, n));
+	watch_exit(&wt);
+
+	for (i = 0; i < nr; i++)
+		if (w[i].fd >= 0) {
+			close(w[i].fd);
+			w[i].fd = -1;
+		}
+	free(fds);
+	return left;
+}
+
+/* Registered with bcache and, for a cache device, in its cache set */
+bool dev_registered(const char *dev)
+{
+	char path[PATH_MAX], real[PATH_MAX];
+	const char *name;
+
+	if (!realpath(dev, real))
+		return false;
+	name = strrchr(real, '/');
+	name = name ? name + 1 : real;
+
+	/* Only backing devices have a state */
+	if (snprintf(path, sizeof(path), "/sys/class/block/%s/bcache/state",
+		     name) >= (int) sizeof(path))
+		return false;
+	if (!access(path, F_OK))
+		return true;
+	strcpy(strrchr(path, '/'), "/set");
+	return !access(path, F_OK);
+}
+
+struct registered {
+	char		**devs;
+	unsigned int	nr;
+	unsigned int	done;	/* the first done devices are registered */
+};
+
+static bool all_registered(void *arg)
+{
+	struct registered *r = arg;
+
+	while (r->done < r->nr && dev_registered(r->devs[r->done]))
+		r->done++;
+	return r->done == r->nr;
+}
+
+/*
+ * Registration may be asynchronous (register_async), this waits for it
+ * to be done. Returns whether every device got registered in time.
+ */
+bool watch_registered(char **devs, unsigned int nr, int timeout_ms)
+{
+	struct registered r = {
+		.devs	= devs,
+		.nr	= nr,
+	};
+
+	return watch_until(all_registered, &r, timeout_ms);
+}
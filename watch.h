@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __WATCH_H
+#define __WATCH_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+/* How long a wait sleeps on changes that don't notify */
+#define WATCH_RECHECK_MS		100
+
+/*
+ * A sysfs attribute waited on until done() accepts its value, which is
+ * NULL once the attribute is gone: its device was stopped or unregistered.
+ */
+struct attr_wait {
+	char		path[PATH_MAX];
+	bool		(*done)(const char *val, void *arg);
+	void		*arg;
+
+	bool		finished;
+	int		fd;
+};
+
+bool watch_until(bool (*cond)(void *arg), void *arg, int timeout_ms);
+
+bool dev_registered(const char *dev);
+bool watch_registered(char **devs, unsigned int nr, int timeout_ms);
+
+/* For done(): the attribute is gone */
+bool attr_gone(const char *val, void *arg);
+
+int attr_wait_all(struct attr_wait *w, unsigned int nr, int timeout_ms);
+
+#endif
@@ -0,0 +1,337 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Synthetic workload generator: picks the page each I/O goes to, and
+ * whether it reads or writes. Offsets are in 4k pages relative to the
+ * range covered by the generator.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workload.h"
+
+/* Up to this many terms zeta(n) is summed exactly, the rest is integrated */
+#define ZETA_EXACT		(1UL << 20)
+
+/* Spreads zipf ranks over the working set, prime so it is coprime to it */
+#define ZIPF_SCATTER		2654435761UL
+
+void workload_init(struct workload *wl)
+{
+	memset(wl, 0, sizeof(*wl));
+	wl->dist = WL_UNIFORM;
+	wl->theta = 0.99;
+	wl->hot_frac = 0.2;
+	wl->hot_access = 0.8;
+	wl->nr_streams = 4;
+	wl->read_pct = -1;
+}
+
+static int parse_pct(const char *s, double *ret)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (end == s || (*end && *end != ':') || v <= 0 || v >= 100)
+		return -1;
+	*ret = v / 100;
+	return 0;
+}
+
+/*
+ * uniform, walk, zipf[:theta], hotspot[:hot%[:access%]], seq[:streams]
+ */
+int workload_parse(struct workload *wl, const char *spec)
+{
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? (size_t) (arg - spec) : strlen(spec);
+	char *end;
+
+	if (arg)
+		arg++;
+
+	if (len == 7 && !strncmp(spec, "uniform", len)) {
+		wl->dist = WL_UNIFORM;
+		if (arg)
+			goto bad;
+	} else if (len == 4 && !strncmp(spec, "walk", len)) {
+		wl->dist = WL_WALK;
+		if (arg)
+			goto bad;
+	} else if (len == 4 && !strncmp(spec, "zipf", len)) {
+		wl->dist = WL_ZIPF;
+		if (arg) {
+			wl->theta = strtod(arg, &end);
+			if (end == arg || *end || wl->theta <= 0 ||
+			    wl->theta >= 1) {
+				fprintf(stderr,
+					"zipf theta must be between 0 and 1\n");
+				return -1;
+			}
+		}
+	} else if (len == 7 && !strncmp(spec, "hotspot", len)) {
+		wl->dist = WL_HOTSPOT;
+		if (arg) {
+			if (parse_pct(arg, &wl->hot_frac))
+				goto bad;
+			arg = strchr(arg, ':');
+			if (arg && parse_pct(arg + 1, &wl->hot_access))
+				goto bad;
+		}
+	} else if (len == 3 && !strncmp(spec, "seq", len)) {
+		wl->dist = WL_SEQ;
+		if (arg) {
+			wl->nr_streams = strtoul(arg, &end, 10);
+			if (end == arg || *end || !wl->nr_streams) {
+				fprintf(stderr,
+					"Number of streams must be at least 1\n");
+				return -1;
+			}
+		}
+	} else {
+		goto bad;
+	}
+
+	return 0;
+bad:
+	fprintf(stderr, "Bad workload profile %s\n", spec);
+	return -1;
+}
+
+/* A size in bytes with an optional k/m/g/t suffix, in pages */
+int workload_parse_size(const char *arg, unsigned long *pages)
+{
+	char *end;
+	double v = strtod(arg, &end);
+
+	switch (*end) {
+	case 't':
+	case 'T':
+		v *= 1024;
+		/* fall through */
+	case 'g':
+	case 'G':
+		v *= 1024;
+		/* fall through */
+	case 'm':
+	case 'M':
+		v *= 1024;
+		/* fall through */
+	case 'k':
+	case 'K':
+		v *= 1024;
+		end++;
+		break;
+	}
+
+	if (end == arg || *end || v < 4096) {
+		fprintf(stderr, "Bad size %s\n", arg);
+		return -1;
+	}
+
+	*pages = v / 4096;
+	return 0;
+}
+
+/* N% of the whole range, Nx the cache size, or a size */
+int workload_parse_ws(struct workload *wl, const char *arg)
+{
+	char *end;
+	double v = strtod(arg, &end);
+
+	wl->ws_frac = wl->ws_cache = 0;
+	wl->ws_pages = 0;
+
+	if (end != arg && v > 0 && *end == '%' && !end[1] && v <= 100) {
+		wl->ws_frac = v / 100;
+		return 0;
+	}
+	if (end != arg && v > 0 && *end == 'x' && !end[1]) {
+		wl->ws_cache = v;
+		return 0;
+	}
+
+	return workload_parse_size(arg, &wl->ws_pages);
+}
+
+const char *workload_name(const struct workload *wl)
+{
+	static const char * const names[] = {
+		[WL_UNIFORM]	= "uniform",
+		[WL_WALK]	= "walk",
+		[WL_ZIPF]	= "zipf",
+		[WL_HOTSPOT]	= "hotspot",
+		[WL_SEQ]	= "seq",
+	};
+
+	return names[wl->dist];
+}
+
+/* Marsaglia polar method
+ */
+static double normal(unsigned short *seed)
+{
+	double x, y, s;
+
+	do {
+		x = erand48(seed) * 2 - 1;
+		y = erand48(seed) * 2 - 1;
+
+		s = x * x + y * y;
+	} while (s >= 1 || s == 0);
+
+	s = sqrt(-2 * log(s) / s);
+	return  x * s;
+}
+
+/* Uniform in [0, n), without the 31 bit limit of nrand48() */
+static inline unsigned long rand_below(unsigned short *seed, unsigned long n)
+{
+	unsigned long v = erand48(seed) * n;
+
+	return v < n ? v : n - 1;
+}
+
+static double zeta(unsigned long n, double theta)
+{
+	unsigned long i, exact = n < ZETA_EXACT ? n : ZETA_EXACT;
+	double sum = 0;
+
+	for (i = 1; i <= exact; i++)
+		sum += pow(i, -theta);
+
+	/* Midpoint approximation of the tail, good to well under 1ppm */
+	if (n > exact)
+		sum += (pow(n + 0.5, 1 - theta) - pow(exact + 0.5, 1 - theta)) /
+			(1 - theta);
+
+	return sum;
+}
+
+int workload_gen_init(struct workload_gen *g, const struct workload *wl,
+		      unsigned long nr, unsigned long total,
+		      const unsigned short seed[3])
+{
+	double ws;
+	unsigned int i;
+
+	memset(g, 0, sizeof(*g));
+	g->wl = wl;
+	g->nr = nr;
+	memcpy(g->seed, seed, sizeof(g->seed));
+
+	if (wl->ws_frac)
+		ws = total * wl->ws_frac;
+	else if (wl->ws_cache) {
+		if (!wl->cache_pages) {
+			fprintf(stderr,
+				"Working set relative to the cache needs the cache size\n");
+			return -1;
+		}
+		ws = wl->cache_pages * wl->ws_cache;
+	} else if (wl->ws_pages)
+		ws = wl->ws_pages;
+	else
+		ws = total;
+
+	/* Each generator gets its share of the working set */
+	ws = ws * nr / total;
+	g->ws = ws < 1 ? 1 : ws > nr ? nr : (unsigned long) ws;
+
+	switch (wl->dist) {
+	case WL_ZIPF:
+		g->zeta2 = zeta(2, wl->theta);
+		g->zetan = zeta(g->ws, wl->theta);
+		g->alpha = 1 / (1 - wl->theta);
+		g->eta = (1 - pow(2.0 / g->ws, 1 - wl->theta)) /
+			(1 - g->zeta2 / g->zetan);
+		break;
+	case WL_SEQ:
+		g->stream = calloc(wl->nr_streams, sizeof(*g->stream));
+		if (!g->stream) {
+			fprintf(stderr, "Could not allocate streams\n");
+			return -ENOMEM;
+		}
+		for (i = 0; i < wl->nr_streams; i++)
+			g->stream[i] = g->ws * i / wl->nr_streams;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+void workload_gen_exit(struct workload_gen *g)
+{
+	free(g->stream);
+	g->stream = NULL;
+}
+
+static unsigned long zipf_rank(struct workload_gen *g)
+{
+	double u = erand48(g->seed), uz = u * g->zetan;
+	unsigned long rank;
+
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, g->wl->theta))
+		return 1;
+
+	rank = g->ws * pow(g->eta * u - g->eta + 1, g->alpha);
+	return rank < g->ws ? rank : g->ws - 1;
+}
+
+/* First page of the next I/O of npages, npages must not exceed nr */
+unsigned long workload_next(struct workload_gen *g, unsigned int npages)
+{
+	const struct workload *wl = g->wl;
+	unsigned long span, page, hot;
+	unsigned int s;
+
+	/* I/Os larger than the working set spill past it */
+	span = g->ws >= npages ? g->ws - npages + 1 : 1;
+
+	switch (wl->dist) {
+	case WL_WALK: {
+		long step = normal(g->seed) * 20;
+
+		g->walk_page = (g->walk_page + span + step % (long) span) % span;
+		return g->walk_page;
+	}
+	case WL_ZIPF:
+		page = zipf_rank(g) * ZIPF_SCATTER % g->ws;
+		break;
+	case WL_HOTSPOT:
+		hot = g->ws * wl->hot_frac;
+		if (!hot)
+			hot = 1;
+		if (erand48(g->seed) < wl->hot_access || hot == g->ws)
+			page = rand_below(g->seed, hot);
+		else
+			page = hot + rand_below(g->seed, g->ws - hot);
+		break;
+	case WL_SEQ:
+		s = g->next_stream++ % wl->nr_streams;
+		page = g->stream[s];
+		if (page >= span)
+			page = 0;
+		g->stream[s] = page + npages;
+		return page;
+	default:
+		return rand_below(g->seed, span);
+	}
+
+	return page < span ? page : span - 1;
+}
+
+bool workload_next_write(struct workload_gen *g)
+{
+	return erand48(g->seed) * 100 >= g->wl->read_pct;
+}
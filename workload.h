@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * This file is part of bcache tools.
+ *
+ * Synthetic workload generator, shared by bcache-test and the cache
+ * simulator.
+ */
+#ifndef __WORKLOAD_H
+#define __WORKLOAD_H
+
+#include <stdbool.h>
+
+enum workload_dist {
+	WL_UNIFORM,
+	WL_WALK,	/* gaussian random walk */
+	WL_ZIPF,
+	WL_HOTSPOT,
+	WL_SEQ,		/* concurrent sequential streams */
+};
+
+/* Parsed from the command line, shared by all generators */
+struct workload {
+	enum workload_dist	dist;
+	double			theta;		/* zipf skew, 0 < theta < 1 */
+	double			hot_frac;	/* hotspot: fraction of the set */
+	double			hot_access;	/* ... receiving this fraction of I/O */
+	unsigned int		nr_streams;	/* seq */
+
+	/*
+	 * Working set: a fraction of the whole range, a multiple of
+	 * cache_pages, or an absolute number of pages. At most one is set.
+	 */
+	double			ws_frac;
+	double			ws_cache;
+	unsigned long		ws_pages;
+	unsigned long		cache_pages;
+
+	int			read_pct;	/* -1: decided by the caller */
+};
+
+/*
+ * Per thread state. One generator covers pages [0, nr), which is its
+ * share of a range of total pages split between several generators.
+ */
+struct workload_gen {
+	const struct workload	*wl;
+	unsigned long		nr;
+	unsigned long		ws;
+	unsigned short		seed[3];
+
+	unsigned long		walk_page;
+
+	/* zipf, see Gray et al., "Quickly Generating Billion-Record
+	 * Synthetic Databases", SIGMOD 1994 */
+	double			zeta2;
+	double			zetan;
+	double			alpha;
+	double			eta;
+
+	unsigned long		*stream;
+	unsigned int		next_stream;
+};
+
+void workload_init(struct workload *wl);
+int workload_parse(struct workload *wl, const char *spec);
+int workload_parse_size(const char *arg, unsigned long *pages);
+int workload_parse_ws(struct workload *wl, const char *arg);
+const char *workload_name(const struct workload *wl);
+
+int workload_gen_init(struct workload_gen *g, const struct workload *wl,
+		      unsigned long nr, unsigned long total,
+		      const unsigned short seed[3]);
+void workload_gen_exit(struct workload_gen *g);
+unsigned long workload_next(struct workload_gen *g, unsigned int npages);
+bool workload_next_write(struct workload_gen *g);
+
+#endif
@@ -7,14 +7,26 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/blkzoned.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
 #include "bcache.h"
+#include "lib.h"
+#include "zoned.h"
+#include "profile.h"
+
+/* Zones per BLKREPORTZONE, 64 bytes each */
+#define ZONE_REPORT_BATCH	8192
 
 /*
  * copied and modified from zonefs_get_dev_capacity() of
@@ -22,17 +34,17 @@
  * returns   0: zone size 0 indicates a non-zoned device
  *         > 0: actual zone size of the zoned device
  */
-static size_t get_zone_size(char *devname)
+size_t get_zone_size(char *devname)
 {
-	char str[128];
+	char path[PATH_MAX], str[128];
 	FILE *file;
 	int res;
 	size_t zone_size = 0;
 
-	snprintf(str, sizeof(str),
-		"/sys/block/%s/queue/chunk_sectors",
-		basename(devname));
-	file = fopen(str, "r");
+	snprintf(path, sizeof(path),
+		"%s/sys/block/%s/queue/chunk_sectors",
+		root_prefix(), basename(devname));
+	file = PROF(PROF_SYSFS, fopen(path, "r"));
 	if (!file)
 		goto out;
 
@@ -79,12 +91,7 @@ void check_data_offset_for_zoned_device(char *devname,
 		exit(EXIT_FAILURE);
 	}
 
-	if (_data_offset & (zone_size - 1)) {
-		fprintf(stderr,
-			"data_offset %lu is not aligned to zone size %lu for zoned device %s\n",
-			_data_offset, zone_size, devname);
-	}
-
+	/* Misalignment is reported by zone_check() */
 	*data_offset = _data_offset;
 }
 
@@ -92,3 +99,143 @@ int is_zoned_device(char *devname)
 {
 	return (get_zone_size(devname) != 0);
 }
+
+/*
+ * Counts the zones of a device by type, reading the zone report in
+ * batches of ZONE_REPORT_BATCH, so that even drives with a hundred
+ * thousand zones take a handful of ioctls. A device that isn't zoned gets
+ * a report of no zones.
+ */
+int zone_report(const char *devname, struct zone_report *r)
+{
+	struct blk_zone_report *rep;
+	struct blk_zone *z;
+	uint64_t sector = 0;
+	unsigned int i;
+	uint32_t zone_size;
+	int fd, ret = -1;
+
+	memset(r, 0, sizeof(*r));
+	r->first_seq = UINT64_MAX;
+
+	fd = PROF(PROF_OPEN, open(devname, O_RDONLY|O_CLOEXEC));
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s: %m\n", devname);
+		return -1;
+	}
+
+	if (PROF(PROF_IOCTL, ioctl(fd, BLKGETZONESZ, &zone_size)) ||
+	    !zone_size) {
+		close(fd);
+		return 0;
+	}
+	r->zone_size = zone_size;
+
+	rep = malloc(sizeof(*rep) + ZONE_REPORT_BATCH * sizeof(*z));
+	if (!rep) {
+		fprintf(stderr, "Could not allocate a zone report\n");
+		goto out;
+	}
+
+	for (;;) {
+		memset(rep, 0, sizeof(*rep));
+		rep->sector = sector;
+		rep->nr_zones = ZONE_REPORT_BATCH;
+		if (PROF(PROF_IOCTL, ioctl(fd, BLKREPORTZONE, rep))) {
+			fprintf(stderr, "Error reporting zones of %s: %m\n",
+				devname);
+			goto out;
+		}
+		if (!rep->nr_zones)
+			break;
+
+		for (i = 0; i < rep->nr_zones; i++) {
+			z = &rep->zones[i];
+			switch (z->type) {
+			case BLK_ZONE_TYPE_CONVENTIONAL:
+				r->conventional++;
+				break;
+			case BLK_ZONE_TYPE_SEQWRITE_REQ:
+				r->seq_required++;
+				break;
+			case BLK_ZONE_TYPE_SEQWRITE_PREF:
+				r->seq_preferred++;
+				break;
+			}
+			if (z->type != BLK_ZONE_TYPE_CONVENTIONAL &&
+			    z->start < r->first_seq) {
+				r->first_seq = z->start;
+				r->first_seq_type = z->type;
+			}
+			if (z->cond == BLK_ZONE_COND_READONLY ||
+			    z->cond == BLK_ZONE_COND_OFFLINE)
+				r->unusable++;
+		}
+		r->nr_zones += rep->nr_zones;
+
+		z = &rep->zones[rep->nr_zones - 1];
+		sector = z->start + z->len;
+	}
+	ret = 0;
+out:
+	free(rep);
+	close(fd);
+	return ret;
+}
+
+void zone_report_print(FILE *out, const char *devname,
+		       const struct zone_report *r)
+{
+	fprintf(out, "%s: %" PRIu64 " zones of %" PRIu64 " sectors, "
+		"%" PRIu64 " conventional, %" PRIu64 " sequential write "
+		"required, %" PRIu64 " sequential write preferred\n",
+		devname, r->nr_zones, r->zone_size, r->conventional,
+		r->seq_required, r->seq_preferred);
+}
+
+/*
+ * The super block is rewritten in place, and bcache passes writes through
+ * at the offsets they have on the bcache device, data_offset further on.
+ * Returns -1 if the super block can't be written at all.
+ */
+int zone_check(FILE *out, const char *devname, const struct zone_report *r,
+	       uint64_t data_offset)
+{
+	uint64_t sb_end = SB_SECTOR + SB_READ_BYTES / 512;
+	int ret = 0;
+
+	if (!r->nr_zones)
+		return 0;
+
+	if (r->first_seq < sb_end) {
+		if (r->first_seq_type == BLK_ZONE_TYPE_SEQWRITE_REQ) {
+			fprintf(out, "%s: the super block at sector %u is in a "
+				"sequential write required zone and can't be "
+				"written\n", devname, SB_SECTOR);
+			ret = -1;
+		} else {
+			fprintf(out, "%s: the super block at sector %u is in a "
+				"sequential write preferred zone, every update "
+				"is a read-modify-write of the zone\n",
+				devname, SB_SECTOR);
+		}
+	} else if (r->first_seq < data_offset) {
+		fprintf(out, "%s: sectors up to the data offset %" PRIu64
+			" are not all conventional, sequential zones start "
+			"at sector %" PRIu64 "\n",
+			devname, data_offset, r->first_seq);
+	}
+
+	if (data_offset % r->zone_size)
+		fprintf(out, "%s: data offset %" PRIu64 " is not a multiple "
+			"of the zone size %" PRIu64 ", zones of the bcache "
+			"device straddle two zones: sequential writes to them "
+			"go out of order on sequential zones, and are "
+			"read-modify-write on sequential write preferred "
+			"ones\n", devname, data_offset, r->zone_size);
+
+	if (r->unusable)
+		fprintf(out, "%s: %" PRIu64 " zones are read-only or "
+			"offline\n", devname, r->unusable);
+	return ret;
+}
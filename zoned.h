@@ -8,7 +8,27 @@
 #ifndef __ZONED_H
 #define __ZONED_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+struct zone_report {
+	uint64_t	zone_size;	/* sectors */
+	uint64_t	nr_zones;
+	uint64_t	conventional;
+	uint64_t	seq_required;
+	uint64_t	seq_preferred;
+	uint64_t	unusable;	/* read-only or offline */
+	uint64_t	first_seq;	/* sector of the first sequential zone */
+	unsigned int	first_seq_type;
+};
+
 void check_data_offset_for_zoned_device(char *devname, uint64_t *data_offset);
 int is_zoned_device(char *devname);
+size_t get_zone_size(char *devname);
+int zone_report(const char *devname, struct zone_report *r);
+void zone_report_print(FILE *out, const char *devname,
+		       const struct zone_report *r);
+int zone_check(FILE *out, const char *devname, const struct zone_report *r,
+	       uint64_t data_offset);
 
 #endif